@@ -20,6 +20,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <float.h>
 #include <math.h>
 #include <gsl/gsl_statistics_double.h>
 #include <gsl/gsl_matrix.h>
@@ -36,106 +38,99 @@
 #include "gui/callbacks.h"
 #include "algos/PSF.h"
 #include "algos/photometry.h"
+#include "algos/median_filter.h"
 
 #define MAX_ITER_NO_ANGLE  10		//Number of iteration in the minimization with no angle
 #define MAX_ITER_ANGLE     10		//Number of iteration in the minimization with angle
 #define EPSILON            0.01
+#define NB_PARAMS_NO_ANGLE 6		//Number of parameters fitted with no angle
+#define STACK_WORKSPACE    256		//Rows and columns of a fit with no angle that need no allocation
+#define LM_INITIAL_DAMPING 1e-3
+#define LM_DAMPING_FACTOR  10.0
+#define LM_MAX_DAMPING     1e10
+#define MIN_INIT_S         0.5		//Smallest initial value of Sx and Sy
+/* Variance of the part of a Gaussian above half of its maximum, weighted by
+ * intensity, relative to the variance of the Gaussian */
+#define HALF_MAX_VARIANCE_RATIO (1.0 - M_LN2)
 
 const double radian_conversion = ((3600.0 * 180.0) / M_PI) / 1.0E3;
 
-static WORD getMedian3x3(gsl_matrix *in, const int xx, const int yy,
-		const int w, const int h) {
-	int step, radius, x, y;
-	double *value, median;
-
-	step = 1;
-	radius = 1;
-
-	int n = 0;
-	int start;
-	value = calloc(8, sizeof(double));
-	for (y = yy - radius; y <= yy + radius; y += step) {
-		for (x = xx - radius; x <= xx + radius; x += step) {
-			if (y >= 0 && y < h) {
-				if (x >= 0 && x < w) {
-					if ((x != xx) || (y != yy)) {
-						value[n++] = gsl_matrix_get(in, y, x);
-					}
-				}
+/* Returns the maximum of the data with hot pixels removed, that is the
+ * largest median of the neighbours of a pixel, and its position. */
+static double psf_find_peak(const double *y, size_t stride, int NbRows,
+		int NbCols, int *peak_i, int *peak_j) {
+	double max = -DBL_MAX;
+	int i, j;
+
+	*peak_i = *peak_j = 0;
+	for (i = 0; i < NbRows; i++) {
+		for (j = 0; j < NbCols; j++) {
+			double a = median_of_neighbours_d(y, stride, j, i, NbCols, NbRows, 1);
+			if (a > max) {
+				max = a;
+				*peak_i = i;
+				*peak_j = j;
 			}
 		}
 	}
-	start = 8 - n - 1;
-	quicksort_d(value, 8);
-	median = gsl_stats_median_from_sorted_data(value + start, 1, n);
-	free(value);
-	return median;
+	return max;
 }
 
-static gsl_matrix *removeHotPixels(gsl_matrix *in) {
-	int width = in->size2;
-	int height = in->size1;
-	int x, y;
-	gsl_matrix *out = gsl_matrix_alloc (in->size1, in->size2);
-
-	gsl_matrix_memcpy (out, in);
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			double a = getMedian3x3(in, x, y, width, height);
-			gsl_matrix_set(out, y, x, a);
+/* Compute initial values of the parameters with no angle, B, A, x0, y0, Sx and
+ * Sy, from the data y. The star is delimited by walking from its peak along
+ * its row and column until the values fall under half of its amplitude, and
+ * its centre and widths are the moments of the pixels above half of the
+ * amplitude in these limits. */
+static void psf_init_data(const double *y, size_t stride, int NbRows,
+		int NbCols, double bg, double *p) {
+	int peak_i, peak_j, i, j, i1, i2, j1, j2;
+	double peak, half, sum = 0.0, sx = 0.0, sy = 0.0, sxx = 0.0, syy = 0.0;
+
+	peak = psf_find_peak(y, stride, NbRows, NbCols, &peak_i, &peak_j);
+	half = bg + 0.5 * (peak - bg);
+
+	i1 = i2 = peak_i;
+	while (i1 < NbRows - 1 && y[(i1 + 1) * stride + peak_j] > half)
+		i1++;
+	while (i2 > 0 && y[(i2 - 1) * stride + peak_j] > half)
+		i2--;
+	j1 = j2 = peak_j;
+	while (j1 < NbCols - 1 && y[peak_i * stride + j1 + 1] > half)
+		j1++;
+	while (j2 > 0 && y[peak_i * stride + j2 - 1] > half)
+		j2--;
+
+	for (i = i2; i <= i1; i++) {
+		for (j = j2; j <= j1; j++) {
+			double v = y[i * stride + j];
+			if (v > half) {
+				v -= bg;
+				sum += v;
+				sx += v * j;
+				sy += v * i;
+				sxx += v * j * j;
+				syy += v * i * i;
+			}
 		}
 	}
-	return out;
-}
 
-/* Compute initial values for the algorithm from data in the pixel value matrix */
-static gsl_vector* psf_init_data(gsl_matrix* z, double bg) {
-	gsl_vector * MaxV = gsl_vector_alloc(5);
-	double max;
-	size_t NbRows = z->size1;
-	size_t NbCols = z->size2;
-	size_t i, j;
-
-	/* find maximum */
-	/* first we remove hot pixels in the matrix */
-	gsl_matrix *m_tmp = removeHotPixels(z);
-	max = gsl_matrix_max(m_tmp);
-	gsl_matrix_max_index(m_tmp, &i, &j);
-	gsl_matrix_free(m_tmp);
-	gsl_vector_set(MaxV, 0, j);
-	gsl_vector_set(MaxV, 1, i);
-	gsl_vector_set(MaxV, 2, max);
-
-	size_t ii1 = (size_t) gsl_vector_get(MaxV, 1);
-	size_t ii2 = (size_t) gsl_vector_get(MaxV, 1);
-	size_t jj1 = (size_t) gsl_vector_get(MaxV, 0);
-	size_t jj2 = (size_t) gsl_vector_get(MaxV, 0);
-	size_t perm1 = (size_t) gsl_vector_get(MaxV, 1);
-	size_t perm2 = (size_t) gsl_vector_get(MaxV, 0);
-
-	while ((2.0 * (gsl_matrix_get(z, ii1, perm2) - bg)
-			> (gsl_matrix_get(z, perm1, perm2) - bg)) && (ii1 < NbRows - 1.0)) {
-		ii1++;
-	}
-	while ((2.0 * (gsl_matrix_get(z, ii2, perm2) - bg)
-			> (gsl_matrix_get(z, perm1, perm2) - bg)) && (ii2 > 0)) {
-		ii2--;
-	}
-
-	while ((2.0 * (gsl_matrix_get(z, perm1, jj1) - bg)
-			> (gsl_matrix_get(z, perm1, perm2) - bg)) && (jj1 < NbCols - 1)) {
-		jj1++;
-	}
-	while ((2.0 * (gsl_matrix_get(z, perm1, jj2) - bg)
-			> (gsl_matrix_get(z, perm1, perm2) - bg)) && (jj2 > 0)) {
-		jj2--;
+	p[0] = bg;
+	p[1] = peak - bg;
+	if (sum > 0.0) {
+		double mx = sx / sum, my = sy / sum;
+		p[2] = mx + 1;
+		p[3] = my + 1;
+		p[4] = 2.0 * (sxx / sum - mx * mx) / HALF_MAX_VARIANCE_RATIO;
+		p[5] = 2.0 * (syy / sum - my * my) / HALF_MAX_VARIANCE_RATIO;
+	} else {
+		p[2] = peak_j + 1;
+		p[3] = peak_i + 1;
+		p[4] = p[5] = MIN_INIT_S;
 	}
-	gsl_vector_set(MaxV, 0, (jj1 + jj2 + 2) / 2.0);
-	gsl_vector_set(MaxV, 1, (ii1 + ii2 + 2) / 2.0);
-	gsl_vector_set(MaxV, 3, (size_t) (SQR(ii1 - ii2) / 4.0 / log(2.0)));
-	gsl_vector_set(MaxV, 4, (size_t) (SQR(jj1 - jj2) / 4.0 / log(2.0)));
-
-	return MaxV;
+	if (!(p[4] >= MIN_INIT_S))
+		p[4] = MIN_INIT_S;
+	if (!(p[5] >= MIN_INIT_S))
+		p[5] = MIN_INIT_S;
 }
 
 /* Basic magnitude computation. This is not really accurate, all pixels are
@@ -156,74 +151,219 @@ static double psf_get_mag(gsl_matrix* z, double B) {
 	return magnitude;
 }
 
-/* No angle */
-static int psf_Gaussian_f(const gsl_vector * x, void *PSF_data, gsl_vector * f) {
-	size_t NbRows = ((struct PSF_data *) PSF_data)->NbRows;
-	size_t NbCols = ((struct PSF_data *) PSF_data)->NbCols;
-	size_t i, j;
-	double *y = ((struct PSF_data *) PSF_data)->y;
-	double *sigma = ((struct PSF_data *) PSF_data)->sigma;
-	double B = gsl_vector_get(x, 0);
-	double A = gsl_vector_get(x, 1);
-	double x0 = gsl_vector_get(x, 2);
-	double y0 = gsl_vector_get(x, 3);
-	double SX = gsl_vector_get(x, 4);
-	double SY = gsl_vector_get(x, 5);
-	double tmpx, tmpy, tmpc, sumres = 0.;
+/* No angle: B + A * exp(-((x - x0)^2 / Sx + (y - y0)^2 / Sy)), pixel
+ * coordinates starting at 1.
+ * Returns the sum of squared residuals of the parameters p on the data y. If
+ * JtJ and Jtr are not NULL, they receive the normal equations of the
+ * linearized problem, J being the Jacobian of the model and r the residuals,
+ * only the upper triangle of JtJ is set.
+ * The Gaussian is separable: the value of column k of J at pixel (i, j) is
+ * the product of a factor of the row, rows[k][i], and of a factor of the
+ * column, cols[k][j], the parameter A aside. Exponentials are computed for
+ * each row and each column and not for each pixel, and J^T.J is made of sums
+ * over rows and columns only. ws holds NB_PARAMS_NO_ANGLE * (NbRows + NbCols)
+ * values. */
+static double psf_Gaussian_no_angle(const double *p, const double *y,
+		size_t stride, int NbRows, int NbCols, double *ws,
+		double JtJ[][NB_PARAMS_NO_ANGLE], double *Jtr) {
+	double B = p[0], A = p[1], x0 = p[2], y0 = p[3], SX = p[4], SY = p[5];
+	double *rows[NB_PARAMS_NO_ANGLE], *cols[NB_PARAMS_NO_ANGLE];
+	double scale[NB_PARAMS_NO_ANGLE] = { 1.0, 1.0, A, A, A, A };
+	double sumres = 0.0;
+	int i, j, k, l;
+
+	for (k = 0; k < NB_PARAMS_NO_ANGLE; k++) {
+		rows[k] = ws + k * NbRows;
+		cols[k] = ws + NB_PARAMS_NO_ANGLE * NbRows + k * NbCols;
+	}
+	for (j = 0; j < NbCols; j++) {
+		double dx = j + 1 - x0;
+		double e = exp(-SQR(dx) / SX);
+		cols[0][j] = 1.0;
+		cols[1][j] = cols[3][j] = cols[5][j] = e;
+		cols[2][j] = e * 2 * dx / SX;
+		cols[4][j] = e * SQR(dx) / SQR(SX);
+	}
+	for (i = 0; i < NbRows; i++) {
+		double dy = i + 1 - y0;
+		double e = exp(-SQR(dy) / SY);
+		rows[0][i] = 1.0;
+		rows[1][i] = rows[2][i] = rows[4][i] = e;
+		rows[3][i] = e * 2 * dy / SY;
+		rows[5][i] = e * SQR(dy) / SQR(SY);
+	}
+
+	if (JtJ) {
+		memset(Jtr, 0, NB_PARAMS_NO_ANGLE * sizeof(double));
+		for (k = 0; k < NB_PARAMS_NO_ANGLE; k++) {
+			for (l = k; l < NB_PARAMS_NO_ANGLE; l++) {
+				double sr = 0.0, sc = 0.0;
+				for (i = 0; i < NbRows; i++)
+					sr += rows[k][i] * rows[l][i];
+				for (j = 0; j < NbCols; j++)
+					sc += cols[k][j] * cols[l][j];
+				JtJ[k][l] = scale[k] * scale[l] * sr * sc;
+			}
+		}
+	}
 
 	for (i = 0; i < NbRows; i++) {
-		for (j = 0; j < NbCols; j++) {
-			tmpx = j + 1;
-			tmpy = i + 1;
-			tmpc = exp(-(SQR(tmpx-x0) / SX + SQR(tmpy-y0) / SY));
-			gsl_vector_set(f, NbCols * i + j,
-					(B + A * tmpc - y[NbCols * i + j]) / sigma[NbCols * i + j]);
-			sumres += (B + A * tmpc - y[NbCols * i + j])
-					* (B + A * tmpc - y[NbCols * i + j]);
+		const double *row = y + i * stride;
+		double Aey = A * rows[1][i], rowres = 0.0;
+		double t0 = 0.0, t1 = 0.0, t2 = 0.0, t4 = 0.0;
+		if (!JtJ) {
+			for (j = 0; j < NbCols; j++) {
+				double r = B + Aey * cols[1][j] - row[j];
+				rowres += r * r;
+			}
+		} else {
+			/* J^T.r, by row: columns 1, 3 and 5 have the same column factor */
+			for (j = 0; j < NbCols; j++) {
+				double r = B + Aey * cols[1][j] - row[j];
+				rowres += r * r;
+				t0 += r;
+				t1 += cols[1][j] * r;
+				t2 += cols[2][j] * r;
+				t4 += cols[4][j] * r;
+			}
+			Jtr[0] += t0;
+			Jtr[1] += rows[1][i] * t1;
+			Jtr[2] += rows[2][i] * t2;
+			Jtr[3] += rows[3][i] * t1;
+			Jtr[4] += rows[4][i] * t4;
+			Jtr[5] += rows[5][i] * t1;
 		}
+		sumres += rowres;
 	}
-	((struct PSF_data *) PSF_data)->rmse = sqrt(sumres / (NbRows * NbCols));
-	return GSL_SUCCESS;
+	if (JtJ) {
+		for (k = 0; k < NB_PARAMS_NO_ANGLE; k++)
+			Jtr[k] *= scale[k];
+	}
+	return sumres;
 }
 
-static int psf_Gaussian_df(const gsl_vector * x, void *PSF_data, gsl_matrix * J) {
-	size_t NbRows = ((struct PSF_data *) PSF_data)->NbRows;
-	size_t NbCols = ((struct PSF_data *) PSF_data)->NbCols;
-	size_t i, j;
-	double *sigma = ((struct PSF_data *) PSF_data)->sigma;
-	double A = gsl_vector_get(x, 1);
-	double x0 = gsl_vector_get(x, 2);
-	double y0 = gsl_vector_get(x, 3);
-	double SX = gsl_vector_get(x, 4);
-	double SY = gsl_vector_get(x, 5);
-	double tmpx, tmpy, tmpc, tmpd;
-
-	for (i = 0; i < NbRows; i++) {
-		for (j = 0; j < NbCols; j++) {
-			tmpx = j + 1;
-			tmpy = i + 1;
-			double s = sigma[NbCols * i + j];
-			tmpc = exp(-(SQR(tmpx-x0) / SX + SQR(tmpy-y0) / SY));
-			gsl_matrix_set(J, NbCols * i + j, 0, 1. / s);
-			gsl_matrix_set(J, NbCols * i + j, 1, tmpc / s);
-			tmpd = A * tmpc * 2 * (tmpx - x0) / SX;
-			gsl_matrix_set(J, NbCols * i + j, 2, tmpd / s);
-			tmpd = A * tmpc * 2 * (tmpy - y0) / SY;
-			gsl_matrix_set(J, NbCols * i + j, 3, tmpd / s);
-			tmpd = A * tmpc * SQR(tmpx - x0) / SQR(SX);
-			gsl_matrix_set(J, NbCols * i + j, 4, tmpd / s);
-			tmpd = A * tmpc * SQR(tmpy - y0) / SQR(SY);
-			gsl_matrix_set(J, NbCols * i + j, 5, tmpd / s);
+/* In place Cholesky decomposition m = L.L^T of the symmetric matrix m, of
+ * which only the upper triangle is read. L is written in the lower triangle.
+ * Returns 1 if m is not positive definite. */
+static int cholesky_decomp(double m[][NB_PARAMS_NO_ANGLE]) {
+	int i, j, k;
+
+	for (j = 0; j < NB_PARAMS_NO_ANGLE; j++) {
+		double s = m[j][j];
+		for (k = 0; k < j; k++)
+			s -= SQR(m[j][k]);
+		if (!(s > 0.0))
+			return 1;
+		m[j][j] = sqrt(s);
+		for (i = j + 1; i < NB_PARAMS_NO_ANGLE; i++) {
+			double t = m[j][i];
+			for (k = 0; k < j; k++)
+				t -= m[i][k] * m[j][k];
+			m[i][j] = t / m[j][j];
 		}
 	}
-	return GSL_SUCCESS;
+	return 0;
 }
 
-int psf_Gaussian_fdf(const gsl_vector * x, void *PSF_data, gsl_vector * f,
-		gsl_matrix * J) {
-	psf_Gaussian_f(x, PSF_data, f);
-	psf_Gaussian_df(x, PSF_data, J);
-	return GSL_SUCCESS;
+/* Solves L.L^T.x = b, L coming from cholesky_decomp() */
+static void cholesky_solve(double L[][NB_PARAMS_NO_ANGLE], const double *b,
+		double *x) {
+	int i, k;
+
+	for (i = 0; i < NB_PARAMS_NO_ANGLE; i++) {
+		double s = b[i];
+		for (k = 0; k < i; k++)
+			s -= L[i][k] * x[k];
+		x[i] = s / L[i][i];
+	}
+	for (i = NB_PARAMS_NO_ANGLE - 1; i >= 0; i--) {
+		double s = x[i];
+		for (k = i + 1; k < NB_PARAMS_NO_ANGLE; k++)
+			s -= L[k][i] * x[k];
+		x[i] = s / L[i][i];
+	}
+}
+
+/* Levenberg-Marquardt fit of the Gaussian with no angle on the data y,
+ * starting from the parameters p which receive the result. The problem being
+ * small, the normal equations are accumulated instead of the Jacobian and the
+ * workspace is on the stack for usual star sizes. covar receives the
+ * covariance matrix of the parameters, zero if it cannot be computed, and rmse
+ * the RMSE of the fit. Returns 1 if the workspace could not be allocated. */
+static int psf_fit_no_angle(const double *y, size_t stride, int NbRows,
+		int NbCols, double *p, double covar[][NB_PARAMS_NO_ANGLE], double *rmse) {
+	double stack_workspace[NB_PARAMS_NO_ANGLE * STACK_WORKSPACE];
+	double JtJ[NB_PARAMS_NO_ANGLE][NB_PARAMS_NO_ANGLE], Jtr[NB_PARAMS_NO_ANGLE];
+	double m[NB_PARAMS_NO_ANGLE][NB_PARAMS_NO_ANGLE];
+	double step[NB_PARAMS_NO_ANGLE], trial[NB_PARAMS_NO_ANGLE];
+	double *ws, cost, lambda = LM_INITIAL_DAMPING;
+	int iter, k, l;
+
+	if (NbRows + NbCols <= STACK_WORKSPACE)
+		ws = stack_workspace;
+	else {
+		ws = malloc(NB_PARAMS_NO_ANGLE * (NbRows + NbCols) * sizeof(double));
+		if (!ws) {
+			printf("Memory allocation failed: psf_fit_no_angle\n");
+			return 1;
+		}
+	}
+
+	cost = psf_Gaussian_no_angle(p, y, stride, NbRows, NbCols, ws, JtJ, Jtr);
+	for (iter = 0; iter < MAX_ITER_NO_ANGLE; iter++) {
+		gboolean accepted = FALSE, converged = TRUE;
+
+		/* the damping is increased until the step reduces the residuals */
+		while (!accepted && lambda < LM_MAX_DAMPING) {
+			double new_cost = INFINITY;
+			for (k = 0; k < NB_PARAMS_NO_ANGLE; k++) {
+				for (l = k; l < NB_PARAMS_NO_ANGLE; l++)
+					m[k][l] = JtJ[k][l];
+				m[k][k] *= 1.0 + lambda;
+			}
+			if (!cholesky_decomp(m)) {
+				cholesky_solve(m, Jtr, step);
+				for (k = 0; k < NB_PARAMS_NO_ANGLE; k++)
+					trial[k] = p[k] - step[k];
+				if (trial[4] > 0.0 && trial[5] > 0.0)
+					new_cost = psf_Gaussian_no_angle(trial, y, stride, NbRows,
+							NbCols, ws, NULL, NULL);
+			}
+			if (new_cost <= cost)
+				accepted = TRUE;
+			else lambda *= LM_DAMPING_FACTOR;
+		}
+		if (!accepted)
+			break;
+
+		/* same test as gsl_multifit_test_delta() */
+		for (k = 0; k < NB_PARAMS_NO_ANGLE; k++) {
+			if (fabs(step[k]) >= 1e-4 + 1e-4 * fabs(trial[k]))
+				converged = FALSE;
+		}
+		memcpy(p, trial, sizeof(trial));
+		cost = psf_Gaussian_no_angle(p, y, stride, NbRows, NbCols, ws, JtJ, Jtr);
+		lambda /= LM_DAMPING_FACTOR;
+		if (converged)
+			break;
+	}
+	*rmse = sqrt(cost / (NbRows * NbCols));
+
+	/* the covariance matrix is the inverse of J^T.J at the solution */
+	memcpy(m, JtJ, sizeof(m));
+	if (cholesky_decomp(m))
+		memset(covar, 0, sizeof(m));
+	else {
+		for (k = 0; k < NB_PARAMS_NO_ANGLE; k++) {
+			double unit[NB_PARAMS_NO_ANGLE] = { 0.0 };
+			unit[k] = 1.0;
+			cholesky_solve(m, unit, covar[k]);
+		}
+	}
+
+	if (ws != stack_workspace)
+		free(ws);
+	return 0;
 }
 
 /* Angle */
@@ -313,81 +453,26 @@ static int psf_Gaussian_fdf_an(const gsl_vector * x, void *PSF_data,
  */
 static fitted_PSF *psf_minimiz_no_angle(gsl_matrix* z, double background,
 		int layer) {
-	size_t i, j;
 	size_t NbRows = z->size1; //characteristics of the selection : height and width
 	size_t NbCols = z->size2;
-	const size_t p = 6;			// Number of parameters fitted
-	const size_t n = NbRows * NbCols;
-	fitted_PSF *psf = malloc(sizeof(fitted_PSF));
-	gsl_vector *MaxV = psf_init_data(z, background);
-	int status;
-	unsigned int iter = 0;
-	gsl_matrix *covar = gsl_matrix_alloc(p, p);
-	double *y = malloc(n * sizeof(double));
-	double *sigma = malloc(n * sizeof(double));
-	struct PSF_data d = { n, y, sigma, NbRows, NbCols, 0 };
-	gsl_multifit_function_fdf f;
-	const gsl_rng_type * type;
-	gsl_rng * r;
-	const gsl_multifit_fdfsolver_type *T;
-	gsl_multifit_fdfsolver *s;
-	double x_init[] = { background, gsl_vector_get(MaxV, 2), gsl_vector_get(
-			MaxV, 0), gsl_vector_get(MaxV, 1), gsl_vector_get(MaxV, 4),
-			gsl_vector_get(MaxV, 3) };
-	gsl_vector_view x = gsl_vector_view_array(x_init, p);
-
-	gsl_rng_env_setup();
-
-	type = gsl_rng_default;
-	r = gsl_rng_alloc(type);
+	double p[NB_PARAMS_NO_ANGLE], covar[NB_PARAMS_NO_ANGLE][NB_PARAMS_NO_ANGLE];
+	double rmse;
+	fitted_PSF *psf;
 
-	f.f = &psf_Gaussian_f;
-	f.df = &psf_Gaussian_df;
-	f.fdf = &psf_Gaussian_fdf;
-	f.n = n;
-	if (n <= p) {
-		free(psf);
-		free(y);
-		free(sigma);
+	if (NbRows * NbCols <= NB_PARAMS_NO_ANGLE)
+		return NULL;
+	psf_init_data(z->data, z->tda, NbRows, NbCols, background, p);
+	if (psf_fit_no_angle(z->data, z->tda, NbRows, NbCols, p, covar, &rmse))
 		return NULL;
-	}
-	f.p = p;
-	f.params = &d;
 
-	for (i = 0; i < NbRows; i++) {
-		for (j = 0; j < NbCols; j++) {
-			y[NbCols * i + j] = gsl_matrix_get(z, i, j);
-			sigma[NbCols * i + j] = 1.0;
-		}
+	psf = malloc(sizeof(fitted_PSF));
+	if (!psf) {
+		printf("Memory allocation failed: psf_minimiz_no_angle\n");
+		return NULL;
 	}
 
-	T = gsl_multifit_fdfsolver_lmsder;
-	s = gsl_multifit_fdfsolver_alloc(T, n, p);
-	gsl_multifit_fdfsolver_set(s, &f, &x.vector);
-
-	do {
-		iter++;
-		status = gsl_multifit_fdfsolver_iterate(s);
-		if (status)
-			break;
-		status = gsl_multifit_test_delta(s->dx, s->x, 1e-4, 1e-4);
-	} while (status == GSL_CONTINUE && iter < MAX_ITER_NO_ANGLE);
-
-#if HAVE_GSL_1
-	gsl_multifit_covar(s->J, 0.0, covar);
-#elif HAVE_GSL_2
-	gsl_matrix * J;
-
-	J = gsl_matrix_alloc(n, p);
-
-	gsl_multifit_fdfsolver_jac(s, J);
-	gsl_multifit_covar(J, 0.0, covar);
-
-	gsl_matrix_free(J);
-#endif
-
-#define FIT(i) gsl_vector_get(s->x, i)
-#define ERR(i) sqrt(gsl_matrix_get(covar,i,i))	//for now, errors are not displayed
+#define FIT(i) p[i]
+#define ERR(i) sqrt(covar[i][i])	//for now, errors are not displayed
 
 	/* Output structure with parameters fitted */
 	psf->B = FIT(0);
@@ -403,10 +488,12 @@ static fitted_PSF *psf_minimiz_no_angle(gsl_matrix* z, double background,
 	psf->units = "px";
 	// Magnitude
 	psf->mag = psf_get_mag(z, psf->B);
+	psf->s_mag = 9.999;
+	psf->phot = NULL;
 	// Layer: not fitted
 	psf->layer = layer;
 	// RMSE
-	psf->rmse = d.rmse;
+	psf->rmse = rmse;
 	// absolute uncertainties
 	psf->B_err = ERR(0) / FIT(0);
 	psf->A_err = ERR(1) / FIT(1);
@@ -417,13 +504,9 @@ static fitted_PSF *psf_minimiz_no_angle(gsl_matrix* z, double background,
 	psf->ang_err = 0;
 	psf->xpos = 0;		// will be set by the peaker
 	psf->ypos = 0;
-	// we free the memory
-	free(sigma);
-	free(y);
-	gsl_vector_free(MaxV);
-	gsl_multifit_fdfsolver_free(s);
-	gsl_matrix_free(covar);
-	gsl_rng_free(r);
+
+#undef FIT
+#undef ERR
 	return psf;
 }
 
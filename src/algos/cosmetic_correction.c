@@ -19,51 +19,30 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
 #include <gsl/gsl_statistics_ushort.h>
 
 #include "core/siril.h"
 #include "core/proto.h"
 #include "core/processing.h"
+#include "core/image_pool.h"
 #include "gui/callbacks.h"
 #include "io/single_image.h"
 #include "io/ser.h"
 #include "algos/cosmetic_correction.h"
+#include "algos/median_filter.h"
+#include "algos/sorting.h"
 
 
+/* median of the 24 closest pixels of the same colour */
 static WORD getMedian5x5(WORD *buf, const int xx, const int yy, const int w,
 		const int h, gboolean is_cfa) {
-	int step, radius, x, y;
-	WORD *value, median;
-
-	if (is_cfa) {
-		step = 2;
-		radius = 4;
-	}
-	else {
-		step = 1;
-		radius = 2;
-	}
-
-	int n = 0;
-	int start;
-	value = calloc(24, sizeof(WORD));
-	for (y = yy - radius; y <= yy + radius; y += step) {
-		for (x = xx - radius; x <= xx + radius; x += step) {
-			if (y >= 0 && y < h) {
-				if (x >= 0 && x < w) {
-					if ((x != xx) || (y != yy)) {
-						value[n++] = buf[x + y * w];
-					}
-				}
-			}
-		}
-	}
-	start = 24 - n - 1;
-	quicksort_s(value, 24);
-	median = round_to_WORD(gsl_stats_ushort_median_from_sorted_data(value + start, 1, n));
-	free(value);
-	return median;
+	if (is_cfa)
+		return median_of_neighbours(buf, xx, yy, w, h, 4, 2);
+	return median_of_neighbours(buf, xx, yy, w, h, 2, 1);
 }
 
 
@@ -125,45 +104,56 @@ static WORD getAverage3x3(WORD *buf, const int xx, const int yy, const int w,
 	return round_to_WORD(value / n);
 }
 
-long count_deviant_pixels(fits *fit, double sig[2], long *icold, long *ihot) {
-	int i;
-	WORD *buf = fit->pdata[RLAYER];
-	imstats *stat;
-	double sigma, median, thresHot, thresCold;
+/* Deviant pixels are those of value at least *hot or at most *cold, found from
+ * the median and sigma of the non-zero pixels of the first layer. Returns the
+ * histogram of the layer, that gives the number of deviant pixels. */
+static uint32_t *deviant_bounds(fits *fit, double sig[2], int *cold, int *hot) {
+	double sigma, median;
+	uint32_t *histo;
 
-	/** statistics **/
-	stat = statistics(fit, RLAYER, NULL, STATS_BASIC, STATS_ZERO_NULLCHECK);
-	if (!stat) {
+	histo = layer_histogram(fit, RLAYER, &median, &sigma);
+	if (!histo) {
 		siril_log_message(_("Error: no data computed.\n"));
-		return 0L;
+		return NULL;
 	}
-	sigma = stat->sigma;
-	median = stat->median;
-
 	if (sig[0] == -1.0) {	// flag for no cold detection
-		thresCold = -1.0;
+		*cold = -1;
 	}
 	else {
 		double val = median - (sig[0] * sigma);
-		thresCold = (val > 0) ? val : 0.0;
+		*cold = (val > 0) ? (int) floor(val) : 0;
 	}
 	if (sig[1] == -1.0) {	// flag for no hot detection
-		thresHot = USHRT_MAX_DOUBLE + 1;
+		*hot = USHRT_MAX + 1;
 	}
 	else {
 		double val = median + (sig[1] * sigma);
-		thresHot = (val > USHRT_MAX_DOUBLE) ? USHRT_MAX_DOUBLE : val;
+		*hot = (val > USHRT_MAX_DOUBLE) ? USHRT_MAX : (int) ceil(val);
+	}
+	return histo;
+}
+
+static void count_in_histogram(const uint32_t *histo, int cold, int hot,
+		long *icold, long *ihot) {
+	int i;
+
+	for (i = 0; i <= USHRT_MAX; i++) {
+		if (i >= hot) *ihot += histo[i];
+		else if (i <= cold) *icold += histo[i];
 	}
+}
 
-	free(stat);
+long count_deviant_pixels(fits *fit, double sig[2], long *icold, long *ihot) {
+	uint32_t *histo;
+	int cold, hot;
 
-	/** We count deviant pixels **/
 	*icold = 0;
 	*ihot = 0;
-	for (i = 0; i < fit->rx * fit->ry; i++) {
-		if (buf[i] >= thresHot) (*ihot)++;
-		else if (buf[i] <= thresCold) (*icold)++;
-	}
+	histo = deviant_bounds(fit, sig, &cold, &hot);
+	if (!histo)
+		return 0L;
+	count_in_histogram(histo, cold, hot, icold, ihot);
+	image_buffer_release(histo, (USHRT_MAX + 1) * sizeof(uint32_t));
 
 	return (*icold + *ihot);
 }
@@ -172,63 +162,67 @@ long count_deviant_pixels(fits *fit, double sig[2], long *icold, long *ihot) {
 /* Gives a list of point p containing deviant pixel coordinates
  * p MUST be freed after the call
  * if cold == -1 or hot == -1, this is a flag to not compute cold or hot
+ * Pixels are counted by row, then each row is filled in parallel from its
+ * first index in the list, so that the list stays sorted.
  */
 deviant_pixel *find_deviant_pixels(fits *fit, double sig[2], long *icold, long *ihot) {
-	int x, y, i;
 	WORD *buf = fit->pdata[RLAYER];
-	imstats *stat;
-	double sigma, median, thresHot, thresCold;
+	int cold, hot, y;
+	long n, *row_start;
+	uint32_t *histo;
 	deviant_pixel *dev;
 
-	/** statistics **/
-	stat = statistics(fit, RLAYER, NULL, STATS_BASIC, STATS_ZERO_NULLCHECK);
-	if (!stat) {
-		siril_log_message(_("Error: no data computed.\n"));
+	*icold = 0;
+	*ihot = 0;
+	histo = deviant_bounds(fit, sig, &cold, &hot);
+	if (!histo)
 		return NULL;
-	}
-	sigma = stat->sigma;
-	median = stat->median;
+	count_in_histogram(histo, cold, hot, icold, ihot);
+	image_buffer_release(histo, (USHRT_MAX + 1) * sizeof(uint32_t));
 
-	if (sig[0] == -1.0) {	// flag for no cold detection
-		thresCold = -1.0;
-	}
-	else {
-		double val = median - (sig[0] * sigma);
-		thresCold = (val > 0) ? val : 0.0;
-	}
-	if (sig[1] == -1.0) {	// flag for no hot detection
-		thresHot = USHRT_MAX_DOUBLE + 1;
-	}
-	else {
-		double val = median + (sig[1] * sigma);
-		thresHot = (val > USHRT_MAX_DOUBLE) ? USHRT_MAX_DOUBLE : val;
+	n = (*icold) + (*ihot);
+	if (n <= 0) return NULL;
+	dev = malloc(n * sizeof(deviant_pixel));
+	row_start = malloc((fit->ry + 1) * sizeof(long));
+	if (!dev || !row_start) {
+		siril_log_message(_("Out of memory - aborting\n"));
+		free(dev);
+		free(row_start);
+		*icold = 0;
+		*ihot = 0;
+		return NULL;
 	}
 
-	free(stat);
-
-	/** First we count deviant pixels **/
-	*icold = 0;
-	*ihot = 0;
-	for (i = 0; i < fit->rx * fit->ry; i++) {
-		if (buf[i] >= thresHot) (*ihot)++;
-		else if (buf[i] <= thresCold) (*icold)++;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(y) schedule(static)
+#endif
+	for (y = 0; y < fit->ry; y++) {
+		WORD *row = buf + y * fit->rx;
+		long count = 0;
+		int x;
+		for (x = 0; x < fit->rx; x++)
+			count += row[x] >= hot || row[x] <= cold;
+		row_start[y + 1] = count;
 	}
+	row_start[0] = 0;
+	for (y = 0; y < fit->ry; y++)
+		row_start[y + 1] += row_start[y];
 
-	/** Second we store deviant pixels in p*/
-	int n = (*icold) + (*ihot);
-	if (n <= 0) return NULL;
-	dev = calloc(n, sizeof(deviant_pixel));
-	i = 0;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(y) schedule(static)
+#endif
 	for (y = 0; y < fit->ry; y++) {
+		WORD *row = buf + y * fit->rx;
+		long i = row_start[y];
+		int x;
 		for (x = 0; x < fit->rx; x++) {
-			double pixel = (double) buf[x + y * fit->rx];
-			if (pixel >= thresHot) {
+			if (row[x] >= hot) {
 				dev[i].p.x = x;
 				dev[i].p.y = y;
 				dev[i].type = HOT_PIXEL;
 				i++;
 			}
-			else if (pixel <= thresCold) {
+			else if (row[x] <= cold) {
 				dev[i].p.x = x;
 				dev[i].p.y = y;
 				dev[i].type = COLD_PIXEL;
@@ -236,9 +230,225 @@ deviant_pixel *find_deviant_pixels(fits *fit, double sig[2], long *icold, long *
 			}
 		}
 	}
+	free(row_start);
 	return dev;
 }
 
+/* Reorders the n pixels of the rx x ry image given by their offsets, and their
+ * types if not NULL, to put first, keeping their order, those that have no
+ * other pixel of the list in the square of radius `radius' sampled by step.
+ * These pixels can be corrected in parallel from their neighbours: corrected
+ * in order after them, the others give the same result as if all were
+ * corrected in order, the square being symmetric.
+ * Returns the number of isolated pixels, -1 if out of memory. */
+static int split_isolated(int *pixels, typeOfDeviant *types, int n, int rx, int ry,
+		int radius, int step) {
+	guchar *mask, *isolated;
+	int *sorted_pixels;
+	typeOfDeviant *sorted_types = NULL;
+	int i, k = 0, nb_isolated = 0;
+
+	if (n <= 0)
+		return 0;
+	mask = calloc((size_t) rx * ry, sizeof(guchar));
+	isolated = malloc(n * sizeof(guchar));
+	sorted_pixels = malloc(n * sizeof(int));
+	if (types)
+		sorted_types = malloc(n * sizeof(typeOfDeviant));
+	if (!mask || !isolated || !sorted_pixels || (types && !sorted_types)) {
+		nb_isolated = -1;
+		goto free_and_exit;
+	}
+	for (i = 0; i < n; i++)
+		mask[pixels[i]] = 1;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if(n > 1000)
+#endif
+	for (i = 0; i < n; i++) {
+		int x0 = pixels[i] % rx, y0 = pixels[i] / rx, x, y;
+		isolated[i] = 1;
+		for (y = y0 - radius; y <= y0 + radius && isolated[i]; y += step) {
+			if (y < 0 || y >= ry)
+				continue;
+			for (x = x0 - radius; x <= x0 + radius; x += step) {
+				if (x >= 0 && x < rx && (x != x0 || y != y0) && mask[x + y * rx]) {
+					isolated[i] = 0;
+					break;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (isolated[i]) {
+			sorted_pixels[k] = pixels[i];
+			if (types) sorted_types[k] = types[i];
+			k++;
+		}
+	nb_isolated = k;
+	for (i = 0; i < n; i++)
+		if (!isolated[i]) {
+			sorted_pixels[k] = pixels[i];
+			if (types) sorted_types[k] = types[i];
+			k++;
+		}
+	memcpy(pixels, sorted_pixels, n * sizeof(int));
+	if (types)
+		memcpy(types, sorted_types, n * sizeof(typeOfDeviant));
+
+free_and_exit:
+	free(mask);
+	free(isolated);
+	free(sorted_pixels);
+	free(sorted_types);
+	return nb_isolated;
+}
+
+/* Offsets of the pixels used to correct the deviant pixel (x, y), stored in
+ * out if not NULL, in the order of getMedian5x5() for cold pixels and of
+ * getAverage3x3() for hot pixels. Returns their number, 24 at most. */
+static int correction_neighbours(int x0, int y0, int rx, int ry, typeOfDeviant type,
+		gboolean is_cfa, int *out) {
+	int step = is_cfa ? 2 : 1;
+	int radius = type == COLD_PIXEL ? 2 * step : step;
+	int x, y, n = 0;
+
+	for (y = y0 - radius; y <= y0 + radius; y += step) {
+		if (y < 0 || y >= ry)
+			continue;
+		for (x = x0 - radius; x <= x0 + radius; x += step) {
+			if (x >= 0 && x < rx && (x != x0 || y != y0)) {
+				if (out)
+					out[n] = x + y * rx;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+void deviant_neighbours_free(struct deviant_neighbours *dn) {
+	if (!dn) return;
+	free(dn->pixel);
+	free(dn->type);
+	free(dn->first);
+	free(dn->neighbour);
+	free(dn);
+}
+
+/* Finds the pixels used to correct the size deviant pixels of dev, in images
+ * of rx x ry pixels. Returns NULL if out of memory. */
+struct deviant_neighbours *deviant_neighbours_new(deviant_pixel *dev, int size,
+		int rx, int ry, gboolean is_cfa) {
+	struct deviant_neighbours *dn;
+	int i, step = is_cfa ? 2 : 1;
+
+	dn = calloc(1, sizeof(struct deviant_neighbours));
+	if (!dn)
+		return NULL;
+	dn->rx = rx;
+	dn->ry = ry;
+	dn->nb_pixels = size;
+	dn->pixel = malloc((size + 1) * sizeof(int));
+	dn->type = malloc((size + 1) * sizeof(typeOfDeviant));
+	dn->first = malloc((size + 1) * sizeof(int));
+	if (!dn->pixel || !dn->type || !dn->first)
+		goto error;
+	for (i = 0; i < size; i++) {
+		dn->pixel[i] = (int) dev[i].p.x + (int) dev[i].p.y * rx;
+		dn->type[i] = dev[i].type;
+	}
+	/* cold pixels use the largest square, of radius 2 * step */
+	dn->nb_isolated = split_isolated(dn->pixel, dn->type, size, rx, ry, 2 * step, step);
+	if (dn->nb_isolated < 0)
+		goto error;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if(size > 1000)
+#endif
+	for (i = 0; i < size; i++)
+		dn->first[i + 1] = correction_neighbours(dn->pixel[i] % rx, dn->pixel[i] / rx,
+				rx, ry, dn->type[i], is_cfa, NULL);
+	dn->first[0] = 0;
+	for (i = 0; i < size; i++)
+		dn->first[i + 1] += dn->first[i];
+	dn->neighbour = malloc((dn->first[size] + 1) * sizeof(int));
+	if (!dn->neighbour)
+		goto error;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if(size > 1000)
+#endif
+	for (i = 0; i < size; i++)
+		correction_neighbours(dn->pixel[i] % rx, dn->pixel[i] / rx, rx, ry,
+				dn->type[i], is_cfa, dn->neighbour + dn->first[i]);
+	return dn;
+
+error:
+	siril_log_message(_("Out of memory - aborting\n"));
+	deviant_neighbours_free(dn);
+	return NULL;
+}
+
+/* corrects the deviant pixel i of dn, with the same values as
+ * cosmeticCorrOnePoint() */
+static void correct_pixel(fits *fit, const struct deviant_neighbours *dn, int i) {
+	const int *nb = dn->neighbour + dn->first[i];
+	int n = dn->first[i + 1] - dn->first[i], j;
+
+	if (n == 0)
+		return;
+	if (fit->type == DATA_FLOAT) {
+		float *buf = fit->fpdata[RLAYER];
+		if (dn->type[i] == COLD_PIXEL) {
+			double values[SORTNET_MAX];
+			for (j = 0; j < n; j++)
+				values[j] = buf[nb[j]];
+			sortnet_sort_d(median_network(n), values);
+			buf[dn->pixel[i]] = n % 2 ? (float) values[n / 2] :
+				(float) (0.5 * (values[n / 2 - 1] + values[n / 2]));
+		} else {
+			double value = 0;
+			for (j = 0; j < n; j++)
+				value += (double) buf[nb[j]];
+			buf[dn->pixel[i]] = (float) (value / n);
+		}
+	} else {
+		WORD *buf = fit->pdata[RLAYER];
+		if (dn->type[i] == COLD_PIXEL) {
+			WORD values[SORTNET_MAX];
+			for (j = 0; j < n; j++)
+				values[j] = buf[nb[j]];
+			sortnet_sort(median_network(n), values);
+			buf[dn->pixel[i]] = (WORD) (((unsigned int) values[(n - 1) / 2]
+						+ values[n / 2] + 1) >> 1);
+		} else {
+			double value = 0;
+			for (j = 0; j < n; j++)
+				value += (double) buf[nb[j]];
+			buf[dn->pixel[i]] = round_to_WORD(value / n);
+		}
+	}
+}
+
+/* Corrects the deviant pixels of dn in the first layer of fit, isolated
+ * pixels in parallel, the others in order after them. */
+int correct_deviant_pixels(fits *fit, const struct deviant_neighbours *dn) {
+	int i;
+
+	if (fit->rx != dn->rx || fit->ry != dn->ry)
+		return 1;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if(dn->nb_isolated > 1000)
+#endif
+	for (i = 0; i < dn->nb_isolated; i++)
+		correct_pixel(fit, dn, i);
+	for (i = dn->nb_isolated; i < dn->nb_pixels; i++)
+		correct_pixel(fit, dn, i);
+	return 0;
+}
+
 int cosmeticCorrOnePoint(fits *fit, deviant_pixel dev, gboolean is_cfa) {
 	WORD *buf = fit->pdata[RLAYER];		// Cosmetic correction, as developed here, is only used on 1-channel images
 	WORD newpixel;
@@ -272,25 +482,20 @@ int cosmeticCorrOneLine(fits *fit, deviant_pixel dev, gboolean is_cfa) {
 	return 0;
 }
 
+/* Corrects the size deviant pixels of dev in the first layer of fit, the only
+ * one for which cosmetic correction, as developed here, is used. */
 int cosmeticCorrection(fits *fit, deviant_pixel *dev, int size, gboolean is_cfa) {
-	int i;
-	WORD *buf = fit->pdata[RLAYER];		// Cosmetic correction, as developed here, is only used on 1-channel images
-	int width = fit->rx;
-	int height = fit->ry;
-
-	for (i = 0; i < size; i++) {
-		WORD newPixel;
-		int xx = (int) dev[i].p.x;
-		int yy = (int) dev[i].p.y;
-
-		if (dev[i].type == COLD_PIXEL)
-			newPixel = getMedian5x5(buf, xx, yy, width, height, is_cfa);
-		else
-			newPixel = getAverage3x3(buf, xx, yy, width, height, is_cfa);
+	struct deviant_neighbours *dn;
+	int retval;
 
-		buf[xx + yy * width] = newPixel;
-	}
-	return 0;
+	if (size <= 0)
+		return 0;
+	dn = deviant_neighbours_new(dev, size, fit->rx, fit->ry, is_cfa);
+	if (!dn)
+		return 1;
+	retval = correct_deviant_pixels(fit, dn);
+	deviant_neighbours_free(dn);
+	return retval;
 }
 
 /**** Autodetect *****/
@@ -313,7 +518,7 @@ int cosmetic_image_hook(struct generic_seq_args *args, int i, fits *fit, rectang
 }
 
 void apply_cosmetic_to_sequence(struct cosmetic_data *cosme_args) {
-	struct generic_seq_args *args = malloc(sizeof(struct generic_seq_args));
+	struct generic_seq_args *args = calloc(1, sizeof(struct generic_seq_args));
 	args->seq = &com.seq;
 	args->partial_image = FALSE;
 	args->filtering_criterion = seq_filter_included;
@@ -379,57 +584,151 @@ gpointer autoDetectThreaded(gpointer p) {
 	return GINT_TO_POINTER(retval);
 }
 
+/* corrects the pixel i of buf if it is hot or cold, see autoDetect(). Returns
+ * 1 if it was found hot, 2 if it was found cold, 3 if both */
+static int autodetect_pixel(WORD *buf, int i, int width, int height, double sig[2],
+		double bkg, double avgDev, double amount, gboolean is_cfa) {
+	int x = i % width, y = i / width, found = 0;
+	double f0 = amount;
+	double f1 = 1 - f0;
+	WORD pixel = buf[i];
+	WORD a = getAverage3x3(buf, x, y, width, height, is_cfa);
+	WORD m = getMedian5x5(buf, x, y, width, height, is_cfa);
+
+	/* Hot autodetect */
+	if (sig[1] != -1.0) {
+		double k1 = avgDev;
+		double k2 = k1 / 2;
+		double k3 = sig[1] * k1;
+		if ((a < bkg + k2) && (pixel > bkg + k1) && (pixel > m + k3)) {
+			found |= 1;
+			buf[i] = a * f0 + pixel * f1;
+		}
+	}
+
+	/* Cold autodetect */
+	if (sig[0] != -1.0) {
+		double k = avgDev * sig[0];
+		if (((pixel + k) < bkg) && ((pixel + k) < m)) {
+			found |= 2;
+			buf[i] = m * f0 + pixel * f1;
+		}
+	}
+	return found;
+}
+
+/* the tests of autodetect_pixel() that do not depend on the neighbours */
+static gboolean is_candidate(WORD pixel, double sig[2], double bkg, double avgDev) {
+	return (sig[1] != -1.0 && pixel > bkg + avgDev) ||
+		(sig[0] != -1.0 && (pixel + avgDev * sig[0]) < bkg);
+}
+
 /* this is an autodetect algorithm. Cold and hot pixels
- *  are corrected in the same time */
+ *  are corrected in the same time.
+ * Only the pixels that are far enough from the background can be corrected:
+ * they are listed in a parallel scan, the others never change. Candidates
+ * with no other candidate around them are then corrected in parallel, and
+ * the others in the order of the image, which gives the same result as
+ * correcting all pixels in that order. */
 int autoDetect(fits *fit, int layer, double sig[2], long *icold, long *ihot, double amount,
 		gboolean is_cfa) {
-	int x, y;
 	int width = fit->rx;
 	int height = fit->ry;
-	double bkg, avgDev;
-	double f0 = amount;
-	double f1 = 1 - f0;
-	imstats *stat;
+	int step = is_cfa ? 2 : 1;
+	int i, y, n, nb_isolated, *row_start, *candidates;
+	double bkg, sigma, avgDev = 0.0;
+	uint64_t ngoodpix = 0;
+	uint32_t *histo;
+	WORD *buf = fit->pdata[layer];
 
 	/* XXX: if cfa, stats are irrelevant. We should compute them taking
 	 * into account the Bayer pattern */
-	stat = statistics(fit, layer, NULL, STATS_BASIC | STATS_AVGDEV, STATS_ZERO_NULLCHECK);
-	if (!stat) {
+	histo = layer_histogram(fit, layer, &bkg, &sigma);
+	if (!histo) {
 		siril_log_message(_("Error: no data computed.\n"));
 		return 1;
 	}
-	bkg = stat->median;
-	avgDev = stat->avgDev;
-	free(stat);
-
-	WORD *buf = fit->pdata[layer];
+	/* average absolute deviation from the median of the non-zero pixels */
+	for (i = 1; i <= USHRT_MAX; i++) {
+		ngoodpix += histo[i];
+		avgDev += (double) histo[i] * fabs(i - bkg);
+	}
+	avgDev /= ngoodpix;
+	image_buffer_release(histo, (USHRT_MAX + 1) * sizeof(uint32_t));
 
+	row_start = malloc((height + 1) * sizeof(int));
+	if (!row_start) {
+		siril_log_message(_("Out of memory - aborting\n"));
+		return 1;
+	}
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(y) schedule(static)
+#endif
 	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			WORD pixel = buf[x + y * width];
-			WORD a = getAverage3x3(buf, x, y, width, height, is_cfa);
-			WORD m = getMedian5x5(buf, x, y, width, height, is_cfa);
-
-			/* Hot autodetect */
-			if (sig[1] != -1.0) {
-				double k1 = avgDev;
-				double k2 = k1 / 2;
-				double k3 = sig[1] * k1;
-				if ((a < bkg + k2) && (pixel > bkg + k1) && (pixel > m + k3)) {
-					(*ihot)++;
-					buf[x + y * width] = a * f0 + pixel * f1;
-				}
-			}
+		WORD *row = buf + y * width;
+		int x, count = 0;
+		for (x = 0; x < width; x++)
+			count += is_candidate(row[x], sig, bkg, avgDev);
+		row_start[y + 1] = count;
+	}
+	row_start[0] = 0;
+	for (y = 0; y < height; y++)
+		row_start[y + 1] += row_start[y];
+	n = row_start[height];
+	if (n == 0) {
+		free(row_start);
+		return 0;
+	}
+	candidates = malloc(n * sizeof(int));
+	if (!candidates) {
+		free(row_start);
+		siril_log_message(_("Out of memory - aborting\n"));
+		return 1;
+	}
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(y) schedule(static)
+#endif
+	for (y = 0; y < height; y++) {
+		WORD *row = buf + y * width;
+		int x, j = row_start[y];
+		for (x = 0; x < width; x++)
+			if (is_candidate(row[x], sig, bkg, avgDev))
+				candidates[j++] = x + y * width;
+	}
+	free(row_start);
 
-			/* Cold autodetect */
-			if (sig[0] != -1.0) {
-				double k = avgDev * sig[0];
-				if (((pixel + k) < bkg) && ((pixel + k) < m)) {
-					(*icold)++;
-					buf[x + y * width] = m * f0 + pixel * f1;
-				}
-			}
+	/* the median uses the largest square, of radius 2 * step */
+	nb_isolated = split_isolated(candidates, NULL, n, width, height, 2 * step, step);
+	if (nb_isolated < 0) {
+		free(candidates);
+		siril_log_message(_("Out of memory - aborting\n"));
+		return 1;
+	}
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if(nb_isolated > 1000)
+#endif
+	for (i = 0; i < nb_isolated; i++) {
+		int found = autodetect_pixel(buf, candidates[i], width, height, sig,
+				bkg, avgDev, amount, is_cfa);
+		if (found & 1) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+			(*ihot)++;
 		}
+		if (found & 2) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+			(*icold)++;
+		}
+	}
+	for (i = nb_isolated; i < n; i++) {
+		int found = autodetect_pixel(buf, candidates[i], width, height, sig,
+				bkg, avgDev, amount, is_cfa);
+		if (found & 1) (*ihot)++;
+		if (found & 2) (*icold)++;
 	}
+	free(candidates);
 	return 0;
 }
@@ -25,6 +25,18 @@ struct deviant_struct {
 	typeOfDeviant type;
 };
 
+/* Deviant pixels and the pixels used to correct them, found once for all the
+ * images corrected with the same list, like those calibrated with a dark */
+struct deviant_neighbours {
+	int rx, ry;		// size of the images
+	int nb_pixels;
+	int nb_isolated;	// first pixels, with no deviant pixel around them
+	int *pixel;		// offsets of the deviant pixels in the image
+	typeOfDeviant *type;
+	int *first;		// neighbours of pixel i start at neighbour[first[i]]
+	int *neighbour;		// offsets of the neighbours, first[nb_pixels] in all
+};
+
 long count_deviant_pixels(fits *fit, double sig[2], long *icold, long *ihot);
 deviant_pixel *find_deviant_pixels(fits *fit, double sig[2], long *icold, long *ihot);
 int autoDetect(fits *fit, int layer, double sig[2], long *icold, long *ihot,
@@ -32,6 +44,10 @@ int autoDetect(fits *fit, int layer, double sig[2], long *icold, long *ihot,
 void apply_cosmetic_to_sequence(struct cosmetic_data *cosme_args);
 gpointer autoDetectThreaded(gpointer p);
 int cosmeticCorrection(fits *fit, deviant_pixel *dev, int size, gboolean is_CFA);
+struct deviant_neighbours *deviant_neighbours_new(deviant_pixel *dev, int size,
+		int rx, int ry, gboolean is_cfa);
+void deviant_neighbours_free(struct deviant_neighbours *dn);
+int correct_deviant_pixels(fits *fit, const struct deviant_neighbours *dn);
 int cosmeticCorrOneLine(fits *fit, deviant_pixel dev, gboolean is_cfa);
 int cosmeticCorrOnePoint(fits *fit, deviant_pixel dev, gboolean is_cfa);
 
@@ -25,6 +25,7 @@
 
 #include "core/siril.h"
 #include "core/proto.h"
+#include "core/image_pool.h"
 #include "gui/callbacks.h"
 #include "algos/demosaicing.h"
 
@@ -420,7 +421,6 @@ int bayer_VNG(const WORD *bayer, WORD *dst, int sx, int sy,
 }
 
 /* AHD interpolation ported from dcraw to libdc1394 by Samuel Audet */
-static gboolean ahd_inited = FALSE; /* WARNING: not multi-processor safe */
 
 #define CLIPOUT(x) LIM(x,0,255)
 #define CLIPOUT16(x,bits) LIM(x,0,((1<<bits)-1))
@@ -464,6 +464,15 @@ static void cam_to_cielab(uint16_t cam[3], float lab[3]) /* [SA] */
 	}
 }
 
+/* computes the tables of cam_to_cielab, once for all threads */
+static void ahd_init() {
+	static gsize inited = 0;
+	if (g_once_init_enter(&inited)) {
+		cam_to_cielab(NULL, NULL);
+		g_once_init_leave(&inited, 1);
+	}
+}
+
 /*
  Adaptive Homogeneity-Directed interpolation is based on
  the work of Keigo Hirakawa, Thomas Parks, and Paul Lee.
@@ -486,11 +495,7 @@ int bayer_AHD(const WORD *bayer, WORD *dst, int sx, int sy,
 	const int height = sy, width = sx;
 	int x, y;
 
-	if (ahd_inited == FALSE) {
-		/* WARNING: this might not be multi-processor safe */
-		cam_to_cielab(NULL, NULL);
-		ahd_inited = TRUE;
-	}
+	ahd_init();
 
 	switch (pattern) {
 	case BAYER_FILTER_BGGR:
@@ -672,7 +677,7 @@ WORD *debayer_buffer(WORD *buf, int *width, int *height,
 	switch (interpolation) {
 	case BAYER_BILINEAR:
 		npixels = (*width) * (*height);
-		newbuf = calloc(1, 3 * npixels * sizeof(WORD));
+		newbuf = image_buffer_get_zeroed(3 * npixels * sizeof(WORD));
 		if (newbuf == NULL) {
 			printf("Not enough memory for debayering\n");
 			return NULL;
@@ -682,7 +687,7 @@ WORD *debayer_buffer(WORD *buf, int *width, int *height,
 		break;
 	case BAYER_NEARESNEIGHBOR:
 		npixels = (*width) * (*height);
-		newbuf = calloc(1, 3 * npixels * sizeof(WORD));
+		newbuf = image_buffer_get_zeroed(3 * npixels * sizeof(WORD));
 		if (newbuf == NULL) {
 			printf("Not enough memory for debayering\n");
 			return NULL;
@@ -693,7 +698,7 @@ WORD *debayer_buffer(WORD *buf, int *width, int *height,
 	default:
 	case BAYER_VNG:
 		npixels = (*width) * (*height);
-		newbuf = calloc(1, 3 * npixels * sizeof(WORD));
+		newbuf = image_buffer_get_zeroed(3 * npixels * sizeof(WORD));
 		if (newbuf == NULL) {
 			printf("Not enough memory for debayering\n");
 			return NULL;
@@ -703,7 +708,7 @@ WORD *debayer_buffer(WORD *buf, int *width, int *height,
 		break;
 	case BAYER_AHD:
 		npixels = (*width) * (*height);
-		newbuf = calloc(1, 3 * npixels * sizeof(WORD));
+		newbuf = image_buffer_get_zeroed(3 * npixels * sizeof(WORD));
 		if (newbuf == NULL) {
 			printf("Not enough memory for debayering\n");
 			return NULL;
@@ -713,7 +718,7 @@ WORD *debayer_buffer(WORD *buf, int *width, int *height,
 		break;
 	case BAYER_SUPER_PIXEL:
 		npixels = (*width / 2 + *width % 2) * (*height / 2 + *height % 2);
-		newbuf = calloc(1, 3 * npixels * sizeof(WORD));
+		newbuf = image_buffer_get_zeroed(3 * npixels * sizeof(WORD));
 		if (newbuf == NULL) {
 			printf("Not enough memory for debayering\n");
 			return NULL;
@@ -726,23 +731,252 @@ WORD *debayer_buffer(WORD *buf, int *width, int *height,
 	return newbuf;
 }
 
-int debayer(fits* fit, interpolation_method interpolation) {
-	int i, j;
+/* colour of the CFA pixels for each pattern, on even and odd rows and columns */
+static const int cfa_colors[4][2][2] = {
+	{ { RLAYER, GLAYER }, { GLAYER, BLAYER } },	// RGGB
+	{ { BLAYER, GLAYER }, { GLAYER, RLAYER } },	// BGGR
+	{ { GLAYER, BLAYER }, { RLAYER, GLAYER } },	// GBRG
+	{ { GLAYER, RLAYER }, { BLAYER, GLAYER } }	// GRBG
+};
+
+/* Bilinear interpolation of the pixels of one parity of a row, from start to
+ * end by steps of 2. For green pixels, hor receives the average of the
+ * horizontal neighbours and ver of the vertical ones; for red or blue pixels,
+ * hor receives the average of the four direct neighbours, the green, and ver
+ * of the four diagonal ones. Loops have no branch to be vectorized. */
+static void bilinear_pixels(const WORD *up, const WORD *cur, const WORD *down,
+		WORD *own, WORD *hor, WORD *ver, int start, int end, gboolean green) {
+	int x;
+	if (green) {
+		for (x = start; x < end; x += 2) {
+			own[x] = cur[x];
+			hor[x] = (cur[x - 1] + cur[x + 1] + 1) >> 1;
+			ver[x] = (up[x] + down[x] + 1) >> 1;
+		}
+	} else {
+		for (x = start; x < end; x += 2) {
+			own[x] = cur[x];
+			hor[x] = (cur[x - 1] + cur[x + 1] + up[x] + down[x] + 2) >> 2;
+			ver[x] = (up[x - 1] + up[x + 1] + down[x - 1] + down[x + 1] + 2) >> 2;
+		}
+	}
+}
+
+/* Same result as bayer_Bilinear, black borders included, but written directly
+ * in the three planes of out, rows being interpolated in parallel. */
+static int bilinear_planar(const WORD *bayer, WORD *out, int width, int height,
+		sensor_pattern pattern) {
+	long npixels = (long) width * height;
+	WORD *planes[3] = { out, out + npixels, out + 2 * npixels };
+	int y;
+
+	if ((pattern > BAYER_FILTER_MAX) || (pattern < BAYER_FILTER_MIN))
+		return -1;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(y) schedule(static)
+#endif
+	for (y = 0; y < height; y++) {
+		long offset = (long) y * width;
+		int c, p;
+		if (y == 0 || y == height - 1) {
+			for (c = 0; c < 3; c++)
+				memset(planes[c] + offset, 0, width * sizeof(WORD));
+			continue;
+		}
+		for (c = 0; c < 3; c++)
+			planes[c][offset] = planes[c][offset + width - 1] = 0;
+		/* x starts at 1, the odd columns first */
+		for (p = 0; p < 2; p++) {
+			int x_parity = 1 - p;
+			int own = cfa_colors[pattern][y & 1][x_parity];
+			int next = cfa_colors[pattern][y & 1][!x_parity];
+			int vert = cfa_colors[pattern][!(y & 1)][x_parity];
+			const WORD *cur = bayer + offset;
+			if (own == GLAYER)
+				bilinear_pixels(cur - width, cur, cur + width,
+						planes[own] + offset, planes[next] + offset,
+						planes[vert] + offset, 1 + p, width - 1, TRUE);
+			else bilinear_pixels(cur - width, cur, cur + width,
+						planes[own] + offset, planes[GLAYER] + offset,
+						planes[2 - own] + offset, 1 + p, width - 1, FALSE);
+		}
+	}
+	return 0;
+}
+
+/* Same as super_pixel, written directly in the three planes of out, of size
+ * (width / 2 + width % 2) x (height / 2 + height % 2). The last row and column
+ * of images of odd size have no complete CFA cell and are black. */
+static int super_pixel_planar(const WORD *buf, WORD *out, int width, int height,
+		sensor_pattern pattern) {
+	int ow = width / 2 + width % 2, oh = height / 2 + height % 2;
+	long npixels = (long) ow * oh;
+	WORD *planes[3] = { out, out + npixels, out + 2 * npixels };
+	int y;
+
+	if ((pattern > BAYER_FILTER_MAX) || (pattern < BAYER_FILTER_MIN))
+		return -1;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(y) schedule(static)
+#endif
+	for (y = 0; y < oh; y++) {
+		const WORD *row0 = buf + (long) 2 * y * width, *row1 = row0 + width;
+		WORD *g = planes[GLAYER] + (long) y * ow;
+		/* the red and blue pixels of the cell, the greens are on the
+		 * other diagonal */
+		int first = cfa_colors[pattern][0][0] == GLAYER;
+		WORD *c0 = planes[cfa_colors[pattern][0][first]] + (long) y * ow;
+		WORD *c1 = planes[cfa_colors[pattern][1][!first]] + (long) y * ow;
+		int x, c;
+
+		if (2 * y + 1 >= height) {
+			for (c = 0; c < 3; c++)
+				memset(planes[c] + (long) y * ow, 0, ow * sizeof(WORD));
+			continue;
+		}
+		for (x = 0; x < width / 2; x++) {
+			c0[x] = row0[2 * x + first];
+			c1[x] = row1[2 * x + !first];
+			g[x] = (row0[2 * x + !first] + row1[2 * x + first] + 1) >> 1;
+		}
+		if (width & 1)
+			c0[ow - 1] = c1[ow - 1] = g[ow - 1] = 0;
+	}
+	return 0;
+}
+
+/* number of rows interpolated at once by the interleaved kernels, AHD bands
+ * with their halo match its own tiles */
+#define DEBAYER_BAND_HEIGHT 64
+#define AHD_BAND_HEIGHT (TS - 2 * AHD_HALO)
+/* rows of the neighbouring bands needed by the kernels for exact values */
+#define NEARESTNEIGHBOR_HALO 2
+#define VNG_HALO 4
+#define AHD_HALO 10
+
+/* Interpolation of bands of rows, with the interleaved kernels. Each band is
+ * interpolated with a halo of rows above and below, so that its rows get the
+ * same values as in the interpolation of the whole image, then copied to the
+ * planes of out. Bands are small enough to stay in cache, and are processed in
+ * parallel. Band heights and halos are even so that bands start on a row of
+ * the same parity as the image and keep its pattern. */
+static int interpolate_by_bands(const WORD *bayer, WORD *out, int width, int height,
+		interpolation_method interpolation, sensor_pattern pattern) {
+	long npixels = (long) width * height;
+	int band_height = DEBAYER_BAND_HEIGHT;
+	int nb_bands, halo, band, retval = 0;
+
+	switch (interpolation) {
+	case BAYER_NEARESNEIGHBOR:
+		halo = NEARESTNEIGHBOR_HALO;
+		break;
+	case BAYER_AHD:
+		halo = AHD_HALO;
+		band_height = AHD_BAND_HEIGHT;
+		ahd_init();	// before threads use its tables
+		break;
+	default:
+	case BAYER_VNG:
+		halo = VNG_HALO;
+		break;
+	}
+	nb_bands = (height + band_height - 1) / band_height;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) private(band)
+#endif
+	{
+		size_t band_size = (size_t) (band_height + 2 * halo) * width * 3;
+		WORD *rgb = malloc(band_size * sizeof(WORD));
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (band = 0; band < nb_bands; band++) {
+			int y0 = band * band_height;
+			int y1 = min(y0 + band_height, height);
+			int top = max(y0 - halo, 0), bottom = min(y1 + halo, height);
+			const WORD *band_bayer = bayer + (long) top * width;
+			int y, x, ret;
+
+			if (!rgb || retval) {
+				retval = 1;
+				continue;
+			}
+			memset(rgb, 0, (size_t) (bottom - top) * width * 3 * sizeof(WORD));
+			switch (interpolation) {
+			case BAYER_NEARESNEIGHBOR:
+				ret = bayer_NearestNeighbor(band_bayer, rgb, width, bottom - top, pattern);
+				break;
+			case BAYER_AHD:
+				ret = bayer_AHD(band_bayer, rgb, width, bottom - top, pattern);
+				break;
+			default:
+			case BAYER_VNG:
+				ret = bayer_VNG(band_bayer, rgb, width, bottom - top, pattern);
+				break;
+			}
+			if (ret) {
+				retval = 1;
+				continue;
+			}
+			for (y = y0; y < y1; y++) {
+				const WORD *src = rgb + (long) (y - top) * width * 3;
+				WORD *r = out + (long) y * width;
+				WORD *g = r + npixels, *b = g + npixels;
+				for (x = 0; x < width; x++) {
+					r[x] = src[3 * x + RLAYER];
+					g[x] = src[3 * x + GLAYER];
+					b[x] = src[3 * x + BLAYER];
+				}
+			}
+		}
+		free(rgb);
+	}
+	return retval;
+}
+
+/* Demosaics the CFA image fit in place, the result being a three-layer image.
+ * The interpolated image is written directly in planar form. */
+int debayer(fits* fit, interpolation_method interpolation, sensor_pattern pattern) {
 	int width = fit->rx;
 	int height = fit->ry;
-	int npixels;
-	WORD *buf = fit->data;
-	WORD *newbuf;
+	long npixels, i;
+	WORD *planar;
+	int retval;
 
-	newbuf = debayer_buffer(buf, &width, &height, interpolation,
-			com.debayer.bayer_pattern);
-	if (newbuf == NULL) {
+	if (interpolation == BAYER_SUPER_PIXEL) {
+		width = fit->rx / 2 + fit->rx % 2;
+		height = fit->ry / 2 + fit->ry % 2;
+	}
+	npixels = (long) width * height;
+	planar = image_buffer_get(3 * npixels * sizeof(WORD));
+	if (planar == NULL) {
+		printf("Not enough memory for debayering\n");
+		return 1;
+	}
+
+	switch (interpolation) {
+	case BAYER_BILINEAR:
+		retval = bilinear_planar(fit->data, planar, fit->rx, fit->ry, pattern);
+		break;
+	case BAYER_SUPER_PIXEL:
+		retval = super_pixel_planar(fit->data, planar, fit->rx, fit->ry, pattern);
+		break;
+	default:
+		retval = interpolate_by_bands(fit->data, planar, fit->rx, fit->ry,
+				interpolation, pattern);
+		break;
+	}
+	if (retval) {
+		image_buffer_release(planar, 3 * npixels * sizeof(WORD));
 		return 1;
 	}
-	npixels = width * height;
 
-	// usual color RGBRGB format to fits RRGGBB format
-	fit->data = realloc(fit->data, 3 * npixels * sizeof(WORD));
+	/* the CFA buffer is kept for the next frame */
+	image_buffer_release(fit->data, (size_t) fit->rx * fit->ry * sizeof(WORD));
+	fit->data = planar;
 	fit->naxes[0] = width;
 	fit->naxes[1] = height;
 	fit->naxes[2] = 3;
@@ -752,18 +986,10 @@ int debayer(fits* fit, interpolation_method interpolation) {
 	fit->pdata[RLAYER] = fit->data;
 	fit->pdata[GLAYER] = fit->data + npixels;
 	fit->pdata[BLAYER] = fit->data + npixels * 2;
-	for (i = 0, j = 0; j < npixels; i += 3, j++) {
-		fit->pdata[RLAYER][j] =
-				(fit->bitpix == 8) ?
-						round_to_BYTE(newbuf[i + RLAYER]) : newbuf[i + RLAYER];
-		fit->pdata[GLAYER][j] =
-				(fit->bitpix == 8) ?
-						round_to_BYTE(newbuf[i + GLAYER]) : newbuf[i + GLAYER];
-		fit->pdata[BLAYER][j] =
-				(fit->bitpix == 8) ?
-						round_to_BYTE(newbuf[i + BLAYER]) : newbuf[i + BLAYER];
+	if (fit->bitpix == BYTE_IMG) {
+		for (i = 0; i < 3 * npixels; i++)
+			fit->data[i] = min(fit->data[i], UCHAR_MAX);
 	}
-	free(newbuf);
 	return 0;
 }
 
@@ -0,0 +1,140 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of the median kernels used in median stacking. For several
+ * numbers of frames, it computes the median of random rows of pixels with
+ * the original sort-based method (sort, then the gsl median from sorted data
+ * stored in a WORD) and with the kernels of algos/sorting.c, checks that the
+ * results are identical bit for bit and prints the time taken by each.
+ * Compile siril then use the following command in src to build it:
+ * $ $(CC) -O2 -o median_bench algos/main_median_bench.c algos/sorting.c -I. -I.. `pkg-config gtk+-3.0 cfitsio --cflags`
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "core/siril.h"
+#include "algos/sorting.h"
+
+#define BENCH_WIDTH 4096
+#define BENCH_ROWS 16
+
+static int compare_words(const void *a, const void *b) {
+	return (int)*(const WORD *)a - (int)*(const WORD *)b;
+}
+
+/* the reference: what stack_median() did before the selection kernels */
+static WORD reference_median(WORD *a, int n) {
+	double median;
+	qsort(a, n, sizeof(WORD), compare_words);
+	if (n % 2)
+		median = a[n / 2];
+	else median = (a[(n - 1) / 2] + a[n / 2]) / 2.0;
+	return median;
+}
+
+static double elapsed(struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec - start->tv_sec) +
+		(double)(end.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static int bench(int n, unsigned int range) {
+	WORD *data, *copy, **rows, *stack, *ref, *sel, *net_out;
+	double t_ref = 0.0, t_sel = 0.0, t_net = 0.0;
+	struct timespec start;
+	sortnet *net = NULL;
+	long x, nbpix = (long)BENCH_WIDTH * BENCH_ROWS;
+	int i, r, errors = 0;
+
+	data = malloc(n * nbpix * sizeof(WORD));
+	copy = malloc(n * nbpix * sizeof(WORD));
+	rows = malloc(n * sizeof(WORD *));
+	stack = malloc(n * sizeof(WORD));
+	ref = malloc(nbpix * sizeof(WORD));
+	sel = malloc(nbpix * sizeof(WORD));
+	net_out = malloc(nbpix * sizeof(WORD));
+	for (x = 0; x < n * nbpix; x++)
+		data[x] = rand() % range;
+	for (i = 0; i < n; i++)
+		rows[i] = copy + i * nbpix;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (x = 0; x < nbpix; x++) {
+		for (i = 0; i < n; i++)
+			stack[i] = data[i * nbpix + x];
+		ref[x] = reference_median(stack, n);
+	}
+	t_ref = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (x = 0; x < nbpix; x++) {
+		for (i = 0; i < n; i++)
+			stack[i] = data[i * nbpix + x];
+		sel[x] = quickmedian(stack, n);
+	}
+	t_sel = elapsed(&start);
+
+	if (n <= SORTNET_MAX) {
+		net = sortnet_new(n);
+		memcpy(copy, data, n * nbpix * sizeof(WORD));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (r = 0; r < BENCH_ROWS; r++)
+			sortnet_median_rows(net, rows, r * BENCH_WIDTH, BENCH_WIDTH,
+					net_out + r * BENCH_WIDTH);
+		t_net = elapsed(&start);
+	}
+
+	for (x = 0; x < nbpix; x++) {
+		if (sel[x] != ref[x] || (net && net_out[x] != ref[x]))
+			errors++;
+	}
+	if (net)
+		fprintf(stdout, "%4d frames: sort %8.2f ms, select %8.2f ms, network %8.2f ms, %s\n",
+				n, t_ref * 1000.0, t_sel * 1000.0, t_net * 1000.0,
+				errors ? "MISMATCH" : "identical");
+	else fprintf(stdout, "%4d frames: sort %8.2f ms, select %8.2f ms, %s\n",
+				n, t_ref * 1000.0, t_sel * 1000.0,
+				errors ? "MISMATCH" : "identical");
+
+	sortnet_free(net);
+	free(data); free(copy); free(rows); free(stack);
+	free(ref); free(sel); free(net_out);
+	return errors;
+}
+
+int main(int argc, char **argv) {
+	int sizes[] = { 2, 3, 4, 5, 7, 8, 9, 12, 16, 20, 25, 31, 32, 33, 50, 100, 400 };
+	int i, errors = 0;
+
+	srand(argc > 1 ? atoi(argv[1]) : 42);
+	for (i = 0; i < sizeof(sizes) / sizeof(int); i++) {
+		/* narrow value ranges create many duplicates, a corner case for
+		 * the selection partitioning */
+		errors += bench(sizes[i], 16);
+		errors += bench(sizes[i], USHRT_MAX + 1);
+	}
+	if (errors)
+		fprintf(stdout, "%d medians differ from the reference\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Median filters of WORD images and medians of the neighbourhood of a pixel.
+ *
+ * The image is first copied in a buffer padded with the values of the
+ * nearest edge pixel, so that windows never have to test for borders. Rows
+ * are then filtered in parallel:
+ * - for small kernels, the values of the window are gathered for a chunk of
+ *   pixels of the row and sorted with a sorting network, see sorting.c;
+ * - for larger ones, the window is a histogram slid along the row as in
+ *   T. S. Huang's algorithm: only the column leaving the window and the one
+ *   entering it are updated, and the median is found from the previous one.
+ *   The histogram has two levels, 256 coarse bins of 256 values, so that the
+ *   median can move by whole coarse bins when it goes far.
+ *   The constant time algorithm of Perreault and Hébert maintains one
+ *   histogram per column of the image, which is not practical for 65536
+ *   levels; the cost here is in the size of the kernel, not its area.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "algos/sorting.h"
+#include "algos/median_filter.h"
+
+#define COARSE_SHIFT 8
+#define COARSE_WIDTH (1 << COARSE_SHIFT)
+#define NB_COARSE (1 << (16 - COARSE_SHIFT))
+
+/* Sorting networks are shared between all users of this file and threads.
+ * They are built on first use and never freed. */
+static sortnet *networks[SORTNET_MAX + 1];
+static gsize networks_init[SORTNET_MAX + 1];
+
+const sortnet *median_network(int n) {
+	if (n < 1 || n > SORTNET_MAX)
+		return NULL;
+	if (g_once_init_enter(&networks_init[n])) {
+		networks[n] = sortnet_new(n);
+		g_once_init_leave(&networks_init[n], 1);
+	}
+	return networks[n];
+}
+
+/* copy of the image with `radius' pixels added on each side, with the value
+ * of the nearest pixel of the image */
+static WORD *pad_image(const WORD *in, int rx, int ry, int radius) {
+	long pw = rx + 2 * radius, ph = ry + 2 * radius;
+	long y;
+	WORD *padded = malloc(pw * ph * sizeof(WORD));
+	if (!padded)
+		return NULL;
+
+	for (y = 0; y < ph; y++) {
+		long sy = y - radius, x;
+		const WORD *src;
+		WORD *dst = padded + y * pw;
+		if (sy < 0) sy = 0;
+		if (sy >= ry) sy = ry - 1;
+		src = in + sy * rx;
+		for (x = 0; x < radius; x++) {
+			dst[x] = src[0];
+			dst[radius + rx + x] = src[rx - 1];
+		}
+		memcpy(dst + radius, src, rx * sizeof(WORD));
+	}
+	return padded;
+}
+
+/* Comparators of the sorting network of n elements that the middle element
+ * depends on, n being odd: the others only order elements that end up on the
+ * same side of the median. */
+static sortnet *median_selection_network(int n) {
+	const sortnet *net = median_network(n);
+	sortnet *sel;
+	gboolean *needed;
+	int c, nb = 0;
+
+	if (!net)
+		return NULL;
+	sel = malloc(sizeof(sortnet));
+	needed = calloc(n, sizeof(gboolean));
+	if (!sel || !needed) {
+		if (sel) free(sel);
+		if (needed) free(needed);
+		return NULL;
+	}
+	sel->n = n;
+	sel->comp = malloc(net->nb_comp * sizeof(*sel->comp));
+	if (!sel->comp) {
+		free(sel);
+		free(needed);
+		return NULL;
+	}
+	needed[n / 2] = TRUE;
+	for (c = net->nb_comp - 1; c >= 0; c--) {
+		int a = net->comp[c][0], b = net->comp[c][1];
+		if (needed[a] || needed[b]) {
+			needed[a] = needed[b] = TRUE;
+			nb++;
+		}
+	}
+	/* second pass to keep them in order */
+	memset(needed, 0, n * sizeof(gboolean));
+	needed[n / 2] = TRUE;
+	sel->nb_comp = nb;
+	for (c = net->nb_comp - 1; c >= 0; c--) {
+		int a = net->comp[c][0], b = net->comp[c][1];
+		if (needed[a] || needed[b]) {
+			needed[a] = needed[b] = TRUE;
+			nb--;
+			sel->comp[nb][0] = a;
+			sel->comp[nb][1] = b;
+		}
+	}
+	free(needed);
+	return sel;
+}
+
+static int median_filter_network(const WORD *padded, WORD *out, int rx, int ry, int ksize) {
+	sortnet *net = median_selection_network(ksize * ksize);
+	long pw = rx + ksize - 1;
+	int y, retval = 0;
+
+	if (!net)
+		return 1;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) private(y)
+#endif
+	{
+		int n = ksize * ksize, i;
+		/* whole chunks are always sorted, so that the loop on pixels has
+		 * a constant length and is vectorized */
+		WORD *scratch = calloc(n * SORTNET_CHUNK, sizeof(WORD));
+		if (!scratch) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+			retval = 1;
+		}
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (y = 0; y < ry; y++) {
+			long start;
+			if (!scratch)
+				continue;
+			for (start = 0; start < rx; start += SORTNET_CHUNK) {
+				long len = rx - start < SORTNET_CHUNK ? rx - start : SORTNET_CHUNK;
+				int dx, dy, c;
+				i = 0;
+				for (dy = 0; dy < ksize; dy++) {
+					const WORD *src = padded + (y + dy) * pw + start;
+					for (dx = 0; dx < ksize; dx++)
+						memcpy(scratch + (i++) * SORTNET_CHUNK, src + dx, len * sizeof(WORD));
+				}
+				for (c = 0; c < net->nb_comp; c++) {
+					WORD *ra = scratch + net->comp[c][0] * SORTNET_CHUNK;
+					WORD *rb = scratch + net->comp[c][1] * SORTNET_CHUNK;
+					int x;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+					for (x = 0; x < SORTNET_CHUNK; x++) {
+						WORD u = ra[x], v = rb[x];
+						ra[x] = u < v ? u : v;
+						rb[x] = u < v ? v : u;
+					}
+				}
+				memcpy(out + (long) y * rx + start, scratch + (n / 2) * SORTNET_CHUNK,
+						len * sizeof(WORD));
+			}
+		}
+		if (scratch) free(scratch);
+	}
+	sortnet_free(net);
+	return retval;
+}
+
+/* sliding window histogram: hist has 65536 bins, coarse sums them by 256;
+ * below is the number of values of the window lower than med */
+struct window_histogram {
+	unsigned int *hist;
+	unsigned int coarse[NB_COARSE];
+	unsigned int below;
+	WORD med;
+};
+
+static inline void histogram_add(struct window_histogram *wh, WORD v) {
+	wh->hist[v]++;
+	wh->coarse[v >> COARSE_SHIFT]++;
+	if (v < wh->med) wh->below++;
+}
+
+static inline void histogram_remove(struct window_histogram *wh, WORD v) {
+	wh->hist[v]--;
+	wh->coarse[v >> COARSE_SHIFT]--;
+	if (v < wh->med) wh->below--;
+}
+
+/* moves med to the value of rank t of the window */
+static inline WORD histogram_rank(struct window_histogram *wh, unsigned int t) {
+	unsigned int med = wh->med, below = wh->below;
+
+	while (below > t) {
+		unsigned int c;
+		med--;
+		c = med >> COARSE_SHIFT;
+		if ((med & (COARSE_WIDTH - 1)) == COARSE_WIDTH - 1 && below - wh->coarse[c] > t) {
+			/* the whole coarse bin is above the median */
+			below -= wh->coarse[c];
+			med = c << COARSE_SHIFT;
+		} else below -= wh->hist[med];
+	}
+	while (below + wh->hist[med] <= t) {
+		unsigned int c = med >> COARSE_SHIFT;
+		if ((med & (COARSE_WIDTH - 1)) == 0 && below + wh->coarse[c] <= t) {
+			/* the whole coarse bin is below the median */
+			below += wh->coarse[c];
+			med += COARSE_WIDTH;
+		} else {
+			below += wh->hist[med];
+			med++;
+		}
+	}
+	wh->med = (WORD) med;
+	wh->below = below;
+	return wh->med;
+}
+
+static int median_filter_histogram(const WORD *padded, WORD *out, int rx, int ry, int ksize) {
+	long pw = rx + ksize - 1;
+	unsigned int t = ksize * ksize / 2;
+	int y, retval = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) private(y)
+#endif
+	{
+		struct window_histogram wh = { 0 };
+		wh.hist = calloc(USHRT_MAX + 1, sizeof(unsigned int));
+		if (!wh.hist) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+			retval = 1;
+		}
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 8)
+#endif
+		for (y = 0; y < ry; y++) {
+			int x, dx, dy;
+			WORD *outrow = out + (long) y * rx;
+			if (!wh.hist)
+				continue;
+			/* the histogram is empty between rows */
+			wh.med = 0;
+			wh.below = 0;
+			for (dy = 0; dy < ksize; dy++) {
+				const WORD *src = padded + (y + dy) * pw;
+				for (dx = 0; dx < ksize; dx++)
+					histogram_add(&wh, src[dx]);
+			}
+			outrow[0] = histogram_rank(&wh, t);
+			for (x = 1; x < rx; x++) {
+				for (dy = 0; dy < ksize; dy++) {
+					const WORD *src = padded + (y + dy) * pw + x;
+					histogram_remove(&wh, src[-1]);
+					histogram_add(&wh, src[ksize - 1]);
+				}
+				outrow[x] = histogram_rank(&wh, t);
+			}
+			for (dy = 0; dy < ksize; dy++) {
+				const WORD *src = padded + (y + dy) * pw + rx - 1;
+				for (dx = 0; dx < ksize; dx++)
+					histogram_remove(&wh, src[dx]);
+			}
+		}
+		if (wh.hist) free(wh.hist);
+	}
+	return retval;
+}
+
+/* Median filter of the rx x ry image in, with a ksize x ksize window, ksize
+ * being odd. Pixels outside the image take the value of the nearest edge
+ * pixel. in and out must not overlap. Returns 0 on success. */
+int median_filter_buffer(const WORD *in, WORD *out, int rx, int ry, int ksize) {
+	WORD *padded;
+	int retval;
+
+	if (ksize < 1 || ksize % 2 == 0 || rx < 1 || ry < 1)
+		return 1;
+	if (ksize == 1) {
+		memcpy(out, in, (long) rx * ry * sizeof(WORD));
+		return 0;
+	}
+	padded = pad_image(in, rx, ry, ksize / 2);
+	if (!padded) {
+		printf("median filter: error allocating data\n");
+		return 1;
+	}
+	if (ksize <= MEDIAN_NETWORK_MAX_KSIZE)
+		retval = median_filter_network(padded, out, rx, ry, ksize);
+	else retval = median_filter_histogram(padded, out, rx, ry, ksize);
+	free(padded);
+	return retval;
+}
+
+/* Median of the pixels of the (2 * radius + 1) square centred on (xx, yy),
+ * taken every step pixels, without the centre and the pixels outside the
+ * image. The mean of the two middle values is rounded for even numbers. */
+WORD median_of_neighbours(const WORD *buf, int xx, int yy, int w, int h,
+		int radius, int step) {
+	WORD stack_values[SORTNET_MAX], *values = stack_values, lo, hi;
+	int x, y, i, n = 0, side = 2 * (radius / step) + 1;
+
+	if (side * side - 1 > SORTNET_MAX) {
+		values = malloc((side * side - 1) * sizeof(WORD));
+		if (!values)
+			return buf[xx + yy * w];
+	}
+	for (y = yy - radius; y <= yy + radius; y += step) {
+		if (y < 0 || y >= h)
+			continue;
+		for (x = xx - radius; x <= xx + radius; x += step) {
+			if (x >= 0 && x < w && (x != xx || y != yy))
+				values[n++] = buf[x + y * w];
+		}
+	}
+	if (n == 0) {
+		if (values != stack_values)
+			free(values);
+		return buf[xx + yy * w];
+	}
+	if (n <= SORTNET_MAX) {
+		sortnet_sort(median_network(n), values);
+		hi = values[n / 2];
+		lo = values[(n - 1) / 2];
+	} else {
+		hi = quickselect_s(values, n, n / 2);
+		lo = hi;
+		if (n % 2 == 0) {
+			lo = values[0];
+			for (i = 1; i < n / 2; i++)
+				if (values[i] > lo) lo = values[i];
+		}
+	}
+	if (values != stack_values)
+		free(values);
+	return (WORD) (((unsigned int) lo + hi + 1) >> 1);
+}
+
+/* Same as median_of_neighbours() for float pixels, without rounding. Areas of
+ * more than SORTNET_MAX neighbours are not handled, the pixel is kept. */
+float median_of_neighbours_f(const float *buf, int xx, int yy, int w, int h,
+		int radius, int step) {
+	double values[SORTNET_MAX];
+	int x, y, n = 0, side = 2 * (radius / step) + 1;
+
+	if (side * side - 1 > SORTNET_MAX)
+		return buf[xx + yy * w];
+	for (y = yy - radius; y <= yy + radius; y += step) {
+		if (y < 0 || y >= h)
+			continue;
+		for (x = xx - radius; x <= xx + radius; x += step) {
+			if (x >= 0 && x < w && (x != xx || y != yy))
+				values[n++] = buf[x + y * w];
+		}
+	}
+	if (n == 0)
+		return buf[xx + yy * w];
+	sortnet_sort_d(median_network(n), values);
+	if (n % 2)
+		return (float) values[n / 2];
+	return (float) (0.5 * (values[n / 2 - 1] + values[n / 2]));
+}
+
+/* Same as median_of_neighbours() for a matrix of double with a row stride,
+ * radius being at most 2 */
+double median_of_neighbours_d(const double *buf, int stride, int xx, int yy, int w, int h,
+		int radius) {
+	double values[SORTNET_MAX];
+	int x, y, n = 0;
+
+	if (radius > 2)
+		radius = 2;
+	for (y = yy - radius; y <= yy + radius; y++) {
+		if (y < 0 || y >= h)
+			continue;
+		for (x = xx - radius; x <= xx + radius; x++) {
+			if (x >= 0 && x < w && (x != xx || y != yy))
+				values[n++] = buf[x + y * stride];
+		}
+	}
+	if (n == 0)
+		return buf[xx + yy * stride];
+	sortnet_sort_d(median_network(n), values);
+	if (n % 2)
+		return values[n / 2];
+	return 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
@@ -0,0 +1,22 @@
+#ifndef SRC_ALGOS_MEDIAN_FILTER_H_
+#define SRC_ALGOS_MEDIAN_FILTER_H_
+
+#include "core/siril.h"
+#include "algos/sorting.h"
+
+/* Above this kernel size, the median of the window is maintained in a
+ * histogram slid along rows instead of being computed by a sorting network */
+#define MEDIAN_NETWORK_MAX_KSIZE 5
+
+const sortnet *median_network(int n);
+
+int median_filter_buffer(const WORD *in, WORD *out, int rx, int ry, int ksize);
+
+WORD median_of_neighbours(const WORD *buf, int xx, int yy, int w, int h,
+		int radius, int step);
+float median_of_neighbours_f(const float *buf, int xx, int yy, int w, int h,
+		int radius, int step);
+double median_of_neighbours_d(const double *buf, int stride, int xx, int yy, int w, int h,
+		int radius);
+
+#endif /* SRC_ALGOS_MEDIAN_FILTER_H_ */
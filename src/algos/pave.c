@@ -71,6 +71,22 @@
 **
 ** extracts a plan from the wavelet transform
 **
+*******************************************************************************
+**
+** pave_2d_plan (Imag, Plan, Nl, Nc, Nbr_Plan, Num_Plan, Type_To)
+** float *Imag, *Plan;
+** int Nl, Nc, Nbr_Plan, Num_Plan;
+** int Type_To;
+**
+** computes only the plan Num_Plan of the wavelet transform, without storing
+** the others
+**
+*******************************************************************************
+**
+** Both scaling functions are separable: images are smoothed by a pass on
+** rows followed by a pass on columns, each pass being run on several rows in
+** parallel. Nothing is shared between calls, they can be run from any thread.
+**
 ******************************************************************************/ 
 
 #include <stdio.h>
@@ -79,62 +95,97 @@
 #include <stdlib.h>
 
 #include "core/siril.h"
+#include "core/proto.h"
 #include "algos/Def_Math.h"
 #include "algos/Def_Mem.h"
 #include "algos/Def_Wavelet.h"
 
 /****************************************************************************/
 
-int static test_ind (ind, N)
-int ind, N;
-{
-    int Val;
-    
-/*    if (ind < 0) Val = - ind;*/
-    if (ind < 0) Val = -0;
-    else
-    {
-/*       if (ind >= N) Val = 2 * (N - 1) - ind;*/
-        if (ind >= N) Val = N - 1;
-        else Val = ind;
-    }
-    return (Val);
+static inline int test_ind(int ind, int N) {
+	if (ind < 0) return 0;
+	if (ind >= N) return N - 1;
+	return ind;
 }
 
 /****************************************************************************/
 
+/* Smooths Imag in Smooth with the separable kernel of 2 * radius + 1 taps,
+ * spaced by Step pixels. Pixels outside the image take the value of the
+ * closest pixel of the border. */
+static int pave_2d_separable_smooth(float *Imag, float *Smooth, int Nl, int Nc,
+		int Step, const float *kernel, int radius) {
+	int i;
+	float *tmp = f_vector_alloc(Nl * Nc);
+	if (tmp == NULL) return 1;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) private(i)
+#endif
+	{
+		/* rows */
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (i = 0; i < Nl; i++) {
+			float *in = Imag + (long) i * Nc, *out = tmp + (long) i * Nc;
+			int j, t, first, last;
+			/* pixels for which all taps are in the row */
+			first = radius * Step < Nc ? radius * Step : Nc;
+			last = Nc - radius * Step > first ? Nc - radius * Step : first;
+			for (j = first; j < last; j++) {
+				float sum = 0.f;
+				for (t = -radius; t <= radius; t++)
+					sum += kernel[t + radius] * in[j + t * Step];
+				out[j] = sum;
+			}
+			/* borders */
+			for (j = 0; j < Nc; j++) {
+				float sum = 0.f;
+				if (j == first)
+					j = last;
+				if (j >= Nc)
+					break;
+				for (t = -radius; t <= radius; t++)
+					sum += kernel[t + radius] * in[test_ind(j + t * Step, Nc)];
+				out[j] = sum;
+			}
+		}
+
+		/* columns: whole rows are combined */
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (i = 0; i < Nl; i++) {
+			float *out = Smooth + (long) i * Nc;
+			int j, t;
+			for (j = 0; j < Nc; j++)
+				out[j] = 0.f;
+			for (t = -radius; t <= radius; t++) {
+				float k = kernel[t + radius];
+				float *in = tmp + (long) test_ind(i + t * Step, Nl) * Nc;
+				for (j = 0; j < Nc; j++)
+					out[j] += k * in[j];
+			}
+		}
+	}
+	free(tmp);
+	return 0;
+}
+
 int pave_2d_linear_smooth (Imag, Smooth, Nl, Nc, Num_Plan)
 float *Imag, *Smooth;
 int Nl, Nc, Num_Plan;
 {
-    int i,j,Step;
-    int indi1,indj1,indi2,indj2;
-
-    Step = pow(2., (float) Num_Plan) + 0.5;
+	static const float kernel[3] = { 0.25f, 0.5f, 0.25f };
+	int Step = pow(2., (float) Num_Plan) + 0.5;
 
-    for (i = 0; i < Nl; i ++)
-    {
-        for (j = 0; j < Nc; j ++)
-        {
-            indi1 = test_ind (i - Step, Nl);
-            indj1 = test_ind (j - Step, Nc);
-            indi2 = test_ind (i + Step, Nl);
-            indj2 = test_ind (j + Step,Nc);
-            Smooth [i * Nc + j] = 1./16. * (   Imag [indi1 * Nc + indj1]
-                                           + Imag [indi1 * Nc + indj2]
-                                           + Imag [indi2 * Nc + indj1]
-                                           + Imag [indi2 * Nc + indj2])
-                               + 1./8. * (   Imag [indi1 * Nc + j]
-                                           + Imag [i * Nc + indj1]
-                                           + Imag [i * Nc + indj2]
-                                           + Imag [indi2 * Nc + j])
-                               + 1./4. * Imag [i * Nc + j];
-
-        }
-    }
-	return 0;
+	return pave_2d_separable_smooth(Imag, Smooth, Nl, Nc, Step, kernel, 1);
 }
 
+static int pave_2d_smooth(float *Imag, float *Smooth, int Nl, int Nc, int Num_Plan,
+		int Type_To);
+
 /***************************************************************************/
 
 int pave_2d_tfo (Pict, Pave, Nl, Nc, Nbr_Plan, Type_To)
@@ -159,17 +210,9 @@ int Type_To;
 		//for (i = 0; i < Nl*Nc; i++) Plan [i] = Imag [i];
 	
 		/* we smooth the image */
-		switch (Type_To) {
-			case TO_PAVE_LINEAR:
-				pave_2d_linear_smooth (Plan, Imag, Nl, Nc, Num_Plan);
-				break;
-			case TO_PAVE_BSPLINE:
-				pave_2d_bspline_smooth (Plan, Imag, Nl, Nc, Num_Plan);
-				break;
-			default:
-				fprintf (stderr, "pave_2d.c: unknown transform\n");
-				exit (-1);
-				break;
+		if (pave_2d_smooth (Plan, Imag, Nl, Nc, Num_Plan, Type_To)) {
+			free ((char *) Imag);
+			return 1;
 		}
 		
 		/* computes  the wavelet transform */
@@ -228,59 +271,69 @@ int pave_2d_bspline_smooth (Imag, Smooth, Nl, Nc, Num_Plan)
 float *Imag, *Smooth;
 int Nl, Nc, Num_Plan;
 {
-	int i,j,Step;
-	int indi1,indj1,indi2,indj2,indi3,indj3,indi4,indj4;
-	
-	Step = pow(2., (float) Num_Plan) + 0.5;
-	
-	for (i = 0; i < Nl; i ++)
-	{
-		for (j = 0; j < Nc; j ++)
-		{
-			indi1 = test_ind (i - Step, Nl);
-			indj1 = test_ind (j - Step, Nc);
-			indi2 = test_ind (i + Step, Nl);
-			indj2 = test_ind (j + Step,Nc);
-			indi3 = test_ind (i - 2 * Step, Nl);
-			indj3 = test_ind (j - 2 * Step,Nc);
-			indi4 = test_ind (i + 2 * Step, Nl);
-			indj4 = test_ind (j + 2 * Step,Nc);
-	
-	
-			Smooth [i * Nc + j] = 0.00390625 * ( Imag [indi3 * Nc + indj3]
-										+ Imag [indi3 * Nc + indj4]
-										+ Imag [indi4 * Nc + indj3]
-										+ Imag [indi4 * Nc + indj4])
-							+ 0.015625 * ( Imag [indi4 * Nc + indj2]
-										+ Imag [indi3 * Nc + indj2]
-										+ Imag [indi4 * Nc + indj1]
-										+ Imag [indi3 * Nc + indj1]
-	
-										+ Imag [indi2 * Nc + indj3]
-										+ Imag [indi2 * Nc + indj4]
-										+ Imag [indi1 * Nc + indj3]
-										+ Imag [indi1 * Nc + indj4])
-	
-							+ 0.0234375 * ( Imag [indi3 * Nc + j]
-										+ Imag [indi4 * Nc + j]
-										+ Imag [i * Nc + indj3]
-										+ Imag [i * Nc + indj4])
-	
-							+ 0.06250 * ( Imag [indi1 * Nc + indj1]
-										+ Imag [indi1 * Nc + indj2]
-										+ Imag [indi2 * Nc + indj1]
-										+ Imag [indi2* Nc + indj2])
-	
-							+ 0.09375 * ( Imag [indi1 * Nc + j]
-										+ Imag [indi2 * Nc + j]
-										+ Imag [i * Nc + indj1]
-										+ Imag [i * Nc + indj2])
-	
-							+ 0.140625 * Imag [i * Nc + j];
-	
-		}
+	static const float kernel[5] = { 0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f };
+	int Step = pow(2., (float) Num_Plan) + 0.5;
+
+	return pave_2d_separable_smooth(Imag, Smooth, Nl, Nc, Step, kernel, 2);
+}
+
+/***************************************************************************/
+
+static int pave_2d_smooth(float *Imag, float *Smooth, int Nl, int Nc, int Num_Plan,
+		int Type_To) {
+	switch (Type_To) {
+		case TO_PAVE_LINEAR:
+			return pave_2d_linear_smooth(Imag, Smooth, Nl, Nc, Num_Plan);
+		case TO_PAVE_BSPLINE:
+			return pave_2d_bspline_smooth(Imag, Smooth, Nl, Nc, Num_Plan);
+		default:
+			fprintf(stderr, "pave_2d.c: unknown transform\n");
+			return 1;
+	}
+}
+
+/***************************************************************************/
+
+int pave_2d_plan(float *Imag, float *Plan, int Nl, int Nc, int Nbr_Plan,
+		int Num_Plan, int Type_To) {
+	long i, n = (long) Nl * Nc;
+	int p;
+	float *cur, *next, *swap;
+
+	if (Num_Plan < 0 || Num_Plan >= Nbr_Plan)
+		return 1;
+	cur = f_vector_alloc(n);
+	next = f_vector_alloc(n);
+	if (cur == NULL || next == NULL) {
+		if (cur) free(cur);
+		if (next) free(next);
+		return 1;
+	}
+	memcpy(cur, Imag, n * sizeof(float));
+
+	/* smoothed images of the planes before the requested one */
+	for (p = 0; p < Num_Plan; p++) {
+		if (pave_2d_smooth(cur, next, Nl, Nc, p, Type_To))
+			goto error;
+		swap = cur; cur = next; next = swap;
+	}
+	if (Num_Plan == Nbr_Plan - 1) {
+		/* the low resolution image */
+		memcpy(Plan, cur, n * sizeof(float));
+	} else {
+		if (pave_2d_smooth(cur, next, Nl, Nc, Num_Plan, Type_To))
+			goto error;
+		for (i = 0; i < n; i++)
+			Plan[i] = cur[i] - next[i];
 	}
+	free(cur);
+	free(next);
 	return 0;
+
+error:
+	free(cur);
+	free(next);
+	return 1;
 }
 
 /****************************************************************************/
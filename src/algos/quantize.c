@@ -42,8 +42,15 @@ static int FnMeanSigma_ushort(WORD *array, long npix, int nullcheck,
 static int FnMeanSigma_int(int *array, long npix, int nullcheck, int nullvalue,
 		long *ngoodpix, double *mean, double *sigma, int *status);
 
-static int FnNoise1_ushort(WORD *array, long nx, long ny, int nullcheck,
-		WORD nullvalue, double *noise, int *status);
+static int FnMeanSigma_double(double *array, long npix, int nullcheck,
+		double nullvalue, long *ngoodpix, double *mean, double *sigma,
+		int *status);
+
+static int FnNoise1_ushort(WORD *array, long nx, long ny, long rowstride,
+		int nullcheck, WORD nullvalue, double *noise, int *status);
+
+static int FnNoise1_float(float *array, long nx, long ny, long rowstride,
+		int nullcheck, float nullvalue, double *noise, int *status);
 
 static int FnNoise5_ushort(WORD *array, long nx, long ny, int nullcheck,
 		WORD nullvalue, long *ngood, WORD *minval, WORD *maxval, double *n2,
@@ -97,7 +104,7 @@ int *status) /* error status */
 	}
 
 	if (noise1) {
-		FnNoise1_ushort(array, nx, ny, nullcheck, nullvalue, &xnoise, status);
+		FnNoise1_ushort(array, nx, ny, nx, nullcheck, nullvalue, &xnoise, status);
 
 		*noise1 = xnoise;
 	}
@@ -189,6 +196,60 @@ int *status) /* error status */
 	return (*status);
 }
 
+/*--------------------------------------------------------------------------*/
+static int FnMeanSigma_double(double *array, /*  2 dimensional array of image pixels */
+long npix, /* number of pixels in the image */
+int nullcheck, /* check for null values, if true */
+double nullvalue, /* value of null pixels, if nullcheck is true */
+
+/* returned parameters */
+
+long *ngoodpix, /* number of non-null pixels in the image */
+double *mean, /* returned mean value of all non-null pixels */
+double *sigma, /* returned R.M.S. value of all non-null pixels */
+int *status) /* error status */
+
+/*
+ Compute mean and RMS sigma of the non-null pixels in the input array.
+ */
+{
+	long ii, ngood = 0;
+	double sum = 0., sum2 = 0., xtemp;
+
+	for (ii = 0; ii < npix; ii++) {
+		if (nullcheck && array[ii] == nullvalue)
+			continue;
+		ngood++;
+		sum += array[ii];
+		sum2 += (array[ii] * array[ii]);
+	}
+
+	if (ngood > 1) {
+		if (ngoodpix)
+			*ngoodpix = ngood;
+		xtemp = sum / ngood;
+		if (mean)
+			*mean = xtemp;
+		if (sigma)
+			*sigma = sqrt((sum2 / ngood) - (xtemp * xtemp));
+	} else if (ngood == 1) {
+		if (ngoodpix)
+			*ngoodpix = 1;
+		if (mean)
+			*mean = sum;
+		if (sigma)
+			*sigma = 0.0;
+	} else {
+		if (ngoodpix)
+			*ngoodpix = 0;
+		if (mean)
+			*mean = 0.;
+		if (sigma)
+			*sigma = 0.;
+	}
+	return (*status);
+}
+
 /*--------------------------------------------------------------------------*/
 static int FnMeanSigma_int(int *array, /*  2 dimensional array of image pixels */
 long npix, /* number of pixels in the image */
@@ -658,6 +719,7 @@ int *status) /* error status */
 static int FnNoise1_ushort(WORD *array, /*  2 dimensional array of image pixels */
 long nx, /* number of pixels in each row of the image */
 long ny, /* number of rows in the image */
+long rowstride, /* number of pixels between the start of two rows in array */
 int nullcheck, /* check for null values, if true */
 WORD nullvalue, /* value of null pixels, if nullcheck is true */
 /* returned parameters */
@@ -669,14 +731,12 @@ int *status) /* error status */
  noise = 1.0 / sqrt(2) * rms of (flux[i] - flux[i-1])
 
  The returned estimate is the median of the values that are computed for each
- row of the image.
+ row of the image. Rows are processed in parallel.
  */
 {
-	int iter;
-	long ii, jj, kk, nrows = 0, nvals;
-	int *differences;
-	WORD *rowpix, v1;
-	double *diffs, xnoise, mean, stdev;
+	long jj, nrows = 0;
+	double *diffs, xnoise;
+	char *valid;
 
 	/* rows must have at least 3 pixels to estimate noise */
 	if (nx < 3) {
@@ -685,23 +745,179 @@ int *status) /* error status */
 	}
 
 	/* allocate arrays used to compute the median and noise estimates */
-	differences = calloc(nx, sizeof(int));
+	diffs = calloc(ny, sizeof(double));
+	valid = calloc(ny, sizeof(char));
+	if (!diffs || !valid) {
+		free(diffs);
+		free(valid);
+		*status = MEMORY_ALLOCATION;
+		return (*status);
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) if(nx * ny > 100000)
+#endif
+	{
+	int iter, local_status = 0;
+	long ii, kk, nvals;
+	WORD *rowpix, v1;
+	double mean, stdev;
+	int *differences = malloc(nx * sizeof(int));
+
+	/* loop over each row of the image */
+#ifdef _OPENMP
+#pragma omp for private(jj) schedule(static)
+#endif
+	for (jj = 0; jj < ny; jj++) {
+		if (!differences)
+			continue;
+
+		rowpix = array + (jj * rowstride); /* point to first pixel in the row */
+
+		/***** find the first valid pixel in row */
+		ii = 0;
+		if (nullcheck)
+			while (ii < nx && rowpix[ii] == nullvalue)
+				ii++;
+
+		if (ii == nx)
+			continue; /* hit end of row */
+		v1 = rowpix[ii]; /* store the good pixel value */
+
+		/* now continue populating the differences arrays */
+		/* for the remaining pixels in the row */
+		nvals = 0;
+		for (ii++; ii < nx; ii++) {
+
+			/* find the next valid pixel in row */
+			if (nullcheck)
+				while (ii < nx && rowpix[ii] == nullvalue)
+					ii++;
+
+			if (ii == nx)
+				break; /* hit end of row */
+
+			/* construct array of 1st order differences */
+			differences[nvals] = v1 - rowpix[ii];
+
+			nvals++;
+			/* shift over 1 pixel */
+			v1 = rowpix[ii];
+		} /* end of loop over pixels in the row */
+
+		if (nvals < 2)
+			continue;
+
+		FnMeanSigma_int(differences, nvals, 0, 0, 0, &mean, &stdev, &local_status);
+
+		if (stdev > 0.) {
+			for (iter = 0; iter < NITER; iter++) {
+				kk = 0;
+				for (ii = 0; ii < nvals; ii++) {
+					if (fabs(differences[ii] - mean) < SIGMA_CLIP * stdev) {
+						if (kk < ii)
+							differences[kk] = differences[ii];
+						kk++;
+					}
+				}
+				if (kk == nvals)
+					break;
+
+				nvals = kk;
+				FnMeanSigma_int(differences, nvals, 0, 0, 0, &mean, &stdev,
+						&local_status);
+			}
+		}
+
+		diffs[jj] = stdev;
+		valid[jj] = 1;
+	} /* end of loop over rows */
 	if (!differences) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
 		*status = MEMORY_ALLOCATION;
+	}
+	free(differences);
+	}
+
+	/* gather the values of the rows that have one */
+	for (jj = 0; jj < ny; jj++) {
+		if (valid[jj])
+			diffs[nrows++] = diffs[jj];
+	}
+
+	/* compute median of the values for each row */
+	if (nrows == 0) {
+		xnoise = 0;
+	} else if (nrows == 1) {
+		xnoise = diffs[0];
+	} else {
+		qsort(diffs, nrows, sizeof(double), FnCompare_double);
+		xnoise = (diffs[(nrows - 1) / 2] + diffs[nrows / 2]) / 2.;
+	}
+
+	*noise = .70710678 * xnoise;
+
+	free(diffs);
+	free(valid);
+
+	return (*status);
+}
+
+/*--------------------------------------------------------------------------*/
+static int FnNoise1_float(float *array, /*  2 dimensional array of image pixels */
+long nx, /* number of pixels in each row of the image */
+long ny, /* number of rows in the image */
+long rowstride, /* number of pixels between the start of two rows in array */
+int nullcheck, /* check for null values, if true */
+float nullvalue, /* value of null pixels, if nullcheck is true */
+/* returned parameters */
+double *noise, /* returned R.M.S. value of all non-null pixels */
+int *status) /* error status */
+/*
+ Same as FnNoise1_ushort, for 32-bit float pixels.
+ */
+{
+	long jj, nrows = 0;
+	double *diffs, xnoise;
+	char *valid;
+
+	/* rows must have at least 3 pixels to estimate noise */
+	if (nx < 3) {
+		*noise = 0;
 		return (*status);
 	}
 
+	/* allocate arrays used to compute the median and noise estimates */
 	diffs = calloc(ny, sizeof(double));
-	if (!diffs) {
-		free(differences);
+	valid = calloc(ny, sizeof(char));
+	if (!diffs || !valid) {
+		free(diffs);
+		free(valid);
 		*status = MEMORY_ALLOCATION;
 		return (*status);
 	}
 
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) if(nx * ny > 100000)
+#endif
+	{
+	int iter, local_status = 0;
+	long ii, kk, nvals;
+	float *rowpix, v1;
+	double mean, stdev;
+	double *differences = malloc(nx * sizeof(double));
+
 	/* loop over each row of the image */
+#ifdef _OPENMP
+#pragma omp for private(jj) schedule(static)
+#endif
 	for (jj = 0; jj < ny; jj++) {
+		if (!differences)
+			continue;
 
-		rowpix = array + (jj * nx); /* point to first pixel in the row */
+		rowpix = array + (jj * rowstride); /* point to first pixel in the row */
 
 		/***** find the first valid pixel in row */
 		ii = 0;
@@ -727,7 +943,7 @@ int *status) /* error status */
 				break; /* hit end of row */
 
 			/* construct array of 1st order differences */
-			differences[nvals] = v1 - rowpix[ii];
+			differences[nvals] = (double) v1 - rowpix[ii];
 
 			nvals++;
 			/* shift over 1 pixel */
@@ -736,33 +952,45 @@ int *status) /* error status */
 
 		if (nvals < 2)
 			continue;
-		else {
-
-			FnMeanSigma_int(differences, nvals, 0, 0, 0, &mean, &stdev, status);
-
-			if (stdev > 0.) {
-				for (iter = 0; iter < NITER; iter++) {
-					kk = 0;
-					for (ii = 0; ii < nvals; ii++) {
-						if (fabs(differences[ii] - mean) < SIGMA_CLIP * stdev) {
-							if (kk < ii)
-								differences[kk] = differences[ii];
-							kk++;
-						}
-					}
-					if (kk == nvals)
-						break;
 
-					nvals = kk;
-					FnMeanSigma_int(differences, nvals, 0, 0, 0, &mean, &stdev,
-							status);
+		FnMeanSigma_double(differences, nvals, 0, 0.0, 0, &mean, &stdev, &local_status);
+
+		if (stdev > 0.) {
+			for (iter = 0; iter < NITER; iter++) {
+				kk = 0;
+				for (ii = 0; ii < nvals; ii++) {
+					if (fabs(differences[ii] - mean) < SIGMA_CLIP * stdev) {
+						if (kk < ii)
+							differences[kk] = differences[ii];
+						kk++;
+					}
 				}
-			}
+				if (kk == nvals)
+					break;
 
-			diffs[nrows] = stdev;
-			nrows++;
+				nvals = kk;
+				FnMeanSigma_double(differences, nvals, 0, 0.0, 0, &mean, &stdev,
+						&local_status);
+			}
 		}
+
+		diffs[jj] = stdev;
+		valid[jj] = 1;
 	} /* end of loop over rows */
+	if (!differences) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		*status = MEMORY_ALLOCATION;
+	}
+	free(differences);
+	}
+
+	/* gather the values of the rows that have one */
+	for (jj = 0; jj < ny; jj++) {
+		if (valid[jj])
+			diffs[nrows++] = diffs[jj];
+	}
 
 	/* compute median of the values for each row */
 	if (nrows == 0) {
@@ -777,10 +1005,25 @@ int *status) /* error status */
 	*noise = .70710678 * xnoise;
 
 	free(diffs);
-	free(differences);
+	free(valid);
 
 	return (*status);
 }
+
+/*--------------------------------------------------------------------------*/
+/* Background noise of an area of an image, rows of which are rowstride pixels
+ * apart in array. Used by statistics() without copying the area. */
+int fits_img_noise_ushort(WORD *array, long nx, long ny, long rowstride,
+		int nullcheck, WORD nullvalue, double *noise, int *status) {
+	return FnNoise1_ushort(array, nx, ny, rowstride, nullcheck, nullvalue,
+			noise, status);
+}
+
+int fits_img_noise_float(float *array, long nx, long ny, long rowstride,
+		int nullcheck, float nullvalue, double *noise, int *status) {
+	return FnNoise1_float(array, nx, ny, rowstride, nullcheck, nullvalue,
+			noise, status);
+}
 /*--------------------------------------------------------------------------*/
 
 static int FnCompare_double(const void *v1, const void *v2) {
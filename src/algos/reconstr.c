@@ -123,9 +123,6 @@ int reget_rawdata(float *Imag, int Nl, int Nc, WORD *buf){
 	double ratio;
 	int i;
 
-	gfit.ry = Nl;
-	gfit.rx = Nc;
-
 	for (i=0;i<Nl*Nc;++i){
 		maximum = max(maximum, im[i]);
 	}
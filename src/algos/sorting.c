@@ -0,0 +1,199 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Median and order statistics engine for WORD data.
+ * The median returned by all functions of this file is identical to the one
+ * obtained by sorting the data with quicksort_s() and calling
+ * gsl_stats_ushort_median_from_sorted_data() with the result stored in a
+ * WORD, i.e. the mean of the two middle values is truncated for even sizes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/siril.h"
+#include "algos/sorting.h"
+
+/* Batcher's odd-even merge sort network, built for the next power of two and
+ * cropped to n elements: comparators touching an index >= n are dropped,
+ * which is equivalent to padding the input with +infinity values that never
+ * move. */
+sortnet *sortnet_new(int n) {
+	int p, k, j, i, N = 1, nb = 0, allocated = 0;
+	sortnet *net;
+
+	if (n < 1 || n > SHRT_MAX)
+		return NULL;
+	net = malloc(sizeof(sortnet));
+	if (!net)
+		return NULL;
+	net->n = n;
+	net->comp = NULL;
+	while (N < n)
+		N <<= 1;
+
+	for (p = 1; p < N; p <<= 1) {
+		for (k = p; k >= 1; k >>= 1) {
+			for (j = k % p; j + k < N; j += 2 * k) {
+				for (i = 0; i < k && i + j + k < N; i++) {
+					if ((i + j) / (2 * p) != (i + j + k) / (2 * p))
+						continue;
+					if (i + j + k >= n)
+						continue;
+					if (nb == allocated) {
+						short (*tmp)[2];
+						allocated = allocated ? allocated * 2 : 64;
+						tmp = realloc(net->comp, allocated * sizeof(*tmp));
+						if (!tmp) {
+							sortnet_free(net);
+							return NULL;
+						}
+						net->comp = tmp;
+					}
+					net->comp[nb][0] = i + j;
+					net->comp[nb][1] = i + j + k;
+					nb++;
+				}
+			}
+		}
+	}
+	net->nb_comp = nb;
+	return net;
+}
+
+void sortnet_free(sortnet *net) {
+	if (!net) return;
+	if (net->comp) free(net->comp);
+	free(net);
+}
+
+/* in-place sort of the array a of net->n elements */
+void sortnet_sort(const sortnet *net, WORD *a) {
+	int c;
+	for (c = 0; c < net->nb_comp; c++) {
+		WORD u = a[net->comp[c][0]];
+		WORD v = a[net->comp[c][1]];
+		a[net->comp[c][0]] = u < v ? u : v;
+		a[net->comp[c][1]] = u < v ? v : u;
+	}
+}
+
+/* same as sortnet_sort() for an array of double */
+void sortnet_sort_d(const sortnet *net, double *a) {
+	int c;
+	for (c = 0; c < net->nb_comp; c++) {
+		double u = a[net->comp[c][0]];
+		double v = a[net->comp[c][1]];
+		a[net->comp[c][0]] = u < v ? u : v;
+		a[net->comp[c][1]] = u < v ? v : u;
+	}
+}
+
+/* Sorts net->n rows for `width' pixels starting at `offset' in each row along
+ * the frame axis: after the call, rows[i][x] <= rows[i+1][x] for each x. */
+void sortnet_sort_rows(const sortnet *net, WORD **rows, long offset, long width) {
+	long start, x;
+	int c;
+
+	for (start = 0; start < width; start += SORTNET_CHUNK) {
+		long len = width - start < SORTNET_CHUNK ? width - start : SORTNET_CHUNK;
+		for (c = 0; c < net->nb_comp; c++) {
+			WORD *ra = rows[net->comp[c][0]] + offset + start;
+			WORD *rb = rows[net->comp[c][1]] + offset + start;
+			for (x = 0; x < len; x++) {
+				WORD u = ra[x], v = rb[x];
+				ra[x] = u < v ? u : v;
+				rb[x] = u < v ? v : u;
+			}
+		}
+	}
+}
+
+/* Computes the median of net->n rows for `width' pixels starting at `offset'
+ * in each row, and stores it in out. Rows are sorted in place along the
+ * frame axis: each comparator is applied to a whole chunk of pixels at once,
+ * which the compiler turns into SIMD min/max instructions. */
+void sortnet_median_rows(const sortnet *net, WORD **rows, long offset, long width, WORD *out) {
+	long start, x;
+	int c, n = net->n;
+
+	for (start = 0; start < width; start += SORTNET_CHUNK) {
+		long len = width - start < SORTNET_CHUNK ? width - start : SORTNET_CHUNK;
+		for (c = 0; c < net->nb_comp; c++) {
+			WORD *ra = rows[net->comp[c][0]] + offset + start;
+			WORD *rb = rows[net->comp[c][1]] + offset + start;
+			for (x = 0; x < len; x++) {
+				WORD u = ra[x], v = rb[x];
+				ra[x] = u < v ? u : v;
+				rb[x] = u < v ? v : u;
+			}
+		}
+		if (n % 2) {
+			WORD *mid = rows[n / 2] + offset + start;
+			memcpy(out + start, mid, len * sizeof(WORD));
+		} else {
+			WORD *lo = rows[n / 2 - 1] + offset + start;
+			WORD *hi = rows[n / 2] + offset + start;
+			for (x = 0; x < len; x++)
+				out[start + x] = (WORD)(((unsigned int)lo[x] + hi[x]) >> 1);
+		}
+	}
+}
+
+/* Returns the k-th smallest element (starting at 0) of a, which is partially
+ * reordered: on return, a[i] <= a[k] for i < k and a[i] >= a[k] for i > k.
+ * This is Hoare's selection algorithm in the formulation of N. Wirth. */
+WORD quickselect_s(WORD *a, int n, int k) {
+	int l = 0, m = n - 1;
+	while (l < m) {
+		WORD x = a[k];
+		int i = l, j = m;
+		do {
+			while (a[i] < x) i++;
+			while (x < a[j]) j--;
+			if (i <= j) {
+				WORD t = a[i];
+				a[i] = a[j];
+				a[j] = t;
+				i++; j--;
+			}
+		} while (i <= j);
+		if (j < k) l = i;
+		if (k < i) m = j;
+	}
+	return a[k];
+}
+
+/* median of the n elements of a, which is modified */
+WORD quickmedian(WORD *a, int n) {
+	int i;
+	WORD hi, lo;
+
+	if (n < 1)
+		return 0;
+	hi = quickselect_s(a, n, n / 2);
+	if (n % 2)
+		return hi;
+	/* the lower middle value is the largest of the lower partition */
+	lo = a[0];
+	for (i = 1; i < n / 2; i++)
+		if (a[i] > lo) lo = a[i];
+	return (WORD)(((unsigned int)lo + hi) >> 1);
+}
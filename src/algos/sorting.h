@@ -0,0 +1,34 @@
+#ifndef SRC_ALGOS_SORTING_H_
+#define SRC_ALGOS_SORTING_H_
+
+#include "core/siril.h"
+
+/* Above this number of elements, sorting networks become slower than the
+ * selection algorithm, their number of comparators growing in n.log²(n) */
+#define SORTNET_MAX 32
+
+/* number of pixels processed together by the comparators of a network, chosen
+ * to keep SORTNET_MAX rows of WORD in L1 cache */
+#define SORTNET_CHUNK 256
+
+/* a sorting network: a fixed list of compare-exchange operations that sorts
+ * any array of n elements, without data-dependent branches */
+typedef struct sorting_network_struct sortnet;
+
+struct sorting_network_struct {
+	int n;			// number of elements sorted by the network
+	int nb_comp;		// number of comparators
+	short (*comp)[2];	// comparators, comp[i][0] < comp[i][1]
+};
+
+sortnet *sortnet_new(int n);
+void sortnet_free(sortnet *net);
+void sortnet_sort(const sortnet *net, WORD *a);
+void sortnet_sort_d(const sortnet *net, double *a);
+void sortnet_sort_rows(const sortnet *net, WORD **rows, long offset, long width);
+void sortnet_median_rows(const sortnet *net, WORD **rows, long offset, long width, WORD *out);
+
+WORD quickselect_s(WORD *a, int n, int k);
+WORD quickmedian(WORD *a, int n);
+
+#endif /* SRC_ALGOS_SORTING_H_ */
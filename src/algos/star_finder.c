@@ -91,6 +91,15 @@ static void get_structure(starFinder *sf) {
 	sf->roundness = gtk_spin_button_get_value(spin_roundness);
 }
 
+/* sets the parameters of the detection to the defaults of the GUI, for the
+ * headless runs that cannot read them from it */
+void starfinder_default_params(starFinder *sf) {
+	memset(sf, 0, sizeof(starFinder));
+	sf->radius = STARFINDER_DEFAULT_RADIUS;
+	sf->sigma = STARFINDER_DEFAULT_SIGMA;
+	sf->roundness = STARFINDER_DEFAULT_ROUNDNESS;
+}
+
 /*
  This is an implementation of a simple peak detector algorithm which
  identifies any pixel that is greater than any of its eight neighbors.
@@ -99,8 +108,17 @@ static void get_structure(starFinder *sf) {
  Copyleft (L) 1998 Kenneth J. Mighell (Kitt Peak National Observatory)
  */
 
-/* returns a NULL-ended array of FWHM info */
+/* returns a NULL-ended array of FWHM info, with the parameters of the
+ * detection taken from the GUI and stored in sf */
 fitted_PSF **peaker(fits *fit, int layer, starFinder *sf, rectangle *area) {
+	get_structure(sf);
+	return peaker_with_params(fit, layer, sf, area);
+}
+
+/* Same as peaker(), with the parameters of the detection already in sf. It
+ * does not access the GUI and can be called from several threads at once,
+ * each with its own starFinder. */
+fitted_PSF **peaker_with_params(fits *fit, int layer, starFinder *sf, rectangle *area) {
 	int nx = fit->rx;
 	int ny = fit->ry;
 	int areaX0 = 0;
@@ -134,7 +152,6 @@ fitted_PSF **peaker(fits *fit, int layer, starFinder *sf, rectangle *area) {
 	gettimeofday(&t_start, NULL);
 
 	results[0] = NULL;
-	get_structure(sf);
 	threshold = Compute_threshold(fit, sf->sigma, layer, &norm, &bg);
 
 	copyfits(fit, wave_fit, CP_ALLOC | CP_FORMAT | CP_COPYA, 0);
@@ -171,7 +188,16 @@ fitted_PSF **peaker(fits *fit, int layer, starFinder *sf, rectangle *area) {
 	}
 
 #ifdef _OPENMP
-#pragma omp parallel for num_threads(com.max_thread) private(y) schedule(static)
+#pragma omp parallel num_threads(com.max_thread)
+#endif
+	{
+	/* the box of data around a candidate, one per thread for all its fits */
+	double *zdata = malloc(4 * sf->radius * sf->radius * sizeof(double));
+	gsl_matrix_view z = gsl_matrix_view_array(zdata, sf->radius * 2, sf->radius * 2);
+	if (!zdata)
+		printf("Memory allocation failed: peaker\n");
+#ifdef _OPENMP
+#pragma omp for private(y) schedule(dynamic, 16)
 #endif
 	for (y = sf->radius + areaY0; y < areaY1 - sf->radius; y++) {
 		int x;
@@ -197,23 +223,22 @@ fitted_PSF **peaker(fits *fit, int layer, starFinder *sf, rectangle *area) {
 						}
 					}
 				}
-				if (bingo && nbstars < MAX_STARS) {
+				if (bingo && zdata && nbstars < MAX_STARS) {
 					int ii, jj, i, j;
 					//~ fprintf(stdout, "Found a probable star at position (%d, %d) with a value of %hu\n", x, y, pixel);
-					gsl_matrix *z = gsl_matrix_alloc(sf->radius * 2, sf->radius * 2);
 					/* FILL z */
 					for (jj = 0, j = y - sf->radius; j < y + sf->radius;
 							j++, jj++) {
 						for (ii = 0, i = x - sf->radius; i < x + sf->radius;
 								i++, ii++) {
-							gsl_matrix_set(z, ii, jj, (double) real_image[j][i]);
+							gsl_matrix_set(&z.matrix, ii, jj, (double) real_image[j][i]);
 						}
 					}
 					/* ****** */
 					/* In this case the angle is not fitted because it
 					 *  slows down the algorithm too much 
 					 * To fit the angle, set the 3rd parameter to TRUE */
-					fitted_PSF *cur_star = psf_global_minimisation(z, bg, layer,
+					fitted_PSF *cur_star = psf_global_minimisation(&z.matrix, bg, layer,
 							FALSE, FALSE);
 					if (cur_star) {
 						psf_update_units(fit, &cur_star);
@@ -232,11 +257,12 @@ fitted_PSF **peaker(fits *fit, int layer, starFinder *sf, rectangle *area) {
 							}
 						}
 					}
-					gsl_matrix_free(z);
 				}
 			}
 		}
 	}
+	free(zdata);
+	}
 
 	if (nbstars == 0) {
 		free(results);
@@ -1,6 +1,11 @@
 #ifndef FINDER_H_
 #define FINDER_H_
 
+/* parameters of the detection when there is no GUI, those of its defaults */
+#define STARFINDER_DEFAULT_RADIUS 7
+#define STARFINDER_DEFAULT_SIGMA 1.0
+#define STARFINDER_DEFAULT_ROUNDNESS 0.6
+
 typedef struct starFinder_struct starFinder;
 
 struct starFinder_struct {
@@ -10,7 +15,9 @@ struct starFinder_struct {
 	int nb_stars;
 };
 
+void starfinder_default_params(starFinder *sf);
 fitted_PSF **peaker(fits *fit, int layer, starFinder *sf, rectangle *area);
+fitted_PSF **peaker_with_params(fits *fit, int layer, starFinder *sf, rectangle *area);
 fitted_PSF *add_star(fits *fit, int layer, int *index);
 int remove_star(int index);
 void sort_stars(fitted_PSF **stars, int total);
@@ -23,149 +23,264 @@
 #include <math.h>
 #include <string.h>
 #include <float.h>
-#include <gsl/gsl_statistics.h>
+#include <stdint.h>
 #include "core/siril.h"
 #include "core/proto.h"
+#include "core/image_pool.h"
 #include "gui/histogram.h"
 
-static void select_area(fits *fit, WORD *data, int layer, rectangle *bounds) {
-	int i, j, k = 0;
-
-	WORD *from = fit->pdata[layer] + (fit->ry - bounds->y - bounds->h) * fit->rx
-			+ bounds->x;
-	int stridefrom = fit->rx - bounds->w;
-
-	for (i = 0; i < bounds->h; ++i) {
-		for (j = 0; j < bounds->w; ++j) {
-			data[k] = *from++;
-			k++;
-		}
-		from += stridefrom;
+/* All statistics are computed from a 65536-bin histogram of the layer, built
+ * in a single parallel pass over the image data, without copying it. Values
+ * being integers, the median, the MAD, the average deviation and the
+ * biweight midvariance computed on the histogram are exact, and so is IKSS,
+ * which only works on ranges of sorted values. Only the background noise,
+ * that depends on the position of pixels, needs another pass.
+ * For 32-bit float images, values are counted in the bin of their rounded
+ * value, so that the order statistics are given with the resolution of 16-bit
+ * data, while the count, extrema, mean and sigma are computed exactly in the
+ * same pass. */
+
+#define HISTO_SIZE (USHRT_MAX + 1)
+
+/* builds the histogram of the area of the layer, or of the whole layer if
+ * selection is NULL. Threads count in their own histogram. */
+static uint32_t *build_histogram(fits *fit, int layer, rectangle *selection) {
+	WORD *from;
+	long nx, ny, y;
+	uint32_t *histo;
+
+	if (selection) {
+		nx = selection->w;
+		ny = selection->h;
+		from = fit->pdata[layer] + (fit->ry - selection->y - selection->h) * fit->rx
+			+ selection->x;
+	} else {
+		nx = fit->rx;
+		ny = fit->ry;
+		from = fit->pdata[layer];
 	}
-}
+	histo = image_buffer_get_zeroed(HISTO_SIZE * sizeof(uint32_t));
+	if (!histo)
+		return NULL;
 
-static double siril_stats_ushort_median(gsl_histogram *histo, const size_t n, int nullcheck) {
-	size_t i;
-	size_t hist_size = gsl_histogram_bins(histo);
-	double sum = 0.0;
-	double median = 0.0;
-	int zero = (nullcheck == 0) ? zero = 0 : 1;
-
-	/* Get the median value without 0 value*/
-	for (i = zero; i < hist_size; i++) {
-		sum += gsl_histogram_get(histo, i);
-		if (sum > ((double) n * 0.5)) {
-			median = (double) i;
-			break;	//we get out of the loop
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) if(nx * ny > 100000)
+#endif
+	{
+		uint32_t *local = image_buffer_get_zeroed(HISTO_SIZE * sizeof(uint32_t));
+		long i, x;
+#ifdef _OPENMP
+#pragma omp for private(y) schedule(static)
+#endif
+		for (y = 0; y < ny; y++) {
+			WORD *row = from + y * fit->rx;
+			if (!local) {	// fallback, slower but correct
+				for (x = 0; x < nx; x++) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+					histo[row[x]]++;
+				}
+				continue;
+			}
+			for (x = 0; x < nx; x++)
+				local[row[x]]++;
+		}
+		if (local) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+			for (i = 0; i < HISTO_SIZE; i++)
+				histo[i] += local[i];
+			image_buffer_release(local, HISTO_SIZE * sizeof(uint32_t));
 		}
 	}
-	return median;
+	return histo;
 }
 
-static double siril_stats_ushort_mad(const WORD* data, const size_t stride,
-		const size_t n, const double m, int nullcheck) {
-	size_t i;
-	double median;
-	gsl_histogram *histo;
-
-	histo = gsl_histogram_alloc(USHRT_MAX + 1);
-	gsl_histogram_set_ranges_uniform(histo, 0, USHRT_MAX);
-	for (i = 0; i < n; i++) {
-		const double delta = fabs(data[i * stride] - m);
-		gsl_histogram_increment(histo, delta);
+/* exact statistics of the float values, computed with their histogram */
+struct float_sums {
+	uint64_t n;
+	double sum, sum2, min, max;
+};
+
+/* builds the histogram of the area of a float layer, see above. With
+ * nullcheck, values equal to zero are ignored. */
+static uint32_t *build_histogram_float(fits *fit, int layer, rectangle *selection,
+		int nullcheck, struct float_sums *sums) {
+	float *from;
+	long nx, ny, y;
+	uint32_t *histo;
+
+	if (selection) {
+		nx = selection->w;
+		ny = selection->h;
+		from = fit->fpdata[layer] + (fit->ry - selection->y - selection->h) * fit->rx
+			+ selection->x;
+	} else {
+		nx = fit->rx;
+		ny = fit->ry;
+		from = fit->fpdata[layer];
 	}
-	median = siril_stats_ushort_median(histo, n, nullcheck);
-	gsl_histogram_free(histo);
-
-	return median;
+	histo = image_buffer_get_zeroed(HISTO_SIZE * sizeof(uint32_t));
+	if (!histo)
+		return NULL;
+	memset(sums, 0, sizeof(struct float_sums));
+	sums->min = DBL_MAX;
+	sums->max = -DBL_MAX;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(com.max_thread) if(nx * ny > 100000)
+#endif
+	{
+		uint32_t *local = image_buffer_get_zeroed(HISTO_SIZE * sizeof(uint32_t));
+		struct float_sums ls = { 0, 0.0, 0.0, DBL_MAX, -DBL_MAX };
+		long i, x;
+#ifdef _OPENMP
+#pragma omp for private(y) schedule(static)
+#endif
+		for (y = 0; y < ny; y++) {
+			float *row = from + y * fit->rx;
+			for (x = 0; x < nx; x++) {
+				double v = (double) row[x];
+				WORD bin;
+				if (nullcheck && row[x] == 0.0f)
+					continue;
+				ls.n++;
+				ls.sum += v;
+				ls.sum2 += v * v;
+				if (v < ls.min) ls.min = v;
+				if (v > ls.max) ls.max = v;
+				bin = round_to_WORD(v);
+				if (local)
+					local[bin]++;
+				else {	// fallback, slower but correct
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+					histo[bin]++;
+				}
+			}
+		}
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		{
+			if (local)
+				for (i = 0; i < HISTO_SIZE; i++)
+					histo[i] += local[i];
+			sums->n += ls.n;
+			sums->sum += ls.sum;
+			sums->sum2 += ls.sum2;
+			if (ls.min < sums->min) sums->min = ls.min;
+			if (ls.max > sums->max) sums->max = ls.max;
+		}
+		image_buffer_release(local, HISTO_SIZE * sizeof(uint32_t));
+	}
+	return histo;
 }
 
-static double siril_stats_double_mad(const double* data, const size_t stride,
-		const size_t n, const double m) {
-	size_t i;
-	double median;
-	double *tmp;
-
-	tmp = calloc(n, sizeof(double));
+/* value of rank k (from 0) in the sorted values of the bins [lo, hi] */
+static double histo_kth(const uint32_t *histo, int lo, int hi, uint64_t k) {
+	uint64_t sum = 0;
+	int i;
 
-	for (i = 0; i < n; i++) {
-		const double delta = fabs(data[i * stride] - m);
-		tmp[i] = delta;
+	for (i = lo; i <= hi; i++) {
+		sum += histo[i];
+		if (sum > k)
+			return (double) i;
 	}
-	quicksort_d(tmp, n);
-	median = gsl_stats_median_from_sorted_data(tmp, 1, n);
-	free(tmp);
-
-	return median;
+	return (double) hi;
 }
 
-static double siril_stats_ushort_bwmv(const WORD* data, const size_t n,
-		const double mad, const double median) {
-
-	double bwmv = 0.0;
-	double up = 0.0, down = 0.0;
-	size_t i;
-
-	if (mad > 0.0) {
-		for (i = 0; i < n; i++) {
-			double yi, ai, yi2;
-
-			yi = ((double) data[i] - median) / (9 * mad);
-			yi2 = yi * yi;
-			ai = (fabs(yi) < 1.0) ? 1.0 : 0.0;
-
-			up += ai * SQR((double ) data[i] - median) * SQR(SQR (1 - yi2));
-			down += (ai * (1 - yi2) * (1 - 5 * yi2));
-
+/* value of rank k (from 0) in the sorted absolute deviations from m of the
+ * values of the bins [lo, hi]. Bins are taken by increasing deviation, from
+ * both sides of m. */
+static double histo_kth_deviation(const uint32_t *histo, int lo, int hi,
+		double m, uint64_t k) {
+	uint64_t sum = 0;
+	int left = (int) floor(m), right = left + 1;
+
+	if (left > hi) left = hi;
+	if (right < lo) right = lo;
+	while (left >= lo || right <= hi) {
+		double dev;
+		if (right > hi || (left >= lo && m - left <= right - m)) {
+			dev = m - left;
+			sum += histo[left--];
+		} else {
+			dev = right - m;
+			sum += histo[right++];
 		}
-
-		bwmv = n * (up / (down * down));
+		if (sum > k)
+			return dev;
 	}
+	return 0.0;
+}
 
-	return bwmv;
+/* median of the values of the bins [lo, hi], averaging the two middle values
+ * for an even number of values, as gsl_stats_median_from_sorted_data does */
+static double histo_median(const uint32_t *histo, int lo, int hi, uint64_t n) {
+	if (n & 1)
+		return histo_kth(histo, lo, hi, n / 2);
+	return 0.5 * (histo_kth(histo, lo, hi, n / 2 - 1) + histo_kth(histo, lo, hi, n / 2));
 }
 
-static double siril_stats_double_bwmv(const double* data, const size_t n,
-		const double mad, const double median) {
+static double histo_mad(const uint32_t *histo, int lo, int hi, uint64_t n, double m) {
+	if (n & 1)
+		return histo_kth_deviation(histo, lo, hi, m, n / 2);
+	return 0.5 * (histo_kth_deviation(histo, lo, hi, m, n / 2 - 1) +
+			histo_kth_deviation(histo, lo, hi, m, n / 2));
+}
 
-	double bwmv = 0.0;
+static double histo_bwmv(const uint32_t *histo, int lo, int hi, uint64_t n,
+		double mad, double median) {
 	double up = 0.0, down = 0.0;
-	size_t i;
-
-	if (mad > 0.0) {
-		for (i = 0; i < n; i++) {
-			double yi, ai, yi2;
-
-			yi = (data[i] - median) / (9 * mad);
-			yi2 = yi * yi;
-			ai = (fabs(yi) < 1.0) ? 1.0 : 0.0;
-
-			up += ai * SQR(data[i] - median) * SQR(SQR (1 - yi2));
-			down += (ai * (1 - yi2) * (1 - 5 * yi2));
-		}
-		bwmv = n * (up / (down * down));
+	int i;
+
+	if (mad <= 0.0)
+		return 0.0;
+	/* only values with |yi| < 1 contribute */
+	int first = (int) ceil(median - 9 * mad), last = (int) floor(median + 9 * mad);
+	if (first < lo) first = lo;
+	if (last > hi) last = hi;
+	for (i = first; i <= last; i++) {
+		double yi, yi2;
+		if (!histo[i])
+			continue;
+		yi = ((double) i - median) / (9 * mad);
+		yi2 = yi * yi;
+		if (fabs(yi) >= 1.0)
+			continue;
+		up += histo[i] * SQR((double) i - median) * SQR(SQR(1 - yi2));
+		down += histo[i] * (1 - yi2) * (1 - 5 * yi2);
 	}
-
-	return bwmv;
+	if (down == 0.0)
+		return 0.0;
+	return n * (up / (down * down));
 }
 
-static int IKSS(double *data, int n, double *location, double *scale) {
-	size_t i, j;
+/* Iterative k-sigma estimator of location and scale, on the values of the
+ * bins [lo, hi]. norm is the normalization value of the image, the original
+ * algorithm working on values in the [0, 1] range. */
+static void IKSS(const uint32_t *histo, int lo, int hi, double norm,
+		double *location, double *scale) {
 	double mad, s, s0, m, xlow, xhigh;
+	uint64_t n;
+	int i;
 
-	quicksort_d(data, n);
-	i = 0;
-	j = n;
-	s0 = 1;
+	s0 = norm;
 	for (;;) {
-		if (j - i < 1) {
+		for (i = lo, n = 0; i <= hi; i++)
+			n += histo[i];
+		if (n < 1) {
 			*location = *scale = 0;
 			break;
 		}
-		m = gsl_stats_median_from_sorted_data(data + i, 1, j - i);
-		mad = siril_stats_double_mad(data + i, 1, j - i, m);
-		s = sqrt(siril_stats_double_bwmv(data + i, j - i, mad, m));
-		if (s < 2E-23) {
+		m = histo_median(histo, lo, hi, n);
+		mad = histo_mad(histo, lo, hi, n, m);
+		s = sqrt(histo_bwmv(histo, lo, hi, n, mad, m));
+		if (s < 2E-23 * norm) {
 			*location = m;
 			*scale = 0;
 			break;
@@ -178,118 +293,121 @@ static int IKSS(double *data, int n, double *location, double *scale) {
 		s0 = s;
 		xlow = m - 4 * s;
 		xhigh = m + 4 * s;
-		while (data[i] < xlow)
-			i++;
-		while (data[j - 1] > xhigh)
-			j--;
+		if (xlow > lo) lo = (int) ceil(xlow);
+		if (xhigh < hi) hi = (int) floor(xhigh);
 	}
-	return 0;
 }
 
-static WORD* reassign_data(WORD *data, int nb, long ngoodpix) {
-	int i, j = 0;
-	WORD *ndata = calloc(ngoodpix, sizeof(WORD));
-
-	for (i = 0; i < nb; i++)
-		if (data[i] > 0) {
-			ndata[j] = data[i];
-			j++;
-		}
-	free(data);
-	return ndata;
-}
-
-/* computes statistics on the given layer of the given image. It creates the
- * histogram to easily extract the median. mean, sigma and noise
- * are computed with a cfitsio function rewritten here.
- * min and max value, average deviation, MAD, Bidweight Midvariance and IKSS are computed with gsl stats.
+/* computes statistics on the given layer of the given image. All values but
+ * the noise come from the histogram of the layer, see above. The noise is
+ * computed with a cfitsio function rewritten in quantize.c.
+ * With nullcheck, pixels with a zero value are ignored.
  */
 imstats* statistics(fits *fit, int layer, rectangle *selection, int option, int nullcheck) {
 	double mean = 0.0;
 	double median = 0.0;
 	double sigma = 0.0;
 	double noise = 0.0;
-	long ngoodpix = 0L;
 	double avgDev = 0.0;
 	double mad = 0.0;
 	double bwmv = 0.0;
 	double location = 0.0, scale = 0.0;
+	double sum = 0.0, sum2 = 0.0, norm;
+	uint64_t ngoodpix = 0;
 	int status = 0;
-	int nx, ny;
-	WORD min = 0, max = 0, *data;
-	gsl_histogram* histo;
-	size_t i, hist_size;
+	int i, min = 0, max = 0;
+	long nx, ny;
+	uint32_t *histo;
+	struct float_sums fsums;
 	imstats* stat = NULL;
 
 	if (selection && selection->h > 0 && selection->w > 0) {
 		nx = selection->w;
 		ny = selection->h;
-		data = calloc(nx * ny, sizeof(WORD));
-		select_area(fit, data, layer, selection);
-		histo = computeHisto_Selection(fit, layer, selection);
 	} else {
+		selection = NULL;
 		nx = fit->rx;
 		ny = fit->ry;
-		data = calloc(nx * ny, sizeof(WORD));
-		histo = computeHisto(fit, layer);
-		memcpy(data, fit->pdata[layer], nx * ny * sizeof(WORD));
 	}
-	hist_size = gsl_histogram_bins(histo);
-
-	/* Calculation of mean, sigma and noise */
-	if (option & STATS_BASIC)
-		fits_img_stats_ushort(data, nx, ny, nullcheck, 0, &ngoodpix, NULL, NULL, &mean,
-			&sigma, &noise, NULL, NULL, NULL, &status);
-	if (status) {
-		free(data);
+	if (fit->type == DATA_FLOAT)
+		histo = build_histogram_float(fit, layer, selection, nullcheck, &fsums);
+	else histo = build_histogram(fit, layer, selection);
+	if (!histo)
 		return NULL;
+	if (nullcheck && fit->type != DATA_FLOAT)
+		histo[0] = 0;
+	norm = (double) get_normalized_value(fit);
+
+	/* count, extrema, mean and sigma */
+	min = -1;
+	for (i = 0; i < HISTO_SIZE; i++) {
+		if (!histo[i])
+			continue;
+		if (min < 0) min = i;
+		max = i;
+		ngoodpix += histo[i];
+		sum += (double) histo[i] * i;
+		sum2 += (double) histo[i] * i * i;
 	}
-	if (ngoodpix == 0L) {
-		free(data);
+	if (ngoodpix == 0) {
+		image_buffer_release(histo, HISTO_SIZE * sizeof(uint32_t));
 		return NULL;
 	}
+	if (fit->type == DATA_FLOAT) {
+		sum = fsums.sum;
+		sum2 = fsums.sum2;
+	}
+	mean = sum / ngoodpix;
+	if (ngoodpix > 1) {
+		double var = sum2 / ngoodpix - mean * mean;
+		sigma = var > 0.0 ? sqrt(var) : 0.0;
+	}
 
-	/* Calculation of median with histogram */
-	if ((option & STATS_BASIC) || (option & STATS_AVGDEV)
-			|| (option & STATS_MAD) || (option & STATS_BWMV))
-		median = siril_stats_ushort_median(histo, ngoodpix, nullcheck);
-	gsl_histogram_free(histo);
-
-	if (nullcheck) {
-		data = reassign_data(data, nx * ny, ngoodpix);
+	/* Calculation of the background noise, on the original data */
+	if (option & STATS_BASIC) {
+		long offset = 0;
+		if (selection)
+			offset = (fit->ry - selection->y - selection->h) * fit->rx + selection->x;
+		if (fit->type == DATA_FLOAT)
+			fits_img_noise_float(fit->fpdata[layer] + offset, nx, ny, fit->rx,
+					nullcheck, 0.0f, &noise, &status);
+		else fits_img_noise_ushort(fit->pdata[layer] + offset, nx, ny, fit->rx,
+				nullcheck, 0, &noise, &status);
+		if (status) {
+			image_buffer_release(histo, HISTO_SIZE * sizeof(uint32_t));
+			return NULL;
+		}
 	}
 
-	if (option & STATS_BASIC)
-		gsl_stats_ushort_minmax(&min, &max, data, 1, ngoodpix);
+	/* median: the value of rank ngoodpix / 2 */
+	if ((option & STATS_BASIC) || (option & STATS_AVGDEV)
+			|| (option & STATS_MAD) || (option & STATS_BWMV))
+		median = histo_kth(histo, min, max, ngoodpix / 2);
 
 	/* Calculation of average absolute deviation from the median */
-	if (option & STATS_AVGDEV)
-		avgDev = gsl_stats_ushort_absdev_m(data, 1, ngoodpix, median);
+	if (option & STATS_AVGDEV) {
+		double dev = 0.0;
+		for (i = min; i <= max; i++)
+			dev += (double) histo[i] * fabs(i - median);
+		avgDev = dev / ngoodpix;
+	}
 
 	/* Calculation of median absolute deviation */
 	if ((option & STATS_MAD) || (option & STATS_BWMV))
-		mad = siril_stats_ushort_mad(data, 1, ngoodpix, median, nullcheck);
+		mad = histo_kth_deviation(histo, min, max, median, ngoodpix / 2);
 
 	/* Calculation of Bidweight Midvariance */
 	if (option & STATS_BWMV)
-		bwmv = siril_stats_ushort_bwmv(data, ngoodpix, mad, median);
+		bwmv = histo_bwmv(histo, min, max, ngoodpix, mad, median);
 
 	/* Calculation of IKSS. Used for stacking */
-	if (option & (STATS_IKSS)) {
-		double *newdata = calloc(ngoodpix, sizeof(double));
-
-		/* we convert in the [0, 1] range */
-		for (i = 0; i < ngoodpix; i++) {
-			newdata[i] = (double) data[i] / ((double) hist_size - 1);
-		}
-		IKSS(newdata, ngoodpix, &location, &scale);
-		/* go back to the original range */
-		location *= ((double) hist_size - 1);
-		scale *= ((double) hist_size - 1);
-		free(newdata);
-	}
+	if (option & (STATS_IKSS))
+		IKSS(histo, min, max, norm, &location, &scale);
 
+	image_buffer_release(histo, HISTO_SIZE * sizeof(uint32_t));
 	stat = malloc(sizeof(imstats));
+	if (!stat)
+		return NULL;
 
 	switch (layer) {
 	case 0:
@@ -307,20 +425,61 @@ imstats* statistics(fits *fit, int layer, rectangle *selection, int option, int
 	}
 
 	stat->total = (nx * ny);
-	stat->ngoodpix = ngoodpix;
+	stat->ngoodpix = (long) ngoodpix;
 	stat->mean = mean;
 	stat->avgDev = avgDev;
 	stat->mad = mad;
 	stat->median = median;
 	stat->sigma = sigma;
 	stat->bgnoise = noise;
-	stat->min = (double) min;
-	stat->max = (double) max;
+	if (fit->type == DATA_FLOAT) {
+		stat->min = fsums.min;
+		stat->max = fsums.max;
+	} else {
+		stat->min = (double) min;
+		stat->max = (double) max;
+	}
 	stat->sqrtbwmv = sqrt(bwmv);
 	stat->location = location;
 	stat->scale = scale;
-	stat->normValue = (double) hist_size - 1;
+	stat->normValue = norm;
 
-	free(data);
 	return stat;
 }
+
+/* Returns the histogram of a layer of a 16-bit image, of USHRT_MAX + 1 bins,
+ * to be released with image_buffer_release(), for the processings that need
+ * to count pixels by value. median and sigma are set to those that statistics()
+ * gives with STATS_BASIC and nullcheck, without computing the noise. Returns
+ * NULL on error or if all pixels are zero. */
+uint32_t *layer_histogram(fits *fit, int layer, double *median, double *sigma) {
+	double sum = 0.0, sum2 = 0.0, mean;
+	uint64_t ngoodpix = 0;
+	uint32_t *histo;
+	int i, min = -1, max = 0;
+
+	histo = build_histogram(fit, layer, NULL);
+	if (!histo)
+		return NULL;
+	for (i = 1; i < HISTO_SIZE; i++) {
+		if (!histo[i])
+			continue;
+		if (min < 0) min = i;
+		max = i;
+		ngoodpix += histo[i];
+		sum += (double) histo[i] * i;
+		sum2 += (double) histo[i] * i * i;
+	}
+	if (ngoodpix == 0) {
+		image_buffer_release(histo, HISTO_SIZE * sizeof(uint32_t));
+		return NULL;
+	}
+	mean = sum / ngoodpix;
+	*sigma = 0.0;
+	if (ngoodpix > 1) {
+		double var = sum2 / ngoodpix - mean * mean;
+		*sigma = var > 0.0 ? sqrt(var) : 0.0;
+	}
+	*median = histo_kth(histo, min, max, ngoodpix / 2);
+	return histo;
+}
@@ -104,6 +104,18 @@
 ** Fc = INPUT:cut-off frequency if the algorithm use the FFT
 ** Nbr_Plan = INPUT:number of scales
 **
+******************************************************************************
+**
+** wavelet_transform_plan (Imag, Nl, Nc, Type_Transform, Nbr_Plan, Num_Plan)
+** float *Imag;
+** int Nl, Nc;
+** int Type_Transform;
+** int Nbr_Plan, Num_Plan;
+**
+** Replaces the image Imag by the plan Num_Plan of its transform in Nbr_Plan
+** scales, computed in memory. Only a trous algorithms (1 and 2) are
+** supported.
+**
 ******************************************************************************/
 
 #include <stdio.h>
@@ -175,6 +187,30 @@ WORD *data;
 
 /*****************************************************************************/
 
+/* test if the number of planes is not too high */
+static int check_nbr_plan(int Nl, int Nc, int Nbr_Plan) {
+	int Min = (Nl < Nc) ? Nl : Nc;
+	int temp = pow(2., (double) Nbr_Plan + 2.) + 0.5;
+	if (Min < temp) {
+		siril_log_message(_("wavelet_transform_data: bad plane number\n"));
+		return 1;
+	}
+	return 0;
+}
+
+int wavelet_transform_plan(float *Imag, int Nl, int Nc, int Type_Transform,
+		int Nbr_Plan, int Num_Plan) {
+	if (check_nbr_plan(Nl, Nc, Nbr_Plan))
+		return 1;
+	if (Type_Transform != TO_PAVE_LINEAR && Type_Transform != TO_PAVE_BSPLINE) {
+		printf("wavelet_transform_plan: wrong transform type\n");
+		return 1;
+	}
+	return pave_2d_plan(Imag, Imag, Nl, Nc, Nbr_Plan, Num_Plan, Type_Transform);
+}
+
+/*****************************************************************************/
+
 int wavelet_transform_data (Imag, Nl, Nc, Wavelet, Type_Transform, Nbr_Plan)
 float *Imag;
 int Nl, Nc;
@@ -183,22 +219,15 @@ int Type_Transform;
 int Nbr_Plan;
 {
 	float *Pave;
-	double Exp;
-	int Size,Min,temp;
+	int Size;
 	
 	Wavelet->Nbr_Ligne = Nl;
 	Wavelet->Nbr_Col = Nc;
 	Wavelet->Nbr_Plan = Nbr_Plan;
 	Wavelet->Type_Wave_Transform = Type_Transform;
 	
-	/* test if the number of planes is not too high */
-	Min = (Nl < Nc) ? Nl : Nc;
-	Exp = (double) Nbr_Plan + 2.;
-	temp = pow(2., Exp) + 0.5;
-	if (Min < temp) {
-		siril_log_message(_("wavelet_transform_data: bad plane number\n"));
+	if (check_nbr_plan(Nl, Nc, Nbr_Plan))
 		return 1;
-	}
 	
 	switch (Type_Transform)	{
 		case TO_PAVE_LINEAR:
@@ -209,7 +238,8 @@ int Nbr_Plan;
 				return 1;
 			}
 			Pave = Wavelet->Pave.Data;
-			pave_2d_tfo (Imag, Pave, Nl, Nc, Nbr_Plan, Type_Transform);
+			if (pave_2d_tfo (Imag, Pave, Nl, Nc, Nbr_Plan, Type_Transform))
+				return 1;
 			break;
 		default:
 			printf("wavelet_transform_data: wrong transform type\n");
@@ -93,7 +93,7 @@ static void align_and_compose() {
 }
 
 int rgb_align(int m) {
-	struct registration_args regargs;
+	struct registration_args regargs = { 0 };
 	struct registration_method *method;
 
 	initialize_methods();
@@ -64,13 +64,13 @@
 static char *word[MAX_COMMAND_WORDS];
 
 command commande[] = {
-	/* name,	nbarg,	usage,			function pointer */
+	/* name,	nbarg,	usage,			function pointer, headless */
 	{"addmax",	1,	"addmax filename",	process_addmax},
 	
 	{"bg", 0, "bg", process_bg},
 	{"bgnoise", 0, "bgnoise", process_bgnoise},
 	
-	{"cd", 1, "cd directory (define the working directory)", process_cd},
+	{"cd", 1, "cd directory (define the working directory)", process_cd, TRUE},
 	{"cdg", 0, "cdg", process_cdg},
 	{"clearstar", 0, "clearstar", process_clearstar},
 	{"contrast", 0, "contrast", process_contrast},
@@ -81,7 +81,7 @@ command commande[] = {
 	{"ddp", 3, "ddp level coef sigma", process_ddp}, 
 	
 	{"entropy", 0, "entropy", process_entropy},
-	{"exit", 0, "exit", process_exit},
+	{"exit", 0, "exit", process_exit, TRUE},
 	{"extract", 1, "extract NbPlans", process_extract},
 	
 	{"fdiv", 2, "fdiv filename scalar", process_fdiv},
@@ -101,7 +101,7 @@ command commande[] = {
 	{"gauss", 1, "gauss sigma ", process_gauss},	
 	//~ {"gauss2", 1, "gauss sigma", process_gauss2},
 
-	{"help", 0, "help", process_help},	
+	{"help", 0, "help", process_help, TRUE},	
 	{"histo", 1, "histo layer (layer=0, 1, 2 with 0: red, 1: green, 2: blue)", process_histo},
 	
 	/* commands oper filename and curent image */
@@ -125,9 +125,11 @@ command commande[] = {
 	
 	{"offset", 1, "offset value", process_offset},
 	
+	{"preprocess", 1, "preprocess sequencename [-bias=filename] [-dark=filename] [-flat=filename] [-opt] [-norm=value] [-float] [-prefix=]", process_preprocess, TRUE},
 	{"psf", 0, "psf", process_psf},
 	
 #ifdef HAVE_OPENCV
+	{"register", 1, "register sequencename [-norot] [-noout] [-layer=number] [-prefix=] [-radius=] [-sigma=] [-roundness=]", process_register, TRUE},
 	{"resample", 1, "resample factor", process_resample},
 #endif	
 	{"rmgreen", 1, "rmgreen type", process_scnr},
@@ -153,12 +155,13 @@ command commande[] = {
 	{"seqfind_cosme_cfa", 2, "seqfind_cosme_cfa cold_sigma hot_sigma", process_findcosme},
 	{"seqpsf", 0, "seqpsf", process_seq_psf},
 #ifdef _OPENMP
-	{"setcpu", 1, "setcpu number", process_set_cpu},
+	{"setcpu", 1, "setcpu number", process_set_cpu, TRUE},
 #endif
 	{"setmag", 1, "setmag magnitude", process_set_mag},
 	{"setmagseq", 1, "setmagseq magnitude", process_set_mag_seq},
 	{"split", 3, "split R G B", process_split},
 	{"stat", 0, "stat", process_stat},
+	{"stack", 1, "stack sequencename [sum|max|min|med|rej [siglow sighigh]] [-norm=add|mul|addscale|mulscale] [-float] [-out=filename]", process_stack, TRUE},
 	{"stackall", 0, "stackall", process_stackall},
 	
 	{"threshlo", 1, "threshlo level", process_threshlo},
@@ -997,7 +1000,10 @@ int process_findstar(int nb){
 	if (!single_image_is_loaded()) return 0;
 	if (isrgb(&gfit)) layer = GLAYER;
 	delete_selected_area();
-	com.stars = peaker(&gfit, layer, &sf, NULL);
+	if (com.headless) {
+		starfinder_default_params(&sf);
+		com.stars = peaker_with_params(&gfit, layer, &sf, NULL);
+	} else com.stars = peaker(&gfit, layer, &sf, NULL);
 	refresh_stars_list(com.stars);
 	return 0;
 }
@@ -1431,6 +1437,8 @@ gpointer stackall_worker(gpointer args) {
 				args.seq = seq;
 				args.filtering_criterion = stack_filter_all;
 				args.nb_images_to_stack = seq->number;
+				args.reglayer = get_default_reglayer(seq);
+				args.use_float = com.float_pipeline;
 				snprintf(filename, 256, "%s%sstacked%s", seq->seqname,
 						ends_with(seq->seqname, "_") ?
 								"" : (ends_with(com.seq.seqname, "-") ? "" : "_"),
@@ -1441,6 +1449,7 @@ gpointer stackall_worker(gpointer args) {
 				if (savefits(filename, &gfit))
 					siril_log_message(_("Could not save the stacking result %s\n"),
 							filename);
+				convert_fit_to_ushort(&gfit);
 
 				free_sequence(seq, TRUE);
 				++number_of_loaded_sequences;
@@ -1460,6 +1469,278 @@ int process_stackall(int nb) {
 	return 0;
 }
 
+/* reads a master frame given to the preprocess command */
+static fits *load_master(const char *filename, sequence *seq) {
+	fits *fit = calloc(1, sizeof(fits));
+	if (!fit)
+		return NULL;
+	if (readfits(filename, fit, NULL)) {
+		siril_log_message(_("Cannot use %s: cannot open the file\n"), filename);
+		free(fit);
+		return NULL;
+	}
+	if (fit->naxes[2] != seq->nb_layers) {
+		siril_log_message(_("Cannot use %s: number of channels is different\n"), filename);
+		clearfits(fit);
+		free(fit);
+		return NULL;
+	}
+	return fit;
+}
+
+static gpointer preprocess_worker(gpointer p) {
+	struct preprocessing_data *args = (struct preprocessing_data *) p;
+	struct timeval t_end;
+	int retval;
+
+	retval = preprocess_images(args);
+	if (!retval) {
+		check_seq(0);	// creates the .seq file of the new sequence
+		gettimeofday(&t_end, NULL);
+		show_time(args->t_start, t_end);
+	}
+	sequence_free_preprocessing_data(args->seq);
+	free_sequence(args->seq, TRUE);
+	free(args);
+	gdk_threads_add_idle(end_generic, NULL);
+	return GINT_TO_POINTER(retval);
+}
+
+int process_preprocess(int nb) {
+	struct preprocessing_data *args;
+	sequence *seq;
+	const char *prefix = "pp_";
+	int i;
+
+	if (get_thread_run()) {
+		siril_log_message(_("Another task is already in progress, ignoring new request.\n"));
+		return 1;
+	}
+	if (!(seq = load_sequence(word[1])))
+		return 1;
+
+	com.preprostatus = 0;
+	args = calloc(1, sizeof(struct preprocessing_data));
+	args->seq = seq;
+	args->autolevel = TRUE;
+	args->normalisation = 1.0f;	// will be updated anyway
+	args->sigma[0] = -1.0;
+	args->sigma[1] = -1.0;
+
+	for (i = 2; i < nb; i++) {
+		if (g_str_has_prefix(word[i], "-bias=")) {
+			if (!(seq->offset = load_master(word[i] + 6, seq)))
+				goto failed;
+			com.preprostatus |= USE_OFFSET;
+		} else if (g_str_has_prefix(word[i], "-dark=")) {
+			if (!(seq->dark = load_master(word[i] + 6, seq)))
+				goto failed;
+			com.preprostatus |= USE_DARK;
+		} else if (g_str_has_prefix(word[i], "-flat=")) {
+			if (!(seq->flat = load_master(word[i] + 6, seq)))
+				goto failed;
+			com.preprostatus |= USE_FLAT;
+		} else if (!strcmp(word[i], "-opt")) {
+			com.preprostatus |= USE_OPTD;
+		} else if (!strcmp(word[i], "-float")) {
+			args->use_float = TRUE;
+		} else if (g_str_has_prefix(word[i], "-norm=")) {
+			args->autolevel = FALSE;
+			args->normalisation = atof(word[i] + 6);
+		} else if (g_str_has_prefix(word[i], "-prefix=")) {
+			prefix = word[i] + 8;
+		} else {
+			siril_log_message(_("Unknown option: %s\n"), word[i]);
+			goto failed;
+		}
+	}
+	if (!(com.preprostatus & (USE_OFFSET | USE_DARK | USE_FLAT))) {
+		siril_log_message(_("No master frame given, nothing to do\n"));
+		goto failed;
+	}
+	seq->ppprefix = strdup(prefix);
+
+	siril_log_color_message(_("Preprocessing...\n"), "red");
+	gettimeofday(&args->t_start, NULL);
+	start_in_new_thread(preprocess_worker, args);
+	return 0;
+
+failed:
+	sequence_free_preprocessing_data(seq);
+	free_sequence(seq, TRUE);
+	free(args);
+	return 1;
+}
+
+#ifdef HAVE_OPENCV
+int process_register(int nb) {
+	struct registration_args *reg_args;
+	sequence *seq;
+	const char *prefix = "r_";
+	int i;
+
+	if (get_thread_run()) {
+		siril_log_message(_("Another task is already in progress, ignoring new request.\n"));
+		return 1;
+	}
+	if (!(seq = load_sequence(word[1])))
+		return 1;
+
+	reg_args = calloc(1, sizeof(struct registration_args));
+	reg_args->func = &register_star_alignment;
+	reg_args->seq = seq;
+	reg_args->process_all_frames = TRUE;
+	reg_args->layer = seq->nb_layers == 3 ? GLAYER : RLAYER;
+	reg_args->interpolation = OPENCV_LANCZOS4;
+	reg_args->run_in_thread = TRUE;
+	starfinder_default_params(&reg_args->sf);
+
+	for (i = 2; i < nb; i++) {
+		if (!strcmp(word[i], "-norot")) {
+			reg_args->translation_only = TRUE;
+		} else if (!strcmp(word[i], "-noout")) {
+			/* the transforms are applied by the stacking */
+			reg_args->no_output = TRUE;
+		} else if (g_str_has_prefix(word[i], "-layer=")) {
+			reg_args->layer = atoi(word[i] + 7);
+			if (reg_args->layer < 0 || reg_args->layer >= seq->nb_layers) {
+				siril_log_message(_("The sequence has no layer %d\n"), reg_args->layer);
+				goto failed;
+			}
+		} else if (g_str_has_prefix(word[i], "-prefix=")) {
+			prefix = word[i] + 8;
+		} else if (g_str_has_prefix(word[i], "-radius=")) {
+			reg_args->sf.radius = atoi(word[i] + 8);
+			if (reg_args->sf.radius < 1 || reg_args->sf.radius > 50) {
+				siril_log_message(_("The star detection radius must be between 1 and 50\n"));
+				goto failed;
+			}
+		} else if (g_str_has_prefix(word[i], "-sigma=")) {
+			reg_args->sf.sigma = atof(word[i] + 7);
+			if (reg_args->sf.sigma < 0.05 || reg_args->sf.sigma > 15.0) {
+				siril_log_message(_("The star detection threshold must be between 0.05 and 15\n"));
+				goto failed;
+			}
+		} else if (g_str_has_prefix(word[i], "-roundness=")) {
+			reg_args->sf.roundness = atof(word[i] + 11);
+			if (reg_args->sf.roundness < 0.0 || reg_args->sf.roundness > 0.9) {
+				siril_log_message(_("The star roundness must be between 0 and 0.9\n"));
+				goto failed;
+			}
+		} else {
+			siril_log_message(_("Unknown option: %s\n"), word[i]);
+			goto failed;
+		}
+	}
+	/* freed by the worker, with the sequence */
+	reg_args->prefix = g_strdup(prefix);
+
+	siril_log_color_message(_("Registration: processing using method: %s\n"),
+			"red", _("Global Star Alignment (deep-sky)"));
+	gettimeofday(&reg_args->t_start, NULL);
+	start_in_new_thread(register_sequence_worker, reg_args);
+	return 0;
+
+failed:
+	free_sequence(seq, TRUE);
+	free(reg_args);
+	return 1;
+}
+#endif
+
+int process_stack(int nb) {
+	struct stacking_args *args;
+	sequence *seq;
+	gchar *output = NULL;
+	int i = 2;
+
+	if (get_thread_run()) {
+		siril_log_message(_("Another task is already in progress, ignoring new request.\n"));
+		return 1;
+	}
+	if (!(seq = load_sequence(word[1])))
+		return 1;
+
+	args = calloc(1, sizeof(struct stacking_args));
+	args->seq = seq;
+	args->method = stack_summing;
+	args->type_of_rejection = NO_REJEC;
+	args->normalize = NO_NORM;
+	args->streaming = com.stack.streaming;
+	args->create_rejmaps = com.stack.rejmaps;
+	args->output_overwrite = TRUE;
+
+	if (nb > 2 && word[2][0] != '-') {
+		i = 3;
+		if (!strcmp(word[2], "sum"))
+			args->method = stack_summing;
+		else if (!strcmp(word[2], "max"))
+			args->method = stack_addmax;
+		else if (!strcmp(word[2], "min"))
+			args->method = stack_addmin;
+		else if (!strcmp(word[2], "med"))
+			args->method = stack_median;
+		else if (!strcmp(word[2], "rej")) {
+			args->method = stack_mean_with_rejection;
+			args->type_of_rejection = WINSORIZED;
+			args->sig[0] = 4.0;
+			args->sig[1] = 3.0;
+			if (nb > 4 && word[3][0] != '-') {
+				args->sig[0] = atof(word[3]);
+				args->sig[1] = atof(word[4]);
+				i = 5;
+			}
+		} else {
+			siril_log_message(_("Unknown stacking method: %s\n"), word[2]);
+			goto failed;
+		}
+	}
+	for (; i < nb; i++) {
+		if (g_str_has_prefix(word[i], "-norm=")) {
+			const char *norm = word[i] + 6;
+			if (!strcmp(norm, "add"))
+				args->normalize = ADDITIVE;
+			else if (!strcmp(norm, "mul"))
+				args->normalize = MULTIPLICATIVE;
+			else if (!strcmp(norm, "addscale"))
+				args->normalize = ADDITIVE_SCALING;
+			else if (!strcmp(norm, "mulscale"))
+				args->normalize = MULTIPLICATIVE_SCALING;
+			else {
+				siril_log_message(_("Unknown normalization: %s\n"), norm);
+				goto failed;
+			}
+		} else if (g_str_has_prefix(word[i], "-out=")) {
+			g_free(output);
+			output = g_strdup(word[i] + 5);
+		} else if (!strcmp(word[i], "-float")) {
+			args->use_float = TRUE;
+		} else {
+			siril_log_message(_("Unknown option: %s\n"), word[i]);
+			goto failed;
+		}
+	}
+	if (args->use_float && !stacking_supports_float(args->method)) {
+		siril_log_message(_("The -float option only applies to sum and rejection stacking, ignoring it\n"));
+		args->use_float = FALSE;
+	}
+	if (!output)
+		output = g_strdup_printf("%s%sstacked%s", seq->seqname,
+				ends_with(seq->seqname, "_") || ends_with(seq->seqname, "-") ?
+						"" : "_", com.ext);
+	/* freed by the worker, with the sequence */
+	args->output_filename = output;
+
+	start_in_new_thread(stack_sequence_worker, args);
+	return 0;
+
+failed:
+	g_free(output);
+	free_sequence(seq, TRUE);
+	free(args);
+	return 1;
+}
+
 
 #ifdef _OPENMP
 int process_set_cpu(int nb){
@@ -1482,7 +1763,8 @@ int process_set_cpu(int nb){
 	}
 	siril_log_message(_("Using now %d logical processors\n"), proc_out);
 	com.max_thread = proc_out;
-	update_spinCPU(0);
+	if (!com.headless)
+		update_spinCPU(0);
 
 	return 0;
 }
@@ -1572,6 +1854,13 @@ static int executeCommand(int wordnb) {
 		}
 	}
 
+	/* without GUI, only the commands that do not use it can run */
+	if (com.headless && !commande[i].headless) {
+		siril_log_message(_("Command '%s' needs the graphical interface and "
+					"cannot be used in headless mode\n"), commande[i].name);
+		return 1;
+	}
+
 	// verify argument count
 	if(wordnb - 1 < commande[i].nbarg) {
 		siril_log_message(_("Usage: %s\n"), commande[i].usage);
@@ -1579,69 +1868,70 @@ static int executeCommand(int wordnb) {
 	}
 
 	// process the command
-	commande[i].process(wordnb);
-	return 0;
+	return commande[i].process(wordnb);
+}
+
+/* Executes the commands of the script file, one per line, '#' starting
+ * comments. In headless mode, each command runs to completion before the next
+ * one is started. Stops at the first error and returns 1. */
+int execute_script(FILE *fp) {
+	int wordnb = 0, i = 0, retval = 0;
+	char *myline;
+#if (_POSIX_C_SOURCE >= 200809L)
+	char * linef = NULL;
+	size_t lenf = 0;
+	ssize_t read;
+	while ((read = getline(&linef, &lenf, fp)) != -1) {
+#else
+	char linef[256];
+	size_t read = sizeof(linef);
+	while (fgets(linef, 256, fp)) {
+#endif
+		++i;
+		if (linef[0] == '#') continue;	// comments
+		if (linef[0] == '\0' || linef[0] == '\n')
+			continue;
+		myline = strdup(linef);
+		parseLine(myline, read, &wordnb);
+		retval = executeCommand(wordnb);
+		free(myline);
+		if (!retval && com.headless)
+			retval = wait_for_processing_thread();
+		if (retval) {
+			siril_log_message(_("Error in line: %d. Exiting batch processing\n"), i);
+			break;
+		}
+	}
+#if (_POSIX_C_SOURCE >= 200809L)
+	free(linef);
+#endif
+	return retval ? 1 : 0;
 }
 
 int processcommand(const char *line) {
-	int wordnb = 0, len, i = 0;
+	int wordnb = 0, len;
 	char *myline;
 
 	if (line[0] == '\0' || line[0] == '\n')
 		return 0;
 	if (line[0] == '@') { // case of files
 		FILE * fp;
-
+		int retval;
 
 		fp = fopen(line + 1, "r");
 		if (fp == NULL) {
 			siril_log_message(_("File [%s] does not exist\n"), line + 1);
 			return 1;
 		}
-#if (_POSIX_C_SOURCE >= 200809L)
-		char * linef = NULL;
-		size_t lenf = 0;
-		ssize_t read;
-		while ((read = getline(&linef, &lenf, fp)) != -1) {
-			++i;
-			if (linef[0] == '#') continue;	// comments
-			if (linef[0] == '\0' || linef[0] == '\n')
-				continue;
-			myline = strdup(linef);
-			parseLine(myline, read, &wordnb);
-			if (executeCommand(wordnb)) {
-				siril_log_message(_("Error in line: %d. Exiting batch processing\n"), i);
-				free(myline);
-				return 1;
-			}
-			free(myline);
-		}
-		free(linef);
-#else
-		char linef[256];
-		while (fgets(linef, 256, fp)) {
-			++i;
-			if (linef[0] == '#') continue;	// comments
-			if (linef[0] == '\0' || linef[0] == '\n')
-				continue;
-			myline = strdup(linef);
-			parseLine(myline, sizeof(linef), &wordnb);
-			if (executeCommand(wordnb)) {
-				siril_log_message(_("Error in line: %d. Exiting batch processing\n"), i);
-				free(myline);
-				fclose(fp);
-				return 1;
-			}
-			free(myline);
-		}
-#endif
-
+		retval = execute_script(fp);
 		fclose(fp);
+		return retval;
 	} else {
 		myline = strdup(line);
 		len = strlen(line);
 		parseLine(myline, len, &wordnb);
 		if (executeCommand(wordnb)) {
+			free(myline);
 			return 1;
 		}
 		free(myline);
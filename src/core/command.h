@@ -4,6 +4,7 @@
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
+#include <stdio.h>
 
 typedef
 struct {
@@ -11,6 +12,7 @@ struct {
 	int nbarg;
 	char usage[128];
 	int (* process)(int);
+	int headless;	// can run without the GUI, in scripts started with siril -s
 } command;
 
 int	process_load(int nb);
@@ -111,6 +113,11 @@ int	process_unset_mag_seq(int nb);
 int	process_unselect(int nb);
 int	process_stat(int nb);
 int	process_stackall(int nb);
+int	process_preprocess(int nb);
+#ifdef HAVE_OPENCV
+int	process_register(int nb);
+#endif
+int	process_stack(int nb);
 #ifdef _OPENMP
 int process_set_cpu(int nb);
 #endif
@@ -125,6 +132,7 @@ int	process_lrgb(int nb);
 int	process_help(int nb);
 int	process_exit(int nb);
 int	process_extract(int nb);
+int	execute_script(FILE *fp);
 int	processcommand(const char *line);
 
 #endif
@@ -0,0 +1,156 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Headless mode, see headless.h. GTK+ is not initialized, so nothing here
+ * or in the commands run by the script may use widgets, and idle functions
+ * queued by the processing threads are never run: the script runner joins
+ * each processing thread instead. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "core/command.h"
+#include "core/initfile.h"
+#include "core/headless.h"
+#include "io/sequence.h"
+#include "gui/callbacks.h"
+
+/* progress is printed when the percentage has changed by this much */
+#define PROGRESS_STEP 5
+
+static void console_log(const char *msg, const char *color) {
+	struct tm *now;
+	time_t now_sec;
+
+	if (msg[0] == '\n' && msg[1] == '\0') {
+		fputc('\n', stdout);
+		return;
+	}
+	now_sec = time(NULL);
+	now = localtime(&now_sec);
+	fprintf(stdout, "%.2d:%.2d:%.2d: %s", now->tm_hour, now->tm_min,
+			now->tm_sec, msg);
+	fflush(stdout);
+}
+
+/* called with com.mutex locked, from any thread */
+static void console_progress(const char *text, double percent) {
+	static gchar *last_text = NULL;
+	static int last_percent = -PROGRESS_STEP;
+	gboolean new_text = FALSE;
+	int pc;
+
+	if (text && text[0] != '\0' && g_strcmp0(text, last_text)) {
+		g_free(last_text);
+		last_text = g_strdup(text);
+		new_text = TRUE;
+	}
+	if (percent < 0.0) {	// PROGRESS_NONE or PROGRESS_PULSATE
+		if (new_text)
+			fprintf(stdout, "progress: %s\n", last_text);
+		return;
+	}
+	pc = (int) (percent * 100.0);
+	if (new_text || pc < last_percent || pc - last_percent >= PROGRESS_STEP ||
+			(pc == 100 && last_percent != 100)) {
+		fprintf(stdout, "progress: %s %d%%\n", last_text ? last_text : "", pc);
+		last_percent = pc;
+	}
+}
+
+static void console_dialog(const char *text, const char *title, const char *icon) {
+	fprintf(stderr, "%s: %s\n", title, text);
+}
+
+const struct report_functions console_report = {
+	console_log, console_progress, console_dialog
+};
+
+static int open_and_run_script(const char *script) {
+	FILE *fp;
+	int retval;
+
+	if (!strcmp(script, "-"))
+		return execute_script(stdin);
+	fp = fopen(script, "r");
+	if (!fp) {
+		siril_log_message(_("File [%s] does not exist\n"), script);
+		return 1;
+	}
+	retval = execute_script(fp);
+	fclose(fp);
+	return retval;
+}
+
+/* Initializes what the commands need without the GTK+ interface, then runs
+ * the script, "-" for standard input, in the directory cwd.
+ * Returns 0 if all commands succeeded. */
+int run_headless(const char *script, const char *cwd) {
+	int retval;
+
+	com.headless = TRUE;
+	com.report = &console_report;
+	com.selected_star = -1;
+	com.stars = NULL;
+	com.uniq = NULL;
+	initialize_sequence(&com.seq, TRUE);
+
+	com.wd = malloc(PATH_MAX + 1);
+	if (!getcwd(com.wd, PATH_MAX)) {
+		free(com.wd);
+		com.wd = NULL;
+	}
+	if (checkinitfile()) {
+		siril_log_message(_("Could not load or create settings file in ~/.siril, exiting.\n"));
+		return 1;
+	}
+	/* the working directory saved in the settings is the one of the
+	 * interface, scripts run where they were started from */
+	if (cwd)
+		changedir(cwd);
+	if (com.ext)
+		com.len_ext = strlen(com.ext);
+	if (com.stack.memory_percent <= 0.0001)
+		com.stack.memory_percent = 0.9;
+
+	siril_log_message(_("Parallel processing %s: Using %d logical processor(s).\n"),
+#ifdef _OPENMP
+			_("enabled"), com.max_thread = omp_get_num_procs()
+#else
+			_("disabled"), com.max_thread = 1
+#endif
+			);
+
+	retval = open_and_run_script(script);
+	if (retval)
+		siril_log_message(_("Script execution failed.\n"));
+	else siril_log_message(_("Script execution finished successfully.\n"));
+	return retval;
+}
@@ -0,0 +1,14 @@
+#ifndef HEADLESS_H_
+#define HEADLESS_H_
+
+#include "core/siril.h"
+
+/* Running Siril without its graphical interface, from a script given with
+ * the -s option. Messages, progress and dialogs are written to the console
+ * through console_report, processing commands run one after the other. */
+
+extern const struct report_functions console_report;
+
+int run_headless(const char *script, const char *cwd);
+
+#endif
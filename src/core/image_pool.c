@@ -0,0 +1,129 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Image buffer pool, see image_pool.h.
+ * Buffers are taken and released once or twice per frame, so a single lock
+ * for all threads costs nothing compared to the processing of the frame. A
+ * request is served by the smallest pooled buffer in its size class, between
+ * the requested size and twice it, so that a small image never holds a buffer
+ * made for a much larger one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "core/image_pool.h"
+#include "core/processing.h"
+
+struct pooled_buffer {
+	void *buf;
+	size_t size;		// usable size, maybe less than allocated
+};
+
+static struct {
+	GMutex mutex;		// static, no initialization needed
+	int nb_buffers;
+	struct pooled_buffer buffers[IMAGE_POOL_MAX_BUFFERS];
+	int nb_reused, nb_allocated;
+} pool;
+
+static int max_pooled_buffers() {
+	int max = IMAGE_POOL_BUFFERS_PER_THREAD * (com.max_thread > 0 ? com.max_thread : 1);
+	return max > IMAGE_POOL_MAX_BUFFERS ? IMAGE_POOL_MAX_BUFFERS : max;
+}
+
+/* Returns a buffer of at least size bytes, from the pool if one fits. */
+void *image_buffer_get(size_t size) {
+	void *buf = NULL;
+	int i, best = -1;
+
+	if (size >= IMAGE_POOL_MIN_SIZE) {
+		g_mutex_lock(&pool.mutex);
+		for (i = 0; i < pool.nb_buffers; i++) {
+			size_t s = pool.buffers[i].size;
+			if (s >= size && s / 2 <= size &&
+					(best < 0 || s < pool.buffers[best].size))
+				best = i;
+		}
+		if (best >= 0) {
+			buf = pool.buffers[best].buf;
+			pool.buffers[best] = pool.buffers[--pool.nb_buffers];
+			pool.nb_reused++;
+		} else pool.nb_allocated++;
+		g_mutex_unlock(&pool.mutex);
+	}
+	if (!buf)
+		buf = malloc(size);
+	return buf;
+}
+
+void *image_buffer_get_zeroed(size_t size) {
+	void *buf = image_buffer_get(size);
+	if (buf)
+		memset(buf, 0, size);
+	return buf;
+}
+
+/* Like realloc, but an empty buffer is taken from the pool. Readers of
+ * images reuse the data of the fits they are given this way. */
+void *image_buffer_realloc(void *buf, size_t size) {
+	if (!buf)
+		return image_buffer_get(size);
+	return realloc(buf, size);
+}
+
+/* Gives buf back to the pool, or frees it if it is small, if the pool is full
+ * or if no processing is running. size is the number of bytes of buf that can
+ * be used. */
+void image_buffer_release(void *buf, size_t size) {
+	if (!buf)
+		return;
+	if (size >= IMAGE_POOL_MIN_SIZE && get_thread_run()) {
+		g_mutex_lock(&pool.mutex);
+		if (pool.nb_buffers < max_pooled_buffers()) {
+			pool.buffers[pool.nb_buffers].buf = buf;
+			pool.buffers[pool.nb_buffers].size = size;
+			pool.nb_buffers++;
+			buf = NULL;
+		}
+		g_mutex_unlock(&pool.mutex);
+	}
+	free(buf);
+}
+
+/* Frees all pooled buffers, called when a processing is finished. */
+void image_pool_flush() {
+	int i;
+	g_mutex_lock(&pool.mutex);
+	for (i = 0; i < pool.nb_buffers; i++)
+		free(pool.buffers[i].buf);
+#ifdef DEBUG
+	if (pool.nb_reused)
+		fprintf(stdout, "image pool: %d buffers reused, %d allocated\n",
+				pool.nb_reused, pool.nb_allocated);
+#endif
+	pool.nb_buffers = 0;
+	pool.nb_reused = 0;
+	pool.nb_allocated = 0;
+	g_mutex_unlock(&pool.mutex);
+}
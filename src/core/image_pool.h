@@ -0,0 +1,30 @@
+#ifndef IMAGE_POOL_H_
+#define IMAGE_POOL_H_
+
+#include <stddef.h>
+
+/* buffers smaller than this are left to malloc */
+#define IMAGE_POOL_MIN_SIZE (64 * 1024)
+/* number of released buffers kept for each processing thread */
+#define IMAGE_POOL_BUFFERS_PER_THREAD 6
+#define IMAGE_POOL_MAX_BUFFERS 128
+
+/* Pool of the large buffers used for image data. When a sequence is
+ * processed, each frame needs buffers of the same sizes as the previous one:
+ * instead of freeing them and paying for new allocations and page faults,
+ * they are released to the pool and given to the next frame, whichever thread
+ * processes it. Buffers are taken from malloc and stay compatible with it, a
+ * pooled buffer may be freed or reallocated by code that does not know the
+ * pool, and any malloc'ed buffer may be released to the pool.
+ * The size given when releasing a buffer may be smaller than its real size,
+ * never larger. Buffers are only kept while a processing thread runs, and the
+ * pool is flushed when it is stopped, so that images processed from the GUI
+ * thread do not leave buffers behind. */
+
+void *image_buffer_get(size_t size);
+void *image_buffer_get_zeroed(size_t size);
+void *image_buffer_realloc(void *buf, size_t size);
+void image_buffer_release(void *buf, size_t size);
+void image_pool_flush();
+
+#endif
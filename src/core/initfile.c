@@ -100,6 +100,7 @@ static int readinitfile() {
 	config_setting_t *prepro_setting = config_lookup(&config, keywords[PRE]);
 	if (prepro_setting) {
 		config_setting_lookup_bool(prepro_setting, "cfa", &com.prepro_cfa);
+		config_setting_lookup_bool(prepro_setting, "float", &com.float_pipeline);
 	}
 
 	/* Registration setting */
@@ -118,6 +119,10 @@ static int readinitfile() {
 				&com.stack.normalisation_method);
 		config_setting_lookup_float(stack_setting, "maxmem",
 				&com.stack.memory_percent);
+		config_setting_lookup_bool(stack_setting, "streaming",
+				&com.stack.streaming);
+		config_setting_lookup_bool(stack_setting, "rejmaps",
+				&com.stack.rejmaps);
 	}
 	if (com.stack.memory_percent <= 0.0001)
 		com.stack.memory_percent = 0.9;
@@ -233,6 +238,9 @@ static void _save_preprocessing(config_t *config, config_setting_t *root) {
 
 	prepro_setting = config_setting_add(prepro_group, "cfa", CONFIG_TYPE_BOOL);
 	config_setting_set_bool(prepro_setting, com.prepro_cfa);
+
+	prepro_setting = config_setting_add(prepro_group, "float", CONFIG_TYPE_BOOL);
+	config_setting_set_bool(prepro_setting, com.float_pipeline);
 }
 
 static void _save_registration(config_t *config, config_setting_t *root) {
@@ -257,6 +265,12 @@ static void _save_stacking(config_t *config, config_setting_t *root) {
 
 	stk_setting = config_setting_add(stk_group, "maxmem", CONFIG_TYPE_FLOAT);
 	config_setting_set_float(stk_setting, com.stack.memory_percent);
+
+	stk_setting = config_setting_add(stk_group, "streaming", CONFIG_TYPE_BOOL);
+	config_setting_set_bool(stk_setting, com.stack.streaming);
+
+	stk_setting = config_setting_add(stk_group, "rejmaps", CONFIG_TYPE_BOOL);
+	config_setting_set_bool(stk_setting, com.stack.rejmaps);
 }
 
 static void _save_photometry(config_t *config, config_setting_t *root) {
@@ -4,25 +4,54 @@
 
 #include "siril.h"
 #include "processing.h"
+#include "scheduler.h"
 #include "proto.h"
 #include "gui/callbacks.h"
 #include "io/sequence.h"
 #include "io/ser.h"
+#include "io/prefetch.h"
+#include "io/journal.h"
+#include "core/image_pool.h"
+
+/* area of the input frame input_idx to read for a partial processing */
+static void get_frame_area(struct generic_seq_args *args, int input_idx, rectangle *area) {
+	area->x = args->area.x;
+	area->y = args->area.y;
+	area->w = args->area.w;
+	area->h = args->area.h;
+	if (args->regdata_for_partial) {
+		int shiftx = args->seq->regparam[args->layer_for_partial][input_idx].shiftx;
+		int shifty = args->seq->regparam[args->layer_for_partial][input_idx].shifty;
+		area->x -= shiftx;
+		area->y += shifty;
+	}
+	// args->area may be modified in hooks
+	enforce_area_in_image(area, args->seq);
+}
 
 // called in start_in_new_thread only
-// works in parallel if the arg->parallel is TRUE for FITS or SER sequences
+// works in parallel if the arg->parallel is TRUE for FITS or SER sequences.
+// If cfitsio is not reentrant, reading and writing of FITS images are done
+// by one thread at a time, but the hooks still run in parallel.
+// Each thread asks the prefetcher for the frame it will process next, so that
+// it is read while the current one is processed.
+// With a journal, frames done by a previous run are skipped, and not read
 gpointer generic_sequence_worker(gpointer p) {
 	struct generic_seq_args *args = (struct generic_seq_args *) p;
 	struct timeval t_start, t_end;
 	int frame;	// output frame index
 	int input_idx;	// index of the frame being processed in the sequence
 	int *index_mapping = NULL;
-	int nb_frames, progress = 0;
+	int nb_frames, progress = 0, nb_skipped = 0;
 	float nb_framesf;
 	int abort = 0;	// variable for breaking out of loop
 	GString *desc;	// temporary string description for logs
 	gchar *msg;	// final string description for logs
 	fits fit;
+	struct task_scheduler *sched = NULL;
+	struct frame_prefetcher *prefetcher = NULL;
+	gboolean serialize_io;
+	GMutex io_lock;
 
 	assert(args);
 	assert(args->seq);
@@ -35,6 +64,11 @@ gpointer generic_sequence_worker(gpointer p) {
 	else 	nb_frames = args->seq->number;
 	nb_framesf = (float)nb_frames + 0.3f;	// leave margin for rounding errors and post processing
 	args->retval = 0;
+#ifdef _OPENMP
+	omp_init_lock(&args->lock);
+#endif
+	g_mutex_init(&io_lock);
+	args->journal = NULL;
 
 	if (args->prepare_hook && args->prepare_hook(args)) {
 		siril_log_message(_("Preparing sequence processing failed.\n"));
@@ -73,18 +107,37 @@ gpointer generic_sequence_worker(gpointer p) {
 		g_free(msg);
 	}
 
-#ifdef _OPENMP
-	omp_init_lock(&args->lock);
-#endif
+	if (args->journal_name && args->has_output &&
+			!args->force_ser_output && args->seq->type == SEQ_REGULAR)
+		args->journal = journal_open(args->seq, args->journal_name, args->journal_params);
+
 	memset(&fit, 0, sizeof(fits));
+	serialize_io = args->seq->type == SEQ_REGULAR && !fits_is_reentrant();
+
+	/* frames are distributed by the scheduler, threads that are
+	 * done with their frames take some of those of slower threads */
+	sched = scheduler_new(nb_frames, com.max_thread);
+	/* one frame read in advance for each thread */
+	prefetcher = prefetcher_new(args->seq, com.max_thread, args->layer_for_partial,
+			args->get_photometry_data_for_partial, serialize_io ? &io_lock : NULL);
+	if (!sched || !prefetcher) {
+		args->retval = 1;
+		goto the_end;
+	}
 
 #ifdef _OPENMP
-#pragma omp parallel for num_threads(com.max_thread) firstprivate(fit) private(input_idx) schedule(static) \
-	if(args->parallel && ((args->seq->type == SEQ_REGULAR && fits_is_reentrant()) || args->seq->type == SEQ_SER))
+#pragma omp parallel num_threads(com.max_thread) firstprivate(fit) private(input_idx, frame) \
+	if(args->parallel && (args->seq->type == SEQ_REGULAR || args->seq->type == SEQ_SER))
 #endif
-	for (frame = 0; frame < nb_frames; frame++) {
+	{
+	int thread = 0;
+#ifdef _OPENMP
+	thread = omp_get_thread_num();
+#endif
+	while ((frame = scheduler_next(sched, thread)) >= 0) {
 		if (!abort) {
 			char filename[256], msg[256];
+			int retval, next;
 			rectangle area = { .x = args->area.x, .y = args->area.y,
 				.w = args->area.w, .h = args->area.h };
 
@@ -101,54 +154,64 @@ gpointer generic_sequence_worker(gpointer p) {
 				continue;
 			}
 
-			if (args->partial_image) {
-				// if we run in parallel, it will not be the same for all
-				// and we don't want to overwrite the original anyway
-				if (args->regdata_for_partial) {
-					int shiftx = args->seq->regparam[args->layer_for_partial][input_idx].shiftx;
-					int shifty = args->seq->regparam[args->layer_for_partial][input_idx].shifty;
-					area.x -= shiftx;
-					area.y += shifty;
-				}
+			if (journal_frame_done(args->journal, input_idx, NULL, 0)) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+				nb_skipped++;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+				progress++;
+				continue;
+			}
 
-				// args->area may be modified in hooks
-				enforce_area_in_image(&area, args->seq);
-				if (seq_read_frame_part(args->seq,
-							args->layer_for_partial,
-							input_idx, &fit, &area,
-							args->get_photometry_data_for_partial))
-				{
-					abort = 1;
-					clearfits(&fit);
-					continue;
-				}
-			} else {
-				if (seq_read_frame(args->seq, input_idx, &fit)) {
-					abort = 1;
-					clearfits(&fit);
-					continue;
-				}
+			// if we run in parallel, it will not be the same for all
+			// and we don't want to overwrite the original anyway
+			if (args->partial_image)
+				get_frame_area(args, input_idx, &area);
+
+			next = scheduler_peek(sched, thread);
+			if (next >= 0) {
+				rectangle next_area;
+				int next_idx = index_mapping ? index_mapping[next] : next;
+				if (args->partial_image)
+					get_frame_area(args, next_idx, &next_area);
+				if (!journal_frame_done(args->journal, next_idx, NULL, 0))
+					prefetcher_request(prefetcher, next_idx,
+							args->partial_image ? &next_area : NULL);
+			}
+
+			retval = prefetcher_get(prefetcher, input_idx,
+					args->partial_image ? &area : NULL, &fit);
+			if (retval) {
+				abort = 1;
+				fits_recycle(&fit);
+				continue;
 			}
 
 			if (args->image_hook(args, input_idx, &fit, &area)) {
 				abort = 1;
-				clearfits(&fit);
+				fits_recycle(&fit);
 				continue;
 			}
 
 			if (args->has_output) {
-				int retval;
+				if (serialize_io)
+					g_mutex_lock(&io_lock);
 				if (args->save_hook)
 					retval = args->save_hook(args, frame, input_idx, &fit);
 				else retval = generic_save(args, frame, input_idx, &fit);
+				if (serialize_io)
+					g_mutex_unlock(&io_lock);
 				if (retval) {
 					abort = 1;
-					clearfits(&fit);
+					fits_recycle(&fit);
 					continue;
 				}
 			}
 
-			clearfits(&fit);
+			fits_recycle(&fit);
 
 #ifdef _OPENMP
 #pragma omp atomic
@@ -158,6 +221,12 @@ gpointer generic_sequence_worker(gpointer p) {
 			set_progress_bar_data(msg, (float)progress / nb_framesf);
 		}
 	}
+	}
+	scheduler_log_stats(sched, args->description);
+	prefetcher_free(prefetcher);
+	prefetcher = NULL;
+	if (nb_skipped)
+		siril_log_message(_("%d images were already processed and up to date, skipped\n"), nb_skipped);
 
 	if (abort) {
 		set_progress_bar_data(_("Sequence processing failed. Check the log."), PROGRESS_RESET);
@@ -175,7 +244,13 @@ the_end:
 #ifdef _OPENMP
 	omp_destroy_lock(&args->lock);
 #endif
+	prefetcher_free(prefetcher);
+	journal_close(args->journal);
+	args->journal = NULL;
+	g_mutex_clear(&io_lock);
+	image_pool_flush();
 	if (index_mapping) free(index_mapping);
+	scheduler_free(sched);
 	if (args->finalize_hook && args->finalize_hook(args)) {
 		siril_log_message(_("Finalizing sequence processing failed.\n"));
 		args->retval = 1;
@@ -248,9 +323,13 @@ int generic_save(struct generic_seq_args *args, int out_index, int in_index, fit
 	if (args->force_ser_output || args->seq->type == SEQ_SER) {
 		return ser_write_frame_from_fit(args->new_ser, fit, out_index);
 	} else {
+		int retval;
 		snprintf(dest, 256, "%s%s%05d%s", args->new_seq_prefix,
 				args->seq->seqname, in_index, com.ext);
-		return savefits(dest, fit);
+		retval = savefits(dest, fit);
+		if (!retval)
+			journal_set_done(args->journal, in_index, dest, NULL);
+		return retval;
 	}
 }
 
@@ -283,6 +362,21 @@ void stop_processing_thread() {
 
 	g_thread_join(com.thread);
 	com.thread = NULL;
+	image_pool_flush();
+}
+
+/* Waits for the processing thread to finish by itself, unlike
+ * stop_processing_thread(). Used by the script runner in headless mode, where
+ * no idle function will run to stop the thread. Returns the thread's retval. */
+int wait_for_processing_thread() {
+	gpointer retval;
+	if (com.thread == NULL)
+		return 0;
+	retval = g_thread_join(com.thread);
+	com.thread = NULL;
+	set_thread_run(FALSE);
+	image_pool_flush();
+	return GPOINTER_TO_INT(retval);
 }
 
 void set_thread_run(gboolean b) {
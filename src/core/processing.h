@@ -51,6 +51,16 @@ struct generic_seq_args {
 	// new output SER if seq->type == SEQ_SER or force_ser_output (internal)
 	struct ser_struct *new_ser;
 
+	// journal of the frames done, so that images which input and output
+	// files did not change since a previous run with the same parameters are
+	// skipped, see io/journal.h. journal_name identifies the processing,
+	// journal_params is everything else the result depends on. NULL for no
+	// journal. Only for FITS sequences with FITS output
+	const char *journal_name;
+	const char *journal_params;
+	// opened journal, save hooks record the frames in it (internal)
+	struct work_journal *journal;
+
 	// user data: pointer to operation-specific data
 	void *user;
 
@@ -76,6 +86,7 @@ int seq_filter_included(sequence *seq, int nb_img, double any);
 
 void start_in_new_thread(gpointer(*f)(gpointer p), gpointer p);
 void stop_processing_thread();
+int wait_for_processing_thread();
 void set_thread_run(gboolean b);
 gboolean get_thread_run();
 gboolean end_generic(gpointer arg);
@@ -18,8 +18,11 @@
 
 /****************** image_format_fits.h ******************/
 int	readfits(const char *filename, fits *fit, char *realname);
+int	convert_fit_to_float(fits *fit);
+int	convert_fit_to_ushort(fits *fit);
 char*	list_header(fits *fit);
 void	clearfits(fits *);
+void	fits_recycle(fits *);
 void	report_fits_error(int status);
 int	readfits_partial(const char *filename, int layer, fits *fit, const rectangle *area, gboolean read_date);
 int	read_opened_fits_partial(sequence *seq, int layer, int index, WORD *buffer, const rectangle *area);
@@ -132,6 +135,10 @@ int fits_img_stats_ushort(WORD *array, long nx, long ny, int nullcheck,
 		WORD nullvalue, long *ngoodpix, WORD *minvalue, WORD *maxvalue,
 		double *mean, double *sigma, double *noise1, double *noise2, double *noise3,
 		double *noise5, int *status);
+int fits_img_noise_ushort(WORD *array, long nx, long ny, long rowstride,
+		int nullcheck, WORD nullvalue, double *noise, int *status);
+int fits_img_noise_float(float *array, long nx, long ny, long rowstride,
+		int nullcheck, float nullvalue, double *noise, int *status);
 
 /****************** siril.h ******************/
 /* crop sequence data from GUI */
@@ -193,11 +200,13 @@ void 	mirrorx(fits *fit, gboolean verbose);
 void 	mirrory(fits *fit, gboolean verbose);
 void 	fits_rotate_pi(fits *fit);
 int	lrgb(fits *l, fits *r, fits *g, fits *b, fits *lrgb);
+int preprocess_images(struct preprocessing_data *args);
 gpointer seqpreprocess(gpointer empty);
 void	initialize_preprocessing();
 double	background(fits* fit, int reqlayer, rectangle *selection);
 int backgroundnoise(fits* fit, double sigma[]);
 imstats* statistics(fits *, int, rectangle *, int, int);
+uint32_t *layer_histogram(fits *fit, int layer, double *median, double *sigma);
 void	show_FITS_header(fits *);
 #ifdef HAVE_OPENCV
 int	verbose_resize_gaussian(fits *, int, int, int);
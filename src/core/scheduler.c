@@ -0,0 +1,184 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Task scheduler with work stealing, see scheduler.h.
+ * It is used inside an OpenMP parallel region, instead of a parallel for:
+ *
+ *	sched = scheduler_new(nb_tasks, com.max_thread);
+ *	#pragma omp parallel num_threads(com.max_thread) private(task)
+ *	{
+ *		while ((task = scheduler_next(sched, omp_get_thread_num())) >= 0) {
+ *			... process task, continue works as in a loop ...
+ *		}
+ *	}
+ *	scheduler_log_stats(sched, "Stacking");
+ *	scheduler_free(sched);
+ *
+ * Tasks are expected to be long, reading a frame or a block of frames, so a
+ * single lock protects all ranges. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "core/scheduler.h"
+#include "gui/callbacks.h"
+
+struct task_scheduler *scheduler_new(int nb_tasks, int nb_threads) {
+	struct task_scheduler *sched;
+	int i;
+
+	if (nb_threads < 1)
+		nb_threads = 1;
+	sched = calloc(1, sizeof(struct task_scheduler));
+	if (!sched)
+		return NULL;
+	sched->nb_tasks = nb_tasks;
+	sched->nb_threads = nb_threads;
+	sched->ranges = calloc(nb_threads, sizeof(struct task_range));
+	sched->duration = calloc(nb_tasks > 0 ? nb_tasks : 1, sizeof(gint64));
+	sched->thread_of_task = calloc(nb_tasks > 0 ? nb_tasks : 1, sizeof(int));
+	if (!sched->ranges || !sched->duration || !sched->thread_of_task) {
+		scheduler_free(sched);
+		return NULL;
+	}
+	for (i = 0; i < nb_tasks; i++)
+		sched->thread_of_task[i] = -1;
+	/* the same initial distribution as schedule(static) */
+	for (i = 0; i < nb_threads; i++) {
+		sched->ranges[i].next = (int)((gint64)nb_tasks * i / nb_threads);
+		sched->ranges[i].end = (int)((gint64)nb_tasks * (i + 1) / nb_threads);
+		sched->ranges[i].current = -1;
+	}
+	g_mutex_init(&sched->mutex);
+	sched->start = g_get_monotonic_time();
+	return sched;
+}
+
+/* moves the second half of the largest remaining range to the range of thief,
+ * which is empty. Called with the lock held. Returns FALSE if there is
+ * nothing left to steal. */
+static gboolean steal_tasks(struct task_scheduler *sched, int thief) {
+	int i, victim = -1, largest = 0, half;
+
+	for (i = 0; i < sched->nb_threads; i++) {
+		int remaining = sched->ranges[i].end - sched->ranges[i].next;
+		if (i != thief && remaining > largest) {
+			largest = remaining;
+			victim = i;
+		}
+	}
+	if (victim < 0)
+		return FALSE;
+	/* a victim that has not started yet is probably not running at all */
+	if (sched->ranges[victim].nb_done == 0 && sched->ranges[victim].current < 0)
+		half = largest;
+	else half = (largest + 1) / 2;
+	sched->ranges[thief].end = sched->ranges[victim].end;
+	sched->ranges[thief].next = sched->ranges[victim].end - half;
+	sched->ranges[victim].end -= half;
+	sched->ranges[thief].nb_stolen += half;
+	return TRUE;
+}
+
+/* Ends the task that thread was running, if any, and returns the next task
+ * it has to run, or -1 if all tasks have been distributed. */
+int scheduler_next(struct task_scheduler *sched, int thread) {
+	struct task_range *range;
+	gint64 now = g_get_monotonic_time();
+	int task = -1;
+
+	if (thread >= sched->nb_threads)
+		return -1;	// should not happen, num_threads is the limit
+	range = &sched->ranges[thread];
+	g_mutex_lock(&sched->mutex);
+	if (range->current >= 0) {
+		sched->duration[range->current] = now - range->task_start;
+		sched->thread_of_task[range->current] = thread;
+		range->busy += now - range->task_start;
+		range->nb_done++;
+		range->current = -1;
+	}
+	if (range->next < range->end || steal_tasks(sched, thread)) {
+		task = range->next++;
+		range->current = task;
+		range->task_start = now;
+	}
+	g_mutex_unlock(&sched->mutex);
+	return task;
+}
+
+/* Returns the task that thread will probably run after the current one, to
+ * start reading its data in advance, or -1 if it has none in its range. */
+int scheduler_peek(struct task_scheduler *sched, int thread) {
+	int task = -1;
+
+	if (thread >= sched->nb_threads)
+		return -1;
+	g_mutex_lock(&sched->mutex);
+	if (sched->ranges[thread].next < sched->ranges[thread].end)
+		task = sched->ranges[thread].next;
+	g_mutex_unlock(&sched->mutex);
+	return task;
+}
+
+/* Prints the activity of each thread on the standard output and a summary of
+ * the distribution of tasks in the log. */
+void scheduler_log_stats(struct task_scheduler *sched, const char *description) {
+	gint64 wall = g_get_monotonic_time() - sched->start;
+	gint64 total = 0, shortest = G_MAXINT64, longest = 0;
+	int i, nb_stolen = 0, nb_done = 0, nb_active = 0;
+
+	for (i = 0; i < sched->nb_tasks; i++) {
+		if (sched->thread_of_task[i] < 0)
+			continue;	// not run
+		total += sched->duration[i];
+		if (sched->duration[i] < shortest) shortest = sched->duration[i];
+		if (sched->duration[i] > longest) longest = sched->duration[i];
+	}
+	for (i = 0; i < sched->nb_threads; i++) {
+		struct task_range *range = &sched->ranges[i];
+		if (range->nb_done == 0) continue;
+		fprintf(stdout, "%s: thread %d ran %d tasks (%d stolen), busy %.1f%% of the time\n",
+				description, i, range->nb_done, range->nb_stolen,
+				wall > 0 ? 100.0 * range->busy / wall : 0.0);
+		nb_stolen += range->nb_stolen;
+		nb_done += range->nb_done;
+		nb_active++;
+	}
+	if (nb_done == 0)
+		return;
+	siril_log_message(_("%s: %d tasks on %d threads, %d stolen. Task time: "
+				"%.1f ms min, %.1f ms mean, %.1f ms max. Parallel efficiency: %.0f%%\n"),
+			description, nb_done, nb_active, nb_stolen, shortest / 1000.0,
+			total / 1000.0 / nb_done, longest / 1000.0,
+			wall > 0 ? 100.0 * total / ((double)wall * nb_active) : 100.0);
+}
+
+void scheduler_free(struct task_scheduler *sched) {
+	if (!sched) return;
+	g_mutex_clear(&sched->mutex);
+	if (sched->ranges) free(sched->ranges);
+	if (sched->duration) free(sched->duration);
+	if (sched->thread_of_task) free(sched->thread_of_task);
+	free(sched);
+}
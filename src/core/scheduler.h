@@ -0,0 +1,39 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <glib.h>
+
+/* Distribution of independent tasks, numbered from 0 to nb_tasks - 1, to the
+ * threads of a parallel region. Each thread first gets a contiguous range of
+ * tasks, like a static schedule, and takes them in order. A thread that has
+ * no task left steals the second half of the largest remaining range, so that
+ * threads slowed down by I/O do not leave the others idle at the end.
+ * Threads that never ask for tasks, when the region runs on fewer threads
+ * than planned, have their whole range stolen. */
+
+struct task_range {
+	int next, end;		// tasks [next, end) remain for the thread
+	int nb_done;		// number of tasks run by the thread
+	int nb_stolen;		// number of tasks it stole from others
+	int current;		// task being run, -1 if none
+	gint64 task_start;	// start time of current, in µs
+	gint64 busy;		// time spent in tasks, in µs
+};
+
+struct task_scheduler {
+	int nb_tasks;
+	int nb_threads;
+	struct task_range *ranges;	// one per thread
+	gint64 *duration;		// duration of each task, in µs
+	int *thread_of_task;		// thread that has run each task
+	gint64 start;			// creation time of the scheduler
+	GMutex mutex;
+};
+
+struct task_scheduler *scheduler_new(int nb_tasks, int nb_threads);
+int scheduler_next(struct task_scheduler *sched, int thread);
+int scheduler_peek(struct task_scheduler *sched, int thread);
+void scheduler_log_stats(struct task_scheduler *sched, const char *description);
+void scheduler_free(struct task_scheduler *sched);
+
+#endif
@@ -55,7 +55,9 @@
 #include "algos/Def_Math.h"
 #include "algos/Def_Wavelet.h"
 #include "algos/cosmetic_correction.h"
+#include "algos/median_filter.h"
 #include "io/ser.h"
+#include "io/journal.h"
 
 #define MAX_ITER 15
 #define EPSILON 1E-4
@@ -109,6 +111,33 @@ int nozero(fits *fit, int level) {
 /* equivalent to (map simple_operation a), with simple_operation being
  * (lambda (pixel) (oper pixel scalar))
  * oper is a for addition, s for substraction (i for difference) and so on. */
+/* same as soper() for float images, not rounded */
+static int soper_float(fits *a, double scalar, char oper) {
+	long i, n = a->rx * a->ry * a->naxes[2];
+	float *buf = a->fdata;
+	float s = (float) scalar;
+
+	if (oper == OPER_DIV) {
+		s = (float) (1.0 / scalar);
+		oper = OPER_MUL;
+	}
+	switch (oper) {
+	case OPER_ADD:
+		for (i = 0; i < n; ++i)
+			buf[i] += s;
+		break;
+	case OPER_SUB:
+		for (i = 0; i < n; ++i)
+			buf[i] -= s;
+		break;
+	case OPER_MUL:
+		for (i = 0; i < n; ++i)
+			buf[i] *= s;
+		break;
+	}
+	return 0;
+}
+
 int soper(fits *a, double scalar, char oper) {
 	WORD *gbuf;
 	int i, layer;
@@ -116,6 +145,9 @@ int soper(fits *a, double scalar, char oper) {
 
 	assert(n > 0);
 
+	if (a->type == DATA_FLOAT)
+		return soper_float(a, scalar, oper);
+
 	for (layer = 0; layer < a->naxes[2]; ++layer) {
 		gbuf = a->pdata[layer];
 		switch (oper) {
@@ -144,6 +176,36 @@ int soper(fits *a, double scalar, char oper) {
 	return 0;
 }
 
+/* same as imoper() for a float image a, b being 16-bit or float, not rounded */
+static int imoper_float(fits *a, fits *b, char oper) {
+	long i, n = a->rx * a->ry;
+	int layer;
+
+	for (layer = 0; layer < a->naxes[2]; ++layer) {
+		float *gbuf = a->fpdata[layer];
+		const float *fbuf = b->type == DATA_FLOAT ? b->fpdata[layer] : NULL;
+		const WORD *buf = b->pdata[layer];
+		for (i = 0; i < n; ++i) {
+			float v = fbuf ? fbuf[i] : (float) buf[i];
+			switch (oper) {
+			case OPER_ADD:
+				gbuf[i] += v;
+				break;
+			case OPER_SUB:
+				gbuf[i] -= v;
+				break;
+			case OPER_MUL:
+				gbuf[i] *= v;
+				break;
+			case OPER_DIV:
+				gbuf[i] = v == 0.0f ? 0.0f : gbuf[i] / v;
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
 /* applies operation of image a with image b, for all their layers:
  * a = a oper b
  * returns 0 on success */
@@ -156,6 +218,12 @@ int imoper(fits *a, fits *b, char oper) {
 				a->rx, b->rx, a->ry, b->ry);
 		return 1;
 	}
+	if (a->type == DATA_FLOAT)
+		return imoper_float(a, b, oper);
+	if (b->type == DATA_FLOAT) {
+		siril_log_message(_("imoper: a 32-bit float image cannot be applied to a 16-bit image\n"));
+		return 1;
+	}
 	for (layer = 0; layer < a->naxes[2]; ++layer) {
 		WORD *buf = b->pdata[layer];
 		WORD *gbuf = a->pdata[layer];
@@ -943,45 +1011,256 @@ static double goldenSectionSearch(fits *brut, fits *dark, double a, double b,
 	return ((b + a) / 2);
 }
 
-static int preprocess(fits *brut, fits *offset, fits *dark, fits *flat, float level) {
+/* Master frames, prepared once for the calibration of all images */
+struct calibration_data {
+	struct preprocessing_data *args;
+	fits *offset, *dark, *flat;
+	fits *dark_sub;		// for dark optimization: first layer of dark, minus offset
+	double *flat_coef[3];	// normalisation / flat, for each layer of the flat
+	struct deviant_neighbours *dev;	// for cosmetic correction, found in the dark
+	long icold, ihot;
+};
+
+static void free_calibration_data(struct calibration_data *cal) {
+	int layer;
+	if (cal->dark_sub) {
+		clearfits(cal->dark_sub);
+		free(cal->dark_sub);
+	}
+	for (layer = 0; layer < 3; layer++)
+		if (cal->flat_coef[layer])
+			free(cal->flat_coef[layer]);
+	deviant_neighbours_free(cal->dev);
+	free(cal);
+}
 
-	if (com.preprostatus & USE_OFFSET) {
-		imoper(brut, offset, OPER_SUB);
+static struct calibration_data *prepare_calibration_data(struct preprocessing_data *args,
+		fits *offset, fits *dark, fits *flat) {
+	struct calibration_data *cal;
+	int layer;
+
+	cal = calloc(1, sizeof(struct calibration_data));
+	if (!cal)
+		return NULL;
+	cal->args = args;
+	cal->offset = offset;
+	cal->dark = dark;
+	cal->flat = flat;
+
+	if ((com.preprostatus & USE_OPTD) && (com.preprostatus & USE_DARK)) {
+		cal->dark_sub = calloc(1, sizeof(fits));
+		if (!cal->dark_sub) {
+			free_calibration_data(cal);
+			return NULL;
+		}
+		new_fit_image(cal->dark_sub, dark->rx, dark->ry, 1);
+		copyfits(dark, cal->dark_sub, CP_ALLOC | CP_EXTRACT, 0);
+		if (com.preprostatus & USE_OFFSET)
+			imoper(cal->dark_sub, offset, OPER_SUB);
 	}
 
-	/* if dark optimization, the master-dark has already been subtracted */
-	if ((com.preprostatus & USE_DARK) && !(com.preprostatus & USE_OPTD)) {
-		imoper(brut, dark, OPER_SUB);
+	/* the division by the flat becomes a multiplication */
+	if (com.preprostatus & USE_FLAT) {
+		for (layer = 0; layer < flat->naxes[2]; layer++) {
+			WORD *buf = flat->pdata[layer];
+			long i, n = flat->rx * flat->ry;
+			cal->flat_coef[layer] = malloc(n * sizeof(double));
+			if (!cal->flat_coef[layer]) {
+				siril_log_message(_("Out of memory - aborting\n"));
+				free_calibration_data(cal);
+				return NULL;
+			}
+			for (i = 0; i < n; i++)
+				// avoid division by 0
+				cal->flat_coef[layer][i] = (double) args->normalisation /
+					(double) (buf[i] == 0 ? 1 : buf[i]);
+		}
 	}
 
-	if (com.preprostatus & USE_FLAT) {
-		fdiv(brut, flat, level);
+	if ((com.preprostatus & USE_COSME) && (com.preprostatus & USE_DARK)) {
+		if (dark->naxes[2] == 1) {
+			deviant_pixel *dev = find_deviant_pixels(dark, args->sigma,
+					&cal->icold, &cal->ihot);
+			if (dev) {
+				cal->dev = deviant_neighbours_new(dev, cal->icold + cal->ihot,
+						dark->rx, dark->ry, args->is_cfa);
+				free(dev);
+			}
+			siril_log_message(_("%ld pixels corrected (%ld + %ld)\n"),
+					cal->icold + cal->ihot, cal->icold, cal->ihot);
+		} else
+			siril_log_message(_("Darkmap cosmetic correction "
+						"is only supported with single channel images\n"));
 	}
+	return cal;
+}
 
-	return 0;
+static gboolean same_size(fits *a, fits *b, const char *what) {
+	if (a->rx != b->rx || a->ry != b->ry) {
+		siril_log_message(_("%s: images don't have the same size (w = %u|%u, h = %u|%u)\n"),
+				what, a->rx, b->rx, a->ry, b->ry);
+		return FALSE;
+	}
+	return TRUE;
 }
 
-static int darkOptimization(fits *brut, fits *dark, fits *offset) {
+/* Subtracts the master-dark multiplied by the coefficient that minimizes the
+ * background noise of the result */
+static int darkOptimization(struct calibration_data *cal, fits *brut) {
 	double k;
 	double lo = 0.0;
 	double up = 2.0;
+	long i, n = brut->rx * brut->ry;
+	int layer;
 
-	fits *dark_tmp = calloc(1, sizeof(fits));
-	new_fit_image(dark_tmp, dark->rx, dark->ry, 1);
-	copyfits(dark, dark_tmp, CP_ALLOC | CP_EXTRACT, 0);
+	if (!same_size(brut, cal->dark_sub, "Dark optimization"))
+		return 1;
 
-	/* Minimization of background noise to find better k */
-	k = goldenSectionSearch(brut, dark_tmp, lo, up, 1E-3);
+	/* Minimization of background noise to find better k, on the master-dark
+	 * as it was given, the offset being subtracted from the image later */
+	k = goldenSectionSearch(brut, cal->dark, lo, up, 1E-3);
 
 	siril_log_message(_("Dark optimization: %.3lf\n"), k);
-	/* Multiply coefficient to master-dark */
+	/* Multiply coefficient to master-dark, without copying it */
+	for (layer = 0; layer < brut->naxes[2]; layer++) {
+		WORD *buf = brut->pdata[layer], *dbuf = cal->dark_sub->data;
+		for (i = 0; i < n; i++)
+			buf[i] = round_to_WORD(buf[i] - round_to_WORD((double) dbuf[i] * k));
+	}
+	return 0;
+}
+
+/* Offset and dark subtraction and flat division in a single pass over the
+ * image. Intermediate results are clipped as if operations were done one
+ * after the other. */
+static int preprocess(struct calibration_data *cal, fits *brut) {
+	gboolean use_offset = FALSE, use_dark = FALSE, use_flat = FALSE;
+	long n = brut->rx * brut->ry;
+	int layer;
+
 	if (com.preprostatus & USE_OFFSET)
-		imoper(dark_tmp, offset, OPER_SUB);
-	soper(dark_tmp, k, OPER_MUL);
-	imoper(brut, dark_tmp, OPER_SUB);
+		use_offset = same_size(brut, cal->offset, "imoper");
 
-	clearfits(dark_tmp);
+	/* if dark optimization, the master-dark has already been subtracted */
+	if ((com.preprostatus & USE_DARK) && !(com.preprostatus & USE_OPTD))
+		use_dark = same_size(brut, cal->dark, "imoper");
+
+	if (com.preprostatus & USE_FLAT) {
+		if (brut->rx != cal->flat->rx || brut->ry != cal->flat->ry ||
+				brut->naxes[2] != cal->flat->naxes[2]) {
+			fprintf(stderr, "Wrong size or channel count: %u=%u? / %u=%u?\n", brut->rx,
+					cal->flat->rx, brut->ry, cal->flat->ry);
+		} else use_flat = TRUE;
+	}
+	if (!use_offset && !use_dark && !use_flat)
+		return 0;
+
+	for (layer = 0; layer < brut->naxes[2]; layer++) {
+		WORD *buf = brut->pdata[layer];
+		WORD *obuf = use_offset ? cal->offset->pdata[layer] : NULL;
+		WORD *dbuf = use_dark ? cal->dark->pdata[layer] : NULL;
+		double *coef = use_flat ? cal->flat_coef[layer] : NULL;
+		long i;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if(!omp_in_parallel())
+#endif
+		for (i = 0; i < n; i++) {
+			int v = buf[i];
+			if (obuf) {
+				v -= obuf[i];
+				if (v < 0) v = 0;
+			}
+			if (dbuf) {
+				v -= dbuf[i];
+				if (v < 0) v = 0;
+			}
+			if (coef)
+				buf[i] = round_to_WORD((double) v * coef[i]);
+			else buf[i] = (WORD) v;
+		}
+	}
+	return 0;
+}
+
+/* Same as darkOptimization() and preprocess() together, for a result in
+ * 32-bit float: brut, 16-bit, is converted and calibrated in place. The
+ * optimized master-dark is not rounded and values are only clipped to the
+ * [0, 65535] range, at the end. */
+static int preprocess_float(struct calibration_data *cal, fits *brut) {
+	gboolean use_offset = FALSE, use_dark = FALSE, use_flat = FALSE;
+	double k = 1.0;
+	long n = brut->rx * brut->ry;
+	int layer;
+
+	if (com.preprostatus & USE_OFFSET)
+		use_offset = same_size(brut, cal->offset, "imoper");
+
+	if (com.preprostatus & USE_DARK) {
+		if (com.preprostatus & USE_OPTD) {
+			use_dark = same_size(brut, cal->dark_sub, "Dark optimization");
+			if (use_dark) {
+				k = goldenSectionSearch(brut, cal->dark, 0.0, 2.0, 1E-3);
+				siril_log_message(_("Dark optimization: %.3lf\n"), k);
+			}
+		} else use_dark = same_size(brut, cal->dark, "imoper");
+	}
 
+	if (com.preprostatus & USE_FLAT) {
+		if (brut->rx != cal->flat->rx || brut->ry != cal->flat->ry ||
+				brut->naxes[2] != cal->flat->naxes[2]) {
+			fprintf(stderr, "Wrong size or channel count: %u=%u? / %u=%u?\n", brut->rx,
+					cal->flat->rx, brut->ry, cal->flat->ry);
+		} else use_flat = TRUE;
+	}
+
+	if (convert_fit_to_float(brut))
+		return 1;
+
+	for (layer = 0; layer < brut->naxes[2]; layer++) {
+		float *buf = brut->fpdata[layer];
+		WORD *obuf = use_offset ? cal->offset->pdata[layer] : NULL;
+		WORD *dbuf = NULL;
+		double *coef = use_flat ? cal->flat_coef[layer] : NULL;
+		float dk = (float) k;
+		long i;
+
+		/* the optimized dark is the first layer of the dark, minus offset */
+		if (use_dark)
+			dbuf = (com.preprostatus & USE_OPTD) ? cal->dark_sub->data :
+				cal->dark->pdata[layer];
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if(!omp_in_parallel())
+#endif
+		for (i = 0; i < n; i++) {
+			float v = buf[i];
+			if (obuf)
+				v -= (float) obuf[i];
+			if (dbuf)
+				v -= dk * (float) dbuf[i];
+			if (v < 0.0f)
+				v = 0.0f;
+			if (coef)
+				v = (float) ((double) v * coef[i]);
+			buf[i] = v > USHRT_MAX_SINGLE ? USHRT_MAX_SINGLE : v;
+		}
+	}
+	return 0;
+}
+
+/* the complete calibration of an image */
+static int calibrate_image(struct calibration_data *cal, fits *fit) {
+	if (cal->args->use_float) {
+		if (preprocess_float(cal, fit))
+			return 1;
+	} else {
+		if ((com.preprostatus & USE_OPTD) && (com.preprostatus & USE_DARK))
+			darkOptimization(cal, fit);
+
+		preprocess(cal, fit);
+	}
+
+	if (cal->dev)
+		correct_deviant_pixels(fit, cal->dev);
 	return 0;
 }
 
@@ -1015,23 +1294,87 @@ static gboolean end_sequence_prepro(gpointer p) {
 	return FALSE;
 }
 
-/* doing the preprocessing. No unprotected GTK+ calls can go there.
- * returns 1 on error */
-gpointer seqpreprocess(gpointer p) {
+static int prepro_image_hook(struct generic_seq_args *args, int i, fits *fit, rectangle *_) {
+	struct calibration_data *cal = (struct calibration_data *) args->user;
+	return calibrate_image(cal, fit);
+}
+
+/* output images keep the name of the input image, with the prefix */
+static int prepro_save_hook(struct generic_seq_args *args, int out_index, int in_index, fits *fit) {
+	char source_filename[256], dest_filename[256];
+
+	if (args->seq->type == SEQ_SER) {
+		/* frames are written at their position in the file, so the
+		 * output is ordered whatever the thread that wrote them.
+		 * SER files only store integers. */
+		if (convert_fit_to_ushort(fit))
+			return 1;
+		return ser_write_frame_from_fit(args->new_ser, fit, out_index);
+	}
+
+	seq_get_image_filename(args->seq, in_index, source_filename);
+	snprintf(dest_filename, 255, "%s%s", args->new_seq_prefix, source_filename);
+	dest_filename[255] = '\0';
+	if (savefits(dest_filename, fit))
+		return 1;
+	journal_set_done(args->journal, in_index, dest_filename, NULL);
+	return 0;
+}
+
+static void checksum_master(GChecksum *checksum, const char *name, fits *master) {
+	gchar *header;
+	size_t n;
+
+	if (!master) return;
+	n = master->rx * master->ry * master->naxes[2];
+	header = g_strdup_printf("%s %u %u %ld %d", name, master->rx, master->ry,
+			master->naxes[2], master->type);
+	g_checksum_update(checksum, (const guchar *) header, -1);
+	g_free(header);
+	if (master->type == DATA_FLOAT && master->fdata)
+		g_checksum_update(checksum, (const guchar *) master->fdata, n * sizeof(float));
+	else if (master->data)
+		g_checksum_update(checksum, (const guchar *) master->data, n * sizeof(WORD));
+}
+
+/* everything the calibrated images depend on, except the input images, for
+ * the journal of the calibration of a sequence */
+static gchar *get_calibration_params(struct calibration_data *cal) {
+	struct preprocessing_data *args = cal->args;
+	GChecksum *checksum;
+	gchar *params;
+
+	checksum = g_checksum_new(G_CHECKSUM_MD5);
+	checksum_master(checksum, "offset", (com.preprostatus & USE_OFFSET) ? cal->offset : NULL);
+	checksum_master(checksum, "dark", (com.preprostatus & USE_DARK) ? cal->dark : NULL);
+	checksum_master(checksum, "flat", (com.preprostatus & USE_FLAT) ? cal->flat : NULL);
+	params = g_strdup_printf("%d %d %.9g %.9g %.9g %d %d %s %s", com.preprostatus,
+			args->autolevel, args->normalisation, args->sigma[0], args->sigma[1],
+			args->is_cfa, args->use_float, args->seq->ppprefix,
+			g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+	return params;
+}
+
+/* Calibrates the sequence args->seq, or the loaded image if it is NULL, with
+ * the master frames attached to it, in the calling thread. No unprotected
+ * GTK+ calls can go there. Returns 0 on success. */
+int preprocess_images(struct preprocessing_data *args) {
 	char dest_filename[256], msg[256];
 	fits *dark, *offset, *flat;
-	struct preprocessing_data *args = (struct preprocessing_data *) p;
-
-	if (single_image_is_loaded()) {
+	struct calibration_data *cal;
+	int retval = 0;
+
+	if (args->seq) {
+		dark = args->seq->dark;
+		offset = args->seq->offset;
+		flat = args->seq->flat;
+	} else if (single_image_is_loaded()) {
 		dark = com.uniq->dark;
 		offset = com.uniq->offset;
 		flat = com.uniq->flat;
-	} else if (sequence_is_loaded()) {
-		dark = com.seq.dark;
-		offset = com.seq.offset;
-		flat = com.seq.flat;
 	} else
-		return GINT_TO_POINTER(1);
+		return 1;
 
 	if (com.preprostatus & USE_FLAT) {
 		if (args->autolevel) {
@@ -1040,7 +1383,7 @@ gpointer seqpreprocess(gpointer p) {
 			imstats *stat = statistics(flat, RLAYER, NULL, STATS_BASIC, STATS_ZERO_NULLCHECK);
 			if (!stat) {
 				siril_log_message(_("Error: no data computed.\n"));
-				return GINT_TO_POINTER(1);
+				return 1;
 			}
 			args->normalisation = stat->mean;
 			siril_log_message(_("Normalisation value auto evaluated: %.2lf\n"),
@@ -1049,31 +1392,18 @@ gpointer seqpreprocess(gpointer p) {
 		}
 	}
 
-	if (single_image_is_loaded()) {
+	cal = prepare_calibration_data(args, offset, dark, flat);
+	if (!cal)
+		return 1;
+	if (args->use_float)
+		siril_log_message(_("Calibrated images will be saved in 32-bit float\n"));
+
+	if (!args->seq) {
 		snprintf(msg, 255, _("Pre-processing image %s"), com.uniq->filename);
 		msg[255] = '\0';
 		set_progress_bar_data(msg, 0.5);
 
-		if ((com.preprostatus & USE_OPTD) && (com.preprostatus & USE_DARK))
-			darkOptimization(com.uniq->fit, dark, offset);
-
-		preprocess(com.uniq->fit, offset, dark, flat, args->normalisation);
-
-		if ((com.preprostatus & USE_COSME) && (com.preprostatus & USE_DARK)) {
-			if (dark->naxes[2] == 1) {
-			/* Cosmetic correction */
-			long icold, ihot;
-			deviant_pixel *dev = find_deviant_pixels(dark, args->sigma, &icold, &ihot);
-			siril_log_message(_("%ld pixels corrected (%ld + %ld)\n"),
-					icold + ihot, icold, ihot);
-			cosmeticCorrection(com.uniq->fit, dev, icold + ihot, args->is_cfa);
-			if (dev)
-				free(dev);
-			}
-			else
-				siril_log_message(_("Darkmap cosmetic correction "
-						"is only supported with single channel images\n"));
-		}
+		calibrate_image(cal, com.uniq->fit);
 
 		gchar *filename = g_path_get_basename(com.uniq->filename);
 		char *filename_noext = remove_ext_from_filename(filename);
@@ -1083,90 +1413,48 @@ gpointer seqpreprocess(gpointer p) {
 		msg[255] = '\0';
 		set_progress_bar_data(msg, PROGRESS_NONE);
 		savefits(dest_filename, com.uniq->fit);
+		/* the loaded image is displayed in 16 bits */
+		convert_fit_to_ushort(com.uniq->fit);
 		g_free(filename);
 		free(filename_noext);
 	} else {	// sequence
-		struct ser_struct *new_ser_file = NULL;
-		char source_filename[256];
-		int i;
-		long icold = 0L, ihot = 0L;
-		deviant_pixel *dev = NULL;
-
-		// creating a SER file if the input data is SER
-		if (com.seq.type == SEQ_SER) {
-			char new_ser_filename[256];
-			new_ser_file = calloc(1, sizeof(struct ser_struct));
-			snprintf(new_ser_filename, 255, "%s%s", com.seq.ppprefix, com.seq.ser_file->filename);
-			ser_create_file(new_ser_filename, new_ser_file, TRUE, com.seq.ser_file);
-		}
-
-		if ((com.preprostatus & USE_COSME) && (com.preprostatus & USE_DARK)) {
-			if (dark->naxes[2] == 1) {
-				dev = find_deviant_pixels(dark, args->sigma, &icold, &ihot);
-				siril_log_message(_("%ld pixels corrected (%ld + %ld)\n"),
-						icold + ihot, icold, ihot);
-			} else
-				siril_log_message(_("Darkmap cosmetic correction "
-						"is only supported with single channel images\n"));
-		}
-
-		fits *fit = calloc(1, sizeof(fits));
+		/* Images are read, calibrated and written by all threads, so
+		 * that reading and writing of some images overlap with the
+		 * calibration of others. */
+		struct generic_seq_args *seqargs = calloc(1, sizeof(struct generic_seq_args));
+		gchar *params = get_calibration_params(cal);
+		seqargs->seq = args->seq;
+		seqargs->nb_filtered_images = args->seq->number;
+		seqargs->prepare_hook = ser_prepare_hook;
+		seqargs->image_hook = prepro_image_hook;
+		seqargs->save_hook = prepro_save_hook;
+		seqargs->finalize_hook = ser_finalize_hook;
+		seqargs->description = _("Preprocessing");
+		seqargs->has_output = TRUE;
+		seqargs->new_seq_prefix = args->seq->ppprefix;
+		/* an interrupted calibration is resumed */
+		seqargs->journal_name = "preprocess";
+		seqargs->journal_params = params;
+		seqargs->user = cal;
+		seqargs->already_in_a_thread = TRUE;
+		seqargs->parallel = TRUE;
+
+		generic_sequence_worker(seqargs);
+		retval = seqargs->retval;
+		free(seqargs);
+		g_free(params);
+	}
+	free_calibration_data(cal);
+	return retval;
+}
 
-		for (i = 0; i < com.seq.number; i++) {
-			if (!get_thread_run())
-				break;
-			seq_get_image_filename(&com.seq, i, source_filename);
-			snprintf(msg, 255, _("Loading and pre-processing image %d/%d (%s)"),
-					i + 1, com.seq.number, source_filename);
-			msg[255] = '\0';
-			set_progress_bar_data(msg,
-					(double) (i + 1) / (double) com.seq.number);
-			if (seq_read_frame(&com.seq, i, fit)) {
-				snprintf(msg, 255, _("Could not read one of the raw files: %s."
-						" Aborting preprocessing."), source_filename);
-				msg[255] = '\0';
-				set_progress_bar_data(msg, PROGRESS_RESET);
-				args->retval = 1;
-				if (com.seq.type == SEQ_SER) {
-					ser_close_file(new_ser_file);
-					free(new_ser_file);
-				}
-				gdk_threads_add_idle(end_sequence_prepro, args);
-				return GINT_TO_POINTER(1);
-			}
-			if ((com.preprostatus & USE_OPTD) && (com.preprostatus & USE_DARK))
-				darkOptimization(fit, dark, offset);
-
-			preprocess(fit, offset, dark, flat, args->normalisation);
-
-			if ((com.preprostatus & USE_COSME) && (com.preprostatus & USE_DARK) && (dark->naxes[2] == 1))
-				cosmeticCorrection(fit, dev, icold + ihot, args->is_cfa);
-
-			snprintf(dest_filename, 255, "%s%s", com.seq.ppprefix,
-					source_filename);
-			dest_filename[255] = '\0';
-			snprintf(msg, 255, "Saving image %d/%d (%s)", i + 1, com.seq.number,
-					dest_filename);
-			if (com.seq.type == SEQ_SER) {
-				ser_write_frame_from_fit(new_ser_file, fit, i);
-			} else {
-				savefits(dest_filename, fit);
-			}
-			clearfits(fit);
-		}
-		free(fit);
-		// closing SER file if it applies
-		if (com.seq.type == SEQ_SER && (new_ser_file != NULL)) {
-			close(new_ser_file->fd);
-			free(new_ser_file);
-			new_ser_file = NULL;
-		}
-		set_progress_bar_data(PROGRESS_TEXT_RESET, PROGRESS_RESET);
-		if (dev) free(dev);
-	}
-	args->retval = 0;
+/* doing the preprocessing in the processing thread, or in the GTK+ thread for
+ * a single image. returns 1 on error */
+gpointer seqpreprocess(gpointer p) {
+	struct preprocessing_data *args = (struct preprocessing_data *) p;
+	args->retval = preprocess_images(args);
 	gdk_threads_add_idle(end_sequence_prepro, args);
-	return GINT_TO_POINTER(0);
+	return GINT_TO_POINTER(args->retval);
 }
 
 /* computes the background value using the histogram and/or median value.
@@ -1281,17 +1569,13 @@ int verbose_rotate_image(fits *image, double angle, int interpolation,
 #endif
 
 /* This function computes wavelets with the number of Nbr_Plan and
- * extracts plan "Plan" in fit parameters */
+ * extracts plan "Plan" in fit parameters. The plan is computed in memory,
+ * so it can be called from several threads at once */
 
 int get_wavelet_layers(fits *fit, int Nbr_Plan, int Plan, int Type, int reqlayer) {
-	char *File_Name_Transform[3] = { "r_rawdata.wave", "g_rawdata.wave",
-			"b_rawdata.wave" }, *dir[3];
-	const char *tmpdir;
 	int chan, start, end;
-	wave_transf_des Wavelet[3];
 
 	assert(fit->naxes[2] <= 3);
-	tmpdir = g_get_tmp_dir();
 
 	float *Imag = f_vector_alloc(fit->ry * fit->rx);
 	if (Imag == NULL)
@@ -1306,37 +1590,15 @@ int get_wavelet_layers(fits *fit, int Nbr_Plan, int Plan, int Type, int reqlayer
 		end = start + 1;
 	}
 	for (chan = start; chan < end; chan++) {
-		int Nl, Nc;
-
-		dir[chan] = malloc(
-				strlen(tmpdir) + strlen(File_Name_Transform[chan]) + 2);
-		strcpy(dir[chan], tmpdir);
-		strcat(dir[chan], "/");
-		strcat(dir[chan], File_Name_Transform[chan]);
-		if (wavelet_transform_file(Imag, fit->ry, fit->rx, dir[chan], Type, Nbr_Plan,
-				fit->pdata[chan])) {
-			free((char *) Imag);
-			free(dir[chan]);
-			return 1;
-		}
-		if (wave_io_read(dir[chan], &Wavelet[chan])) {
+		prepare_rawdata(Imag, fit->ry, fit->rx, fit->pdata[chan]);
+		if (wavelet_transform_plan(Imag, fit->ry, fit->rx, Type, Nbr_Plan, Plan)) {
 			free((char *) Imag);
-			free(dir[chan]);
 			return 1;
 		}
-		Nl = Wavelet[chan].Nbr_Ligne;
-		Nc = Wavelet[chan].Nbr_Col;
-		pave_2d_extract_plan(Wavelet[chan].Pave.Data, Imag, Nl, Nc, Plan);
-		reget_rawdata(Imag, Nl, Nc, fit->pdata[chan]);
-		free(dir[chan]);
+		reget_rawdata(Imag, fit->ry, fit->rx, fit->pdata[chan]);
 	}
 
-	/* Free */
-	if (Imag)
-		free((char *) Imag);
-	for (chan = start; chan < end; chan++) {
-		wave_io_free(&Wavelet[chan]);
-	}
+	free((char *) Imag);
 	return 0;
 }
 
@@ -1358,15 +1620,15 @@ gboolean end_median_filter(gpointer p) {
 
 /* The function smoothes an image using the median filter with the
  * ksize x ksize aperture. Each channel of a multi-channel image is 
- * processed independently. In-place operation is supported. */
+ * processed independently, see algos/median_filter.c. */
 gpointer median_filter(gpointer p) {
 	struct median_filter_data *args = (struct median_filter_data *) p;
 	assert(args->ksize % 2 == 1 && args->ksize > 1);
-	int i, x, y, xx, yy, layer, iter = 0;
+	int layer, iter = 0, retval = 0;
+	long i, n;
 	int nx = args->fit->rx;
 	int ny = args->fit->ry;
-	int radius = (args->ksize - 1) / 2;
-	double norm = (double) get_normalized_value(args->fit);
+	WORD *median;
 
 	assert(nx > 0 && ny > 0);
 
@@ -1375,79 +1637,42 @@ gpointer median_filter(gpointer p) {
 	siril_log_color_message(_("Median Filter: processing...\n"), "red");
 	gettimeofday(&t_start, NULL);
 
+	n = (long) nx * ny;
+	median = malloc(n * sizeof(WORD));
+	if (median == NULL) {
+		printf("median filter: error allocating data\n");
+		gdk_threads_add_idle(end_median_filter, args);
+		return GINT_TO_POINTER(1);
+	}
+
 	do {
 		if (args->iterations != 1)
 			siril_log_message(_("Iteration #%d...\n"), iter + 1);
-		for (layer = 0; layer < com.uniq->nb_layers; layer++) {
-			/* FILL image upside-down */
-			WORD **image = malloc(ny * sizeof(WORD *));
-			if (image == NULL) {
-				printf("median filter: error allocating data\n");
-				gdk_threads_add_idle(end_median_filter, args);
-				return GINT_TO_POINTER(1);
+		for (layer = 0; layer < com.uniq->nb_layers && get_thread_run(); layer++) {
+			WORD *buf = args->fit->pdata[layer];
+			if (median_filter_buffer(buf, median, nx, ny, args->ksize)) {
+				retval = 1;
+				break;
 			}
-			for (i = 0; i < ny; i++)
-				image[ny - i - 1] = args->fit->pdata[layer] + i * nx;
-
-			for (y = 0; y < ny; y++) {
-				if (!get_thread_run())
-					break;
-				for (x = 0; x < nx; x++) {
-					WORD *data = calloc(args->ksize * args->ksize,
-							sizeof(WORD));
-					if (data == NULL) {
-						printf("median filter: error allocating data\n");
-						free(image);
-						gdk_threads_add_idle(end_median_filter, args);
-						return GINT_TO_POINTER(1);
-					}
-					i = 0;
-					for (yy = y - radius; yy <= y + radius; yy++) {
-						for (xx = x - radius; xx <= x + radius; xx++) {
-							WORD tmp;
-							if (xx < 0 && yy >= 0) {
-								if (yy >= ny)
-									tmp = image[ny - 1][00];
-								else
-									tmp = image[yy][0];
-							} else if (xx > 0 && yy <= 0) {
-								if (xx >= nx)
-									tmp = image[00][nx - 1];
-								else
-									tmp = image[0][xx];
-							} else if (xx <= 0 && yy <= 0) {
-								tmp = image[0][0];
-							} else {
-								if (xx >= nx && yy >= ny)
-									tmp = image[ny - 1][nx - 1];
-								else if (xx >= nx && yy < ny)
-									tmp = image[yy][nx - 1];
-								else if (xx < nx && yy >= ny)
-									tmp = image[ny - 1][xx];
-								else
-									tmp = image[yy][xx];
-							}
-							data[i++] = tmp;
-						}
-					}
-					quicksort_s(data, args->ksize * args->ksize);
-					WORD median = round_to_WORD(gsl_stats_ushort_median_from_sorted_data(data, 1, args->ksize * args->ksize));
-					double pixel = args->amount * (median / norm);
-					pixel += (1.0 - args->amount)
-							* ((double) image[y][x] / norm);
-					image[y][x] = round_to_WORD(pixel * norm);
-					free(data);
-				}
+			if (args->amount == 1.0) {
+				memcpy(buf, median, n * sizeof(WORD));
+				continue;
 			}
-			free(image);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static)
+#endif
+			for (i = 0; i < n; i++)
+				buf[i] = round_to_WORD(args->amount * median[i]
+						+ (1.0 - args->amount) * buf[i]);
 		}
 		iter++;
-	} while (iter < args->iterations && get_thread_run());
+	} while (!retval && iter < args->iterations && get_thread_run());
+	free(median);
 	gettimeofday(&t_end, NULL);
 	show_time(t_start, t_end);
 	gdk_threads_add_idle(end_median_filter, args);
 
-	return GINT_TO_POINTER(0);
+	return GINT_TO_POINTER(retval);
 }
 
 static int fmul_layer(fits *a, int layer, float coeff) {
@@ -1474,7 +1699,7 @@ int banding_image_hook(struct generic_seq_args *args, int i, fits *fit, rectangl
 }
 
 void apply_banding_to_sequence(struct banding_data *banding_args) {
-	struct generic_seq_args *args = malloc(sizeof(struct generic_seq_args));
+	struct generic_seq_args *args = calloc(1, sizeof(struct generic_seq_args));
 	args->seq = &com.seq;
 	args->partial_image = FALSE;
 	args->filtering_criterion = seq_filter_included;
@@ -246,6 +246,12 @@ typedef enum {
 	OUTPUT_LOGS
 } main_tabs;
 
+/* storage of the pixels of an image, see struct ffit */
+typedef enum {
+	DATA_USHORT,	// data and pdata
+	DATA_FLOAT	// fdata and fpdata, in the same [0, 65535] range
+} data_type;
+
 typedef enum {
 	BAYER_BILINEAR,
 	BAYER_NEARESNEIGHBOR,
@@ -302,12 +308,14 @@ struct imdata {
 	char *date_obs;		/* date of the observation, processed and copied from the header */
 };
 
-/* preprocessing data from GUI */
+/* preprocessing data from GUI or from the preprocess command */
 struct preprocessing_data {
+	sequence *seq;		// the sequence to calibrate, NULL for the loaded image
 	struct timeval t_start;
 	gboolean autolevel;
 	double sigma[2];
 	gboolean is_cfa;
+	gboolean use_float;	// calibrated images are saved in 32-bit float
 	float normalisation;
 	int retval;
 };
@@ -323,6 +331,12 @@ struct registration_data {
 	// entropy could be replaced by a more general quality indicator at
 	// some point. It's the only double value stored in the .seq files, others are single.
 	double quality;
+	/* affine transform from the pixel coordinates of the reference image to
+	 * those of this image, for images that are registered without being
+	 * resampled: stacking interpolates them with it instead of using the
+	 * shifts, which are only approximations then. saved */
+	gboolean has_transform;
+	double transform[6];
 };
 
 struct sequ {
@@ -366,6 +380,7 @@ struct sequ {
 	//struct registration_method reg_method;	// is it the right place for that?
 	
 	gboolean needs_saving;	// a dirty flag for the sequence, avoid saving it too often
+	struct stats_cache *stats_cache;	// statistics of all layers, saved in seqname.stats
 
 	fitted_PSF **photometry[MAX_SEQPSF];// psf for multiple stars for all images
 	int reference_star;	// reference star for apparent magnitude (index of photometry)
@@ -436,8 +451,11 @@ struct ffit {
 	unsigned short mini;	// min of the min[3]
 
 	fitsfile *fptr;		// file descriptor. Only used for file read and write.
+	data_type type;		// which of data or fdata holds the pixels
 	WORD *data;		// 16-bit image data (depending on image type)
 	WORD *pdata[3];		// pointers on data, per layer data access (RGB)
+	float *fdata;		// 32-bit image data, for DATA_FLOAT
+	float *fpdata[3];	// pointers on fdata, per layer data access (RGB)
 	char *header;		// entire header of the FITS file. NULL for non-FITS file.
 };
 
@@ -472,6 +490,8 @@ struct stack_config {
 	int normalisation_method;
 	int rej_method;
 	double memory_percent;			// percent of available memory to use for stacking
+	gboolean streaming;			// always stack median and rejection through a temporary file
+	gboolean rejmaps;			// save rejection maps with rejection stacking
 };
 
 struct rectangle_struct {
@@ -503,6 +523,14 @@ struct dateTime_struct {
 	int ms;
 };
 
+/* Functions through which processing reports to the user. When com.report
+ * is set, they replace the GTK+ log, progress bar and dialogs. */
+struct report_functions {
+	void (*log)(const char *msg, const char *color);
+	void (*progress)(const char *text, double percent);
+	void (*dialog)(const char *text, const char *title, const char *icon);
+};
+
 struct cominf {
 	/* current version of GTK, through GdkPixmap, doesn't handle gray images, so
 	 * graybufs are the same size than the rgbbuf with 3 times the same value */
@@ -524,6 +552,7 @@ struct cominf {
 	sliders_mode sliders;		// 0: min/max, 1: MIPS-LO/HI, 2: user
 	int preprostatus;
 	gboolean prepro_cfa;	// Use to save type of sensor for cosmetic correction in preprocessing
+	gboolean float_pipeline;	// calibrate, sum and rejection stack to 32-bit float images
 	gboolean show_excluded;		// show excluded images in sequences
 	double zoom_value;		// 1.0 is normal zoom, use get_zoom_val() to access it
 
@@ -594,6 +623,9 @@ struct cominf {
 	GMutex mutex;			// a mutex we use for this thread
 	gboolean run_thread;		// the main thread loop condition
 	int max_thread;			// maximum of thread used
+
+	gboolean headless;		// no GTK+ interface, running a script
+	const struct report_functions *report;	// NULL for the GTK+ interface
 };
 
 /* this structure is used to characterize the statistics of the image */
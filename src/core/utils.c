@@ -231,6 +231,8 @@ int changedir(const char *dir) {
 		}
 		siril_log_message(_("Setting CWD (Current Working Directory) to '%s'\n"),
 				com.wd);
+		if (com.headless)
+			return 0;
 		set_GUI_CWD();
 
 		snprintf(str, 255, "%s v%s - %s", PACKAGE, VERSION, dir);
@@ -252,6 +252,11 @@ static char* siril_log_internal(const char* format, const char* color, va_list a
 	if (msg == NULL || msg[0] == '\0')
 		return NULL;
 
+	if (com.report) {
+		com.report->log(msg, color);
+		return (msg[0] == '\n' && msg[1] == '\0') ? NULL : msg;
+	}
+
 	if (msg[0] == '\n' && msg[1] == '\0') {
 		fputc('\n', stdout);
 		new_msg = malloc(sizeof(struct log_message));
@@ -2292,7 +2297,12 @@ void show_time(struct timeval t_start, struct timeval t_end) {
 
 /* sets text in the label and displays the dialog window 1 */
 void show_dialog(const char *text, const char *title, const char *icon) {
-	struct _dialog_data *args = malloc(sizeof(struct _dialog_data));
+	struct _dialog_data *args;
+	if (com.report) {
+		com.report->dialog(text, title, icon);
+		return;
+	}
+	args = malloc(sizeof(struct _dialog_data));
 	args->text = text;
 	args->title = title;
 	args->icon = icon;
@@ -2372,6 +2382,11 @@ void set_progress_bar_data(const char *text, double percent) {
 	struct progress_bar_idle_data *data;
 	g_mutex_lock(&com.mutex);
 	//fprintf(stdout, "progress: %s, %g\n", text ? text : "NULL", percent);
+	if (com.report) {
+		com.report->progress(text, percent);
+		g_mutex_unlock(&com.mutex);
+		return;
+	}
 	data = malloc(sizeof(struct progress_bar_idle_data));
 	data->progress_bar_text = text ? strdup(text) : NULL;
 	data->progress_bar_percent = percent;
@@ -2634,7 +2649,7 @@ void initialize_display_mode() {
 }
 
 void set_GUI_CWD() {
-	if (!com.wd)
+	if (!com.wd || com.headless)
 		return;
 	GtkLabel *label = GTK_LABEL(lookup_widget("labelcwd"));
 	gtk_label_set_text(label, com.wd);
@@ -4344,12 +4359,14 @@ void on_prepro_button_clicked(GtkButton *button, gpointer user_data) {
 		args->sigma[1] = -1.0;
 
 	args->is_cfa = gtk_toggle_button_get_active(CFA);
+	args->use_float = com.float_pipeline;
 
 	/****/
 
 	if (single_image_is_loaded()) {
 		int success = 0;
 
+		args->seq = NULL;
 		com.uniq->ppprefix = strdup(gtk_entry_get_text(entry));
 		// start preprocessing
 		set_cursor_waiting(TRUE);
@@ -4368,6 +4385,7 @@ void on_prepro_button_clicked(GtkButton *button, gpointer user_data) {
 		if (com.seq.ppprefix)
 			free(com.seq.ppprefix);
 		com.seq.ppprefix = strdup(gtk_entry_get_text(entry));
+		args->seq = &com.seq;
 
 		// start preprocessing
 		set_cursor_waiting(TRUE);
@@ -231,6 +231,8 @@ void on_spinbut_shift_value_change(GtkSpinButton *spinbutton, gpointer user_data
 	if (spinbutton == spin_shiftx)
 		com.seq.regparam[current_layer][com.seq.current].shiftx = new_value;
 	else com.seq.regparam[current_layer][com.seq.current].shifty = new_value;
+	/* the manual shift replaces the transform computed for the frame */
+	com.seq.regparam[current_layer][com.seq.current].has_transform = FALSE;
 	writeseqfile(&com.seq);
 	fill_sequence_list(&com.seq, current_layer);	// update list with new regparam
 	redraw_previews();
@@ -32,6 +32,7 @@
 #include "core/siril.h"
 #include "core/proto.h"
 #include "core/processing.h"
+#include "core/image_pool.h"
 #include "io/conversion.h"
 #include "io/films.h"
 #include "io/sequence.h"
@@ -40,6 +41,8 @@
 #include "algos/demosaicing.h"
 
 #define MAX_OF_EXTENSIONS 50	// actual size of supported_extensions
+/* part of the available memory that the images being converted may use */
+#define CONVERSION_MEMORY_RATIO 0.5
 
 static gchar *destroot = NULL;
 static unsigned int convflags = CONV1X3;	// default
@@ -506,47 +509,74 @@ void on_convert_button_clicked(GtkButton *button, gpointer user_data) {
 	return;
 }
 
-static gpointer convert_thread_worker(gpointer p) {
-	char dest_filename[128], msg_bar[256];
-	int indice;
-	double progress = 0.0;
-	struct ser_struct *ser_file = NULL;
-	struct _convert_data *args = (struct _convert_data *) p;
-	GList *list;
-	
-	list = g_list_first(args->list);
-	indice = args->start;
+/* A file to convert: an image, or a film or a SER file of which all frames
+ * are converted */
+struct _convert_source {
+	gchar *filename;		// not owned
+	image_type type;
+	int nb_frames;
+	struct ser_struct *ser_file;	// for TYPESER
+#if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
+	struct film_struct *film_file;	// for TYPEAVI
+#endif
+};
 
-	if (convflags & CONVDSTSER) {
-		if (convflags & CONV3X1) {
-			siril_log_color_message(_("SER output will take precedence over the one-channel per image creation option.\n"), "salmon");
-			convflags &= ~CONV3X1;
-		} else {
-			ser_file = malloc(sizeof(struct ser_struct));
-			if (!(convflags & CONVMULTIPLE)) {
-				if (ser_create_file(destroot, ser_file, TRUE, NULL)) {
-					siril_log_message(_("Creating the SER file failed, aborting.\n"));
-					goto clean_exit;
-				}
-			}
-		}
-	}
+/* An image to convert, a single file or a frame of a source */
+struct _convert_item {
+	struct _convert_source *source;
+	int frame;
+};
+
+/* The output, written by one thread at a time in the order of the items */
+struct _convert_output {
+	int indice;			// number of the next FITS file
+	struct ser_struct *ser_file;	// SER file being written, or NULL
+	int ser_frame;			// index of the next frame in ser_file
+};
 
-	while (list) {
-		gchar *src_filename = (gchar *)list->data;
-		const char *src_ext = get_filename_ext(src_filename);
-		image_type imagetype;
+/* films can only be read by one thread at a time */
+static GMutex film_lock;
 
-		if (!get_thread_run()) {
-			break;
+static void close_convert_sources(struct _convert_source *sources, int nb_sources) {
+	int i;
+	for (i = 0; i < nb_sources; i++) {
+		if (sources[i].ser_file) {
+			ser_close_file(sources[i].ser_file);
+			free(sources[i].ser_file);
 		}
-		gchar *name = g_utf8_strrchr(src_filename, strlen(src_filename), '/');
-		if (name)
-			g_snprintf(msg_bar, 256, _("Converting %s..."), name + 1);
-		else g_snprintf(msg_bar, 256, _("Converting %s..."), src_filename);
+#if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
+		if (sources[i].film_file) {
+			film_close_file(sources[i].film_file);
+			free(sources[i].film_file);
+		}
+#endif
+	}
+	free(sources);
+}
 
-		imagetype = get_type_for_extension(src_ext);
-		if (imagetype == TYPEUNDEF) {
+/* Opens the sequence files of the list and makes the list of the images to
+ * convert, in the order of the output. Returns the number of items, -1 on
+ * error. */
+static int open_convert_sources(GList *list, struct _convert_source **sources,
+		struct _convert_item **items) {
+	int nb_sources = g_list_length(list), nb_items = 0, i, frame;
+	struct _convert_source *src;
+
+	*sources = calloc(nb_sources, sizeof(struct _convert_source));
+	*items = NULL;
+	if (!*sources) {
+		printf("Memory allocation failed: conversion\n");
+		return -1;
+	}
+	for (i = 0; list; list = g_list_next(list), i++) {
+		const char *src_ext;
+		src = &(*sources)[i];
+		src->filename = (gchar *)list->data;
+		src_ext = get_filename_ext(src->filename);
+		src->type = get_type_for_extension(src_ext);
+		src->nb_frames = 1;
+
+		if (src->type == TYPEUNDEF) {
 			char msg[512];
 			siril_log_message(_("FILETYPE IS NOT SUPPORTED, CANNOT CONVERT: %s\n"), src_ext);
 			g_snprintf(msg, 512, _("File extension '%s' is not supported.\n"
@@ -557,105 +587,257 @@ static gpointer convert_thread_worker(gpointer p) {
 				"formats, you may notify the developpers that the extension you are "
 				"trying to use should be recognized for this type."), src_ext);
 			show_dialog(msg, _("Error"), "gtk-dialog-error");
-			break;	// avoid 100 error popups
+			goto error;
 		}
-
-		if (imagetype == TYPEAVI) {
-			// we need to do a semi-recursive thing here,
-			// thankfully it's only one level deep
-#if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
-			int frame;
-			fits *fit = calloc(1, sizeof(fits));
-			struct film_struct film_file;
-			if (film_open_file(src_filename, &film_file) != FILM_SUCCESS) {
-				siril_log_message(_("Error while opening film %s, aborting.\n"), src_filename);
-				clearfits(fit);
-				free(fit);
-				break;
-			}
-			if (convflags & CONVMULTIPLE) {
-				if (ser_create_file(create_sequence_filename(indice++, dest_filename, 128),
-							ser_file, TRUE, NULL)) {
-					siril_log_message(_("Creating the SER file failed, aborting.\n"));
-					clearfits(fit);
-					free(fit);
-					goto clean_exit;
-				}
-			}
-			for (frame = 0; frame < film_file.frame_count; frame++) {
-				// read frame from the film
-				if (film_read_frame(&film_file, frame, fit) != FILM_SUCCESS) {
-					siril_log_message(_("Error while reading frame %d from %s, aborting.\n"),
-							frame, src_filename);
-					clearfits(fit);
-					free(fit);
-					goto clean_exit;
-				}
-
-				// save to the destination file
-				if (convflags & CONVDSTSER) {
-					if (convflags & CONV1X1)
-						keep_first_channel_from_fits(fit);
-					if (ser_write_frame_from_fit(ser_file, fit, frame)) {
-						siril_log_message(_("Error while converting to SER (no space left?)\n"));
-						clearfits(fit);
-						free(fit);
-						goto clean_exit;
-					}
-				} else {
-					g_snprintf(dest_filename, 128, "%s%05d", destroot, indice++);
-					if (save_to_target_fits(fit, dest_filename)) {
-						siril_log_message(_("Error while converting to FITS (no space left?)\n"));
-						clearfits(fit);
-						free(fit);
-						goto clean_exit;
-					}
-				}
-				clearfits(fit);
+		if (src->type == TYPESER) {
+			src->ser_file = malloc(sizeof(struct ser_struct));
+			ser_init_struct(src->ser_file);
+			if (ser_open_file(src->filename, src->ser_file)) {
+				siril_log_message(_("Error while opening SER file %s, aborting.\n"), src->filename);
+				free(src->ser_file);
+				src->ser_file = NULL;
+				goto error;
 			}
-			if (convflags & CONVMULTIPLE) {
-				ser_write_and_close(ser_file);
+			src->nb_frames = src->ser_file->frame_count;
+		}
+#if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
+		else if (src->type == TYPEAVI) {
+			src->film_file = malloc(sizeof(struct film_struct));
+			if (film_open_file(src->filename, src->film_file) != FILM_SUCCESS) {
+				siril_log_message(_("Error while opening film %s, aborting.\n"), src->filename);
+				free(src->film_file);
+				src->film_file = NULL;
+				goto error;
 			}
-			free(fit);
+			src->nb_frames = src->film_file->frame_count;
+		}
 #endif
+		if (src->type != TYPESER && src->type != TYPEAVI &&
+				(convflags & CONVDSTSER) && (convflags & CONVMULTIPLE)) {
+			siril_log_message(_("One SER file for each input can only be created from films or SER files, aborting.\n"));
+			goto error;
 		}
-		else if (imagetype == TYPESER) {
-			siril_log_message(_("Converting from SER is not yet supported\n"));
-			break;
+		nb_items += src->nb_frames;
+	}
+
+	*items = malloc(nb_items * sizeof(struct _convert_item));
+	if (!*items) {
+		printf("Memory allocation failed: conversion\n");
+		goto error;
+	}
+	for (i = 0, nb_items = 0; i < nb_sources; i++) {
+		for (frame = 0; frame < (*sources)[i].nb_frames; frame++, nb_items++) {
+			(*items)[nb_items].source = &(*sources)[i];
+			(*items)[nb_items].frame = frame;
 		}
-		else {	// single image
-			fits *fit = any_to_new_fits(imagetype, src_filename, args->compatibility);
-			if (convflags & CONVDSTSER) {
-				if (convflags & CONV1X1)
-					keep_first_channel_from_fits(fit);
-				if (ser_write_frame_from_fit(ser_file, fit, args->nb_converted)) {
-					siril_log_message(_("Error while converting to SER (no space left?)\n"));
-					break;
-				}
-			} else {
-				g_snprintf(dest_filename, 128, "%s%05d", destroot, indice++);
-				if (save_to_target_fits(fit, dest_filename)) {
-					siril_log_message(_("Error while converting to FITS (no space left?)\n"));
-					break;
-				}
+	}
+	return nb_items;
+
+error:
+	close_convert_sources(*sources, nb_sources);
+	*sources = NULL;
+	return -1;
+}
+
+/* Reads the image of an item into fit, demosaicing it if needed. This is
+ * called by several threads at once. io_lock, if not NULL, is held while
+ * reading FITS files. */
+static int convert_read_item(struct _convert_item *item, fits *fit,
+		gboolean compatibility, GMutex *io_lock) {
+	struct _convert_source *src = item->source;
+	int retval;
+
+	switch (src->type) {
+		case TYPESER:
+			retval = ser_read_frame_debayer(src->ser_file, item->frame, fit,
+					convflags & CONVDEBAYER);
+			if (retval)
+				siril_log_message(_("Error while reading frame %d from %s, aborting.\n"),
+						item->frame, src->filename);
+			break;
+#if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
+		case TYPEAVI:
+			g_mutex_lock(&film_lock);
+			retval = film_read_frame(src->film_file, item->frame, fit) != FILM_SUCCESS;
+			g_mutex_unlock(&film_lock);
+			if (retval)
+				siril_log_message(_("Error while reading frame %d from %s, aborting.\n"),
+						item->frame, src->filename);
+			break;
+#endif
+		default:
+			if (io_lock && src->type == TYPEFITS)
+				g_mutex_lock(io_lock);
+			retval = any_to_fits(src->type, src->filename, fit);
+			if (io_lock && src->type == TYPEFITS)
+				g_mutex_unlock(io_lock);
+			if (!retval)
+				retval = debayer_if_needed(src->type, fit, compatibility);
+			if (retval)
+				siril_log_message(_("Error while converting %s, aborting.\n"), src->filename);
+	}
+	return retval;
+}
+
+/* Writes the image of an item to the output. Items are written one at a time,
+ * in their order, which gives the numbers of the FITS files and the order of
+ * the frames in SER files. */
+static int convert_write_item(struct _convert_item *item, fits *fit,
+		struct _convert_output *out, GMutex *io_lock) {
+	char dest_filename[128];
+	int retval;
+
+	if (convflags & CONVDSTSER) {
+		if ((convflags & CONVMULTIPLE) && item->frame == 0) {
+			/* one SER file for each film or SER file */
+			out->ser_file = malloc(sizeof(struct ser_struct));
+			if (ser_create_file(create_sequence_filename(out->indice++, dest_filename, 128),
+						out->ser_file, TRUE, NULL)) {
+				siril_log_message(_("Creating the SER file failed, aborting.\n"));
+				free(out->ser_file);
+				out->ser_file = NULL;
+				return 1;
 			}
-			clearfits(fit);
-			free(fit);
+			out->ser_frame = 0;
+		}
+		if (convflags & CONV1X1)
+			keep_first_channel_from_fits(fit);
+		if (ser_write_frame_from_fit(out->ser_file, fit, out->ser_frame++)) {
+			siril_log_message(_("Error while converting to SER (no space left?)\n"));
+			return 1;
+		}
+		if ((convflags & CONVMULTIPLE) && item->frame == item->source->nb_frames - 1) {
+			ser_write_and_close(out->ser_file);
+			free(out->ser_file);
+			out->ser_file = NULL;
+		}
+		return 0;
+	}
+
+	g_snprintf(dest_filename, 128, "%s%05d", destroot, out->indice++);
+	if (io_lock)
+		g_mutex_lock(io_lock);
+	retval = save_to_target_fits(fit, dest_filename);
+	if (io_lock)
+		g_mutex_unlock(io_lock);
+	if (retval)
+		siril_log_message(_("Error while converting to FITS (no space left?)\n"));
+	return retval;
+}
+
+/* Number of images that can be converted at the same time, given the size of
+ * the first one. Memory is also needed to decode and demosaic them. */
+static int get_conversion_window(fits *fit) {
+	double image_size = (double) fit->rx * fit->ry * fit->naxes[2] * sizeof(WORD);
+	double memory = CONVERSION_MEMORY_RATIO * get_available_memory_in_MB() * 1024.0 * 1024.0;
+	int window;
+
+	if (image_size < 1.0)
+		return com.max_thread;
+	window = (int) (memory / (2.0 * image_size));
+	if (window > com.max_thread)
+		window = com.max_thread;
+	return window < 1 ? 1 : window;
+}
+
+/* Images are decoded and demosaiced in parallel, and written in their order
+ * by an ordered section, so that the numbering of the FITS files and the order
+ * of SER frames do not depend on the threads. A thread that has decoded an
+ * image waits for the previous ones to be written before taking another one,
+ * so there are never more images in memory than threads, and their number is
+ * limited by the available memory with the size of the first image. */
+static gpointer convert_thread_worker(gpointer p) {
+	char msg_bar[256];
+	int nb_items, i, window, abort = 0, progress = 0;
+	struct _convert_data *args = (struct _convert_data *) p;
+	struct _convert_source *sources = NULL;
+	struct _convert_item *items = NULL;
+	struct _convert_output out = { .indice = args->start, .ser_file = NULL, .ser_frame = 0 };
+	gboolean serialize_io = !fits_is_reentrant();
+	GMutex io_lock;
+	fits fit;
+
+	g_mutex_init(&io_lock);
+	memset(&fit, 0, sizeof(fits));
+
+	if (convflags & CONVDSTSER) {
+		if (convflags & CONV3X1) {
+			siril_log_color_message(_("SER output will take precedence over the one-channel per image creation option.\n"), "salmon");
+			convflags &= ~CONV3X1;
 		}
+	}
 
-		set_progress_bar_data(msg_bar, progress/((double)args->total));
-		progress += 1.0;
-		args->nb_converted++;
+	nb_items = open_convert_sources(g_list_first(args->list), &sources, &items);
+	if (nb_items <= 0)
+		goto clean_exit;
+
+	if ((convflags & CONVDSTSER) && !(convflags & CONVMULTIPLE)) {
+		out.ser_file = malloc(sizeof(struct ser_struct));
+		if (ser_create_file(destroot, out.ser_file, TRUE, NULL)) {
+			siril_log_message(_("Creating the SER file failed, aborting.\n"));
+			free(out.ser_file);
+			out.ser_file = NULL;
+			goto clean_exit;
+		}
+	}
 
-		list = g_list_next(list);
+	/* the first image gives the size of the others */
+	set_progress_bar_data(_("Converting..."), PROGRESS_RESET);
+	if (convert_read_item(&items[0], &fit, args->compatibility, NULL) ||
+			convert_write_item(&items[0], &fit, &out, NULL)) {
+		fits_recycle(&fit);
+		goto clean_exit;
+	}
+	window = get_conversion_window(&fit);
+	fits_recycle(&fit);
+	args->nb_converted++;
+	progress++;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(window) firstprivate(fit) private(i) ordered schedule(dynamic)
+#endif
+	for (i = 1; i < nb_items; i++) {
+		int retval = 0;
+		if (!abort) {
+			if (!get_thread_run())
+				abort = 1;
+			else retval = convert_read_item(&items[i], &fit, args->compatibility,
+					serialize_io ? &io_lock : NULL);
+		}
+#ifdef _OPENMP
+#pragma omp ordered
+#endif
+		{
+			if (retval)
+				abort = 1;
+			if (!abort) {
+				gchar *src_filename = items[i].source->filename;
+				gchar *name = g_utf8_strrchr(src_filename, strlen(src_filename), '/');
+				if (convert_write_item(&items[i], &fit, &out,
+							serialize_io ? &io_lock : NULL))
+					abort = 1;
+				else {
+					args->nb_converted++;
+					progress++;
+					g_snprintf(msg_bar, 256, _("Converting %s..."),
+							name ? name + 1 : src_filename);
+					set_progress_bar_data(msg_bar, progress / (double) nb_items);
+				}
+			}
+		}
+		fits_recycle(&fit);
 	}
 
 clean_exit:
-	if (convflags & CONVDSTSER) {
-		if (!(convflags & CONVMULTIPLE))
-			ser_write_and_close(ser_file);
-		free(ser_file);
+	if (out.ser_file) {
+		ser_write_and_close(out.ser_file);
+		free(out.ser_file);
 	}
+	if (sources)
+		close_convert_sources(sources, g_list_length(args->list));
+	free(items);
+	g_mutex_clear(&io_lock);
+	image_pool_flush();
 
 	gdk_threads_add_idle(end_convert_idle, args);
 	return NULL;
@@ -735,13 +917,15 @@ static int retrieveBayerPattern(char *bayer) {
 
 int debayer_if_needed(image_type imagetype, fits *fit, gboolean compatibility) {
 	int retval = 0;
-	sensor_pattern tmp;
+	sensor_pattern pattern;
 	/* What the hell?
 	 * Siril's FITS are stored bottom to top, debayering will throw 
 	 * wrong results. So before demosacaing we need to transforme the image
 	 * with fits_flip_top_to_bottom() function */
 	if (imagetype == TYPEFITS && (convflags & CONVDEBAYER)) {
-		tmp = com.debayer.bayer_pattern;
+		/* the settings are not modified, images may be converted by
+		 * several threads */
+		pattern = com.debayer.bayer_pattern;
 		if (fit->naxes[2] != 1) {
 			siril_log_message(_("Cannot perform debayering on image with more than one channel\n"));
 			return retval;
@@ -760,21 +944,20 @@ int debayer_if_needed(image_type imagetype, fits *fit, gboolean compatibility) {
 					siril_log_color_message(_("Bayer pattern found in header (%s) is different"
 							" from Bayer pattern in settings (%s). Overriding settings.\n"),
 							"red", filter_pattern[bayer], filter_pattern[com.debayer.bayer_pattern]);
-					com.debayer.bayer_pattern = bayer;
+					pattern = bayer;
 				}
 			}
 		}
-		if (com.debayer.bayer_pattern >= 0)
-			siril_log_message(_("Filter Pattern: %s\n"), filter_pattern[com.debayer.bayer_pattern]);
+		if (pattern >= 0)
+			siril_log_message(_("Filter Pattern: %s\n"), filter_pattern[pattern]);
 
-		if (debayer(fit, com.debayer.bayer_inter)) {
+		if (debayer(fit, com.debayer.bayer_inter, pattern)) {
 			siril_log_message(_("Cannot perform debayering\n"));
 			retval = -1;
 		} else {
 			if (!compatibility)
 				fits_flip_top_to_bottom(fit);
 		}
-		com.debayer.bayer_pattern = tmp;
 	}
 	return retval;
 }
@@ -28,6 +28,7 @@
 
 #include "core/siril.h"
 #include "core/proto.h"
+#include "core/image_pool.h"
 #include "io/sequence.h"
 #include "gui/callbacks.h"
 
@@ -172,7 +173,134 @@ static void read_fits_header(fits *fit) {
 	fits_read_key(fit->fptr, TUSHORT, "DFT_RY", &(fit->dft_ry), NULL, &status);
 }
 
-// return 0 on success, fills realname if not NULL with the opened file's name
+/* sets the per layer pointers of the data of the fit, of nbdata pixels and
+ * depth layers */
+static void set_fit_layers(fits *fit, long nbdata, int depth) {
+	int layer;
+
+	for (layer = 0; layer < 3; layer++) {
+		long offset = depth == 3 ? layer * nbdata : 0;
+		fit->pdata[layer] = fit->data ? fit->data + offset : NULL;
+		fit->fpdata[layer] = fit->fdata ? fit->fdata + offset : NULL;
+	}
+}
+
+/* (re)allocates nbdata pixels for depth layers in the type of the fit,
+ * freeing the data of the other type, and sets the layer pointers */
+static int alloc_fit_data(fits *fit, long nbdata, int depth) {
+	if (fit->type == DATA_FLOAT) {
+		float *newdata = image_buffer_realloc(fit->fdata, nbdata * depth * sizeof(float));
+		if (!newdata)
+			return 1;
+		fit->fdata = newdata;
+		if (fit->data) {
+			free(fit->data);
+			fit->data = NULL;
+		}
+	} else {
+		WORD *newdata = image_buffer_realloc(fit->data, nbdata * depth * sizeof(WORD));
+		if (!newdata)
+			return 1;
+		fit->data = newdata;
+		if (fit->fdata) {
+			free(fit->fdata);
+			fit->fdata = NULL;
+		}
+	}
+	set_fit_layers(fit, nbdata, depth);
+	return 0;
+}
+
+/* Reads the n pixels of the opened file in fdata, converted by cfitsio. Values
+ * are brought to the [0, 65535] range of 16-bit images the same way readfits
+ * does for the conversion to 16 bits, but without rounding nor clipping. */
+static void read_fits_float_data(fits *fit, long n, int *status) {
+	long orig[3] = { 1L, 1L, 1L };
+	int zero = 0, key_status = 0;
+	unsigned long offset = 0;
+	float max = 0.0f;
+	double scale = 1.0, shift = 0.0;
+	long i;
+
+	fits_read_pix(fit->fptr, TFLOAT, orig, n, &zero, fit->fdata, &zero, status);
+	if (*status)
+		return;
+	for (i = 0; i < n; i++)
+		if (fit->fdata[i] > max)
+			max = fit->fdata[i];
+
+	switch (fit->bitpix) {
+	case FLOAT_IMG:
+	case DOUBLE_IMG:
+		if (max <= 1.0f)
+			scale = USHRT_MAX_DOUBLE;
+		break;
+	case LONG_IMG:
+	case ULONG_IMG:
+		/* shifted by the distance of BZERO to 2^31, and for data
+		 * exceeding 16 bits, scaled from the 32-bit range */
+		fits_read_key(fit->fptr, TULONG, "BZERO", &offset, NULL, &key_status);
+		shift = (double) (0x80000000UL - offset) / (double) UINT_MAX;
+		if (max > USHRT_MAX_SINGLE) {
+			scale = USHRT_MAX_DOUBLE / (double) UINT_MAX;
+			shift *= USHRT_MAX_DOUBLE;
+		}
+		break;
+	default:
+		break;
+	}
+	if (scale != 1.0 || shift != 0.0)
+		for (i = 0; i < n; i++)
+			fit->fdata[i] = (float) (fit->fdata[i] * scale + shift);
+	fit->bitpix = FLOAT_IMG;
+}
+
+/* Converts the pixels of the image to 32-bit float, in place. */
+int convert_fit_to_float(fits *fit) {
+	long i, n = fit->rx * fit->ry * fit->naxes[2];
+	float *fdata;
+
+	if (fit->type == DATA_FLOAT)
+		return 0;
+	fdata = malloc(n * sizeof(float));
+	if (!fdata)
+		return 1;
+	for (i = 0; i < n; i++)
+		fdata[i] = (float) fit->data[i];
+	free(fit->data);
+	fit->data = NULL;
+	fit->fdata = fdata;
+	fit->type = DATA_FLOAT;
+	fit->bitpix = FLOAT_IMG;
+	set_fit_layers(fit, fit->rx * fit->ry, fit->naxes[2]);
+	return 0;
+}
+
+/* Converts the pixels of the image to 16-bit unsigned integers, in place,
+ * rounding and clipping them to the [0, 65535] range. */
+int convert_fit_to_ushort(fits *fit) {
+	long i, n = fit->rx * fit->ry * fit->naxes[2];
+	WORD *data;
+
+	if (fit->type == DATA_USHORT)
+		return 0;
+	data = malloc(n * sizeof(WORD));
+	if (!data)
+		return 1;
+	for (i = 0; i < n; i++)
+		data[i] = round_to_WORD((double) fit->fdata[i]);
+	free(fit->fdata);
+	fit->fdata = NULL;
+	fit->data = data;
+	fit->type = DATA_USHORT;
+	fit->bitpix = USHORT_IMG;
+	set_fit_layers(fit, fit->rx * fit->ry, fit->naxes[2]);
+	return 0;
+}
+
+/* return 0 on success, fills realname if not NULL with the opened file's name.
+ * The image is read in the type of fit: pixels of a DATA_FLOAT fit are
+ * read in fdata as 32-bit float, whatever the type of the file. */
 int readfits(const char *filename, fits *fit, char *realname) {
 	int status;
 	long orig[3] = { 1L, 1L, 1L };
@@ -258,33 +386,21 @@ int readfits(const char *filename, fits *fit, char *realname) {
 		return -1;
 	}
 
-	/* realloc fit->data to the image size */
-	WORD *olddata = fit->data;
-	if ((fit->data = realloc(fit->data, nbdata * fit->naxes[2] * sizeof(WORD)))
-			== NULL) {
+	/* realloc the data of the type of the fit to the image size */
+	if (alloc_fit_data(fit, nbdata, fit->naxes[2])) {
 		fprintf(stderr, "readfits: error realloc %s %lu\n", filename,
 				nbdata * fit->naxes[2]);
 		status = 0;
 		fits_close_file(fit->fptr, &status);
-		if (olddata)
-			free(olddata);
 		return -1;
 	}
 
-	if (fit->naxis == 3) {
-		fit->pdata[RLAYER] = fit->data;
-		fit->pdata[GLAYER] = fit->data + nbdata;
-		fit->pdata[BLAYER] = fit->data + nbdata * 2;
-	} else {
-		fit->pdata[RLAYER] = fit->data;
-		fit->pdata[GLAYER] = fit->data;
-		fit->pdata[BLAYER] = fit->data;
-	}
-
 	read_fits_header(fit);
 
 	status = 0;
-	switch (fit->bitpix) {
+	if (fit->type == DATA_FLOAT)
+		read_fits_float_data(fit, nbdata * fit->naxes[2], &status);
+	else switch (fit->bitpix) {
 	case SBYTE_IMG:
 	case BYTE_IMG:
 		data8 = calloc(fit->rx * fit->ry * fit->naxes[2], sizeof(BYTE));
@@ -443,6 +559,22 @@ void clearfits(fits *fit) {
 		return;
 	if (fit->data)
 		free(fit->data);
+	if (fit->fdata)
+		free(fit->fdata);
+	if (fit->header)
+		free(fit->header);
+	memset(fit, 0, sizeof(fits));
+}
+
+/* Same as clearfits, but the image data is given back to the image pool, to
+ * be reused for the next frame of a sequence. */
+void fits_recycle(fits *fit) {
+	size_t nbdata;
+	if (fit == NULL)
+		return;
+	nbdata = (size_t) fit->rx * fit->ry * (fit->naxes[2] > 1 ? fit->naxes[2] : 1);
+	image_buffer_release(fit->data, nbdata * sizeof(WORD));
+	image_buffer_release(fit->fdata, nbdata * sizeof(float));
 	if (fit->header)
 		free(fit->header);
 	memset(fit, 0, sizeof(fits));
@@ -546,7 +678,7 @@ int readfits_partial(const char *filename, int layer, fits *fit,
 
 	/* realloc fit->data to the image size */
 	WORD *olddata = fit->data;
-	if ((fit->data = realloc(fit->data, nbdata * sizeof(WORD))) == NULL) {
+	if ((fit->data = image_buffer_realloc(fit->data, nbdata * sizeof(WORD))) == NULL) {
 		fprintf(stderr, "readfits: error realloc %s %u\n", filename, nbdata);
 		status = 0;
 		fits_close_file(fit->fptr, &status);
@@ -670,6 +802,10 @@ int savefits(const char *name, fits *f) {
 	}
 
 	unlink(filename); /* Delete old file if it already exists */
+	if (f->type == DATA_FLOAT)
+		f->bitpix = FLOAT_IMG;
+	else if (f->bitpix == FLOAT_IMG)	// converted back to 16 bits
+		f->bitpix = USHORT_IMG;
 
 	status = 0;
 	if (fits_create_diskfile(&(f->fptr), filename, &status)) { /* create new FITS file */
@@ -715,9 +851,17 @@ int savefits(const char *name, fits *f) {
 			return 1;
 		}
 		break;
+	case FLOAT_IMG:
+		if (f->type == DATA_FLOAT) {
+			if (fits_write_pix(f->fptr, TFLOAT, orig, pixel_count, f->fdata, &status)) {
+				report_fits_error(status);
+				return 1;
+			}
+			break;
+		}
+		/* no break */
 	case LONG_IMG:
 	case LONGLONG_IMG:
-	case FLOAT_IMG:
 	case DOUBLE_IMG:
 	default:
 		msg = siril_log_message(
@@ -754,6 +898,7 @@ void save_fits_header(fits *fit) {
 	switch (fit->bitpix) {
 	case BYTE_IMG:
 	case SHORT_IMG:
+	case FLOAT_IMG:
 		zero = 0;
 		break;
 	default:
@@ -958,6 +1103,7 @@ void save_fits_header(fits *fit) {
 int copyfits(fits *from, fits *to, unsigned char oper, int layer) {
 	int depth;
 	unsigned int nbdata = from->rx * from->ry;
+	size_t pixel_size = from->type == DATA_FLOAT ? sizeof(float) : sizeof(WORD);
 
 	if ((oper & CP_EXPAND)) {
 		depth = 3;
@@ -966,31 +1112,24 @@ int copyfits(fits *from, fits *to, unsigned char oper, int layer) {
 	}
 
 	if ((oper & CP_ALLOC)) {
-		WORD *olddata = to->data;
-		if ((to->data = realloc(to->data, nbdata * depth * sizeof(WORD)))
-				== NULL) {
+		to->type = from->type;
+		if (alloc_fit_data(to, nbdata, depth)) {
 			fprintf(stderr, "copyfits: error reallocating data\n");
-			if (olddata)
-				free(olddata);
 			return -1;
 		}
-		to->pdata[RLAYER] = to->data;
-		if (depth == 3) {
-			to->pdata[GLAYER] = to->data + nbdata;
-			to->pdata[BLAYER] = to->data + 2 * nbdata;
-		} else {
-			to->pdata[GLAYER] = to->data;
-			to->pdata[BLAYER] = to->data;
-		}
 	}
 	//	memcpy(to->r,from->r,from->rx * from->ry*sizeof(WORD));
 
 	if ((oper & CP_INIT)) {
-		memset(to->data, 0, nbdata * depth * sizeof(WORD));
+		if (to->type == DATA_FLOAT)
+			memset(to->fdata, 0, nbdata * depth * sizeof(float));
+		else memset(to->data, 0, nbdata * depth * sizeof(WORD));
 	}
 
 	if ((oper & CP_COPYA)) {
-		memcpy(to->data, from->data, nbdata * depth * sizeof(WORD));
+		if (from->type == DATA_FLOAT)
+			memcpy(to->fdata, from->fdata, nbdata * depth * pixel_size);
+		else memcpy(to->data, from->data, nbdata * depth * pixel_size);
 	}
 
 	if ((oper & CP_FORMAT)) {
@@ -1015,8 +1154,9 @@ int copyfits(fits *from, fits *to, unsigned char oper, int layer) {
 		to->naxes[0] = from->naxes[0];
 		to->naxes[1] = from->naxes[1];
 		to->naxes[2] = 1;
-		memcpy(to->data, from->pdata[layer],
-				nbdata * to->naxes[2] * sizeof(WORD));
+		if (from->type == DATA_FLOAT)
+			memcpy(to->fdata, from->fpdata[layer], nbdata * pixel_size);
+		else memcpy(to->data, from->pdata[layer], nbdata * pixel_size);
 	}
 	update_used_memory();
 	return 0;
@@ -1167,8 +1307,8 @@ void fits_flip_top_to_bottom(fits *fit) {
 void extract_region_from_fits(fits *from, int layer, fits *to,
 		const rectangle *area) {
 	int x, y, d, ystart, yend;
-	clearfits(to);
-	to->data = malloc(area->w * area->h * sizeof(WORD));
+	fits_recycle(to);
+	to->data = image_buffer_get(area->w * area->h * sizeof(WORD));
 
 	d = 0;
 	ystart = from->ry - area->y - area->h;
@@ -1199,7 +1339,7 @@ int new_fit_image(fits *fit, int width, int height, int nblayer) {
 	assert(nblayer <= 3);
 
 	npixels = width * height;
-	data = calloc(npixels, sizeof(WORD) * nblayer);
+	data = image_buffer_get_zeroed((size_t) npixels * nblayer * sizeof(WORD));
 
 	if (data != NULL) {
 		clearfits(fit);
@@ -0,0 +1,260 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Journal of the frames done by a processing, see journal.h.
+ * The file is a text file with tab separated fields:
+ *	V version params_checksum
+ *	F filenum in_mtime in_size out_mtime out_size data output	for each frame done
+ * Modification times are in nanoseconds.
+ * Lines are appended and flushed as frames are done, so that the journal is
+ * valid whenever the processing stops. A line cut by a crash has no end of
+ * line and is ignored. When a frame is done several times, the last line
+ * counts. When the journal is opened, the entries that are still valid are
+ * written again at the start of the file, the others are dropped. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "gui/callbacks.h"
+#include "io/sequence.h"
+#include "io/journal.h"
+
+static void free_entry(gpointer data) {
+	struct journal_entry *entry = (struct journal_entry *) data;
+	g_free(entry->output);
+	g_free(entry->data);
+	free(entry);
+}
+
+/* gets the key of a file, returns 0 if it exists. The modification time is
+ * in nanoseconds, a file rewritten within the same second with the same size
+ * has another key where the system gives the fractional part. */
+static int get_file_key(const char *filename, gint64 *mtime, gint64 *size) {
+	struct stat sts;
+	gint64 nsec = 0;
+	if (!filename || stat(filename, &sts))
+		return -1;
+#if defined(__APPLE__)
+	nsec = (gint64) sts.st_mtimespec.tv_nsec;
+#elif !defined(WIN32)
+	nsec = (gint64) sts.st_mtim.tv_nsec;
+#endif
+	*mtime = (gint64) sts.st_mtime * G_GINT64_CONSTANT(1000000000) + nsec;
+	*size = (gint64) sts.st_size;
+	return 0;
+}
+
+static gboolean same_file_key(const char *filename, gint64 mtime, gint64 size) {
+	gint64 cur_mtime, cur_size;
+	if (get_file_key(filename, &cur_mtime, &cur_size))
+		return FALSE;
+	return cur_mtime == mtime && cur_size == size;
+}
+
+static void write_entry(FILE *file, int filenum, const struct journal_entry *entry) {
+	fprintf(file, "F\t%d\t%lld\t%lld\t%lld\t%lld\t%s\t%s\n", filenum,
+			(long long) entry->in_mtime, (long long) entry->in_size,
+			(long long) entry->out_mtime, (long long) entry->out_size,
+			entry->data ? entry->data : "",
+			entry->output ? entry->output : "");
+}
+
+/* reads the entries of a previous run with the same parameters */
+static void read_entries(struct work_journal *journal, FILE *file,
+		const char *checksum, const char *filename) {
+	char line[1024];
+	gboolean valid = FALSE;
+
+	while (fgets(line, 1024, file)) {
+		struct journal_entry *entry;
+		gchar **fields;
+		size_t len = strlen(line);
+		int filenum;
+
+		if (len == 0 || line[len - 1] != '\n')
+			continue;	// cut or too long
+		line[len - 1] = '\0';
+		fields = g_strsplit(line, "\t", 8);
+		if (!fields[0]) {
+			g_strfreev(fields);
+			continue;
+		}
+		switch (fields[0][0]) {
+			case 'V':
+				valid = g_strv_length(fields) == 3 &&
+					atoi(fields[1]) == JOURNAL_VERSION &&
+					!strcmp(fields[2], checksum);
+				if (!valid)
+					fprintf(stdout, "Journal %s is outdated or for other parameters, ignoring it\n", filename);
+				break;
+			case 'F':
+				if (!valid || g_strv_length(fields) != 8)
+					break;
+				entry = calloc(1, sizeof(struct journal_entry));
+				if (!entry)
+					break;
+				filenum = atoi(fields[1]);
+				entry->in_mtime = g_ascii_strtoll(fields[2], NULL, 10);
+				entry->in_size = g_ascii_strtoll(fields[3], NULL, 10);
+				entry->out_mtime = g_ascii_strtoll(fields[4], NULL, 10);
+				entry->out_size = g_ascii_strtoll(fields[5], NULL, 10);
+				if (fields[6][0] != '\0')
+					entry->data = g_strdup(fields[6]);
+				if (fields[7][0] != '\0')
+					entry->output = g_strdup(fields[7]);
+				g_hash_table_replace(journal->done, GINT_TO_POINTER(filenum), entry);
+				break;
+		}
+		g_strfreev(fields);
+		if (!valid)
+			break;
+	}
+}
+
+/* Opens the journal of the processing for the sequence. Frames done in a
+ * previous run with the same params, a string describing everything the
+ * result depends on other than the input file, can be skipped. Returns NULL
+ * if the sequence cannot be journaled or if the file cannot be written. */
+struct work_journal *journal_open(sequence *seq, const char *processing, const char *params) {
+	struct work_journal *journal;
+	GHashTableIter iter;
+	gpointer key, value;
+	gchar *filename, *checksum;
+	FILE *file;
+
+	if (!seq || seq->type != SEQ_REGULAR || !processing || !params)
+		return NULL;
+	journal = calloc(1, sizeof(struct work_journal));
+	if (!journal)
+		return NULL;
+	journal->seq = seq;
+	journal->done = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_entry);
+	g_mutex_init(&journal->mutex);
+
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_MD5, params, -1);
+	filename = g_strdup_printf("%s.%s%s", seq->seqname, processing, JOURNAL_EXT);
+	file = fopen(filename, "r");
+	if (file) {
+		read_entries(journal, file, checksum, filename);
+		fclose(file);
+	}
+
+	journal->file = fopen(filename, "w");
+	if (!journal->file) {
+		fprintf(stderr, "Journal: cannot open %s for writing\n", filename);
+		g_free(filename);
+		g_free(checksum);
+		journal_close(journal);
+		return NULL;
+	}
+	fprintf(journal->file, "V\t%d\t%s\n", JOURNAL_VERSION, checksum);
+	g_hash_table_iter_init(&iter, journal->done);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		write_entry(journal->file, GPOINTER_TO_INT(key), (struct journal_entry *) value);
+	fflush(journal->file);
+
+	if (g_hash_table_size(journal->done) > 0)
+		siril_log_message(_("Journal of a previous run found, %d images may not need to be processed again\n"),
+				g_hash_table_size(journal->done));
+	g_free(filename);
+	g_free(checksum);
+	return journal;
+}
+
+/* Returns TRUE if the image index of the sequence was done by a previous run
+ * and neither its input nor its output file changed since. The data saved
+ * with the frame is then copied in data, if not NULL. */
+gboolean journal_frame_done(struct work_journal *journal, int index, char *data, size_t size) {
+	struct journal_entry *entry;
+	char filename[256];
+
+	if (!journal || index < 0 || index >= journal->seq->number)
+		return FALSE;
+	// the table is not modified after opening, it can be read by all threads
+	entry = g_hash_table_lookup(journal->done,
+			GINT_TO_POINTER(journal->seq->imgparam[index].filenum));
+	if (!entry)
+		return FALSE;
+	if (!fit_sequence_get_image_filename(journal->seq, index, filename, TRUE) ||
+			!same_file_key(filename, entry->in_mtime, entry->in_size))
+		return FALSE;
+	if (entry->output && !same_file_key(entry->output, entry->out_mtime, entry->out_size))
+		return FALSE;
+	if (data && size > 0)
+		g_strlcpy(data, entry->data ? entry->data : "", size);
+	return TRUE;
+}
+
+/* Records that the image index of the sequence is done, once its output file,
+ * if not NULL, is written. data, if not NULL, must hold on a line without
+ * tabulation and is given back by journal_frame_done(). */
+void journal_set_done(struct work_journal *journal, int index, const char *output, const char *data) {
+	struct journal_entry entry = { 0 };
+	char filename[256];
+
+	if (!journal || index < 0 || index >= journal->seq->number)
+		return;
+	if (!fit_sequence_get_image_filename(journal->seq, index, filename, TRUE) ||
+			get_file_key(filename, &entry.in_mtime, &entry.in_size))
+		return;
+	if (output && get_file_key(output, &entry.out_mtime, &entry.out_size))
+		return;
+	entry.output = (gchar *) output;
+	entry.data = (gchar *) data;
+
+	g_mutex_lock(&journal->mutex);
+	write_entry(journal->file, journal->seq->imgparam[index].filenum, &entry);
+	fflush(journal->file);
+	g_mutex_unlock(&journal->mutex);
+}
+
+/* The journal file is kept, for the next runs */
+void journal_close(struct work_journal *journal) {
+	if (!journal) return;
+	if (journal->file)
+		fclose(journal->file);
+	g_hash_table_destroy(journal->done);
+	g_mutex_clear(&journal->mutex);
+	free(journal);
+}
+
+/* A string identifying the current state of the file of the image index, for
+ * the parameters of processings that use it as a reference. */
+gchar *journal_image_key(sequence *seq, int index) {
+	char filename[256];
+	gint64 mtime, size;
+
+	if (seq->type != SEQ_REGULAR ||
+			!fit_sequence_get_image_filename(seq, index, filename, TRUE) ||
+			get_file_key(filename, &mtime, &size))
+		return g_strdup_printf("%d", index);
+	return g_strdup_printf("%d %lld %lld", index, (long long) mtime, (long long) size);
+}
@@ -0,0 +1,43 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <glib.h>
+#include "core/siril.h"
+
+/* Journal of the frames of a sequence done by a processing, kept in a file
+ * next to the .seq file, named seqname.processing.journal. A frame is written
+ * to the journal as soon as it is done, with the keys (modification time to
+ * the nanosecond and size) of its input file and of its output file, and some
+ * data the processing needs to restore its result. When the processing is run
+ * again with the same parameters, frames which files have not changed since
+ * are skipped: an aborted processing resumes where it stopped and frames added
+ * to the sequence are processed alone.
+ * Frames are identified by their file number, only FITS sequences have one
+ * file per frame and can be journaled. */
+
+#define JOURNAL_VERSION 2
+#define JOURNAL_EXT ".journal"
+/* maximum length of the data of a frame */
+#define JOURNAL_DATA_SIZE 256
+
+struct journal_entry {
+	gint64 in_mtime, in_size;	// key of the input file
+	gint64 out_mtime, out_size;	// key of the output file, if any
+	gchar *output;			// output file name, NULL if none
+	gchar *data;			// processing data, NULL if none
+};
+
+struct work_journal {
+	sequence *seq;
+	GHashTable *done;	// filenum -> struct journal_entry, from previous runs
+	FILE *file;		// entries of this run are appended
+	GMutex mutex;		// it is filled by worker threads
+};
+
+struct work_journal *journal_open(sequence *seq, const char *processing, const char *params);
+gboolean journal_frame_done(struct work_journal *journal, int index, char *data, size_t size);
+void journal_set_done(struct work_journal *journal, int index, const char *output, const char *data);
+void journal_close(struct work_journal *journal);
+gchar *journal_image_key(sequence *seq, int index);
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Read-ahead of sequence frames, see prefetch.h.
+ * Slots are only changed with the mutex held, except the fits of a queued
+ * slot which belongs to the I/O thread reading it until it is marked read. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "io/sequence.h"
+#include "io/prefetch.h"
+
+static int read_frame(struct frame_prefetcher *pf, int index, const rectangle *area, fits *dest) {
+	int retval;
+	if (pf->io_lock)
+		g_mutex_lock(pf->io_lock);
+	if (area)
+		retval = seq_read_frame_part(pf->seq, pf->layer, index, dest,
+				area, pf->do_photometry);
+	else retval = seq_read_frame(pf->seq, index, dest);
+	if (pf->io_lock)
+		g_mutex_unlock(pf->io_lock);
+	return retval;
+}
+
+/* run by the I/O threads */
+static void read_slot(gpointer data, gpointer user_data) {
+	struct prefetch_slot *slot = (struct prefetch_slot *) data;
+	struct frame_prefetcher *pf = (struct frame_prefetcher *) user_data;
+	int retval;
+
+	retval = read_frame(pf, slot->index, slot->partial ? &slot->area : NULL, &slot->fit);
+	g_mutex_lock(&pf->mutex);
+	slot->retval = retval;
+	slot->state = SLOT_READ;
+	g_cond_broadcast(&pf->slot_read);
+	g_mutex_unlock(&pf->mutex);
+}
+
+/* number of frames that can be read in advance with the available memory */
+static int max_slots_for_memory(sequence *seq) {
+	double frame_size = (double) seq->rx * seq->ry * seq->nb_layers * sizeof(WORD);
+	double memory = PREFETCH_MEMORY_RATIO * get_available_memory_in_MB() * 1024.0 * 1024.0;
+	if (frame_size < 1.0)
+		return 0;
+	return (int) (memory / frame_size);
+}
+
+/* Creates a prefetcher for seq with at most nb_slots frames read in advance,
+ * less if memory is short. io_lock, if not NULL, is held while reading, for
+ * the sequences that cannot be read while other images are read or written.
+ * With 0 slots, or for sequences that cannot be read from several threads,
+ * requests are only hints and frames are read by prefetcher_get(). */
+struct frame_prefetcher *prefetcher_new(sequence *seq, int nb_slots, int layer,
+		gboolean do_photometry, GMutex *io_lock) {
+	struct frame_prefetcher *pf;
+	int max_slots;
+
+	pf = calloc(1, sizeof(struct frame_prefetcher));
+	if (!pf)
+		return NULL;
+	pf->seq = seq;
+	pf->layer = layer;
+	pf->do_photometry = do_photometry;
+	pf->io_lock = io_lock;
+	g_mutex_init(&pf->mutex);
+	g_cond_init(&pf->slot_read);
+
+	if (seq->type != SEQ_REGULAR && seq->type != SEQ_SER)
+		nb_slots = 0;
+	max_slots = max_slots_for_memory(seq);
+	if (nb_slots > max_slots)
+		nb_slots = max_slots;
+	if (nb_slots > 0) {
+		pf->slots = calloc(nb_slots, sizeof(struct prefetch_slot));
+		if (pf->slots)
+			pf->io_threads = g_thread_pool_new(read_slot, pf,
+					io_lock ? 1 : PREFETCH_IO_THREADS, FALSE, NULL);
+		if (!pf->io_threads) {
+			free(pf->slots);
+			pf->slots = NULL;
+		} else pf->nb_slots = nb_slots;
+	}
+	return pf;
+}
+
+/* called with the mutex held */
+static struct prefetch_slot *find_slot(struct frame_prefetcher *pf, int index) {
+	int i;
+	for (i = 0; i < pf->nb_slots; i++) {
+		if (pf->slots[i].state != SLOT_FREE && pf->slots[i].index == index)
+			return &pf->slots[i];
+	}
+	return NULL;
+}
+
+static gboolean same_area(const struct prefetch_slot *slot, const rectangle *area) {
+	if (!area)
+		return !slot->partial;
+	return slot->partial && slot->area.x == area->x && slot->area.y == area->y &&
+		slot->area.w == area->w && slot->area.h == area->h;
+}
+
+/* Announces that the frame index will be read with prefetcher_get(), for the
+ * area if not NULL. It does not block. */
+void prefetcher_request(struct frame_prefetcher *pf, int index, const rectangle *area) {
+	struct prefetch_slot *slot = NULL;
+	int i;
+
+	if (!pf || index < 0 || index >= pf->seq->number)
+		return;
+	g_mutex_lock(&pf->mutex);
+	if (find_slot(pf, index)) {
+		g_mutex_unlock(&pf->mutex);
+		return;
+	}
+	for (i = 0; i < pf->nb_slots; i++) {
+		if (pf->slots[i].state == SLOT_FREE) {
+			slot = &pf->slots[i];
+			break;
+		}
+	}
+	if (slot) {
+		slot->state = SLOT_QUEUED;
+		slot->index = index;
+		slot->partial = area != NULL;
+		if (area)
+			slot->area = *area;
+		memset(&slot->fit, 0, sizeof(fits));
+		g_thread_pool_push(pf->io_threads, slot, NULL);
+	}
+	g_mutex_unlock(&pf->mutex);
+
+	if (!slot)
+		seq_prefetch_frame(pf->seq, index);
+}
+
+/* Gets the frame index, for the area if not NULL, in dest whose data is
+ * replaced, or reused by the read. Returns the value of the read, 0 on
+ * success. */
+int prefetcher_get(struct frame_prefetcher *pf, int index, const rectangle *area, fits *dest) {
+	struct prefetch_slot *slot;
+	int retval;
+
+	g_mutex_lock(&pf->mutex);
+	slot = find_slot(pf, index);
+	if (slot) {
+		while (slot->state != SLOT_READ)
+			g_cond_wait(&pf->slot_read, &pf->mutex);
+		if (same_area(slot, area)) {
+			retval = slot->retval;
+			fits_recycle(dest);
+			if (retval)
+				fits_recycle(&slot->fit);
+			else *dest = slot->fit;
+			memset(&slot->fit, 0, sizeof(fits));
+			slot->state = SLOT_FREE;
+			pf->nb_hits++;
+			g_mutex_unlock(&pf->mutex);
+			return retval;
+		}
+		/* the area was changed by the processing after the request */
+		fits_recycle(&slot->fit);
+		slot->state = SLOT_FREE;
+	}
+	pf->nb_misses++;
+	g_mutex_unlock(&pf->mutex);
+
+	return read_frame(pf, index, area, dest);
+}
+
+/* Waits for the reads in progress and frees the frames that were not used. */
+void prefetcher_free(struct frame_prefetcher *pf) {
+	int i;
+	if (!pf) return;
+	if (pf->io_threads)
+		g_thread_pool_free(pf->io_threads, TRUE, TRUE);
+	for (i = 0; i < pf->nb_slots; i++)
+		clearfits(&pf->slots[i].fit);
+#ifdef DEBUG
+	if (pf->nb_hits)
+		fprintf(stdout, "prefetch: %d frames read in advance, %d read on demand\n",
+				pf->nb_hits, pf->nb_misses);
+#endif
+	free(pf->slots);
+	g_mutex_clear(&pf->mutex);
+	g_cond_clear(&pf->slot_read);
+	free(pf);
+}
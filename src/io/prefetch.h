@@ -0,0 +1,56 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+#include <glib.h>
+#include "core/siril.h"
+
+/* number of threads reading frames in advance for a prefetcher */
+#define PREFETCH_IO_THREADS 2
+/* part of the available memory that the frames read in advance may use */
+#define PREFETCH_MEMORY_RATIO 0.1
+
+/* Read-ahead of the frames of a sequence. Processing threads announce the
+ * frames they will process next with prefetcher_request(), I/O threads read
+ * them into a bounded pool of slots and prefetcher_get() hands the image over,
+ * waiting only if its reading is still in progress. Frames are identified by
+ * their index in the sequence, not by thread, so that a frame can be
+ * requested by a thread and processed by another. A frame that was not
+ * requested, or requested with another area, is read by the calling thread.
+ * When all slots are used, requests only give a read-ahead hint to the
+ * system, see seq_prefetch_frame(). */
+
+typedef enum {
+	SLOT_FREE,
+	SLOT_QUEUED,		// waiting for an I/O thread or being read
+	SLOT_READ
+} slot_state;
+
+struct prefetch_slot {
+	slot_state state;
+	int index;		// frame index in the sequence
+	gboolean partial;	// only area is read
+	rectangle area;
+	int retval;		// of the read, when SLOT_READ
+	fits fit;
+};
+
+struct frame_prefetcher {
+	sequence *seq;
+	int layer;		// for partial reads
+	gboolean do_photometry;	// for partial reads
+	GMutex *io_lock;	// held during reads if not NULL, not owned
+	int nb_slots;
+	struct prefetch_slot *slots;
+	GThreadPool *io_threads;
+	GMutex mutex;
+	GCond slot_read;	// signaled when a slot becomes SLOT_READ
+	int nb_hits, nb_misses;	// frames found read or not requested
+};
+
+struct frame_prefetcher *prefetcher_new(sequence *seq, int nb_slots, int layer,
+		gboolean do_photometry, GMutex *io_lock);
+void prefetcher_request(struct frame_prefetcher *pf, int index, const rectangle *area);
+int prefetcher_get(struct frame_prefetcher *pf, int index, const rectangle *area, fits *dest);
+void prefetcher_free(struct frame_prefetcher *pf);
+
+#endif
@@ -33,6 +33,7 @@
 #include "core/siril.h"
 #include "io/ser.h"
 #include "io/sequence.h"
+#include "io/stats_cache.h"
 #include "core/proto.h"
 #include "gui/callbacks.h"
 #if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
@@ -163,15 +164,19 @@ sequence * readseqfile(const char *name){
 				if (i >= seq->number) {
 					fprintf(stderr, "\nreadseqfile ERROR: out of array bounds in reg info!\n\n");
 				} else {
-					int nb_tokens = sscanf(line+3, "%d %d %g %g %g %g %lg",
+					double *t = seq->regparam[current_layer][i].transform;
+					int nb_tokens = sscanf(line+3, "%d %d %g %g %g %g %lg %lg %lg %lg %lg %lg %lg",
 							&(seq->regparam[current_layer][i].shiftx),
 							&(seq->regparam[current_layer][i].shifty),
 							&(seq->regparam[current_layer][i].rot_centre_x),
 							&(seq->regparam[current_layer][i].rot_centre_y),
 							&(seq->regparam[current_layer][i].angle),
 							&(seq->regparam[current_layer][i].fwhm),
-							&(seq->regparam[current_layer][i].quality));
-					if (nb_tokens != 7) {
+							&(seq->regparam[current_layer][i].quality),
+							t, t + 1, t + 2, t + 3, t + 4, t + 5);
+					// the transform, if any, follows the 7 usual tokens
+					seq->regparam[current_layer][i].has_transform = nb_tokens == 13;
+					if (nb_tokens != 7 && nb_tokens != 13) {
 						if (nb_tokens == 3) {
 							// old format, with quality as third token
 							seq->regparam[current_layer][i].rot_centre_x = 0.0f;
@@ -259,6 +264,7 @@ sequence * readseqfile(const char *name){
 		siril_log_message(_("Fixing the selection number in the .seq file (%d) to the actual value (%d) (not saved)\n"), seq->selnum, nbsel);
 		seq->selnum = nbsel;
 	}
+	seq_load_stats_cache(seq);
 	update_used_memory();
 	free(seqfilename);
 	return seq;
@@ -339,7 +345,7 @@ int writeseqfile(sequence *seq){
 						seq->regparam[j][i].fwhm,
 						seq->regparam[j][i].quality
 						);
-				fprintf(seqfile, "R%d %d %d %g %g %g %g %g\n", j,
+				fprintf(seqfile, "R%d %d %d %g %g %g %g %g", j,
 						seq->regparam[j][i].shiftx,
 						seq->regparam[j][i].shifty,
 						seq->regparam[j][i].rot_centre_x,
@@ -348,10 +354,17 @@ int writeseqfile(sequence *seq){
 						seq->regparam[j][i].fwhm,
 						seq->regparam[j][i].quality
 				       );
+				if (seq->regparam[j][i].has_transform) {
+					double *t = seq->regparam[j][i].transform;
+					fprintf(seqfile, " %.17g %.17g %.17g %.17g %.17g %.17g",
+							t[0], t[1], t[2], t[3], t[4], t[5]);
+				}
+				fprintf(seqfile, "\n");
 			}
 		}
 	}
 	fclose(seqfile);
+	seq_save_stats_cache(seq);
 	seq->needs_saving = FALSE;
 	return 0;
 }
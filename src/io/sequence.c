@@ -28,6 +28,7 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <dirent.h>
@@ -44,6 +45,7 @@
 #include "gui/callbacks.h"
 #include "gui/plot.h"
 #include "io/ser.h"
+#include "io/stats_cache.h"
 #if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
 #include "io/films.h"
 #endif
@@ -429,6 +431,40 @@ int set_seq(const char *name){
 	return 0;
 }
 
+/* Reads the sequence name and initializes its runtime data like set_seq()
+ * does, but without displaying it nor replacing com.seq. Used by commands
+ * that process a sequence given by its name. Returns NULL on error. */
+sequence *load_sequence(const char *name) {
+	sequence *seq;
+	fits fit;
+	int image_to_load;
+
+	if ((seq = readseqfile(name)) == NULL) {
+		siril_log_message(_("Could not load sequence %s\n"), name);
+		return NULL;
+	}
+	if (seq->reference_image != -1)
+		image_to_load = seq->reference_image;
+	else image_to_load = 0;
+
+	memset(&fit, 0, sizeof(fits));
+	if (seq_read_frame(seq, image_to_load, &fit)) {
+		siril_log_message(_("Could not load the first image of sequence %s\n"), name);
+		free_sequence(seq, TRUE);
+		return NULL;
+	}
+	seq->rx = fit.rx; seq->ry = fit.ry;
+
+	if (seq->nb_layers == -1 || seq->nb_layers != fit.naxes[2]) {	// first loading of the sequence
+		seq->nb_layers = fit.naxes[2];
+		seq->regparam = calloc(seq->nb_layers, sizeof(regdata *));
+		seq->layers = calloc(seq->nb_layers, sizeof(layer_info));
+		writeseqfile(seq);
+	}
+	clearfits(&fit);
+	return seq;
+}
+
 /* Load image number index from the sequence and display it.
  * if load_it is true, dest is assumed to be gfit
  * TODO: cut that method in two, with an internal func taking a filename and a fits
@@ -563,6 +599,32 @@ int seq_read_frame(sequence *seq, int index, fits *dest) {
 	return 0;
 }
 
+/* Starts reading the image index of the sequence in the system cache, to be
+ * called for the image that will be processed after the current one. */
+void seq_prefetch_frame(sequence *seq, int index) {
+	char filename[256];
+	if (index < 0 || index >= seq->number)
+		return;
+	switch (seq->type) {
+		case SEQ_REGULAR:
+#ifndef WIN32
+			if (fit_sequence_get_image_filename(seq, index, filename, TRUE)) {
+				int fd = open(filename, O_RDONLY);
+				if (fd >= 0) {
+					posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+					close(fd);
+				}
+			}
+#endif
+			break;
+		case SEQ_SER:
+			ser_prefetch_frame(seq->ser_file, index);
+			break;
+		default:
+			break;
+	}
+}
+
 /* same as seq_read_frame above, but creates an image the size of the selection
  * rectangle only. layer is set to the layer number in the read partial frame.
  * The partial image result is only one-channel deep, so it cannot be used to
@@ -837,10 +899,12 @@ void free_sequence(sequence *seq, gboolean free_seq_too) {
 	static GtkComboBoxText *cbbt_layers = NULL;
 	int i, j;
 		
-	if (cbbt_layers == NULL)
-		cbbt_layers = GTK_COMBO_BOX_TEXT(gtk_builder_get_object(
-					builder, "comboboxreglayer"));
-	gtk_combo_box_text_remove_all(cbbt_layers);
+	if (!com.headless) {
+		if (cbbt_layers == NULL)
+			cbbt_layers = GTK_COMBO_BOX_TEXT(gtk_builder_get_object(
+						builder, "comboboxreglayer"));
+		gtk_combo_box_text_remove_all(cbbt_layers);
+	}
 	
 	if (seq == NULL) return;
 	if (seq->nb_layers > 0 && seq->regparam) {
@@ -871,6 +935,7 @@ void free_sequence(sequence *seq, gboolean free_seq_too) {
 				free(seq->imgparam[i].date_obs);
 		}
 	}
+	if (seq->stats_cache)	stats_cache_free(seq->stats_cache);
 	if (seq->seqname)	free(seq->seqname);
 	if (seq->layers)	free(seq->layers);
 	if (seq->imgparam)	free(seq->imgparam);
@@ -1108,13 +1173,21 @@ gboolean sequence_is_rgb(sequence *seq) {
  * Do not free result.
  */
 imstats* seq_get_imstats(sequence *seq, int index, fits *the_image, int option) {
+	imstats stat;
 	assert(seq->imgparam);
+	if (!seq->imgparam[index].stats &&
+			stats_cache_get(seq->stats_cache, index, 0, option, &stat)) {
+		seq->imgparam[index].stats = malloc(sizeof(imstats));
+		if (seq->imgparam[index].stats)
+			memcpy(seq->imgparam[index].stats, &stat, sizeof(imstats));
+	}
 	if (!seq->imgparam[index].stats && the_image) {
 		seq->imgparam[index].stats = statistics(the_image, 0, NULL, option, STATS_ZERO_NULLCHECK);
 		if (!seq->imgparam[index].stats) {
 			siril_log_message(_("Error: no data computed.\n"));
 			return NULL;
 		}
+		stats_cache_set(seq->stats_cache, index, 0, option, seq->imgparam[index].stats);
 		seq->needs_saving = TRUE;
 	}
 	return seq->imgparam[index].stats;
@@ -1786,7 +1859,7 @@ int seqpsf(sequence *seq, int layer, gboolean for_registration,
 		return 1;
 	}
 
-	struct generic_seq_args *args = malloc(sizeof(struct generic_seq_args));
+	struct generic_seq_args *args = calloc(1, sizeof(struct generic_seq_args));
 	struct seqpsf_args *spsfargs = malloc(sizeof(struct seqpsf_args));
 
 	spsfargs->for_registration = for_registration;
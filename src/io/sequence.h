@@ -8,9 +8,11 @@ int	seqsetnum(int image_number);
 int	check_seq(int force);
 int	check_only_one_film_seq(char* name);
 int	set_seq(const char *);
+sequence *	load_sequence(const char *name);
 char *	seq_get_image_filename(sequence *seq, int index, char *name_buf);
 int	seq_read_frame(sequence *seq, int index, fits *dest);
 int	seq_read_frame_part(sequence *seq, int layer, int index, fits *dest, const rectangle *area, gboolean do_photometry);
+void	seq_prefetch_frame(sequence *seq, int index);
 int	seq_load_image(sequence *seq, int index, fits *dest, gboolean load_it);
 int	seq_open_image(sequence *seq, int index);
 void	seq_close_image(sequence *seq, int index);
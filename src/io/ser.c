@@ -30,9 +30,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include "core/siril.h"
 #include "core/proto.h"
+#include "core/image_pool.h"
 #include "gui/callbacks.h"
 #include "algos/demosaicing.h"
 #include "io/ser.h"
@@ -458,24 +463,121 @@ static int retrieveSERBayerPattern(ser_color pattern) {
 	}
 }
 
-/* once a buffer (data) has been acquired from the file, with frame_size pixels
- * read in it, depending on ser_file's endianess and pixel depth, data is
- * reorganized to match Siril's data format . */
-void ser_manage_endianess_and_depth(struct ser_struct *ser_file, WORD *data, int frame_size) {
-	WORD pixel;
+/* Converts a row of w pixels of the file, starting at src, to Siril's data
+ * format in dest. step is the number of values per pixel in the file, to
+ * extract one channel of interleaved RGB data. */
+static void ser_convert_row(struct ser_struct *ser_file, const BYTE *src,
+		int w, int step, WORD *dest) {
 	int i;
 	if (ser_file->byte_pixel_depth == SER_PIXEL_DEPTH_8) {
-		// inline conversion to 16 bit
-		for (i = frame_size - 1; i >= 0; i--)
-			data[i] = (WORD) (((BYTE*)data)[i]);
+		for (i = 0; i < w; i++)
+			dest[i] = (WORD) src[i * step];
 	} else if (ser_file->little_endian == SER_BIG_ENDIAN) {
-		// inline conversion
-		for (i = frame_size - 1; i >= 0; i--) {
-			pixel = data[i];
-			pixel = (pixel >> 8) | (pixel << 8);
-			data[i] = pixel;
+		const WORD *src16 = (const WORD *) src;
+		for (i = 0; i < w; i++) {
+			WORD pixel = src16[i * step];
+			dest[i] = (pixel >> 8) | (pixel << 8);
+		}
+	} else if (step == 1) {
+		memcpy(dest, src, w * sizeof(WORD));
+	} else {
+		const WORD *src16 = (const WORD *) src;
+		for (i = 0; i < w; i++)
+			dest[i] = src16[i * step];
+	}
+}
+
+/* Converts an area of w x h pixels of a frame, src being the address of its
+ * first pixel in the file, to Siril's data format in dest. Depth, endianness,
+ * extraction of the channel and vertical flip are done in the same pass. */
+static void ser_convert_area(struct ser_struct *ser_file, const BYTE *src,
+		int w, int h, int channel, gboolean flip, WORD *dest) {
+	size_t stride = (size_t) ser_file->image_width *
+		ser_file->number_of_planes * ser_file->byte_pixel_depth;
+	int y;
+
+	src += channel * ser_file->byte_pixel_depth;
+	for (y = 0; y < h; y++) {
+		WORD *row = dest + (size_t) (flip ? h - 1 - y : y) * w;
+		ser_convert_row(ser_file, src + y * stride, w,
+				ser_file->number_of_planes, row);
+	}
+}
+
+/* Returns the address of size bytes of the file, starting at offset. When the
+ * file is mapped in memory, this is a view of the mapping and no lock is
+ * needed. Otherwise, data is read in a buffer that is returned in to_free and
+ * has to be freed by the caller. Returns NULL on error. */
+static const BYTE *ser_get_data(struct ser_struct *ser_file, off_t offset,
+		size_t size, BYTE **to_free) {
+	BYTE *buf;
+	ssize_t retval;
+
+	*to_free = NULL;
+	if (ser_file->map) {
+		if (offset < 0 || offset + (off_t) size > (off_t) ser_file->map_size) {
+			fprintf(stderr, "SER: trying to read after the end of %s\n",
+					ser_file->filename);
+			return NULL;
 		}
+		return ser_file->map + offset;
+	}
+
+	buf = image_buffer_get(size);
+	if (!buf) {
+		siril_log_message(_("Out of memory - aborting\n"));
+		return NULL;
+	}
+#ifdef _OPENMP
+	omp_set_lock(&ser_file->fd_lock);
+#endif
+	if ((off_t) -1 == lseek(ser_file->fd, offset, SEEK_SET)) {
+#ifdef _OPENMP
+		omp_unset_lock(&ser_file->fd_lock);
+#endif
+		free(buf);
+		return NULL;
 	}
+	retval = read(ser_file->fd, buf, size);
+#ifdef _OPENMP
+	omp_unset_lock(&ser_file->fd_lock);
+#endif
+	if (retval != (ssize_t) size) {
+		perror("read");
+		free(buf);
+		return NULL;
+	}
+	*to_free = buf;
+	return buf;
+}
+
+/* Maps the file in memory for reading, which allows frames to be read by
+ * several threads without locking and without copying. If it fails, frames
+ * are read with read(2) instead. */
+static void ser_map_file(struct ser_struct *ser_file) {
+#ifndef WIN32
+	void *map;
+	if (ser_file->filesize <= SER_HEADER_LEN ||
+			(uint64_t) ser_file->filesize > (uint64_t) SIZE_MAX)
+		return;
+	map = mmap(NULL, (size_t) ser_file->filesize, PROT_READ, MAP_SHARED,
+			ser_file->fd, 0);
+	if (map == MAP_FAILED) {
+		perror("SER file mmap");
+		return;
+	}
+	ser_file->map = (BYTE *) map;
+	ser_file->map_size = (size_t) ser_file->filesize;
+#endif
+}
+
+static void ser_unmap_file(struct ser_struct *ser_file) {
+#ifndef WIN32
+	if (ser_file->map)
+		munmap(ser_file->map, ser_file->map_size);
+#endif
+	ser_file->map = NULL;
+	ser_file->map_size = 0;
 }
 
 /*
@@ -601,6 +703,7 @@ int ser_open_file(char *filename, struct ser_struct *ser_file) {
 		return -1;
 	}
 	ser_file->filename = strdup(filename);
+	ser_map_file(ser_file);
 
 #ifdef _OPENMP
 	omp_init_lock(&ser_file->fd_lock);
@@ -612,6 +715,7 @@ int ser_close_file(struct ser_struct *ser_file) {
 	int retval = 0;
 	if (!ser_file)
 		return retval;
+	ser_unmap_file(ser_file);
 	if (ser_file->fd > 0) {
 		retval = close(ser_file->fd);
 		ser_file->fd = -1;
@@ -635,16 +739,26 @@ void ser_init_struct(struct ser_struct *ser_file) {
 
 /* frame number starts at 0 */
 int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit) {
-	int retval, frame_size, i, j, swap = 0;
+	return ser_read_frame_debayer(ser_file, frame_no, fit, com.debayer.open_debayer);
+}
+
+/* same as ser_read_frame, but CFA frames are demosaiced if demosaic is set
+ * instead of following the opening setting */
+int ser_read_frame_debayer(struct ser_struct *ser_file, int frame_no, fits *fit,
+		gboolean demosaic) {
+	int frame_size, npixels, y, layer, color_offset;
+	size_t stride, frame_bytes;
 	off_t offset;
-	WORD *olddata, *tmp;
+	const BYTE *frame;
+	BYTE *to_free;
+	WORD *olddata;
 	if (!ser_file || ser_file->fd <= 0 || !ser_file->number_of_planes ||
 			!fit || frame_no < 0 || frame_no >= ser_file->frame_count)
 		return -1;
-	frame_size = ser_file->image_width * ser_file->image_height
-			* ser_file->number_of_planes;
+	npixels = ser_file->image_width * ser_file->image_height;
+	frame_size = npixels * ser_file->number_of_planes;
 	olddata = fit->data;
-	if ((fit->data = realloc(fit->data, frame_size * sizeof(WORD))) == NULL) {
+	if ((fit->data = image_buffer_realloc(fit->data, frame_size * sizeof(WORD))) == NULL) {
 		fprintf(stderr, "ser_read: error realloc %s %d\n", ser_file->filename,
 				frame_size);
 		if (olddata)
@@ -652,27 +766,16 @@ int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit) {
 		return -1;
 	}
 
-	offset = SER_HEADER_LEN + (off_t)frame_size *
-		(off_t)ser_file->byte_pixel_depth * (off_t)frame_no;
+	stride = (size_t) ser_file->image_width * ser_file->number_of_planes *
+		ser_file->byte_pixel_depth;
+	offset = SER_HEADER_LEN + (off_t) stride *
+		(off_t) ser_file->image_height * (off_t) frame_no;
 	/*fprintf(stdout, "offset is %lu (frame %d, %d pixels, %d-byte)\n", offset,
 	 frame_no, frame_size, ser_file->pixel_bytedepth);*/
-#ifdef _OPENMP
-	omp_set_lock(&ser_file->fd_lock);
-#endif
-	if ((off_t) -1 == lseek(ser_file->fd, offset, SEEK_SET)) {
-#ifdef _OPENMP
-		omp_unset_lock(&ser_file->fd_lock);
-#endif
+	frame_bytes = stride * ser_file->image_height;
+	frame = ser_get_data(ser_file, offset, frame_bytes, &to_free);
+	if (!frame)
 		return -1;
-	}
-	retval = read(ser_file->fd, fit->data, frame_size * ser_file->byte_pixel_depth);
-#ifdef _OPENMP
-	omp_unset_lock(&ser_file->fd_lock);
-#endif
-	if (retval != frame_size * ser_file->byte_pixel_depth)
-		return -1;
-
-	ser_manage_endianess_and_depth(ser_file, fit->data, frame_size);
 
 	fit->bitpix = (ser_file->byte_pixel_depth == SER_PIXEL_DEPTH_8) ? BYTE_IMG : USHORT_IMG;
 
@@ -680,7 +783,7 @@ int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit) {
 	 * RGB and BGR are not coming from raw data. In consequence CFA does
 	 * not exist for these kind of cam */
 	ser_color type_ser = ser_file->color_id;
-	if (!com.debayer.open_debayer && type_ser != SER_RGB && type_ser != SER_BGR)
+	if (!demosaic && type_ser != SER_RGB && type_ser != SER_BGR)
 		type_ser = SER_MONO;
 
 	switch (type_ser) {
@@ -692,6 +795,7 @@ int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit) {
 		fit->pdata[RLAYER] = fit->data;
 		fit->pdata[GLAYER] = fit->data;
 		fit->pdata[BLAYER] = fit->data;
+		ser_convert_area(ser_file, frame, fit->rx, fit->ry, 0, TRUE, fit->data);
 		break;
 	case SER_BAYER_RGGB:
 	case SER_BAYER_BGGR:
@@ -700,15 +804,24 @@ int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit) {
 		fit->naxes[0] = fit->rx = ser_file->image_width;
 		fit->naxes[1] = fit->ry = ser_file->image_height;
 		fit->naxes[2] = 3;
-		/* Get Bayer informations from header if available */
-		sensor_pattern sensortmp;
-		sensortmp = com.debayer.bayer_pattern;
+		/* the pattern is given for the orientation of the file, the
+		 * image is flipped after demosaicing */
+		ser_convert_area(ser_file, frame, fit->rx, fit->ry, 0, FALSE, fit->data);
+		if (to_free) {
+			image_buffer_release(to_free, frame_bytes);
+			to_free = NULL;
+		}
+		/* Get Bayer informations from header if available. The settings
+		 * are not modified, frames may be read by several threads */
+		sensor_pattern pattern;
+		pattern = com.debayer.bayer_pattern;
 		if (com.debayer.use_bayer_header) {
 			sensor_pattern bayer;
 			bayer = retrieveSERBayerPattern(type_ser);
 			if (bayer != com.debayer.bayer_pattern) {
-				if (bayer == BAYER_FILTER_NONE  && warning == FALSE) {
-					siril_log_color_message(_("No Bayer pattern found in the header file.\n"), "red");
+				if (bayer == BAYER_FILTER_NONE) {
+					if (warning == FALSE)
+						siril_log_color_message(_("No Bayer pattern found in the header file.\n"), "red");
 				}
 				else {
 					if (warning == FALSE) {
@@ -716,33 +829,32 @@ int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit) {
 								" from Bayer pattern in settings (%s). Overriding settings.\n"),
 								"red", filter_pattern[bayer], filter_pattern[com.debayer.bayer_pattern]);
 					}
-					com.debayer.bayer_pattern = bayer;
+					pattern = bayer;
 				}
 				warning = TRUE;
 			}
 		}
-		debayer(fit, com.debayer.bayer_inter);
-		com.debayer.bayer_pattern = sensortmp;
+		debayer(fit, com.debayer.bayer_inter, pattern);
+		fits_flip_top_to_bottom(fit);
 		break;
 	case SER_BGR:
-		swap = 2;
-		/* no break */
 	case SER_RGB:
-		tmp = malloc(frame_size * sizeof(WORD));
-		memcpy(tmp, fit->data, sizeof(WORD) * frame_size);
 		fit->naxes[0] = fit->rx = ser_file->image_width;
 		fit->naxes[1] = fit->ry = ser_file->image_height;
 		fit->naxes[2] = 3;
 		fit->naxis = 3;
 		fit->pdata[RLAYER] = fit->data;
-		fit->pdata[GLAYER] = fit->data + fit->rx * fit->ry;
-		fit->pdata[BLAYER] = fit->data + fit->rx * fit->ry * 2;
-		for (i = 0, j = 0; j < fit->rx * fit->ry; i += 3, j++) {
-			fit->pdata[0 + swap][j] = tmp[i + RLAYER];
-			fit->pdata[1][j] = tmp[i + GLAYER];
-			fit->pdata[2 - swap][j] = tmp[i + BLAYER];
+		fit->pdata[GLAYER] = fit->data + npixels;
+		fit->pdata[BLAYER] = fit->data + npixels * 2;
+		/* the three channels of a row are extracted while it is in cache */
+		for (y = 0; y < fit->ry; y++) {
+			for (layer = 0; layer < 3; layer++) {
+				color_offset = type_ser == SER_BGR ? 2 - layer : layer;
+				ser_convert_row(ser_file, frame + y * stride +
+						color_offset * ser_file->byte_pixel_depth,
+						fit->rx, 3, fit->pdata[layer] + (fit->ry - 1 - y) * fit->rx);
+			}
 		}
-		free(tmp);
 		break;
 	case SER_BAYER_CYYM:
 	case SER_BAYER_YCMY:
@@ -750,27 +862,61 @@ int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit) {
 	case SER_BAYER_MYYC:
 	default:
 		siril_log_message(_("This type of Bayer pattern is not handled yet.\n"));
+		if (to_free)
+			image_buffer_release(to_free, frame_bytes);
 		return -1;
 	}
-	fits_flip_top_to_bottom(fit);
+	if (to_free)
+		image_buffer_release(to_free, frame_bytes);
+	return 0;
+}
+
+/* Tells the system that the frame will be read soon, so that it can be read
+ * from the disk while the current one is processed */
+int ser_prefetch_frame(struct ser_struct *ser_file, int frame_no) {
+#ifndef WIN32
+	size_t size;
+	off_t offset;
+	if (!ser_file || ser_file->fd <= 0 || frame_no < 0 ||
+			frame_no >= ser_file->frame_count)
+		return -1;
+	size = (size_t) ser_file->image_width * ser_file->number_of_planes *
+		ser_file->byte_pixel_depth * ser_file->image_height;
+	offset = SER_HEADER_LEN + (off_t) size * (off_t) frame_no;
+	if (ser_file->map) {
+		/* madvise needs an address aligned on a page */
+		long pagesize = sysconf(_SC_PAGESIZE);
+		off_t start = pagesize > 0 ? offset - offset % pagesize : offset;
+		if (offset + (off_t) size > (off_t) ser_file->map_size)
+			return -1;
+		return madvise(ser_file->map + start, size + (offset - start), MADV_WILLNEED);
+	}
+	return posix_fadvise(ser_file->fd, offset, size, POSIX_FADV_WILLNEED);
+#else
 	return 0;
+#endif
 }
 
 /* read an area of an image in an opened SER sequence */
 int ser_read_opened_partial(struct ser_struct *ser_file, int layer,
 		int frame_no, WORD *buffer, const rectangle *area) {
-	off_t offset;
-	int frame_size, read_size, retval, xoffset, yoffset, x, y, color_offset;
+	off_t frame_offset;
+	size_t stride, read_size;
+	int xoffset, yoffset, x, y, color_offset;
 	ser_color type_ser;
-	WORD *rawbuf, *demosaiced_buf, *rgb_buf;
+	const BYTE *data;
+	BYTE *to_free;
+	WORD *rawbuf, *demosaiced_buf;
 	rectangle debayer_area, image_area;
-	sensor_pattern sensortmp;
+	sensor_pattern pattern;
 
 	if (!ser_file || ser_file->fd <= 0 || frame_no < 0
 			|| frame_no >= ser_file->frame_count)
 		return -1;
-	frame_size = ser_file->image_width * ser_file->image_height *
-		ser_file->number_of_planes * ser_file->byte_pixel_depth;
+	stride = (size_t) ser_file->image_width * ser_file->number_of_planes *
+		ser_file->byte_pixel_depth;
+	frame_offset = SER_HEADER_LEN + (off_t) stride *
+		(off_t) ser_file->image_height * (off_t) frame_no;
 
 	/* If the user checks the SER CFA box, the video is opened in B&W
 	 * RGB and BGR are not coming from raw data. In consequence CFA does
@@ -782,27 +928,16 @@ int ser_read_opened_partial(struct ser_struct *ser_file, int layer,
 
 	switch (type_ser) {
 	case SER_MONO:
-		offset = SER_HEADER_LEN + (off_t)frame_size * (off_t)frame_no +	// requested frame
-			(off_t)(area->y * ser_file->image_width + area->x)
-						* ser_file->byte_pixel_depth;	// requested area
-#ifdef _OPENMP
-		omp_set_lock(&ser_file->fd_lock);
-#endif
-		if ((off_t) -1 == lseek(ser_file->fd, offset, SEEK_SET)) {
-#ifdef _OPENMP
-			omp_unset_lock(&ser_file->fd_lock);
-#endif
-			return -1;
-		}
-		read_size = area->w * area->h * ser_file->byte_pixel_depth;
-		retval = read(ser_file->fd, buffer, read_size);
-#ifdef _OPENMP
-		omp_unset_lock(&ser_file->fd_lock);
-#endif
-		if (retval != read_size)
+		/* from the first pixel of the area to the last, rows of the area
+		 * are not contiguous in the file */
+		read_size = (area->h - 1) * stride + area->w * ser_file->byte_pixel_depth;
+		data = ser_get_data(ser_file, frame_offset + (off_t) area->y * stride +
+				(off_t) area->x * ser_file->byte_pixel_depth, read_size, &to_free);
+		if (!data)
 			return -1;
-
-		ser_manage_endianess_and_depth(ser_file, buffer, area->w * area->h);
+		ser_convert_area(ser_file, data, area->w, area->h, 0, FALSE, buffer);
+		if (to_free)
+			free(to_free);
 		break;
 
 	case SER_BAYER_RGGB:
@@ -814,8 +949,9 @@ int ser_read_opened_partial(struct ser_struct *ser_file, int layer,
 		 * requested area, giving 3 channels in form of RGBRGBRGB buffers, and finally
 		 * we extract one of the three channels and crop it to the requested area. */
 
-		/* Get Bayer informations from header if available */
-		sensortmp = com.debayer.bayer_pattern;
+		/* Get Bayer informations from header if available. The settings
+		 * are not modified, areas may be read by several threads */
+		pattern = com.debayer.bayer_pattern;
 		if (com.debayer.use_bayer_header) {
 			sensor_pattern bayer;
 			bayer = retrieveSERBayerPattern(type_ser);
@@ -829,7 +965,7 @@ int ser_read_opened_partial(struct ser_struct *ser_file, int layer,
 								" from Bayer pattern in settings (%s). Overriding settings.\n"),
 								"red", filter_pattern[bayer], filter_pattern[com.debayer.bayer_pattern]);
 					}
-					com.debayer.bayer_pattern = bayer;
+					pattern = bayer;
 				}
 				warning = TRUE;
 			}
@@ -843,48 +979,30 @@ int ser_read_opened_partial(struct ser_struct *ser_file, int layer,
 			.w = ser_file->image_width, .h = ser_file->image_height };
 		get_debayer_area(area, &debayer_area, &image_area, &xoffset, &yoffset);
 
-		offset = SER_HEADER_LEN + frame_size * frame_no +	// requested frame
-				(debayer_area.y * ser_file->image_width + debayer_area.x)
-						* ser_file->byte_pixel_depth;	// requested area
-#ifdef _OPENMP
-		omp_set_lock(&ser_file->fd_lock);
-#endif
-		if ((off_t) -1 == lseek(ser_file->fd, offset, SEEK_SET)) {
-#ifdef _OPENMP
-			omp_unset_lock(&ser_file->fd_lock);
-#endif
+		read_size = (debayer_area.h - 1) * stride +
+			debayer_area.w * ser_file->byte_pixel_depth;
+		data = ser_get_data(ser_file, frame_offset + (off_t) debayer_area.y * stride +
+				(off_t) debayer_area.x * ser_file->byte_pixel_depth, read_size, &to_free);
+		if (!data)
 			return -1;
-		}
 
-		// allocating a buffer for WORD because it's going to be converted in-place
 		rawbuf = malloc(debayer_area.w * debayer_area.h * sizeof(WORD));
 		if (!rawbuf) {
-#ifdef _OPENMP
-			omp_unset_lock(&ser_file->fd_lock);
-#endif
+			if (to_free)
+				free(to_free);
 			siril_log_message(_("Out of memory - aborting\n"));
 			return -1;
 		}
-		read_size = debayer_area.w * debayer_area.h * ser_file->byte_pixel_depth;
-		retval = read(ser_file->fd, rawbuf, read_size);
-#ifdef _OPENMP
-		omp_unset_lock(&ser_file->fd_lock);
-#endif
-		if (retval != read_size) {
-			free(rawbuf);
-			perror("read");
-			return -1;
-		}
-
-		ser_manage_endianess_and_depth(ser_file, rawbuf, debayer_area.w * debayer_area.h);
+		ser_convert_area(ser_file, data, debayer_area.w, debayer_area.h, 0, FALSE, rawbuf);
+		if (to_free)
+			free(to_free);
 
 		demosaiced_buf = debayer_buffer(rawbuf, &debayer_area.w,
 				&debayer_area.h, com.debayer.bayer_inter,
-				com.debayer.bayer_pattern);
+				pattern);
 		free(rawbuf);
-		if (demosaiced_buf == NULL) {
+		if (demosaiced_buf == NULL)
 			return -1;
-		}
 
 		/* area is the destination area.
 		 * debayer_area is the demosaiced buf area.
@@ -897,58 +1015,24 @@ int ser_read_opened_partial(struct ser_struct *ser_file, int layer,
 		}
 
 		free(demosaiced_buf);
-		com.debayer.bayer_pattern = sensortmp;
 		break;
 	case SER_BGR:
 	case SER_RGB:
 		assert(ser_file->number_of_planes == 3);
 
-		offset = SER_HEADER_LEN + frame_size * frame_no +	// requested frame
-			(area->y * ser_file->image_width + area->x) *
-			ser_file->byte_pixel_depth * 3;	// requested area
-#ifdef _OPENMP
-		omp_set_lock(&ser_file->fd_lock);
-#endif
-		if ((off_t) -1 == lseek(ser_file->fd, offset, SEEK_SET)) {
-#ifdef _OPENMP
-			omp_unset_lock(&ser_file->fd_lock);
-#endif
+		read_size = (area->h - 1) * stride + area->w * ser_file->byte_pixel_depth * 3;
+		data = ser_get_data(ser_file, frame_offset + (off_t) area->y * stride +
+				(off_t) area->x * ser_file->byte_pixel_depth * 3, read_size, &to_free);
+		if (!data)
 			return -1;
-		}
-
-		read_size = area->w * area->h * ser_file->byte_pixel_depth * 3;
-		// allocating a buffer for WORD because it's going to be converted in-place
-		rgb_buf = malloc(area->w * area->h * 3 * sizeof(WORD));
-		if (!rgb_buf) {
-#ifdef _OPENMP
-			omp_unset_lock(&ser_file->fd_lock);
-#endif
-			siril_log_message(_("Out of memory - aborting\n"));
-			return -1;
-		}
-		retval = read(ser_file->fd, rgb_buf, read_size);
-#ifdef _OPENMP
-		omp_unset_lock(&ser_file->fd_lock);
-#endif
-		if (retval != read_size) {
-			free(rgb_buf);
-			perror("read");
-			return -1;
-		}
-
-		ser_manage_endianess_and_depth(ser_file, rgb_buf, area->w * area->h * 3);
 
 		color_offset = layer;
 		if (type_ser == SER_BGR) {
 			color_offset = 2 - layer;
 		}
-
-		for (y = 0; y < area->h; y++) {
-			for (x = 0; x < area->w; x++) {
-				buffer[y*area->w + x] = rgb_buf[y*area->w*3 + x*3 + color_offset]; 
-			}
-		}
-		free(rgb_buf);
+		ser_convert_area(ser_file, data, area->w, area->h, color_offset, FALSE, buffer);
+		if (to_free)
+			free(to_free);
 		break;
 	default:
 		siril_log_message(_("This type of Bayer pattern is not handled yet.\n"));
@@ -79,8 +79,10 @@ struct ser_struct {
 	unsigned int number_of_planes;	// derived from the color_id
 	int fd;
 	char *filename;
+	unsigned char *map;		// file mapped in memory for reading, or NULL
+	size_t map_size;
 #ifdef _OPENMP
-	omp_lock_t fd_lock;
+	omp_lock_t fd_lock;		// for writes and reads when the file is not mapped
 #endif
 };
 
@@ -92,6 +94,9 @@ int ser_write_and_close(struct ser_struct *ser_file);
 int ser_create_file(const char *filename, struct ser_struct *ser_file, gboolean overwrite, struct ser_struct *copy_from);
 int ser_close_file(struct ser_struct *ser_file);
 int ser_read_frame(struct ser_struct *ser_file, int frame_no, fits *fit);
+int ser_read_frame_debayer(struct ser_struct *ser_file, int frame_no, fits *fit,
+		gboolean demosaic);
+int ser_prefetch_frame(struct ser_struct *ser_file, int frame_no);
 int ser_read_opened_partial(struct ser_struct *ser_file, int layer,
 		int frame_no, WORD *buffer, const rectangle *area);
 int ser_write_frame_from_fit(struct ser_struct *ser_file, fits *fit, int frame);
@@ -234,6 +234,17 @@ int image_find_minmax(fits *fit, int force_minmax){
 		fit->max[layer] = 0;
 		fit->min[layer] = USHRT_MAX;
 
+		if (fit->type == DATA_FLOAT) {
+			/* min and max are kept in 16 bits, rounded */
+			float *fbuf = fit->fpdata[layer], fmin = USHRT_MAX_SINGLE, fmax = 0.0f;
+			for (i = 0; i < fit->rx * fit->ry; ++i) {
+				fmax = max(fmax, fbuf[i]);
+				fmin = min(fmin, fbuf[i]);
+			}
+			fit->max[layer] = round_to_WORD((double) fmax);
+			fit->min[layer] = round_to_WORD((double) fmin);
+			continue;
+		}
 		for (i = 0; i < fit->rx * fit->ry; ++i) {
 			fit->max[layer] = max(fit->max[layer], buf[i]);
 			fit->min[layer] = min(fit->min[layer], buf[i]);
@@ -0,0 +1,313 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Persistent statistics of the images of a sequence, see stats_cache.h.
+ * The file is a text file like the .seq file:
+ *	V version nb_images
+ *	K index mtime size		for each image file
+ *	S index layer option layername ...	for each computed layer
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "io/sequence.h"
+#include "io/ser.h"
+#if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
+#include "io/films.h"
+#endif
+#include "io/stats_cache.h"
+#include "gui/callbacks.h"
+
+struct stats_cache *stats_cache_new(int nb_images) {
+	struct stats_cache *cache;
+	int i;
+
+	if (nb_images <= 0)
+		return NULL;
+	cache = calloc(1, sizeof(struct stats_cache));
+	if (!cache)
+		return NULL;
+	cache->entries = calloc(nb_images, sizeof(struct stats_cache_entry));
+	if (!cache->entries) {
+		free(cache);
+		return NULL;
+	}
+	for (i = 0; i < nb_images; i++)
+		cache->entries[i].size = -1;
+	cache->nb_images = nb_images;
+	g_mutex_init(&cache->mutex);
+	return cache;
+}
+
+void stats_cache_free(struct stats_cache *cache) {
+	if (!cache) return;
+	g_mutex_clear(&cache->mutex);
+	free(cache->entries);
+	free(cache);
+}
+
+/* copies the statistics of a layer of an image in stat, if those requested
+ * by option have been computed. Returns TRUE if they are available. */
+gboolean stats_cache_get(struct stats_cache *cache, int index, int layer,
+		int option, imstats *stat) {
+	gboolean found = FALSE;
+	if (!cache || index < 0 || index >= cache->nb_images || layer < 0 || layer > 2)
+		return FALSE;
+	g_mutex_lock(&cache->mutex);
+	if (cache->entries[index].option[layer] &&
+			(cache->entries[index].option[layer] & option) == option) {
+		memcpy(stat, &cache->entries[index].stats[layer], sizeof(imstats));
+		found = TRUE;
+	}
+	g_mutex_unlock(&cache->mutex);
+	return found;
+}
+
+void stats_cache_set(struct stats_cache *cache, int index, int layer,
+		int option, const imstats *stat) {
+	if (!cache || !stat || index < 0 || index >= cache->nb_images || layer < 0 || layer > 2)
+		return;
+	g_mutex_lock(&cache->mutex);
+	memcpy(&cache->entries[index].stats[layer], stat, sizeof(imstats));
+	cache->entries[index].option[layer] = option;
+	cache->modified = TRUE;
+	g_mutex_unlock(&cache->mutex);
+}
+
+/* drops the statistics of all images, keys of the files are kept */
+void stats_cache_clear(struct stats_cache *cache) {
+	int i;
+
+	if (!cache)
+		return;
+	g_mutex_lock(&cache->mutex);
+	for (i = 0; i < cache->nb_images; i++)
+		memset(cache->entries[i].option, 0, sizeof(cache->entries[i].option));
+	cache->modified = TRUE;
+	g_mutex_unlock(&cache->mutex);
+}
+
+/* Sets the key of an image to the current state of its file. Statistics of
+ * an image which file has changed since they were computed are dropped.
+ * Returns 0 if the file exists. */
+int stats_cache_set_key(struct stats_cache *cache, int index, const char *filename) {
+	struct stat sts;
+	struct stats_cache_entry *entry;
+	int retval = 0;
+
+	if (!cache || index < 0 || index >= cache->nb_images)
+		return -1;
+	entry = &cache->entries[index];
+	g_mutex_lock(&cache->mutex);
+	if (!filename || stat(filename, &sts)) {
+		memset(entry->option, 0, sizeof(entry->option));
+		entry->size = -1;
+		retval = -1;
+	} else if (entry->size != (gint64) sts.st_size ||
+			entry->mtime != (gint64) sts.st_mtime) {
+		if (entry->size >= 0)
+			memset(entry->option, 0, sizeof(entry->option));
+		entry->size = (gint64) sts.st_size;
+		entry->mtime = (gint64) sts.st_mtime;
+		cache->modified = TRUE;
+	}
+	g_mutex_unlock(&cache->mutex);
+	return retval;
+}
+
+/* Reads the statistics file of the sequence seqname. Returns NULL if it does
+ * not exist or if it does not match the sequence or the current version. */
+struct stats_cache *stats_cache_read(const char *seqname, int nb_images) {
+	char line[512], layername[6];
+	struct stats_cache *cache = NULL;
+	struct stats_cache_entry *entry;
+	FILE *file;
+	gchar *filename;
+	int version, number, index, layer, option;
+	long long mtime, size;
+	imstats stat;
+
+	if (!seqname || nb_images <= 0)
+		return NULL;
+	filename = g_strdup_printf("%s%s", seqname, STATS_CACHE_EXT);
+	file = fopen(filename, "r");
+	if (!file) {
+		g_free(filename);
+		return NULL;
+	}
+	while (fgets(line, 511, file)) {
+		switch (line[0]) {
+			case '#':
+				continue;
+			case 'V':
+				if (sscanf(line + 2, "%d %d", &version, &number) != 2 ||
+						version != STATS_CACHE_VERSION || number != nb_images) {
+					fprintf(stdout, "Statistics file %s is outdated, ignoring it\n", filename);
+					goto error;
+				}
+				cache = stats_cache_new(nb_images);
+				if (!cache)
+					goto error;
+				break;
+			case 'K':
+				if (!cache || sscanf(line + 2, "%d %lld %lld", &index, &mtime, &size) != 3 ||
+						index < 0 || index >= nb_images) {
+					fprintf(stderr, "Statistics file format error: %s\n", line);
+					goto error;
+				}
+				cache->entries[index].mtime = (gint64) mtime;
+				cache->entries[index].size = (gint64) size;
+				break;
+			case 'S':
+				memset(&stat, 0, sizeof(imstats));
+				if (!cache || sscanf(line + 2,
+							"%d %d %d %5s %ld %ld %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg",
+							&index, &layer, &option, layername,
+							&stat.ngoodpix, &stat.total, &stat.mean, &stat.median,
+							&stat.sigma, &stat.avgDev, &stat.mad, &stat.sqrtbwmv,
+							&stat.location, &stat.scale, &stat.min, &stat.max,
+							&stat.bgnoise, &stat.normValue) != 18 ||
+						index < 0 || index >= nb_images || layer < 0 || layer > 2) {
+					fprintf(stderr, "Statistics file format error: %s\n", line);
+					goto error;
+				}
+				strcpy(stat.layername, layername);
+				entry = &cache->entries[index];
+				memcpy(&entry->stats[layer], &stat, sizeof(imstats));
+				entry->option[layer] = option;
+				break;
+		}
+	}
+	fclose(file);
+	g_free(filename);
+	if (cache)
+		cache->modified = FALSE;
+	return cache;
+
+error:
+	fclose(file);
+	g_free(filename);
+	stats_cache_free(cache);
+	return NULL;
+}
+
+/* Writes the statistics of the images that have a key in seqname.stats */
+int stats_cache_write(struct stats_cache *cache, const char *seqname) {
+	FILE *file;
+	gchar *filename;
+	int i, layer;
+
+	if (!cache || !seqname || seqname[0] == '\0')
+		return 1;
+	filename = g_strdup_printf("%s%s", seqname, STATS_CACHE_EXT);
+	file = fopen(filename, "w");
+	if (!file) {
+		fprintf(stderr, "Writing statistics file: cannot open %s for writing\n", filename);
+		g_free(filename);
+		return 1;
+	}
+	fprintf(stdout, "Writing statistics file %s\n", filename);
+	g_free(filename);
+
+	g_mutex_lock(&cache->mutex);
+	fprintf(file, "#Siril statistics file. Contains statistics of each layer of the images of the sequence\n");
+	fprintf(file, "#V version nb_images\n");
+	fprintf(file, "V %d %d\n", STATS_CACHE_VERSION, cache->nb_images);
+	fprintf(file, "#K index file_mtime file_size\n");
+	fprintf(file, "#S index layer options layername ngoodpix total mean median sigma avgDev mad sqrtbwmv location scale min max bgnoise normValue\n");
+	for (i = 0; i < cache->nb_images; i++) {
+		struct stats_cache_entry *entry = &cache->entries[i];
+		if (entry->size < 0)
+			continue;
+		fprintf(file, "K %d %lld %lld\n", i, (long long) entry->mtime, (long long) entry->size);
+		for (layer = 0; layer < 3; layer++) {
+			imstats *stat = &entry->stats[layer];
+			if (!entry->option[layer])
+				continue;
+			fprintf(file, "S %d %d %d %s %ld %ld %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g\n",
+					i, layer, entry->option[layer],
+					stat->layername[0] != '\0' ? stat->layername : "-",
+					stat->ngoodpix, stat->total, stat->mean, stat->median,
+					stat->sigma, stat->avgDev, stat->mad, stat->sqrtbwmv,
+					stat->location, stat->scale, stat->min, stat->max,
+					stat->bgnoise, stat->normValue);
+		}
+	}
+	cache->modified = FALSE;
+	g_mutex_unlock(&cache->mutex);
+	fclose(file);
+	return 0;
+}
+
+/* the file containing the image index of the sequence, NULL if none */
+static const char *get_image_file(sequence *seq, int index, char *name_buf) {
+	switch (seq->type) {
+		case SEQ_REGULAR:
+			return fit_sequence_get_image_filename(seq, index, name_buf, TRUE);
+		case SEQ_SER:
+			return seq->ser_file ? seq->ser_file->filename : NULL;
+#if defined(HAVE_FFMS2_1) || defined(HAVE_FFMS2_2)
+		case SEQ_AVI:
+			return seq->film_file ? seq->film_file->filename : NULL;
+#endif
+		default:
+			return NULL;
+	}
+}
+
+/* loads the statistics of the sequence saved in previous runs, and checks that
+ * the files have not changed since */
+void seq_load_stats_cache(sequence *seq) {
+	if (seq->stats_cache || seq->type == SEQ_INTERNAL)
+		return;
+	seq->stats_cache = stats_cache_read(seq->seqname, seq->number);
+	if (!seq->stats_cache)
+		seq->stats_cache = stats_cache_new(seq->number);
+	else siril_log_message(_("Statistics of images of the sequence have been loaded\n"));
+	seq_validate_stats_cache(seq);
+}
+
+void seq_validate_stats_cache(sequence *seq) {
+	char filename[256];
+	int i;
+
+	if (!seq->stats_cache)
+		return;
+	for (i = 0; i < seq->number; i++)
+		stats_cache_set_key(seq->stats_cache, i, get_image_file(seq, i, filename));
+}
+
+int seq_save_stats_cache(sequence *seq) {
+	if (!seq->stats_cache || !seq->stats_cache->modified)
+		return 0;
+	return stats_cache_write(seq->stats_cache, seq->seqname);
+}
@@ -0,0 +1,44 @@
+#ifndef STATS_CACHE_H_
+#define STATS_CACHE_H_
+
+#include <glib.h>
+#include "core/siril.h"
+
+/* Statistics of the images of a sequence, for each layer, kept in a file next
+ * to the .seq file, named seqname.stats. Each image is identified by the
+ * modification time and size of the file that contains it, so that statistics
+ * of an image that has changed are never used.
+ * The version of the file is increased when the way statistics are computed
+ * changes, older files are then ignored. */
+
+#define STATS_CACHE_VERSION 2
+#define STATS_CACHE_EXT ".stats"
+
+struct stats_cache_entry {
+	gint64 mtime, size;	// key of the file containing the image, size is -1 if unknown
+	int option[3];		// statistics computed for each layer, 0 if none
+	imstats stats[3];
+};
+
+struct stats_cache {
+	int nb_images;
+	struct stats_cache_entry *entries;
+	gboolean modified;	// not saved yet
+	GMutex mutex;		// it is filled by worker threads
+};
+
+struct stats_cache *stats_cache_new(int nb_images);
+void stats_cache_free(struct stats_cache *cache);
+gboolean stats_cache_get(struct stats_cache *cache, int index, int layer, int option, imstats *stat);
+void stats_cache_set(struct stats_cache *cache, int index, int layer, int option, const imstats *stat);
+void stats_cache_clear(struct stats_cache *cache);
+int stats_cache_set_key(struct stats_cache *cache, int index, const char *filename);
+struct stats_cache *stats_cache_read(const char *seqname, int nb_images);
+int stats_cache_write(struct stats_cache *cache, const char *seqname);
+
+/* for the sequences */
+void seq_load_stats_cache(sequence *seq);
+void seq_validate_stats_cache(sequence *seq);
+int seq_save_stats_cache(sequence *seq);
+
+#endif
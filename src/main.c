@@ -44,6 +44,7 @@
 #include "core/siril.h"
 #include "core/proto.h"
 #include "core/initfile.h"
+#include "core/headless.h"
 #include "io/sequence.h"
 #include "io/conversion.h"
 #include "gui/callbacks.h"
@@ -132,6 +133,7 @@ void usage(const char *command) {
     printf("\nUsage:  %s [OPTIONS] [IMAGE_FILE_TO_OPEN]\n\n", command);
     puts("-d                      Setting argument in cwd.");
     puts("-i                      With init file name in argument. Start Siril.");
+    puts("-s                      Run the script file in argument without graphical interface, - for standard input");
     puts("-f (or --format)        Print all supported image file formats (depending on the libraries you've installed)");
     puts("-v (or --version)       Print program name and version and exit");
     puts("-h (or --help)          This text");
@@ -151,6 +153,7 @@ int main(int argc, char *argv[]) {
 	char *cwd_orig = NULL;
 	gboolean forcecwd = FALSE;
 	char *cwd_forced = NULL;
+	char *script = NULL;
 #if (defined(__APPLE__) && defined(__MACH__))
 	int ret;
 	pid_t pid;
@@ -174,7 +177,7 @@ int main(int argc, char *argv[]) {
 	signal(SIGINT, signal_handled);
 
 	while (1) {
-		signed char c = getopt(argc, argv, "i:hfvd:");
+		signed char c = getopt(argc, argv, "i:hfvd:s:");
 		if (c == '?') {
 			for (i = 1; i < argc; i++) {
 				if (argv[i][1] == '-') {
@@ -212,6 +215,9 @@ int main(int argc, char *argv[]) {
 			cwd_forced = optarg;
 			forcecwd = TRUE;
 			break;
+		case 's':
+			script = optarg;
+			break;
 		default:
 			fprintf(stderr, _("unknown command line parameter '%c'\n"), argv[argc - 1][1]);
 			/* no break */
@@ -221,6 +227,19 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (script) {
+		/* headless mode, no display is needed */
+		int retval;
+		if (!forcecwd) {
+			cwd_orig = g_get_current_dir();
+			cwd_forced = cwd_orig;
+		}
+		retval = run_headless(script, cwd_forced);
+		undo_flush();
+		g_free(cwd_orig);
+		return retval ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 	gtk_init (&argc, &argv);
 
 #if (defined(__APPLE__) && defined(__MACH__))
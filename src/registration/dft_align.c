@@ -0,0 +1,263 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* DFT registration engine, see dft_align.h.
+ * The FFTW planner is not thread-safe, plans are only created under the lock
+ * below. Executing a plan on other arrays with the new-array execute
+ * functions is, as long as they have the same alignment, which fftw_malloc
+ * guarantees. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <glib.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "registration/dft_align.h"
+
+/* above this number of frames, the time taken to measure the best plan is
+ * worth it, if it was not already known from wisdom */
+#define DFT_MEASURE_MIN_FRAMES 200
+
+static GMutex planner_mutex;
+static gboolean wisdom_loaded = FALSE;
+
+/* plans of the last size used, kept for the next registrations */
+static struct {
+	int size;
+	gboolean measured;
+	fftw_plan forward, backward;
+} plan_cache = { 0 };
+
+static gchar *get_wisdom_filename() {
+	return g_build_filename(g_get_home_dir(), ".siril", "fftw_wisdom", NULL);
+}
+
+/* called with planner_mutex held */
+static void load_wisdom() {
+	gchar *filename;
+	if (wisdom_loaded)
+		return;
+	filename = get_wisdom_filename();
+#ifdef DEBUG
+	if (fftw_import_wisdom_from_filename(filename))
+		fprintf(stdout, "FFTW wisdom loaded from %s\n", filename);
+#else
+	fftw_import_wisdom_from_filename(filename);
+#endif
+	g_free(filename);
+	wisdom_loaded = TRUE;
+}
+
+/* called with planner_mutex held */
+static void save_wisdom() {
+	gchar *filename = get_wisdom_filename();
+	if (!fftw_export_wisdom_to_filename(filename))
+		fprintf(stderr, "Could not save FFTW wisdom to %s\n", filename);
+	g_free(filename);
+}
+
+/* Gets the plans for the size, from the cache or from the planner. Plans are
+ * measured if wisdom already knows them or if there are many frames. */
+static int dft_get_plans(struct dft_engine *eng, int nb_frames) {
+	int size = eng->size;
+	gboolean measure = nb_frames > DFT_MEASURE_MIN_FRAMES;
+	double *real;
+	fftw_complex *spectrum;
+	int retval = 0;
+
+	g_mutex_lock(&planner_mutex);
+	if (plan_cache.size == size && (plan_cache.measured || !measure)) {
+		eng->forward = plan_cache.forward;
+		eng->backward = plan_cache.backward;
+		g_mutex_unlock(&planner_mutex);
+		return 0;
+	}
+	if (plan_cache.size) {
+		fftw_destroy_plan(plan_cache.forward);
+		fftw_destroy_plan(plan_cache.backward);
+		plan_cache.size = 0;
+	}
+	load_wisdom();
+
+	/* planning with FFTW_MEASURE overwrites the arrays */
+	real = fftw_malloc(sizeof(double) * size * size);
+	spectrum = fftw_malloc(sizeof(fftw_complex) * size * (size / 2 + 1));
+	if (!real || !spectrum) {
+		retval = 1;
+		goto the_end;
+	}
+
+	plan_cache.forward = fftw_plan_dft_r2c_2d(size, size, real, spectrum,
+			FFTW_MEASURE | FFTW_WISDOM_ONLY);
+	plan_cache.backward = fftw_plan_dft_c2r_2d(size, size, spectrum, real,
+			FFTW_MEASURE | FFTW_WISDOM_ONLY);
+	if (plan_cache.forward && plan_cache.backward)
+		plan_cache.measured = TRUE;
+	else {
+		int flags = measure ? FFTW_MEASURE : FFTW_ESTIMATE;
+		if (plan_cache.forward) fftw_destroy_plan(plan_cache.forward);
+		if (plan_cache.backward) fftw_destroy_plan(plan_cache.backward);
+		plan_cache.forward = fftw_plan_dft_r2c_2d(size, size, real, spectrum, flags);
+		plan_cache.backward = fftw_plan_dft_c2r_2d(size, size, spectrum, real, flags);
+		plan_cache.measured = measure;
+		if (measure)
+			save_wisdom();
+	}
+	if (!plan_cache.forward || !plan_cache.backward) {
+		retval = 1;
+		goto the_end;
+	}
+	plan_cache.size = size;
+	eng->forward = plan_cache.forward;
+	eng->backward = plan_cache.backward;
+
+the_end:
+	if (real) fftw_free(real);
+	if (spectrum) fftw_free(spectrum);
+	g_mutex_unlock(&planner_mutex);
+	return retval;
+}
+
+static void free_workspace(struct dft_workspace *ws) {
+	if (ws->real) fftw_free(ws->real);
+	if (ws->spectrum) fftw_free(ws->spectrum);
+	ws->real = NULL;
+	ws->spectrum = NULL;
+}
+
+static struct dft_workspace *get_workspace(struct dft_engine *eng, int thread) {
+	struct dft_workspace *ws;
+	if (thread < 0 || thread >= eng->nb_workspaces)
+		return NULL;
+	ws = &eng->ws[thread];
+	if (!ws->real) {
+		ws->real = fftw_malloc(sizeof(double) * eng->size * eng->size);
+		ws->spectrum = fftw_malloc(sizeof(fftw_complex) * eng->size * (eng->size / 2 + 1));
+		if (!ws->real || !ws->spectrum) {
+			free_workspace(ws);
+			return NULL;
+		}
+	}
+	return ws;
+}
+
+/* Creates the engine for size x size images. nb_frames is the number of
+ * frames that will be registered, used to choose the planning effort, and
+ * thread numbers passed to dft_engine_shift() must be below nb_threads. */
+struct dft_engine *dft_engine_new(int size, int nb_frames, int nb_threads) {
+	struct dft_engine *eng;
+
+	if (size < 2 || nb_threads < 1)
+		return NULL;
+	eng = calloc(1, sizeof(struct dft_engine));
+	if (!eng)
+		return NULL;
+	eng->size = size;
+	eng->nb_workspaces = nb_threads;
+	eng->ws = calloc(nb_threads, sizeof(struct dft_workspace));
+	eng->ref_spectrum = fftw_malloc(sizeof(fftw_complex) * size * (size / 2 + 1));
+	if (!eng->ws || !eng->ref_spectrum || dft_get_plans(eng, nb_frames)) {
+		dft_engine_free(eng);
+		return NULL;
+	}
+	return eng;
+}
+
+static void load_data(struct dft_workspace *ws, const WORD *data, long n) {
+	long i;
+	for (i = 0; i < n; i++)
+		ws->real[i] = (double) data[i];
+}
+
+int dft_engine_set_reference(struct dft_engine *eng, const WORD *data) {
+	struct dft_workspace *ws = get_workspace(eng, 0);
+	if (!ws)
+		return 1;
+	load_data(ws, data, (long) eng->size * eng->size);
+	fftw_execute_dft_r2c(eng->forward, ws->real, eng->ref_spectrum);
+	return 0;
+}
+
+/* offset of the vertex of the parabola through (-1, l), (0, c), (1, r) */
+static double parabola_peak(double l, double c, double r) {
+	double denom = l - 2.0 * c + r;
+	if (denom >= 0.0)	// not a maximum
+		return 0.0;
+	return 0.5 * (l - r) / denom;
+}
+
+/* Computes the shift that aligns data, a size x size image, with the
+ * reference image, as the position of the maximum of their correlation.
+ * With subpixel, the maximum is refined by fitting a parabola on its
+ * neighbours in each direction. */
+int dft_engine_shift(struct dft_engine *eng, int thread, const WORD *data,
+		gboolean subpixel, double *shiftx, double *shifty) {
+	struct dft_workspace *ws = get_workspace(eng, thread);
+	int size = eng->size, peakx, peaky;
+	long i, n = (long) size * size, nc = (long) size * (size / 2 + 1), shift = 0;
+	double dx = 0.0, dy = 0.0;
+
+	if (!ws)
+		return 1;
+	load_data(ws, data, n);
+	fftw_execute_dft_r2c(eng->forward, ws->real, ws->spectrum);
+	for (i = 0; i < nc; i++)
+		ws->spectrum[i] = eng->ref_spectrum[i] * conj(ws->spectrum[i]);
+	fftw_execute_dft_c2r(eng->backward, ws->spectrum, ws->real);
+
+	for (i = 1; i < n; i++) {
+		if (ws->real[i] > ws->real[shift])
+			shift = i;
+	}
+	peaky = shift / size;
+	peakx = shift % size;
+
+	if (subpixel) {
+		const double *row = ws->real + peaky * size;
+		double c = row[peakx];
+		dx = parabola_peak(row[(peakx + size - 1) % size], c, row[(peakx + 1) % size]);
+		dy = parabola_peak(ws->real[((peaky + size - 1) % size) * size + peakx], c,
+				ws->real[((peaky + 1) % size) * size + peakx]);
+	}
+	if (peaky > size / 2)
+		peaky -= size;
+	if (peakx > size / 2)
+		peakx -= size;
+	*shiftx = peakx + dx;
+	*shifty = peaky + dy;
+	return 0;
+}
+
+/* plans stay in the cache for the next engine */
+void dft_engine_free(struct dft_engine *eng) {
+	int i;
+	if (!eng) return;
+	if (eng->ws) {
+		for (i = 0; i < eng->nb_workspaces; i++)
+			free_workspace(&eng->ws[i]);
+		free(eng->ws);
+	}
+	if (eng->ref_spectrum) fftw_free(eng->ref_spectrum);
+	free(eng);
+}
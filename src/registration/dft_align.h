@@ -0,0 +1,32 @@
+#ifndef DFT_ALIGN_H_
+#define DFT_ALIGN_H_
+
+#include <fftw3.h>
+#include "core/siril.h"
+
+/* Translation between square images by cross-correlation, computed with
+ * real-to-complex transforms. The spectrum of the reference image is computed
+ * once, frames are then correlated to it from any thread, each thread having
+ * its own buffers. Plans are kept for the next registration with the same
+ * size and FFTW wisdom is saved between sessions. */
+
+struct dft_workspace {
+	double *real;			// size x size image, then correlation
+	fftw_complex *spectrum;		// size x (size / 2 + 1) half spectrum
+};
+
+struct dft_engine {
+	int size;
+	fftw_plan forward, backward;	// shared plans, see dft_get_plans()
+	fftw_complex *ref_spectrum;
+	int nb_workspaces;
+	struct dft_workspace *ws;	// one per thread, allocated when first used
+};
+
+struct dft_engine *dft_engine_new(int size, int nb_frames, int nb_threads);
+int dft_engine_set_reference(struct dft_engine *eng, const WORD *data);
+int dft_engine_shift(struct dft_engine *eng, int thread, const WORD *data,
+		gboolean subpixel, double *shiftx, double *shifty);
+void dft_engine_free(struct dft_engine *eng);
+
+#endif
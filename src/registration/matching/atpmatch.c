@@ -149,6 +149,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <glib.h>
 #include "core/siril.h"
 #include "registration/matching/misc.h"
 #include "registration/matching/atpmatch.h"
@@ -204,6 +205,32 @@ typedef struct s_star_coord {
 	double y; /* "Y" value of star */
 } s_star_coord;
 
+/*
+ * the triangles of the reference list are looked up in a grid over
+ *    the (ba, ca) plane.  Cells are a bit larger than the tolerance
+ *    on the ratios, so that a matching triangle is always in one
+ *    of the 3x3 cells around the cell of the triangle we look for.
+ */
+#define AT_GRID_CELL  (1.25 * AT_QUICK_RATIO_DIFF)
+#define AT_GRID_SIZE  ((int) (1.0 / AT_GRID_CELL) + 1)
+
+/*
+ * everything find_quick_match needs from list B, computed once and
+ *    only read afterwards, so that it can be shared by several
+ *    matches running at the same time against the same list
+ */
+struct s_match_ref {
+	int num_stars; /* number of stars in list B */
+	int nbright; /* triangles are made of this many stars */
+	s_star *star_array; /* stars of B, sorted by magnitude */
+	s_star_coord *star_coord_array; /* same stars, sorted by "X" */
+	int num_triangles; /* number of triangles in triangle_array */
+	s_triangle *triangle_array; /* triangles of B, sorted by "yt" */
+	int *grid_start; /* triangles of cell i are grid_triangles[grid_start[i]] */
+	/*    to grid_triangles[grid_start[i + 1] - 1] */
+	int *grid_triangles; /* indices in triangle_array, increasing in a cell */
+};
+
 static int set_star(s_star *star, double x, double y, double mag);
 static void copy_star(s_star *from_ptr, s_star *to_ptr);
 static void copy_star_array(s_star *from_array, s_star *to_array, int num);
@@ -250,8 +277,7 @@ static int **make_vote_matrix(s_star *star_array_A, int num_stars_A,
 		int nbright, double radius, double min_scale, double max_scale,
 		double rotation_deg, double tolerance_deg);
 static int find_quick_match(s_star *star_array_A, int num_stars_A,
-		s_star *star_array_B, int num_stars_B, s_triangle *t_array_A,
-		int num_triangles_A, s_triangle *t_array_B, int num_triangles_B,
+		s_match_ref *ref, s_triangle *t_array_A, int num_triangles_A,
 		int nbright, double star_match_radius, double radius, int max_iter,
 		double max_sigma, double min_scale, double max_scale,
 		double rotation_deg, double tolerance_deg, int min_req_pairs,
@@ -309,8 +335,9 @@ static int remove_repeated_elements(s_star *star_array_1, int *num_stars_1,
 		s_star *star_array_2, int *num_stars_2);
 static void remove_same_elements(s_star *star_array_1, int num_stars_1,
 		s_star *star_array_2, int *num_stars_2);
-static void write_array(int num_stars, struct s_star *star_array,
-		char *filename);
+static int grid_cell(double ratio);
+static int compare_int(int *i1, int *i2);
+static void link_star_array(s_star *star_array, int num_stars);
 static int is_desired_rotation(struct s_triangle *tri_1,
 		struct s_triangle *tri_2, double want_angle_deg, double tolerance_deg,
 		double *actual_angle_deg);
@@ -411,34 +438,70 @@ TRANS *trans /* O: place into this TRANS structure's fields */
 /*       the coeffs which convert coords of chainA */
 /*       into coords of chainB system. */
 ) {
-	int nbright, min;
-	int num_stars_A; /* number of stars in chain A */
-	int num_stars_B; /* number of stars in chain B */
-	int num_triangles_A; /* number of triangles formed from chain A */
-	int num_triangles_B; /* number of triangles formed from chain B */
-	int start_pairs = 0;
-	s_star *star_array_A = NULL;
-	s_star *star_array_B = NULL;
-	s_triangle *triangle_array_A = NULL;
-	s_triangle *triangle_array_B = NULL;
+	int nbright, ret;
+	s_match_ref *ref;
 
 #ifdef DEBUG
 	printf(" entering atFindTrans \n");
 #endif
 
-	num_stars_A = numA;
-	num_stars_B = numB;
-	star_array_A = list_to_array(numA, listA);
-	star_array_B = list_to_array(numB, listB);
-
 #ifdef DEBUG3
 	test_routine();
 #endif
 
-	shAssert(star_array_A != NULL);
-	shAssert(star_array_B != NULL);
+	nbright = atFindTransNbright(numA, numB, nobj, trans->order);
+	if (nbright < 0) {
+		return (SH_GENERIC_ERROR);
+	}
 
-	switch (trans->order) {
+	/*
+	 * we now convert list B into triangles, using only a subset
+	 * of the "nbright" brightest items; list A is converted by
+	 * atFindTransRef.
+	 */
+	ref = atMatchRefNew(numB, listB, nbright);
+	ret = atFindTransRef(numA, listA, ref, star_match_radius, radius,
+			min_scale, max_scale, rotation_deg, tolerance_deg, max_iter,
+			max_sigma, min_req_pairs, trans);
+	atMatchRefDel(ref);
+
+	return (ret);
+}
+
+/************************************************************************
+ * <AUTO EXTRACT>
+ *
+ * ROUTINE: atFindTransNbright
+ *
+ * DESCRIPTION:
+ * Checks that each list of stars contains the minimum number of stars
+ * required for a TRANS of the given order, and computes the number
+ * of bright stars used to make triangles in atFindTrans.
+ *
+ * If a list has fewer than 'nobj' items, we use the minimum of the
+ * two list lengths, and print a warning message so the user knows
+ * that we're using fewer stars than he asked.
+ *
+ * On the other hand, if the user specifies a value of "nobj" which
+ * is too SMALL, then we ignore it and use the smallest valid
+ * value (which is start_pairs).
+ *
+ * RETURN:
+ *    the number of bright stars to use   if all goes well
+ *    -1                                  if a list is too short
+ *
+ * </AUTO>
+ */
+
+int atFindTransNbright(int numA, /* I: number of stars in list A */
+int numB, /* I: number of stars in list B */
+int nobj, /* I: max number of bright stars requested */
+int order /* I: order of the TRANS to find */
+) {
+	int nbright, min;
+	int start_pairs = 0;
+
+	switch (order) {
 	case AT_TRANS_LINEAR:
 		start_pairs = AT_MATCH_STARTN_LINEAR;
 		break;
@@ -449,31 +512,15 @@ TRANS *trans /* O: place into this TRANS structure's fields */
 		start_pairs = AT_MATCH_STARTN_CUBIC;
 		break;
 	default:
-		shError("atFindTrans: invalid trans->order %d ", trans->order);
+		shError("atFindTrans: invalid trans->order %d ", order);
 		break;
 	}
 
-	/*
-	 * here we check to see if each list of stars contains a
-	 * required minimum number of stars.  If not, we return with
-	 * an error message, and SH_GENERIC_ERROR.
-	 *
-	 * In addition, we check to see that each list has at least 'nobj'
-	 * items.  If not, we set 'nbright' to the minimum of the two
-	 * list lengths, and print a warning message so the user knows
-	 * that we're using fewer stars than he asked.
-	 *
-	 * On the other hand, if the user specifies a value of "nobj" which
-	 * is too SMALL, then we ignore it and use the smallest valid
-	 * value (which is start_pairs).
-	 */
-	min = (num_stars_A < num_stars_B ? num_stars_A : num_stars_B);
+	min = (numA < numB ? numA : numB);
 	if (min < start_pairs) {
 		shError("atFindTrans: only %d stars in list(s), require at least %d",
 				min, start_pairs);
-		free_star_array(star_array_A);
-		free_star_array(star_array_B);
-		return (SH_GENERIC_ERROR);
+		return (-1);
 	}
 	if (nobj > min) {
 		shDebug(AT_MATCH_ERRLEVEL,
@@ -493,23 +540,190 @@ TRANS *trans /* O: place into this TRANS structure's fields */
 	/* this is a sanity check on the above checks */
 	shAssert((nbright >= start_pairs) && (nbright <= min));
 
+	return (nbright);
+}
+
+/************************************************************************
+ * <AUTO EXTRACT>
+ *
+ * ROUTINE: atMatchRefNew
+ *
+ * DESCRIPTION:
+ * Prepares list B for atFindTransRef: the stars are sorted by magnitude
+ * and by "X", the triangles made of the 'nbright' brightest ones are
+ * sorted by "yt" and indexed in a grid over their (ba, ca) ratios.
+ *
+ * The result is only read by atFindTransRef, so the same list B can be
+ * matched against many lists A, possibly from several threads, without
+ * building its triangles again.  Free it with atMatchRefDel.
+ *
+ * RETURN:
+ *    the new s_match_ref
+ *
+ * </AUTO>
+ */
+
+s_match_ref *atMatchRefNew(int numB, /* I: number of stars in list B */
+s_star *listB, /* I: the reference list of objects */
+int nbright /* I: use this many bright stars in triangles */
+) {
+	int i, num_cells, *cell_pos;
+	s_match_ref *ref;
+
+	shAssert(listB != NULL);
+	shAssert(nbright > 0);
+
+	ref = shMalloc(sizeof(s_match_ref));
+	ref->num_stars = numB;
+	ref->nbright = nbright;
+	ref->star_array = list_to_array(numB, listB);
+	shAssert(ref->star_array != NULL);
+
+	/* this also sorts star_array by magnitude */
+	ref->triangle_array = stars_to_triangles(ref->star_array, numB, nbright,
+			&ref->num_triangles);
+	shAssert(ref->triangle_array != NULL);
+	sort_triangle_by_yt(ref->triangle_array, ref->num_triangles);
+#ifdef DEBUG2
+	printf("after sorting by yt, here comes triangle array B\n");
+	print_triangle_array(ref->triangle_array, ref->num_triangles,
+			ref->star_array, numB);
+#endif
+
+	/*
+	 * It will increase efficiency later on
+	 *    (in apply_trans_and_find_matches) to have a
+	 *    way to access the elements of star_array_B
+	 *    in order of their "X" coordinates.
+	 */
+	ref->star_coord_array = shMalloc(sizeof(s_star_coord) * numB);
+	for (i = 0; i < numB; i++) {
+		ref->star_coord_array[i].index = i;
+		ref->star_coord_array[i].x = ref->star_array[i].x;
+		ref->star_coord_array[i].y = ref->star_array[i].y;
+	}
+	sort_star_coord_by_x(ref->star_coord_array, numB);
+
+	/*
+	 * counting sort of the triangles by cell; walking the sorted
+	 *    array keeps the indices increasing within each cell.
+	 */
+	num_cells = AT_GRID_SIZE * AT_GRID_SIZE;
+	ref->grid_start = shMalloc((num_cells + 1) * sizeof(int));
+	ref->grid_triangles = shMalloc((ref->num_triangles + 1) * sizeof(int));
+	cell_pos = shMalloc(num_cells * sizeof(int));
+	memset(ref->grid_start, 0, (num_cells + 1) * sizeof(int));
+	for (i = 0; i < ref->num_triangles; i++) {
+		s_triangle *tri = &(ref->triangle_array[i]);
+		ref->grid_start[grid_cell(tri->ba) * AT_GRID_SIZE
+				+ grid_cell(tri->ca) + 1]++;
+	}
+	for (i = 0; i < num_cells; i++) {
+		ref->grid_start[i + 1] += ref->grid_start[i];
+		cell_pos[i] = ref->grid_start[i];
+	}
+	for (i = 0; i < ref->num_triangles; i++) {
+		s_triangle *tri = &(ref->triangle_array[i]);
+		int cell = grid_cell(tri->ba) * AT_GRID_SIZE + grid_cell(tri->ca);
+		ref->grid_triangles[cell_pos[cell]++] = i;
+	}
+	shFree(cell_pos);
+
+	return (ref);
+}
+
+/************************************************************************
+ * <AUTO EXTRACT>
+ *
+ * ROUTINE: atMatchRefDel
+ *
+ * DESCRIPTION:
+ * Frees an s_match_ref created by atMatchRefNew.
+ *
+ * RETURN:
+ *    nothing
+ *
+ * </AUTO>
+ */
+
+void atMatchRefDel(s_match_ref *ref /* I: structure to free, may be NULL */
+) {
+	if (ref == NULL) {
+		return;
+	}
+	free_star_array(ref->star_array);
+	shFree(ref->star_coord_array);
+	shFree(ref->triangle_array);
+	shFree(ref->grid_start);
+	shFree(ref->grid_triangles);
+	shFree(ref);
+}
+
+/************************************************************************
+ * <AUTO EXTRACT>
+ *
+ * ROUTINE: atFindTransRef
+ *
+ * DESCRIPTION:
+ * Same as atFindTrans, list B being given by an s_match_ref created by
+ * atMatchRefNew, which is not modified.  List A must pass the checks
+ * of atFindTransNbright with the 'nbright' of the s_match_ref.
+ *
+ * RETURN:
+ *    SH_SUCCESS         if all goes well
+ *    SH_GENERIC_ERROR   if an error occurs
+ *
+ * </AUTO>
+ */
+
+int atFindTransRef(int numA, /* I: number of stars in list A */
+struct s_star *listA, /* I: match this set of objects with list B */
+s_match_ref *ref, /* I: list B, prepared by atMatchRefNew */
+double star_match_radius, /* I: max radius in star-space allowed for */
+/*       a pair of stars to match */
+double radius, /* I: max radius in triangle-space allowed for */
+/*       a pair of triangles to match */
+double min_scale, /* I: minimum permitted relative scale factor */
+/*       if -1, any scale factor is allowed */
+double max_scale, /* I: maximum permitted relative scale factor */
+/*       if -1, any scale factor is allowed */
+double rotation_deg, /* I: desired relative angle of coord systems (deg) */
+/*       if AT_MATCH_NOANGLE, any orientation is allowed */
+double tolerance_deg, /* I: allowed range of orientation angles (deg) */
+/*       if AT_MATCH_NOANGLE, any orientation is allowed */
+int max_iter, /* I: go through at most this many iterations */
+/*       in the iter_trans() loop. */
+double max_sigma, /* I: if the mean residual becomes this small */
+/*       then the match was a success */
+int min_req_pairs, /* I: must have at least this many matched pairs */
+/*       of stars be count as successful match */
+TRANS *trans /* O: place into this TRANS structure's fields */
+/*       the coeffs which convert coords of chainA */
+/*       into coords of chainB system. */
+) {
+	int ret;
+	int num_triangles_A; /* number of triangles formed from chain A */
+	s_star *star_array_A = NULL;
+	s_triangle *triangle_array_A = NULL;
+
+	shAssert(ref != NULL);
+	star_array_A = list_to_array(numA, listA);
+	shAssert(star_array_A != NULL);
+
 #ifdef DEBUG
 	printf("here comes star array A\n");
-	print_star_array(star_array_A, num_stars_A);
+	print_star_array(star_array_A, numA);
 	printf("here comes star array B\n");
-	print_star_array(star_array_B, num_stars_B);
+	print_star_array(ref->star_array, ref->num_stars);
 #endif
 
 	/*
-	 * we now convert each list of stars into a list of triangles,
-	 * using only a subset of the "nbright" brightest items in each list.
+	 * we now convert list A into a list of triangles,
+	 * using only a subset of the "nbright" brightest items.
 	 */
-	triangle_array_A = stars_to_triangles(star_array_A, num_stars_A, nbright,
+	triangle_array_A = stars_to_triangles(star_array_A, numA, ref->nbright,
 			&num_triangles_A);
 	shAssert(triangle_array_A != NULL);
-	triangle_array_B = stars_to_triangles(star_array_B, num_stars_B, nbright,
-			&num_triangles_B);
-	shAssert(triangle_array_B != NULL);
 
 	/*
 	 * sort all triangles in list A by their D value
@@ -518,17 +732,7 @@ TRANS *trans /* O: place into this TRANS structure's fields */
 #ifdef DEBUG2
 	printf("after sorting by D, here comes triangle array A\n");
 	print_triangle_array(triangle_array_A, num_triangles_A, star_array_A,
-			num_stars_A);
-#endif
-
-	/*
-	 * sort all triangles in list B by their yt values
-	 */
-	sort_triangle_by_yt(triangle_array_B, num_triangles_B);
-#ifdef DEBUG2
-	printf("after sorting by yt, here comes triangle array B\n");
-	print_triangle_array(triangle_array_B, num_triangles_B, star_array_B,
-			num_stars_B);
+			numA);
 #endif
 
 	/*
@@ -538,11 +742,11 @@ TRANS *trans /* O: place into this TRANS structure's fields */
 	 * of objects; if it's a good match, terminate the
 	 * search.
 	 */
-	if (find_quick_match(star_array_A, num_stars_A, star_array_B, num_stars_B,
-			triangle_array_A, num_triangles_A, triangle_array_B,
-			num_triangles_B, nbright, star_match_radius, radius, max_iter,
-			max_sigma, min_scale, max_scale, rotation_deg, tolerance_deg,
-			min_req_pairs, trans) == SH_SUCCESS) {
+	ret = find_quick_match(star_array_A, numA, ref, triangle_array_A,
+			num_triangles_A, ref->nbright, star_match_radius, radius,
+			max_iter, max_sigma, min_scale, max_scale, rotation_deg,
+			tolerance_deg, min_req_pairs, trans);
+	if (ret == SH_SUCCESS) {
 		/* we found a match */
 #ifdef DEBUG
 		printf("find_quick_match returns with success! \n");
@@ -552,18 +756,16 @@ TRANS *trans /* O: place into this TRANS structure's fields */
 		printf("find_quick_match returns with failure \n");
 #endif
 		shError("atFindTrans: find_quick_match unable to create a valid TRANS");
-		free_star_array(star_array_A);
-		free_star_array(star_array_B);
-		return (SH_GENERIC_ERROR);
+		ret = SH_GENERIC_ERROR;
 	}
 
 	/*
 	 * clean up memory we allocated during the matching process
 	 */
+	shFree(triangle_array_A);
 	free_star_array(star_array_A);
-	free_star_array(star_array_B);
 
-	return (SH_SUCCESS);
+	return (ret);
 }
 
 /************************************************************************
@@ -817,11 +1019,10 @@ TRANS *trans /* I: use this TRANS to transform the coords of */
  *
  * place the elems of A that are matches into output list J
  *                    B that are matches into output list K
- *                    A that are not matches into output list L
- *                    B that are not matches into output list M
  *
- * Place a count of the number of matching pairs into the final
- * argument, 'num_matches'.
+ * Place a count of the number of matching pairs into 'num_matches',
+ * and lists J and K into 'matched_A' and 'matched_B'; the caller
+ * must free them with free_star_array.
  *
  *
  * RETURN:
@@ -836,13 +1037,10 @@ s_star *listA, /* I: first input list of items to be matched */
 int numB, /* I: number of stars in list B */
 s_star *listB, /* I: second list of items to be matched */
 double radius, /* I: maximum radius for items to be a match */
-char *basename, /* I: base of filenames used to store the */
-/*      output; extension indicates which */
-/*      .mtA    items from A that matched */
-/*      .mtB    items from B that matched */
-/*      .unA    items from A that didn't match */
-/*      .unB    items from A that didn't match */
-int *num_matches /* O: number of matching pairs we find */
+int *num_matches, /* O: number of matching pairs we find */
+s_star **matched_A, /* O: items from A that matched */
+s_star **matched_B /* O: items from B that matched, in the */
+/*      same order */
 ) {
 	s_star *star_array_A;
 	int num_stars_A;
@@ -850,7 +1048,6 @@ int *num_matches /* O: number of matching pairs we find */
 	int num_stars_B;
 	s_star *star_array_J, *star_array_K, *star_array_L, *star_array_M;
 	int num_stars_J, num_stars_K, num_stars_L, num_stars_M;
-	char filename[100];
 
 	shAssert(listA != NULL);
 	shAssert(listB != NULL);
@@ -873,6 +1070,8 @@ int *num_matches /* O: number of matching pairs we find */
 			&star_array_L, &num_stars_L, &star_array_M, &num_stars_M)
 			!= SH_SUCCESS) {
 		shError("atMatchLists: match_arrays_slow fails");
+		free_star_array(star_array_A);
+		free_star_array(star_array_B);
 		return (SH_GENERIC_ERROR);
 	}
 
@@ -883,30 +1082,18 @@ int *num_matches /* O: number of matching pairs we find */
 	*num_matches = num_stars_J;
 
 	/*
-	 * now write the output into ASCII text files, each of which starts
-	 * with 'basename', but has a different extension.
-	 *
-	 *    basename.mtA    stars from list A that did match         array J
-	 *    basename.mtB    stars from list A that did match         array K
-	 *    basename.unA    stars from list A that did NOT match     array L
-	 *    basename.unB    stars from list A that did NOT match     array M
+	 * the matched stars are given back as lists; the others are
+	 * not needed.
 	 */
-	sprintf(filename, "%s.mtA", basename);
-	write_array(num_stars_J, star_array_J, filename);
-	sprintf(filename, "%s.mtB", basename);
-	write_array(num_stars_K, star_array_K, filename);
-	sprintf(filename, "%s.unA", basename);
-	write_array(num_stars_L, star_array_L, filename);
-	sprintf(filename, "%s.unB", basename);
-	write_array(num_stars_M, star_array_M, filename);
+	link_star_array(star_array_J, num_stars_J);
+	link_star_array(star_array_K, num_stars_K);
+	*matched_A = star_array_J;
+	*matched_B = star_array_K;
 
-	/*
-	 * all done!
-	 */
-	free_star_array(star_array_J);
-	free_star_array(star_array_K);
 	free_star_array(star_array_L);
 	free_star_array(star_array_M);
+	free_star_array(star_array_A);
+	free_star_array(star_array_B);
 
 	return (SH_SUCCESS);
 }
@@ -1349,13 +1536,13 @@ double x, /* I: star's "X" coordinate */
 double y, /* I: star's "Y" coordinate */
 double mag /* I: star's "mag" coordinate */
 ) {
-	static int id_number = 0;
+	static gint id_number = 0;
 
 	if (star == NULL) {
 		shError("set_star: given a NULL star");
 		return (SH_GENERIC_ERROR);
 	}
-	star->id = id_number++;
+	star->id = g_atomic_int_add(&id_number, 1);
 	star->index = -1;
 	star->x = x;
 	star->y = y;
@@ -1649,7 +1836,7 @@ int s2, /* index in 'star_array' of one vertex */
 int s3, /* index in 'star_array' of one vertex */
 double **darray /* array of distances between stars */
 ) {
-	static int id_number = 0;
+	static gint id_number = 0;
 	double d12, d23, d13;
 	double a = 0.0, b = 0.0, c = 0.0;
 	s_star *star1, *star2, *star3;
@@ -1661,7 +1848,7 @@ double **darray /* array of distances between stars */
 	star3 = &star_array[s3];
 	shAssert((star1 != NULL) && (star2 != NULL) && (star3 != NULL));
 
-	tri->id = id_number++;
+	tri->id = g_atomic_int_add(&id_number, 1);
 	tri->index = -1;
 
 	/*
@@ -3540,6 +3727,66 @@ double *f2 /* I:  ... with SECOND double value  */
 	return (0);
 }
 
+/************************************************************************
+ *
+ *
+ * ROUTINE: compare_int
+ *
+ * DESCRIPTION:
+ * Given pointers to two int numbers, return the comparison.
+ * Used by "find_quick_match"
+ *
+ * RETURN:
+ *    1                  if first int is larger than second
+ *    0                  if the two are equal
+ *   -1                  if first int is smaller than second
+ *
+ * </AUTO>
+ */
+
+static int compare_int(int *i1, /* I: compare size of FIRST int value */
+int *i2 /* I:  ... with SECOND int value  */
+) {
+	shAssert((i1 != NULL) && (i2 != NULL));
+
+	if (*i1 > *i2) {
+		return (1);
+	}
+	if (*i1 < *i2) {
+		return (-1);
+	}
+	return (0);
+}
+
+/************************************************************************
+ *
+ *
+ * ROUTINE: grid_cell
+ *
+ * DESCRIPTION:
+ * Given a ratio of side lengths of a triangle, between 0.0 and 1.0,
+ * return the index of its cell along one axis of the grid of
+ * triangles in an s_match_ref.
+ *
+ * RETURN:
+ *    index of the cell, between 0 and AT_GRID_SIZE - 1
+ *
+ * </AUTO>
+ */
+
+static int grid_cell(double ratio /* I: "ba" or "ca" value of a triangle */
+) {
+	int cell = (int) (ratio / AT_GRID_CELL);
+
+	if (cell < 0) {
+		return (0);
+	}
+	if (cell >= AT_GRID_SIZE) {
+		return (AT_GRID_SIZE - 1);
+	}
+	return (cell);
+}
+
 /************************************************************************
  *
  *
@@ -4512,38 +4759,25 @@ struct s_star *list /* I: the linked list */
 }
 
 /***********************************************************************
- * ROUTINE: write_array
+ * ROUTINE: link_star_array
  *
  * DESCRIPTION:
- * Given an array of s_star structures, write them to an ASCII text
- * file, with the following format:
- *
- *   ID    xvalue    yvalue    magvalue
- *
- * The 'ID' value is one assigned internally by these routines --
- * it doesn't correspond to any input ID value.
+ * Given an array of s_star structures, link them through their 'next'
+ * fields, in the order of the array, so that the array can be used as
+ * a list and freed with free_star_array.
  *
  * RETURNS:
  *     nothing
  */
 
-static void write_array(int num_stars, /* I: number of stars in the array */
-struct s_star *star_array, /* I: the array of stars */
-char *filename /* I: write into this file */
+static void link_star_array(s_star *star_array, /* I/O: the array of stars */
+int num_stars /* I: number of stars in the array */
 ) {
 	int i;
-	FILE *fp;
-
-	if ((fp = fopen(filename, "w")) == NULL) {
-		shFatal("write_array: can't open file %s", filename);
-	}
 
 	for (i = 0; i < num_stars; i++) {
-		fprintf(fp, "%6d %13.7f %13.7f %6.2f\n", star_array[i].id,
-				star_array[i].x, star_array[i].y, star_array[i].mag);
+		star_array[i].next = (i + 1 < num_stars ? &(star_array[i + 1]) : NULL);
 	}
-
-	fclose(fp);
 }
 
 /***********************************************************************
@@ -6579,12 +6813,9 @@ s_triangle *triangle2 /* I:  ... with THIS triangle  */
 
 static int find_quick_match(s_star *star_array_A, /* I: first array of stars */
 int num_stars_A, /* I: number of stars in star_array_A  */
-s_star *star_array_B, /* I: second array of stars */
-int num_stars_B, /* I: number of stars in star_array_B  */
+s_match_ref *ref, /* I: second array of stars and its triangles */
 s_triangle *t_array_A, /* I: array of triangles from star_array_A */
 int num_triangles_A, /* I: number of triangles in t_array_A */
-s_triangle *t_array_B, /* I: array of triangles from star_array_B */
-int num_triangles_B, /* I: number of triangles in t_array_B */
 int nbright, /* I: consider at most this many stars */
 /*       from each array; also the size */
 /*       of the output "vote_matrix". */
@@ -6613,8 +6844,13 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 ) {
 	int i_triA;
 	int failure_flag;
+	int *candidates;
 	struct s_triangle *triA, *triB;
-	struct s_star_coord *star_coord_array_B;
+	s_star *star_array_B = ref->star_array;
+	int num_stars_B = ref->num_stars;
+	s_triangle *t_array_B = ref->triangle_array;
+	int num_triangles_B = ref->num_triangles;
+	struct s_star_coord *star_coord_array_B = ref->star_coord_array;
 
 #ifdef DEBUG
 	printf(" entering find_quick_match \n");
@@ -6632,32 +6868,8 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 		shAssert((min_scale != -1) && (min_scale <= max_scale));
 	}
 
-	/*
-	 * It will increase efficiency later on
-	 *    (in apply_trans_and_find_matches) to have a
-	 *    way to access the elements of star_array_B
-	 *    in order of their "X" coordinates.
-	 */
-	{
-		int i;
-
-		star_coord_array_B = shMalloc(
-				sizeof(struct s_star_coord) * num_stars_B);
-		for (i = 0; i < num_stars_B; i++) {
-			star_coord_array_B[i].index = i;
-			star_coord_array_B[i].x = star_array_B[i].x;
-			star_coord_array_B[i].y = star_array_B[i].y;
-		}
-		sort_star_coord_by_x(star_coord_array_B, num_stars_B);
-#ifdef DEBUG2
-		printf("  here comes star_coord_array_B sorted by x \n");
-		for (i = 0; i < num_stars_B; i++) {
-			printf("   i %5d  index %5d  x %9.4e  y %9.4e \n", i,
-					star_coord_array_B[i].index, star_coord_array_B[i].x,
-					star_coord_array_B[i].y);
-		}
-#endif
-	}
+	/* the triangles of B found near triA in the grid */
+	candidates = shMalloc((num_triangles_B + 1) * sizeof(int));
 
 	/*
 	 * We walk through triangles in list A, which have been sorted by
@@ -6672,6 +6884,7 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 	for (i_triA = 0; i_triA < num_triangles_A; i_triA++) {
 
 		int start_index, end_index, b_index;
+		int num_candidates, cand, cell_ba, cell_ca, i, j;
 		double yt_eps;
 
 #ifdef DEBUG2
@@ -6715,13 +6928,42 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 		/*
 		 * Okay, we have a range of triangles in list B
 		 *    we can try to match to the current triA from
-		 *    list A.
-		 *
+		 *    list A.  Instead of walking through all of
+		 *    them, we only look at those which have close
+		 *    enough "ba" and "ca" values, found in the
+		 *    cells around triA in the grid.  Sorting them
+		 *    keeps the order of the walk through the range.
 		 */
-		for (b_index = start_index; b_index <= end_index; b_index++) {
+		num_candidates = 0;
+		cell_ba = grid_cell(triA->ba);
+		cell_ca = grid_cell(triA->ca);
+		for (i = cell_ba - 1; i <= cell_ba + 1; i++) {
+			if (i < 0 || i >= AT_GRID_SIZE) {
+				continue;
+			}
+			for (j = cell_ca - 1; j <= cell_ca + 1; j++) {
+				int cell, k;
+				if (j < 0 || j >= AT_GRID_SIZE) {
+					continue;
+				}
+				cell = i * AT_GRID_SIZE + j;
+				for (k = ref->grid_start[cell]; k < ref->grid_start[cell + 1];
+						k++) {
+					b_index = ref->grid_triangles[k];
+					if (b_index >= start_index && b_index <= end_index) {
+						candidates[num_candidates++] = b_index;
+					}
+				}
+			}
+		}
+		qsort(candidates, num_candidates, sizeof(int),
+				(PFI) compare_int);
+
+		for (cand = 0; cand < num_candidates; cand++) {
 			double ba_diff, ca_diff, cb_diff;
 			double actual_angle_deg, ratio;
 
+			b_index = candidates[cand];
 			triB = &(t_array_B[b_index]);
 #ifdef DEBUG2
 			printf("      i_triA is %6d, looking at triangle B %5d \n", i_triA,
@@ -6967,6 +7209,11 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 								star_array_B, num_stars_B, star_match_radius,
 								test_trans) != SH_SUCCESS) {
 							printf("eval_trans_quality fails ?!\n");
+							shFree(winner_index_A);
+							shFree(winner_index_B);
+							shFree(winner_votes);
+							atTransDel(test_trans);
+							shFree(candidates);
 							return (SH_GENERIC_ERROR);
 						}
 #ifdef DEBUG
@@ -6998,7 +7245,12 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 
 				}
 
+				shFree(winner_index_A);
+				shFree(winner_index_B);
+				shFree(winner_votes);
+
 				if (failure_flag == 1) {
+					atTransDel(test_trans);
 					continue;
 				}
 
@@ -7030,6 +7282,8 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 
 						/* assign the properties of the test_trans to output_trans */
 						copyTrans(test_trans, output_trans);
+						atTransDel(test_trans);
+						shFree(candidates);
 
 						/* and return immediately -- no need to look for better matches */
 						return (SH_SUCCESS);
@@ -7045,6 +7299,7 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 					printf(" is_trans_good_enough returns no \n");
 #endif
 				}
+				atTransDel(test_trans);
 
 			}
 
@@ -7053,6 +7308,7 @@ TRANS *output_trans /* I/O: "order" field must be set on input */
 	} /* end of loop over all triangles in A list */
 
 	/* if we reach this point, we did NOT find a good match */
+	shFree(candidates);
 	return (SH_GENERIC_ERROR);
 }
 
@@ -7211,6 +7467,7 @@ int *winner_index_B /* O: index into "star_array_B" of stars */
 	if (apply_trans(transformed_star_array_A, num_stars_A, trans)
 			!= SH_SUCCESS) {
 		shError("apply_trans_and_find_matches: apply_trans fails on list A");
+		shFree(transformed_star_array_A);
 		return (SH_GENERIC_ERROR);
 	}
 
@@ -7328,6 +7585,7 @@ int *winner_index_B /* O: index into "star_array_B" of stars */
 				winner_index_B, &mean, &stdev) != 0) {
 			printf(
 					"apply_trans_and_find_matches: compute_match_distance_stats fails \n");
+			shFree(transformed_star_array_A);
 			return (SH_GENERIC_ERROR);
 		}
 
@@ -7345,6 +7603,7 @@ int *winner_index_B /* O: index into "star_array_B" of stars */
 			printf(
 					"apply_trans_and_find_matches: prune_matched_pairs fails \n");
 #endif
+			shFree(transformed_star_array_A);
 			return (SH_GENERIC_ERROR);
 		} else {
 #ifdef DEBUG
@@ -7356,6 +7615,7 @@ int *winner_index_B /* O: index into "star_array_B" of stars */
 
 	}
 
+	shFree(transformed_star_array_A);
 	return (SH_SUCCESS);
 }
 
@@ -239,6 +239,13 @@ typedef struct s_triangle {
 } s_triangle;
 
 
+   /*
+    * the stars and triangles of a list B, prepared once by atMatchRefNew
+    * to be matched against several lists A by atFindTransRef
+    */
+typedef struct s_match_ref s_match_ref;
+
+
    /*
     * these functions are PUBLIC, and may be called by users
     */
@@ -251,10 +258,24 @@ int atFindTrans(int numA, s_star *listA, int numB, s_star *listB,
                 int max_iter, double max_sigma, int min_req_pairs,
                 TRANS *trans);
 
+int atFindTransNbright(int numA, int numB, int nobj, int order);
+
+s_match_ref *atMatchRefNew(int numB, s_star *listB, int nbright);
+
+void atMatchRefDel(s_match_ref *ref);
+
+int atFindTransRef(int numA, s_star *listA, s_match_ref *ref,
+                   double star_match_radius,
+                   double radius, double min_scale, double max_scale,
+                   double rotation_deg, double tolerance_deg,
+                   int max_iter, double max_sigma, int min_req_pairs,
+                   TRANS *trans);
+
 int atApplyTrans(int num, s_star *list, TRANS *trans);
 
 int atMatchLists(int numA, s_star *listA, int numB, s_star *listB,
-                 double radius, char *basename, int *num_matches);
+                 double radius, int *num_matches,
+                 s_star **matched_A, s_star **matched_B);
 
 int
 atBuildSmallFile(double ra, double dec,
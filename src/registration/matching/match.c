@@ -115,17 +115,60 @@ static void reset_copy_ids(int numA, struct s_star *star_list_A,
 
 static int reset_A_coords(int numA, struct s_star *post_list_A,
 		struct s_star *pre_list_A);
-static int prepare_to_recalc(char *outfile, int *num_matched_A,
-		struct s_star **matched_list_A, int *num_matched_B,
-		struct s_star **matched_list_B, struct s_star *star_list_A_copy,
+static int prepare_to_recalc(int num_matched_A,
+		struct s_star *matched_list_A, int num_matched_B,
+		struct s_star *matched_list_B, struct s_star *star_list_A_copy,
 		TRANS *trans);
 
-char progname[CMDBUFLEN + 1];
+/* the reference list of stars, prepared once for all images matched
+ * against it by star_match_with_ref() */
+struct star_match_ref {
+	int n;				/* number of stars in the list */
+	struct s_star *star_list;	/* the list B of the matcher */
+	s_match_ref *ref;		/* its triangles */
+};
+
+/* Prepares the n first stars of ref for star_match_with_ref(). Returns NULL
+ * if there are not enough stars, in which case matching fails as well. */
+struct star_match_ref *star_match_ref_new(fitted_PSF **ref, int n) {
+	struct star_match_ref *mref;
+	int nbright, num;
+
+	nbright = atFindTransNbright(n, n, AT_MATCH_NBRIGHT, AT_TRANS_LINEAR);
+	if (nbright < 0)
+		return NULL;
+	mref = shMalloc(sizeof(struct star_match_ref));
+	if (get_stars(ref, n, &num, &mref->star_list)) {
+		shFree(mref);
+		return NULL;
+	}
+	mref->n = num;
+	mref->ref = atMatchRefNew(num, mref->star_list, nbright);
+	return mref;
+}
+
+void star_match_ref_free(struct star_match_ref *mref) {
+	if (!mref)
+		return;
+	atMatchRefDel(mref->ref);
+	free_star_array(mref->star_list);
+	shFree(mref);
+}
 
 int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
-	int ret;
+	return star_match_with_ref(s1, s2, n, NULL, t);
+}
+
+/* Finds the transformation t from the n first stars of s1 to the n first
+ * stars of s2. mref, if not NULL, is s2 prepared by star_match_ref_new(); it
+ * is only read, so several images can be matched against it at the same
+ * time. It is used if it was prepared with the same number of stars, else
+ * s2 is prepared again. */
+int star_match_with_ref(fitted_PSF **s1, fitted_PSF **s2, int n,
+		struct star_match_ref *mref, TRANS *t) {
+	int ret = SH_GENERIC_ERROR;
 	int numA, numB;
-	int num_matched_A, num_matched_B;
+	int num_matched_A = 0, num_matched_B = 0;
 	int numA_copy;
 	int max_iter = AT_MATCH_MAXITER;
 	int min_req_pairs = AT_MATCH_MINPAIRS;
@@ -141,30 +184,23 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 	double medsigclip = 0.0; /* used in MEDTF calcs */
 	double xshift = 0.0; /* guessed shift in X dir */
 	double yshift = 0.0; /* guessed shift in y dir */
-	int nobj = AT_MATCH_NBRIGHT;
 	int transonly = 0; /* if 1, only find TRANS */
 	int recalc = 1; /* if 1, calc TRANS again */
 	int num_matches = 0; /* number of matching pairs */
 	int medtf_flag = 0; /* calculate MEDTF stats? */
 	int intrans = 0; /* use given input TRANS? */
 	int identity = 0; /* use identity as TRANS? */
-	char outfile[CMDBUFLEN + 1];
 	char intransfile[CMDBUFLEN + 1];
-	const char *tmpdir = g_get_tmp_dir();
-	struct s_star *star_list_A, *star_list_B;
-	struct s_star *star_list_A_copy;
-	struct s_star *matched_list_A, *matched_list_B;
+	struct s_star *star_list_A = NULL, *star_list_B = NULL;
+	struct s_star *star_list_A_copy = NULL;
+	struct s_star *matched_list_A = NULL, *matched_list_B = NULL;
+	struct star_match_ref *own_ref = NULL;
 	MEDTF *medtf;
 	TRANS *trans;
 
 	/* buffer overflow paranoia */
-	outfile[CMDBUFLEN] = '\0';
-	progname[CMDBUFLEN] = '\0';
 	intransfile[CMDBUFLEN] = '\0';
 
-	strncpy(outfile, tmpdir, CMDBUFLEN);
-	strcat(outfile, "/matched");
-
 	/*
 	 * We can only calculate _clipped_ MEDTF statistics if we calculate
 	 *   the regular ones.  So it makes no sense to specify 'medsigclip',
@@ -320,7 +356,6 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 		trans_order = trans->order;
 	} else {
 		/* this will be an "empty" TRANS; atFindTrans will try to fill it */
-		atTransOrderSet(trans_order);
 		trans = atTransNew();
 		trans->order = trans_order;
 	}
@@ -328,15 +363,10 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 	printf("using trans_order %d\n", trans_order);
 #endif
 
-	/* read information from the first file */
-	/*	if (read_star_file(fileA, x1col, y1col, mag1col, id1col, -1, &numA,
-	 &star_list_A) != SH_SUCCESS) {
-	 shError("can't read data from file %s", fileA);
-	 exit(1);
-	 }*/
+	/* read information from the first list */
 	if (get_stars(s1, n, &numA, &star_list_A)) {
 		printf("can't read data\n");
-		return (SH_GENERIC_ERROR);
+		goto out;
 	}
 
 	/*
@@ -349,13 +379,9 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 	 *   so that we can restore the output matched coords
 	 *   (which have been converted to those in set B) with the original coords.
 	 */
-	/*	if (read_star_file(fileA, x1col, y1col, mag1col, id1col, -1, &numA_copy,
-	 &star_list_A_copy) != SH_SUCCESS) {
-	 shFatal("can't read data from file %s", fileA);
-	 }*/
 	if (get_stars(s1, n, &numA_copy, &star_list_A_copy)) {
 		printf("can't read data\n");
-		return (SH_GENERIC_ERROR);
+		goto out;
 	}
 	/* sanity check */
 	shAssert(numA_copy == numA);
@@ -366,35 +392,31 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 	 */
 	reset_copy_ids(numA, star_list_A, star_list_A_copy);
 
-	/* read information from the second file */
-	/*	if (read_star_file(fileB, x2col, y2col, mag2col, id2col, -1, &numB,
-	 &star_list_B) != SH_SUCCESS) {
-	 shError("can't read data from file %s", fileB);
-	 exit(1);
-	 }*/
-	if (get_stars(s2, n, &numB, &star_list_B)) {
-		printf("can't read data\n");
-		return (SH_GENERIC_ERROR);
+	/*
+	 * the second list, with its triangles, is given by the caller or
+	 * prepared here if it was made from another number of stars
+	 */
+	if (!mref || mref->n != n) {
+		mref = own_ref = star_match_ref_new(s2, n);
+		if (!mref)
+			goto out;
 	}
+	numB = mref->n;
+	star_list_B = mref->star_list;
 
 	/*
 	 * Now, if the has has not given us an initial TRANS structure, we need
 	 * to find one ourselves.
 	 */
 	if (intrans == 0) {
-		ret = atFindTrans(numA, star_list_A, numB, star_list_B, match_radius,
-				triangle_radius, nobj, min_scale, max_scale, rot_angle, rot_tol,
+		ret = atFindTransRef(numA, star_list_A, mref->ref, match_radius,
+				triangle_radius, min_scale, max_scale, rot_angle, rot_tol,
 				max_iter, halt_sigma, min_req_pairs, trans);
 		if (ret != SH_SUCCESS) {
 			shFatal("initial call to atFindTrans fails");
-			/** */
-			atTransDel(trans);
-			free_star_array(star_list_A);
-			free_star_array(star_list_A_copy);
-			free_star_array(star_list_B);
-			/** */
-			return (SH_GENERIC_ERROR);
+			goto out;
 		}
+		ret = SH_GENERIC_ERROR;
 	}
 
 #ifdef DEBUG
@@ -408,7 +430,9 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 	 */
 	if (transonly == 1) {
 		print_trans(trans);
-		return (0);
+		*t = *trans;
+		ret = 0;
+		goto out;
 	}
 
 	/*
@@ -419,19 +443,15 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 	atApplyTrans(numA, star_list_A, trans);
 
 	/*
-	 * now match up the two sets of items, and find four subsets:
-	 *
-	 *     those from list A that do     have matches in list B
-	 *     those from list B that do     have matches in list A
-	 *     those from list A that do NOT have matches in list B
-	 *     those from list B that do NOT have matches in list A
-	 *
-	 * We may use the two sets of matched objects for further processing,
-	 * so we put the names of the files containing those matched objects
-	 * into 'matched_file_A' and 'matched_file_B' for easy reference.
+	 * now match up the two sets of items, and keep those from list A
+	 * that have matches in list B, and their matches from list B.
 	 */
-	atMatchLists(numA, star_list_A, numB, star_list_B, match_radius, outfile,
-			&num_matches);
+	if (atMatchLists(numA, star_list_A, numB, star_list_B, match_radius,
+			&num_matches, &matched_list_A, &matched_list_B) != SH_SUCCESS) {
+		shFatal("atMatchLists fails");
+		goto out;
+	}
+	num_matched_A = num_matched_B = num_matches;
 	trans->nm = num_matches;
 
 	/*
@@ -456,28 +476,16 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 	 */
 
 	/* need to send trans to prepare_to_recalc because it adds sdx,sdy to it */
-	if (prepare_to_recalc(outfile, &num_matched_A, &matched_list_A,
-			&num_matched_B, &matched_list_B, star_list_A_copy, trans) != 0) {
+	if (prepare_to_recalc(num_matched_A, matched_list_A, num_matched_B,
+			matched_list_B, star_list_A_copy, trans) != 0) {
 		shFatal("prepare_to_recalc fails");
-		/** */
-		atTransDel(trans);
-		free_star_array(matched_list_A);
-		free_star_array(matched_list_B);
-		free_star_array(star_list_A_copy);
-		/** */
-		return (SH_GENERIC_ERROR);
+		goto out;
 	}
 	/* okay, now we're ready to call atRecalcTrans, on matched items only */
 	if (atRecalcTrans(num_matched_A, matched_list_A, num_matched_B,
 			matched_list_B, max_iter, halt_sigma, trans) != SH_SUCCESS) {
 		shFatal("atRecalcTrans fails on matched pairs only");
-		/** */
-		atTransDel(trans);
-		free_star_array(matched_list_A);
-		free_star_array(matched_list_B);
-		free_star_array(star_list_A_copy);
-		/** */
-		return (SH_GENERIC_ERROR);
+		goto out;
 	}
 #ifdef DEBUG
 	printf("TRANS based on matches only :\n");
@@ -499,13 +507,7 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 		/* re-set coords of all items in star A */
 		if (reset_A_coords(numA, star_list_A, star_list_A_copy) != 0) {
 			shFatal("reset_A_coords returns with error before recalc");
-			/** */
-			atTransDel(trans);
-			free_star_array(matched_list_A);
-			free_star_array(matched_list_B);
-			free_star_array(star_list_A_copy);
-			/** */
-			return (SH_GENERIC_ERROR);
+			goto out;
 		}
 
 		/*
@@ -517,8 +519,16 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 		/*
 		 * Match items in list A to those in list B
 		 */
-		atMatchLists(numA, star_list_A, numB, star_list_B, match_radius,
-				outfile, &num_matches);
+		free_star_array(matched_list_A);
+		free_star_array(matched_list_B);
+		matched_list_A = matched_list_B = NULL;
+		if (atMatchLists(numA, star_list_A, numB, star_list_B, match_radius,
+				&num_matches, &matched_list_A, &matched_list_B)
+				!= SH_SUCCESS) {
+			shFatal("atMatchLists fails");
+			goto out;
+		}
+		num_matched_A = num_matched_B = num_matches;
 		trans->nm = num_matches;
 #ifdef DEBUG
 		printf("After tuning with recalc, num matches is %d\n", num_matches);
@@ -527,30 +537,17 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 
 		/* prepare to call atRecalcTrans one last time */
 		/* need to send trans to prepare_to_recalc because it adds sdx,sdy */
-		if (prepare_to_recalc(outfile, &num_matched_A, &matched_list_A,
-				&num_matched_B, &matched_list_B, star_list_A_copy, trans)
-				!= 0) {
+		if (prepare_to_recalc(num_matched_A, matched_list_A, num_matched_B,
+				matched_list_B, star_list_A_copy, trans) != 0) {
 			shFatal("prepare_to_recalc fails");
-			/** */
-			atTransDel(trans);
-			free_star_array(matched_list_A);
-			free_star_array(matched_list_B);
-			free_star_array(star_list_A_copy);
-			/** */
-			return (SH_GENERIC_ERROR);
+			goto out;
 		}
 
 		/* final call atRecalcTrans, on matched items only */
 		if (atRecalcTrans(num_matched_A, matched_list_A, num_matched_B,
 				matched_list_B, max_iter, halt_sigma, trans) != SH_SUCCESS) {
 			shFatal("atRecalcTrans fails on matched pairs only");
-			/** */
-			atTransDel(trans);
-			free_star_array(matched_list_A);
-			free_star_array(matched_list_B);
-			free_star_array(star_list_A_copy);
-			/** */
-			return (SH_GENERIC_ERROR);
+			goto out;
 		}
 
 #ifdef DEBUG
@@ -572,13 +569,7 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 		if (reset_A_coords(num_matched_A, matched_list_A, star_list_A_copy)
 				!= 0) {
 			shFatal("second call to reset_A_coords returns with error");
-			/** */
-			atTransDel(trans);
-			free_star_array(matched_list_A);
-			free_star_array(matched_list_B);
-			free_star_array(star_list_A_copy);
-			/** */
-			return (SH_GENERIC_ERROR);
+			goto out;
 		}
 
 		medtf = atMedtfNew();
@@ -593,8 +584,16 @@ int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *t) {
 
 	print_trans(trans);
 	*t = *trans;
-
-	return (0);
+	ret = 0;
+
+out:
+	atTransDel(trans);
+	free_star_array(matched_list_A);
+	free_star_array(matched_list_B);
+	free_star_array(star_list_A);
+	free_star_array(star_list_A_copy);
+	star_match_ref_free(own_ref);
+	return (ret);
 }
 
 /***********************************************************************
@@ -699,36 +698,18 @@ struct s_star *pre_list_A /* I: stars in A, with original coords */
  * DESCRIPTION: This function sets us up to call "atRecalcTrans".
  *              We have already found (or been given) a TRANS, and
  *              used it to match up items from list A and list B.
- *              Those matched items are in a pair of files
- *              with names based on 'outfile', but with
- *              extensions "mtA" and "mtB".
- *              Ex: if 'outfile' is "matched",
- *              then the two sets of matched items are in
- *
- *                    matched.mtA      matched.mtB
- *
- *              The format of each file is one star per line,
- *              with 4 fields:
- *
- *                    internal_ID     xval   yval     mag
- *
- *              where the coords (xval, yval) are in system of list B.
+ *              Those matched items are in 'matched_list_A' and
+ *              'matched_list_B', as given by atMatchLists, the
+ *              coords of items from list A being in system of list B.
  *
  *              We are about to use these good, matched items to
  *              find an improved TRANS -- which should take objects
  *              from coord system A to coord system B.
  *
- *              In order to do that, we need to
- *
- *                  a. Read in the good, matched items.  The coordinates
- *                     of objects in list A will have been transformed
- *                     to their corresponding values in coord system
- *                     of list B, so ...
- *
- *                  b. We must then re-set the coords of the items in
- *                     list A to their original values, so that we can
- *                     re-calculate a TRANS which takes the coords
- *                     from system A to system B.
+ *              In order to do that, we must re-set the coords of the
+ *              items in list A to their original values, so that we can
+ *              re-calculate a TRANS which takes the coords
+ *              from system A to system B.
  *
  *              We also take this opportunity to compare the transformed
  *              positions of items in list A against the positions of
@@ -743,51 +724,32 @@ struct s_star *pre_list_A /* I: stars in A, with original coords */
  *    1             if there's an error
  */
 
-static int prepare_to_recalc(char *outfile, /* I: stem of files with matched items */
-int *num_matched_A, /* O: number of stars in matched set */
+static int prepare_to_recalc(int num_matched_A, /* I: number of stars in matched set */
 /*      from list A */
-struct s_star **matched_list_A, /* O: fill this with matched items from */
-/*      list A, in coord system B */
-int *num_matched_B, /* O: number of stars in matched set */
+struct s_star *matched_list_A, /* I/O: matched items from list A, */
+/*      in coord system B on input, */
+/*      with their orig coords on output */
+int num_matched_B, /* I: number of stars in matched set */
 /*      from list B */
-struct s_star **matched_list_B, /* O: fill this with matched items from */
-/*      list B, in coord system B */
-struct s_star *star_list_A_copy, /* O: fill this with matched items from */
-/*      list A, with their orig coords  */
+struct s_star *matched_list_B, /* I: matched items from list B, */
+/*      in coord system B */
+struct s_star *star_list_A_copy, /* I: items from list A, */
+/*      with their orig coords  */
 TRANS *trans /* O: we calc herein the sx, sy fields  */
 /*      so put them into this TRANS */
 ) {
-	char matched_file_A[CMDBUFLEN + 4];
-	char matched_file_B[CMDBUFLEN + 4];
 	double Xrms, Yrms;
 
-	shAssert(outfile != NULL);
-
-	sprintf(matched_file_A, "%s.mtA", outfile);
-	if (read_matched_file(matched_file_A, num_matched_A,
-			matched_list_A) != SH_SUCCESS) {
-		shError("read_matched_file can't read data from file %s",
-				matched_file_A);
-		return (1);
-	}
-	sprintf(matched_file_B, "%s.mtB", outfile);
-	if (read_matched_file(matched_file_B, num_matched_B,
-			matched_list_B) != SH_SUCCESS) {
-		shError("read_matched_file can't read data from file %s",
-				matched_file_B);
-		return (1);
-	}
-
 	/* here we find the rms of those stars we read in -- JPB 17/Jan/02 */
-	if (atCalcRMS(*num_matched_A, *matched_list_A, *num_matched_B,
-			*matched_list_B, &Xrms, &Yrms) != SH_SUCCESS) {
+	if (atCalcRMS(num_matched_A, matched_list_A, num_matched_B,
+			matched_list_B, &Xrms, &Yrms) != SH_SUCCESS) {
 		shFatal("atCalcRMS fails on matched pairs");
 	}
 	trans->sx = Xrms;
 	trans->sy = Yrms;
 	/************************************************/
 
-	if (reset_A_coords(*num_matched_A, *matched_list_A, star_list_A_copy)
+	if (reset_A_coords(num_matched_A, matched_list_A, star_list_A_copy)
 			!= 0) {
 		shError("prepare_to_recalc: reset_A_coords returns with error");
 		return (1);
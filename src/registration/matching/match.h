@@ -3,17 +3,13 @@
 
 #include "core/siril.h"
 
-/*
- * this is default value for the base of the output file names.
- * The 4 output files will have extensions
- *
- *   ".mtA"       stars from first list which DO match
- *   ".mtB"       stars from second list which DO match
- *   ".unA"       stars from first list which DON'T match
- *   ".unB"       stars from second list which DON'T match
- */
-#define AT_MATCH_OUTFILE   "matched"
+struct star_match_ref;
+
+struct star_match_ref *star_match_ref_new(fitted_PSF **ref, int n);
+void star_match_ref_free(struct star_match_ref *mref);
 
 int star_match(fitted_PSF **s1, fitted_PSF **s2, int n, TRANS *trans);
+int star_match_with_ref(fitted_PSF **s1, fitted_PSF **s2, int n,
+		struct star_match_ref *mref, TRANS *trans);
 
 #endif   /* MATCH_H */
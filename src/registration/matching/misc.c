@@ -45,6 +45,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <glib.h>
 #include "core/siril.h"
 #include "gui/callbacks.h"
 #include "algos/PSF.h"
@@ -255,8 +256,11 @@ atTransNew() {
 	static int id_number = 0;
 
 	new = shMalloc(sizeof(TRANS));
-	new->id = id_number++;
-	new->order = atTransOrderGet();
+	/* TRANS are created by matchings running in parallel */
+	new->id = g_atomic_int_add(&id_number, 1);
+	/* the order is set by the caller, not taken from the global value,
+	 * which is not thread-safe */
+	new->order = AT_TRANS_LINEAR;
 	new->nr = 0;
 	new->nm = 0;
 	new->sig = 0.0;
@@ -357,7 +361,7 @@ double mag /* I: mag value for new star */
 	static int id_number = 0;
 
 	new = (struct s_star *) shMalloc(sizeof(struct s_star));
-	new->id = id_number++;
+	new->id = g_atomic_int_add(&id_number, 1);
 	new->index = -1;
 	new->x = x;
 	new->y = y;
@@ -537,29 +541,27 @@ struct s_star **list /* O: new star list will be placed here */
 }
 #endif
 
+/* Creates the list of the n first stars of s. The list is stored in a single
+ * array, it is freed with free_star_array() */
 int get_stars(fitted_PSF **s, int n, int *num_stars, struct s_star **list) {
-	int i = 0;
-	struct s_star *head, *last, *new;
-
-	head = (struct s_star *) NULL;
-	last = head;
+	int i;
+	struct s_star *array;
 
-	while (i < n) {
-		new = atStarNew(s[i]->xpos, s[i]->ypos, s[i]->mag);
-		new->id = i;
-
-		if (head == NULL) {
-			head = new;
-			last = new;
-		} else {
-			last->next = new;
-			last = new;
-		}
-		i++;
+	if (n < 1)
+		return (SH_GENERIC_ERROR);
+	array = (struct s_star *) shMalloc(n * sizeof(struct s_star));
+	for (i = 0; i < n; i++) {
+		array[i].id = i;
+		array[i].index = -1;
+		array[i].x = s[i]->xpos;
+		array[i].y = s[i]->ypos;
+		array[i].mag = s[i]->mag;
+		array[i].match_id = -1;
+		array[i].next = i < n - 1 ? &array[i + 1] : NULL;
 	}
 
-	*num_stars = i;
-	*list = head;
+	*num_stars = n;
+	*list = array;
 
 	return (SH_SUCCESS);
 }
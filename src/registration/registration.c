@@ -37,6 +37,8 @@
 #include "core/proto.h"
 #include "core/initfile.h"
 #include "registration/registration.h"
+#include "registration/dft_align.h"
+#include "registration/warp.h"
 #include "registration/matching/misc.h"
 #include "registration/matching/match.h"
 #include "registration/matching/atpmatch.h"
@@ -47,6 +49,10 @@
 #include "algos/quality.h"
 #include "io/sequence.h"
 #include "io/ser.h"
+#include "io/stats_cache.h"
+#include "io/prefetch.h"
+#include "io/journal.h"
+#include "core/image_pool.h"
 #ifdef HAVE_OPENCV
 #include "opencv/opencv.h"
 #include "opencv/ecc/ecc.h"
@@ -86,6 +92,14 @@ static struct registration_method *reg_methods[NUMBER_OF_METHOD];
 static gpointer register_thread_func(gpointer p);
 static gboolean end_register_idle(gpointer p);
 
+/* the shifts computed by a registration replace the transforms of a previous
+ * star alignment */
+static void clear_transforms(regdata *regparam, int number) {
+	int i;
+	for (i = 0; i < number; i++)
+		regparam[i].has_transform = FALSE;
+}
+
 struct registration_method *new_reg_method(const char *name, registration_function f,
 		selection_type s, registration_type t) {
 	struct registration_method *reg = malloc(sizeof(struct registration_method));
@@ -175,31 +189,39 @@ static void normalizeQualityData(struct registration_args *args, double q_min, d
 	}
 }
 
+/* the first frame after frame that will be registered, -1 if none. Frames
+ * registered by a previous run are not read, they are not returned */
+static int next_frame_to_register(struct registration_args *args, int frame, int ref_image) {
+	for (frame++; frame < args->seq->number; frame++) {
+		if (frame != ref_image && (args->process_all_frames || args->seq->imgparam[frame].incl) &&
+				!journal_frame_done(args->journal, frame, NULL, 0))
+			return frame;
+	}
+	return -1;
+}
+
 /* register images: calculate shift in images to be aligned with the reference image;
  * images are not modified, only shift parameters are saved in regparam in the sequence.
  * layer is the layer on which the registration will be done, green by default (set in siril_init())
  */
 int register_shift_dft(struct registration_args *args) {
 	fits fit_ref, fit;
-	int frame, size, sqsize;
-	fftw_complex *ref, *in, *out, *convol;
-	fftw_plan p, q;
-	int ret, j;
-	int plan;
+	int frame, size;
+	struct dft_engine *dft;
+	struct frame_prefetcher *prefetcher;
+	GMutex io_lock;
+	int ret;
 	int abort = 0;
 	float nb_frames, cur_nb;
 	int ref_image;
 	regdata *current_regdata;
-	rectangle full_area;	// the area to use after getting image_part
 	double q_max = 0, q_min = DBL_MAX;
-	int q_index = -1;
+	int q_index = -1, nb_skipped = 0;
+	gchar *ref_key, *params;
 
 	/* the selection needs to be squared for the DFT */
 	assert(args->selection.w == args->selection.h);
 	size = args->selection.w;
-	full_area.x = full_area.y = 0;
-	full_area.h = full_area.w = size;
-	sqsize = size * size;
 
 	if (args->process_all_frames)
 		nb_frames = (float) args->seq->number;
@@ -214,6 +236,7 @@ int register_shift_dft(struct registration_args *args) {
 		siril_log_message(
 				_("Recomputing already existing registration for this layer\n"));
 		current_regdata = args->seq->regparam[args->layer];
+		clear_transforms(current_regdata, args->seq->number);
 	} else {
 		current_regdata = calloc(args->seq->number, sizeof(regdata));
 		if (current_regdata == NULL) {
@@ -243,33 +266,41 @@ int register_shift_dft(struct registration_args *args) {
 		return ret;
 	}
 
-	ref = fftw_malloc(sizeof(fftw_complex) * sqsize);
-	in = fftw_malloc(sizeof(fftw_complex) * sqsize);
-	out = fftw_malloc(sizeof(fftw_complex) * sqsize);
-	convol = fftw_malloc(sizeof(fftw_complex) * sqsize);
-
-	if (nb_frames > 200.f)
-		plan = FFTW_MEASURE;
-	else
-		plan = FFTW_ESTIMATE;
-
-	p = fftw_plan_dft_2d(size, size, ref, out, FFTW_FORWARD, plan);
-	q = fftw_plan_dft_2d(size, size, convol, out, FFTW_BACKWARD, plan);
-
-	// copying image selection into the fftw data
-	for (j = 0; j < sqsize; j++)
-		ref[j] = (double) fit_ref.data[j];
+	/* plans and buffers are created once for all frames */
+	dft = dft_engine_new(size, (int) nb_frames, com.max_thread);
+	/* frames are read in advance, one at a time if cfitsio is not reentrant */
+	g_mutex_init(&io_lock);
+	prefetcher = prefetcher_new(args->seq, com.max_thread, args->layer, FALSE,
+			args->seq->type == SEQ_REGULAR && !fits_is_reentrant() ? &io_lock : NULL);
+	if (!dft || !prefetcher || dft_engine_set_reference(dft, fit_ref.data)) {
+		siril_log_message(_("Register: could not initialize the DFT, aborting.\n"));
+		if (current_regdata != args->seq->regparam[args->layer])
+			free(current_regdata);
+		clearfits(&fit_ref);
+		dft_engine_free(dft);
+		prefetcher_free(prefetcher);
+		g_mutex_clear(&io_lock);
+		return 1;
+	}
 
 	// We don't need fit anymore, we can destroy it.
 	current_regdata[ref_image].quality = QualityEstimate(&fit_ref, args->layer, QUALTYPE_NORMAL);
 	clearfits(&fit_ref);
-	fftw_execute_dft(p, ref, in); /* repeat as needed */
 	current_regdata[ref_image].shiftx = 0;
 	current_regdata[ref_image].shifty = 0;
 
 	q_min = q_max = current_regdata[ref_image].quality;
 	q_index = ref_image;
 
+	/* shifts and quality of the frames done by a previous run are kept */
+	ref_key = journal_image_key(args->seq, ref_image);
+	params = g_strdup_printf("dft %d %d %d %d %d %s", args->layer,
+			args->selection.x, args->selection.y, args->selection.w,
+			args->selection.h, ref_key);
+	args->journal = journal_open(args->seq, "register", params);
+	g_free(ref_key);
+	g_free(params);
+
 	cur_nb = 0.f;
 
 	memset(&fit, 0, sizeof(fits));
@@ -279,6 +310,9 @@ int register_shift_dft(struct registration_args *args) {
 #endif
 	for (frame = 0; frame < args->seq->number; ++frame) {
 		if (!abort) {
+			int thread = 0;
+			double shiftx, shifty, qual;
+			char data[JOURNAL_DATA_SIZE];
 			if (args->run_in_thread && !get_thread_run()) {
 				abort = 1;
 				continue;
@@ -288,113 +322,97 @@ int register_shift_dft(struct registration_args *args) {
 			if (!args->process_all_frames && !args->seq->imgparam[frame].incl)
 				continue;
 
-			char tmpmsg[1024], tmpfilename[256];
-
-			seq_get_image_filename(args->seq, frame, tmpfilename);
-			g_snprintf(tmpmsg, 1024, _("Register: processing image %s\n"),
-					tmpfilename);
-			set_progress_bar_data(tmpmsg, PROGRESS_NONE);
-			if (!(seq_read_frame_part(args->seq, args->layer, frame, &fit,
-					&args->selection, FALSE))) {
-
-				int x;
-				fftw_complex *img = fftw_malloc(sizeof(fftw_complex) * sqsize);
-				fftw_complex *out2 = fftw_malloc(sizeof(fftw_complex) * sqsize);
-
-				// copying image selection into the fftw data
-				for (x = 0; x < sqsize; x++)
-					img[x] = (double) fit.data[x];
-
-				// We don't need fit anymore, we can destroy it.
-				current_regdata[frame].quality = QualityEstimate(&fit, args->layer,
-						QUALTYPE_NORMAL);
-
-				clearfits(&fit);
-
+			if (journal_frame_done(args->journal, frame, data, JOURNAL_DATA_SIZE) &&
+					sscanf(data, "%lg %lg %lg", &shiftx, &shifty, &qual) == 3) {
 #ifdef _OPENMP
-#pragma omp critical
+#pragma omp atomic
 #endif
-				{
-					double qual = current_regdata[frame].quality;
-					if (qual > q_max) {
-						q_max = qual;
-						q_index = frame;
-					}
-					q_min = min(q_min, qual);
+				nb_skipped++;
+			} else {
+				char tmpmsg[1024], tmpfilename[256];
+
+				seq_get_image_filename(args->seq, frame, tmpfilename);
+				g_snprintf(tmpmsg, 1024, _("Register: processing image %s\n"),
+						tmpfilename);
+				set_progress_bar_data(tmpmsg, PROGRESS_NONE);
+				/* with the static schedule, the next frame of this thread */
+				prefetcher_request(prefetcher, next_frame_to_register(args, frame, ref_image),
+						&args->selection);
+				if (prefetcher_get(prefetcher, frame, &args->selection, &fit)) {
+					//report_fits_error(ret, error_buffer);
+					abort = ret = 1;
+					continue;
 				}
+#ifdef _OPENMP
+				thread = omp_get_thread_num();
+#endif
+				int failed = dft_engine_shift(dft, thread, fit.data, TRUE, &shiftx, &shifty);
 
-				fftw_execute_dft(p, img, out2); /* repeat as needed */
-
-				fftw_complex *convol2 = fftw_malloc(sizeof(fftw_complex) * sqsize);
+				// We don't need fit anymore, we can destroy it.
+				qual = QualityEstimate(&fit, args->layer, QUALTYPE_NORMAL);
 
-				for (x = 0; x < sqsize; x++) {
-					convol2[x] = in[x] * conj(out2[x]);
+				fits_recycle(&fit);
+				if (failed) {
+					abort = ret = 1;
+					continue;
 				}
+				g_snprintf(data, JOURNAL_DATA_SIZE, "%.17g %.17g %.17g", shiftx, shifty, qual);
+				journal_set_done(args->journal, frame, NULL, data);
+			}
+			current_regdata[frame].quality = qual;
 
-				fftw_execute_dft(q, convol2, out2); /* repeat as needed */
-				fftw_free(convol2);
-
-				int shift = 0;
-				for (x = 1; x < sqsize; ++x) {
-					if (creal(out2[x]) > creal(out2[shift])) {
-						shift = x;
-						// break or get last value?
-					}
-				}
-				int shifty = shift / size;
-				int shiftx = shift % size;
-				if (shifty > size / 2) {
-					shifty -= size;
-				}
-				if (shiftx > size / 2) {
-					shiftx -= size;
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+			{
+				if (qual > q_max) {
+					q_max = qual;
+					q_index = frame;
 				}
+				q_min = min(q_min, qual);
+			}
 
-				current_regdata[frame].shiftx = shiftx;
-				current_regdata[frame].shifty = shifty;
+			/* shifts are saved as integers in the sequence for now */
+			current_regdata[frame].shiftx = round_to_int(shiftx);
+			current_regdata[frame].shifty = round_to_int(shifty);
 
-				/* shiftx and shifty are the x and y values for translation that
-				 * would make this image aligned with the reference image.
-				 * WARNING: the y value is counted backwards, since the FITS is
-				 * stored down from up.
-				 */
+			/* shiftx and shifty are the x and y values for translation that
+			 * would make this image aligned with the reference image.
+			 * WARNING: the y value is counted backwards, since the FITS is
+			 * stored down from up.
+			 */
 #ifdef DEBUG
-				fprintf(stderr,
-						"reg: frame %d, shiftx=%d shifty=%d quality=%g\n",
-						args->seq->imgparam[frame].filenum,
-						current_regdata[frame].shiftx, current_regdata[frame].shifty,
-						current_regdata[frame].quality);
+			fprintf(stderr,
+					"reg: frame %d, shiftx=%.2f shifty=%.2f quality=%g\n",
+					args->seq->imgparam[frame].filenum,
+					shiftx, shifty, current_regdata[frame].quality);
 #endif
 #ifdef _OPENMP
 #pragma omp atomic
 #endif
-				cur_nb += 1.f;
-				set_progress_bar_data(NULL, cur_nb / nb_frames);
-				fftw_free(img);
-				fftw_free(out2);
-			} else {
-				//report_fits_error(ret, error_buffer);
-				if (current_regdata == args->seq->regparam[args->layer])
-					args->seq->regparam[args->layer] = NULL;
-				free(current_regdata);
-				abort = ret = 1;
-				continue;
-			}
+			cur_nb += 1.f;
+			set_progress_bar_data(NULL, cur_nb / nb_frames);
 		}
 	}
 
-	fftw_destroy_plan(p);
-	fftw_destroy_plan(q);
-	fftw_free(in);
-	fftw_free(out);
-	fftw_free(ref);
-	fftw_free(convol);
+	journal_close(args->journal);
+	args->journal = NULL;
+	if (nb_skipped)
+		siril_log_message(_("%d images were already registered and up to date, skipped\n"), nb_skipped);
+	prefetcher_free(prefetcher);
+	g_mutex_clear(&io_lock);
+	dft_engine_free(dft);
+	/* a cancelled registration keeps the frames registered so far */
 	if (!ret) {
 		args->seq->regparam[args->layer] = current_regdata;
 		normalizeQualityData(args, q_min, q_max);
 		update_used_memory();
 		siril_log_message(_("Registration finished.\n"));
 		siril_log_color_message(_("Best frame: #%d.\n"), "bold", q_index);
+	} else {
+		if (current_regdata == args->seq->regparam[args->layer])
+			args->seq->regparam[args->layer] = NULL;
+		free(current_regdata);
 	}
 	return ret;
 }
@@ -422,6 +440,7 @@ int register_shift_fwhm(struct registration_args *args) {
 		return 1;
 
 	current_regdata = args->seq->regparam[args->layer];
+	clear_transforms(current_regdata, args->seq->number);
 
 	if (args->process_all_frames)
 		nb_frames = (float) args->seq->number;
@@ -518,19 +537,26 @@ static void _print_result(TRANS *trans, float FWHMx, float FWHMy) {
 int register_star_alignment(struct registration_args *args) {
 	int frame, ref_image, ret, i;
 	int abort = 0;
-	int fitted_stars, failed, skipped;
+	int fitted_stars, failed, out_index;
 	float nb_frames, cur_nb;
 	float FWHMx, FWHMy;
-	fitted_PSF **stars, **refstars;
-	TRANS trans;
+	fitted_PSF **refstars;
+	struct star_match_ref *match_ref;
 	regdata *current_regdata;
 	starFinder sf;
-	fits fit;
+	rectangle *area = NULL;
+	fits ref_fit;
 	struct ser_struct *new_ser = NULL;
-
-	memset(&fit, 0, sizeof(fits));
+	struct stats_cache *new_stats = NULL;
+	struct frame_prefetcher *prefetcher;
+	gboolean serialize_io, in_place;
+	GMutex io_lock;
+	char new_ser_filename[256];
+	gchar *ref_key, *params;
+	int nb_skipped = 0;
+
+	memset(&ref_fit, 0, sizeof(fits));
 	memset(&sf, 0, sizeof(starFinder));
-	memset(&trans, 0, sizeof(TRANS));
 
 	if (!args->seq->regparam) {
 		fprintf(stderr, "regparam should have been created before\n");
@@ -561,7 +587,7 @@ int register_star_alignment(struct registration_args *args) {
 	else ref_image = args->seq->reference_image;
 
 	/* first we're looking for stars in reference image */
-	ret = seq_read_frame(args->seq, ref_image, &fit);
+	ret = seq_read_frame(args->seq, ref_image, &ref_fit);
 	if (ret) {
 		siril_log_message(_("Could not load reference image\n"));
 		if (current_regdata == args->seq->regparam[args->layer])
@@ -571,12 +597,15 @@ int register_star_alignment(struct registration_args *args) {
 	}
 	siril_log_color_message(_("Reference Image:\n"), "green");
 
-	if ((com.selection.w != 0) && (com.selection.h != 0) && args->matchSelection) {
-		com.stars = peaker(&fit, args->layer, &sf, &com.selection);
-	}
-	else {
-		com.stars = peaker(&fit, args->layer, &sf, NULL);
-	}
+	if ((com.selection.w != 0) && (com.selection.h != 0) && args->matchSelection)
+		area = &com.selection;
+	/* without GUI, the parameters come from the command */
+	if (com.headless) {
+		sf = args->sf;
+		com.stars = peaker_with_params(&ref_fit, args->layer, &sf, area);
+	} else com.stars = peaker(&ref_fit, args->layer, &sf, area);
+
+	clearfits(&ref_fit);
 
 	if (sf.nb_stars < AT_MATCH_MINPAIRS) {
 		siril_log_message(
@@ -586,7 +615,8 @@ int register_star_alignment(struct registration_args *args) {
 		free(current_regdata);
 		return 1;
 	}
-	redraw(com.cvport, REMAP_NONE); // draw stars
+	if (!com.headless)
+		redraw(com.cvport, REMAP_NONE); // draw stars
 
 	/* we copy com.stars to refstars in case user take a look to another image of the sequence
 	 * that would destroy com.stars
@@ -624,9 +654,15 @@ int register_star_alignment(struct registration_args *args) {
 	else args->new_total = args->seq->selnum;
 	args->imgparam = calloc(args->new_total, sizeof(imgdata));
 	args->regparam = calloc(args->new_total, sizeof(regdata));
+	/* the results are stored in the registration data of the sequence
+	 * without creating a new one in translation only and no output modes */
+	in_place = args->translation_only || args->no_output;
+	/* statistics of the new images, saved for the stacking of the new sequence */
+	if (!in_place)
+		new_stats = stats_cache_new(args->new_total);
 
-	if (args->seq->type == SEQ_SER) {
-		char dest[256];
+	if (args->seq->type == SEQ_SER && !in_place) {
+		char *dest = new_ser_filename;
 
 		new_ser = malloc(sizeof(struct ser_struct));
 
@@ -645,137 +681,225 @@ int register_star_alignment(struct registration_args *args) {
 		ser_create_file(dest, new_ser, TRUE, NULL);
 	}
 
-	skipped = 0;
+	/* frames registered by a previous run with the same reference stars, and
+	 * which registered image is unchanged, are not processed again */
+	ref_key = journal_image_key(args->seq, ref_image);
+	params = g_strdup_printf("stars %d %d %d %d %s %d %d %d %d %d %d %.9g %.9g %s",
+			args->layer, args->interpolation, args->translation_only, args->no_output,
+			args->prefix ? args->prefix : "", args->matchSelection,
+			com.selection.x, com.selection.y, com.selection.w, com.selection.h,
+			sf.radius, sf.sigma, sf.roundness, ref_key);
+	args->journal = journal_open(args->seq, "register", params);
+	g_free(ref_key);
+	g_free(params);
+
+	/* Frames are registered in parallel, each thread with its own star
+	 * finder and star list. The index of a frame in the new sequence depends
+	 * on the failures of the frames before it, so results are committed in
+	 * the order of the sequence, in the ordered section, where messages are
+	 * also printed. */
 	failed = 0;
-	for (frame = 0, cur_nb = 0.f; frame < args->seq->number; frame++) {
-		if (!abort) {
-			if (args->run_in_thread && !get_thread_run()) {
-				abort = 1;
-				continue;
-			}
-			if (!args->process_all_frames && !args->seq->imgparam[frame].incl) {
-				skipped++;
-				continue;
-			}
-
-			ret = seq_read_frame(args->seq, frame, &fit);
-			if (!ret) {
-				char dest[256], filename[256];
-				int nbpoints;
-
-				if (args->translation_only) {
+	out_index = 0;
+	cur_nb = 0.f;
+	/* the triangles of the reference stars are made once for all frames, it
+	 * is NULL if there are too few stars, and each match then fails */
+	match_ref = star_match_ref_new(refstars, fitted_stars);
+	/* if cfitsio is not reentrant, frames read in advance must not be read
+	 * while the registered frames are saved */
+	serialize_io = args->seq->type == SEQ_REGULAR && !fits_is_reentrant();
+	g_mutex_init(&io_lock);
+	prefetcher = prefetcher_new(args->seq, com.max_thread, args->layer, FALSE,
+			serialize_io ? &io_lock : NULL);
+	if (!prefetcher)
+		abort = 1;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) ordered schedule(dynamic, 1) \
+	private(i) if((args->seq->type == SEQ_REGULAR && fits_is_reentrant()) || args->seq->type == SEQ_SER)
+#endif
+	for (frame = 0; frame < args->seq->number; frame++) {
+		enum { FRAME_SKIPPED, FRAME_FAILED, FRAME_OK } status = FRAME_SKIPPED;
+		const char *failure = NULL;
+		fitted_PSF **stars = NULL;
+		imstats *stats = NULL;
+		starFinder thread_sf = sf;	// the parameters of the reference detection
+		TRANS trans;
+		float fwhmx = 0.f, fwhmy = 0.f;
+		gboolean done = FALSE;	// by a previous run
+		char data[JOURNAL_DATA_SIZE];
+		fits fit;
+
+		memset(&fit, 0, sizeof(fits));
+		memset(&trans, 0, sizeof(TRANS));
+
+		if (!abort && args->run_in_thread && !get_thread_run())
+			abort = 1;
+		if (!abort && (args->process_all_frames || args->seq->imgparam[frame].incl)) {
+			/* the frame this thread will probably process next */
+			prefetcher_request(prefetcher, next_frame_to_register(args,
+						frame + com.max_thread - 1, -1), NULL);
+
+			status = FRAME_FAILED;
+			if (journal_frame_done(args->journal, frame, data, JOURNAL_DATA_SIZE) &&
+					sscanf(data, "%f %lg %lg %lg %lg", &fwhmx, &trans.a,
+						&trans.b, &trans.c, &trans.d) == 5) {
+				status = FRAME_OK;
+				done = TRUE;
+				current_regdata[frame].fwhm = fwhmx;
+			} else if (prefetcher_get(prefetcher, frame, NULL, &fit)) {
+				failure = _("Could not load image %d. Image skipped\n");
+			} else {
+				status = FRAME_OK;
+				if (in_place) {
 					/* if "translation only", we choose to initialize all frames
 					 * to exclude status. If registration is ok, the status is
 					 * set to include */
 					args->seq->imgparam[frame].incl = !SEQUENCE_DEFAULT_INCLUDE;
 				}
+			}
 
-				if (frame != ref_image) {
-					if (args->seq->type == SEQ_SER) {
-						siril_log_color_message(_("Frame %d:\n"), "bold", frame);
-					}
-					stars = peaker(&fit, args->layer, &sf, NULL);
-					if (sf.nb_stars < AT_MATCH_MINPAIRS) {
-						siril_log_message(
-								_("Not enough stars. Image %d skipped\n"), frame);
-						args->new_total--;
-						failed++;
-						cur_nb += 1.f;
-						continue;
-					}
-
-#ifdef DEBUG
-					FILE *pfile2;
-
-					pfile2 = fopen("im.txt", "w+");
-					fprintf(pfile2, "IMAGE %d\n", frame);
-					for (i = 0; i < MAX_STARS_FITTED; i++) {
-						fprintf(pfile2, "%.3lf\t%.3lf\t%.3lf\n", stars[i]->xpos,
-								stars[i]->ypos, stars[i]->mag);
-					}
-					fprintf(pfile2, "\n\n", frame);
-					fclose(pfile2);
-
-#endif
+			if (status == FRAME_OK && !done && frame != ref_image) {
+				int nbpoints, matching;
 
-					nbpoints = (sf.nb_stars < fitted_stars) ?
-						sf.nb_stars : fitted_stars;
-
-					if (star_match(stars, refstars, nbpoints, &trans)) {
-						siril_log_color_message(_("Cannot perform star matching. Image %d skipped\n"),
-								"red", frame);
-						args->new_total--;
-						failed++;
-						i = 0;
-						while (i < MAX_STARS && stars[i])
-							free(stars[i++]);
-						free(stars);
-						cur_nb += 1.f;
-						continue;
+				stars = peaker_with_params(&fit, args->layer, &thread_sf, NULL);
+				nbpoints = (thread_sf.nb_stars < fitted_stars) ?
+					thread_sf.nb_stars : fitted_stars;
+				if (thread_sf.nb_stars < AT_MATCH_MINPAIRS) {
+					failure = _("Not enough stars. Image %d skipped\n");
+					status = FRAME_FAILED;
+				} else {
+					matching = star_match_with_ref(stars, refstars, nbpoints,
+							match_ref, &trans);
+					if (matching) {
+						failure = _("Cannot perform star matching. Image %d skipped\n");
+						status = FRAME_FAILED;
 					}
+				}
 
-					FWHM_average(stars, &FWHMx, &FWHMy, nbpoints);
-					_print_result(&trans, FWHMx, FWHMy);
-					current_regdata[frame].fwhm = FWHMx;
-
-					if (!args->translation_only) {
-						fits_flip_top_to_bottom(&fit);	// this is because in cvTransformImage, rotation center point is at (0, 0)
-
-						/* An alternative method for generating an improved rotation: Basically we apply the operation to an image
-						 * that is at least twice (or more) the size of the final image size wanted. After rotating the image,
-						 * the image is resized down to its final size so as to produce a very sharp lines,
-						 * edges, and much cleaner looking fonts. */
-						/**TODO: use vips and 	VipsInterpolate *interpolate = vips_interpolate_new( "nohalo" );  */
-						cvResizeGaussian(&fit, fit.rx * SUPER_SAMPLING, fit.ry * SUPER_SAMPLING, OPENCV_CUBIC);
-						trans.a *= SUPER_SAMPLING;
-						trans.d *= SUPER_SAMPLING;
-						cvTransformImage(&fit, trans, args->interpolation);
-						cvResizeGaussian(&fit, fit.rx / SUPER_SAMPLING, fit.ry / SUPER_SAMPLING, OPENCV_CUBIC);
-
-						fits_flip_top_to_bottom(&fit);
+				if (status == FRAME_OK) {
+					FWHM_average(stars, &fwhmx, &fwhmy, nbpoints);
+					current_regdata[frame].fwhm = fwhmx;
+
+					if (!in_place) {
+						/* the output is interpolated in a single pass,
+						 * straight from the input image */
+						double m[6];
+						if (warp_get_transform(&trans, fit.ry, m) ||
+								warp_image(&fit, m, args->interpolation)) {
+							failure = _("Cannot transform the image. Image %d skipped\n");
+							status = FRAME_FAILED;
+						}
 					}
+				}
 
+				if (stars) {
 					i = 0;
 					while (i < MAX_STARS && stars[i])
 						free(stars[i++]);
 					free(stars);
 				}
+			}
 
-				if (!args->translation_only) {
+			/* the statistics used by the normalization of the new image,
+			 * before waiting for its turn */
+			if (status == FRAME_OK && !done && !in_place)
+				stats = statistics(&fit, 0, NULL, STATS_EXTRA, STATS_ZERO_NULLCHECK);
+		}
+
+#ifdef _OPENMP
+#pragma omp ordered
+#endif
+		{
+			if (status == FRAME_FAILED) {
+				siril_log_color_message(failure, "red", frame);
+				args->new_total--;
+				failed++;
+			} else if (status == FRAME_OK) {
+				g_snprintf(data, JOURNAL_DATA_SIZE, "%.9g %.17g %.17g %.17g %.17g",
+						current_regdata[frame].fwhm, trans.a, trans.b, trans.c, trans.d);
+				if (done)
+					nb_skipped++;
+				else if (frame != ref_image) {
+					if (args->seq->type == SEQ_SER)
+						siril_log_color_message(_("Frame %d:\n"), "bold", frame);
+					_print_result(&trans, fwhmx, fwhmy);
+				}
+				if (!in_place) {
+					char dest[256], filename[256];
+					stats_cache_set(new_stats, out_index, 0, STATS_EXTRA, stats);
 					if (args->seq->type == SEQ_SER) {
-						ser_write_frame_from_fit(new_ser, &fit,
-								frame - failed - skipped);
-						args->imgparam[frame - failed - skipped].filenum =
-							frame - failed - skipped;
+						ser_write_frame_from_fit(new_ser, &fit, out_index);
+						args->imgparam[out_index].filenum = out_index;
 					} else {
 						fit_sequence_get_image_filename(args->seq, frame, filename, TRUE);
 						snprintf(dest, 256, "%s%s", args->prefix, filename);
-						savefits(dest, &fit);
-						args->imgparam[frame - failed - skipped].filenum = args->seq->imgparam[frame].filenum;
+						if (!done) {
+							if (serialize_io)
+								g_mutex_lock(&io_lock);
+							ret = savefits(dest, &fit);
+							if (serialize_io)
+								g_mutex_unlock(&io_lock);
+							if (!ret)
+								journal_set_done(args->journal, frame, dest, data);
+						}
+						stats_cache_set_key(new_stats, out_index, dest);
+						args->imgparam[out_index].filenum = args->seq->imgparam[frame].filenum;
 					}
-					args->imgparam[frame - failed - skipped].incl = SEQUENCE_DEFAULT_INCLUDE;
-					args->regparam[frame - failed - skipped].fwhm = current_regdata[frame].fwhm;	// not FWHMx because of the ref frame
+					args->imgparam[out_index].incl = SEQUENCE_DEFAULT_INCLUDE;
+					args->regparam[out_index].fwhm = current_regdata[frame].fwhm;	// not FWHMx because of the ref frame
 				} else {
 					current_regdata[frame].shiftx = trans.a;
 					current_regdata[frame].shifty = -trans.d;
+					/* the reference frame has no transform, it is the
+					 * identity, as frames that failed */
+					if (args->no_output && !args->translation_only && frame != ref_image)
+						current_regdata[frame].has_transform =
+							!warp_get_transform(&trans, args->seq->ry,
+									current_regdata[frame].transform);
 					args->seq->imgparam[frame].incl = SEQUENCE_DEFAULT_INCLUDE;
+					if (!done)
+						journal_set_done(args->journal, frame, NULL, data);
 				}
-
+				out_index++;
+			}
+			if (status != FRAME_SKIPPED) {
 				cur_nb += 1.f;
 				set_progress_bar_data(NULL, cur_nb / nb_frames);
 			}
 		}
+
+		if (stats) free(stats);
+		fits_recycle(&fit);
 	}
 
+	prefetcher_free(prefetcher);
+	star_match_ref_free(match_ref);
+	g_mutex_clear(&io_lock);
+	journal_close(args->journal);
+	args->journal = NULL;
+	if (nb_skipped)
+		siril_log_message(_("%d images were already registered and up to date, skipped\n"), nb_skipped);
+
 	i = 0;
 	while (i < MAX_STARS && refstars[i])
 		free(refstars[i++]);
 	free(refstars);
 
-	if (args->seq->type == SEQ_SER) {
+	if (new_ser) {
 		ser_write_and_close(new_ser);
 		free(new_ser);
+		for (i = 0; i < args->new_total; i++)
+			stats_cache_set_key(new_stats, i, new_ser_filename);
 	}
+	if (new_stats && !abort) {
+		/* same name as the sequence created in end_register_idle */
+		gchar *seqname = g_path_get_basename(args->seq->seqname);
+		gchar *new_seqname = g_strdup_printf("%s%s", args->prefix, seqname);
+		new_stats->nb_images = args->new_total;
+		stats_cache_write(new_stats, new_seqname);
+		g_free(new_seqname);
+		g_free(seqname);
+	}
+	stats_cache_free(new_stats);
 	args->seq->regparam[args->layer] = current_regdata;
 	update_used_memory();
 	if (!abort) {
@@ -785,7 +909,7 @@ int register_star_alignment(struct registration_args *args) {
 		siril_log_color_message(_("Total: %d failed, %d registered.\n"), "green",
 				failed, args->new_total);
 
-		args->load_new_sequence = !args->translation_only;
+		args->load_new_sequence = !in_place;
 
 	}
 	else {
@@ -1150,7 +1274,7 @@ void on_seqregister_button_clicked(GtkButton *button, gpointer user_data) {
 	}
 	// TODO: check for reentrance
 
-	reg_args = malloc(sizeof(struct registration_args));
+	reg_args = calloc(1, sizeof(struct registration_args));
 
 	control_window_switch_to_tab(OUTPUT_LOGS);
 
@@ -1193,10 +1317,92 @@ void on_seqregister_button_clicked(GtkButton *button, gpointer user_data) {
 static gpointer register_thread_func(gpointer p) {
 	struct registration_args *args = (struct registration_args *) p;
 	args->retval = args->func(args);
+	image_pool_flush();
 	gdk_threads_add_idle(end_register_idle, args);
 	return GINT_TO_POINTER(args->retval);	// not used anyway
 }
 
+#ifdef HAVE_OPENCV
+/* Creates the sequence of the images transformed by the star alignment from
+ * the data stored in args, and writes its .seq file. Data of args are now
+ * owned by the new sequence. The name of the .seq file is returned in
+ * rseqname if not NULL. */
+sequence *create_registered_sequence(struct registration_args *args, char **rseqname) {
+	sequence *seq;
+	gchar *seqname;
+	char *filename;
+
+	if (!(seq = malloc(sizeof(sequence)))) {
+		fprintf(stderr, "could not allocate new sequence\n");
+		return NULL;
+	}
+	initialize_sequence(seq, FALSE);
+
+	/* we are not interested in the whole path */
+	seqname = g_path_get_basename(args->seq->seqname);
+	filename = malloc(strlen(args->prefix) + strlen(seqname) + 5);
+	sprintf(filename, "%s%s.seq", args->prefix, seqname);
+	g_free(seqname);
+	unlink(filename);	// remove previous to overwrite
+	seq->seqname = remove_ext_from_filename(filename);
+	seq->number = args->new_total;
+	seq->selnum = args->new_total;
+	seq->fixed = args->seq->fixed;
+	seq->nb_layers = args->seq->nb_layers;
+	seq->rx = args->seq->rx;
+	seq->ry = args->seq->ry;
+	seq->imgparam = args->imgparam;
+	seq->regparam = calloc(seq->nb_layers, sizeof(regdata*));
+	seq->regparam[args->layer] = args->regparam;
+	seq->layers = calloc(seq->nb_layers, sizeof(layer_info));
+	seq->beg = seq->imgparam[0].filenum;
+	seq->end = seq->imgparam[seq->number-1].filenum;
+	seq->type = args->seq->type;
+	seq->current = -1;
+	seq->needs_saving = TRUE;
+	writeseqfile(seq);
+
+	if (rseqname)
+		*rseqname = filename;
+	else free(filename);
+	return seq;
+}
+#endif
+
+/* Registration started from a command, on a sequence that is not displayed.
+ * Results are saved from the processing thread, the sequence and args are
+ * freed. */
+gpointer register_sequence_worker(gpointer p) {
+	struct registration_args *args = (struct registration_args *) p;
+	int retval;
+
+	args->retval = args->func(args);
+	image_pool_flush();
+	if (!args->retval) {
+		writeseqfile(args->seq);
+#ifdef HAVE_OPENCV
+		if (args->func == &register_star_alignment && args->load_new_sequence) {
+			sequence *seq = create_registered_sequence(args, NULL);
+			if (seq)
+				free_sequence(seq, TRUE);
+			else args->retval = 1;
+		}
+#endif
+	}
+	if (!args->retval) {
+		struct timeval t_end;
+		set_progress_bar_data(_("Registration complete."), PROGRESS_DONE);
+		gettimeofday(&t_end, NULL);
+		show_time(args->t_start, t_end);
+	}
+	retval = args->retval;
+	free_sequence(args->seq, TRUE);
+	g_free((gchar *) args->prefix);
+	free(args);
+	gdk_threads_add_idle(end_generic, NULL);
+	return GINT_TO_POINTER(retval);
+}
+
 // end of registration, GTK thread
 static gboolean end_register_idle(gpointer p) {
 	struct timeval t_end;
@@ -1211,39 +1417,10 @@ static gboolean end_register_idle(gpointer p) {
 #ifdef HAVE_OPENCV
 		if (args->func == &register_star_alignment) {
 			if (args->load_new_sequence) {
-				sequence *seq;
-				if (!(seq = malloc(sizeof(sequence)))) {
-					fprintf(stderr, "could not allocate new sequence\n");
+				char *rseqname;
+				sequence *seq = create_registered_sequence(args, &rseqname);
+				if (!seq)
 					goto failed_end;
-				}
-				initialize_sequence(seq, FALSE);
-
-				/* we are not interested in the whole path */
-				gchar *seqname = g_path_get_basename (com.seq.seqname);
-				char *rseqname = malloc(
-						strlen(args->prefix) + strlen(seqname) + 5);
-
-				sprintf(rseqname, "%s%s.seq", args->prefix, seqname);
-				g_free(seqname);
-				unlink(rseqname);	// remove previous to overwrite
-				char *newname = remove_ext_from_filename(rseqname);
-				seq->seqname = newname;
-				seq->number = args->new_total;
-				seq->selnum = args->new_total;
-				seq->fixed = args->seq->fixed;
-				seq->nb_layers = args->seq->nb_layers;
-				seq->rx = args->seq->rx;
-				seq->ry = args->seq->ry;
-				seq->imgparam = args->imgparam;
-				seq->regparam = calloc(seq->nb_layers, sizeof(regdata*));
-				seq->regparam[args->layer] = args->regparam;
-				seq->layers = calloc(seq->nb_layers, sizeof(layer_info));
-				seq->beg = seq->imgparam[0].filenum;
-				seq->end = seq->imgparam[seq->number-1].filenum;
-				seq->type = args->seq->type;
-				seq->current = -1;
-				seq->needs_saving = TRUE;
-				writeseqfile(seq);
 
 				free_sequence(args->seq, FALSE);	// probably com.seq
 
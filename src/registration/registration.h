@@ -2,9 +2,9 @@
 #define _REGISTRATION_H_
 
 #include "core/siril.h"
+#include "algos/star_finder.h"
 
 #define NUMBER_OF_METHOD 5
-#define SUPER_SAMPLING 2
 
 struct registration_args;
 typedef int (*registration_function)(struct registration_args *);
@@ -21,10 +21,13 @@ struct registration_args {
 	gboolean run_in_thread;		// true if the registration was run in a thread
 	const gchar *prefix;		// prefix of the created sequence if any
 	gboolean follow_star;		// follow star position between frames
-	gboolean load_new_sequence;	// load a new sequence if success
+	gboolean load_new_sequence;	// a new sequence was created and can be loaded, set by the registration
 	gboolean matchSelection;	// Match stars found in the seleciton of reference image
 	opencv_interpolation interpolation; // type of rotation interpolation
 	gboolean translation_only;	// don't rotate images
+	gboolean no_output;		// store the transforms in the sequence, for stacking, instead of creating a registered sequence
+	struct work_journal *journal;	// frames registered by a previous run (internal)
+	starFinder sf;			// star detection parameters, used when headless
 
 	/* data for generated sequence, for star alignment registration */
 	int new_total;
@@ -67,6 +70,10 @@ void compute_fitting_selection(rectangle *area, int hsteps, int vsteps, int pres
 void get_the_registration_area(struct registration_args *reg_args,
 		struct registration_method *method); // for compositing
 void fill_comboboxregmethod();
+#ifdef HAVE_OPENCV
+sequence *create_registered_sequence(struct registration_args *args, char **rseqname);
+#endif
+gpointer register_sequence_worker(gpointer p);
 
 /** getter */
 int get_registration_layer();
@@ -0,0 +1,292 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Single pass image warping, see warp.h.
+ * Kernels are those of OpenCV for the same interpolation types, so that
+ * results stay close to those of cvTransformImage(), AREA being linear as
+ * in warpAffine(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "core/image_pool.h"
+#include "registration/warp.h"
+
+#define CUBIC_A -0.75
+#define LANCZOS_A 4
+
+struct warp_kernel {
+	int taps;		// number of input samples in each direction
+	int offset;		// of the first sample from the integer position
+	double bias;		// added to the position before taking its integer part
+	float weights[WARP_TAB_SIZE + 1][WARP_MAX_TAPS];
+};
+
+struct warp_input {
+	int rx, ry, nb_layers;
+	WORD *data[3];		// for DATA_USHORT
+	float *fdata[3];	// for DATA_FLOAT
+};
+
+static double cubic_weight(double x) {
+	x = fabs(x);
+	if (x <= 1.0)
+		return ((CUBIC_A + 2.0) * x - (CUBIC_A + 3.0)) * x * x + 1.0;
+	if (x < 2.0)
+		return ((CUBIC_A * x - 5.0 * CUBIC_A) * x + 8.0 * CUBIC_A) * x - 4.0 * CUBIC_A;
+	return 0.0;
+}
+
+static double lanczos_weight(double x) {
+	if (fabs(x) < 1e-9)
+		return 1.0;
+	if (fabs(x) >= LANCZOS_A)
+		return 0.0;
+	return LANCZOS_A * sin(M_PI * x) * sin(M_PI * x / LANCZOS_A) / (M_PI * M_PI * x * x);
+}
+
+/* tabulates the weights of the samples for each subpixel position, the
+ * weights of a position sum to 1 so that flat areas stay flat */
+static void init_kernel(struct warp_kernel *k, opencv_interpolation interpolation) {
+	int t, i;
+
+	switch (interpolation) {
+		case OPENCV_NEAREST:
+			k->taps = 1;
+			k->bias = 0.5;
+			break;
+		case OPENCV_CUBIC:
+			k->taps = 4;
+			break;
+		case OPENCV_LANCZOS4:
+			k->taps = 2 * LANCZOS_A;
+			break;
+		default:
+			k->taps = 2;
+			break;
+	}
+	if (k->taps > 1) {
+		k->offset = 1 - k->taps / 2;
+		k->bias = 0.0;
+	} else k->offset = 0;
+
+	for (t = 0; t <= WARP_TAB_SIZE; t++) {
+		double f = (double) t / WARP_TAB_SIZE, sum = 0.0, w[WARP_MAX_TAPS];
+		for (i = 0; i < k->taps; i++) {
+			/* distance from the position to the sample */
+			double x = f - (double) (i + k->offset);
+			switch (k->taps) {
+				case 1:
+					w[i] = 1.0;
+					break;
+				case 2:
+					w[i] = 1.0 - fabs(x);
+					break;
+				case 4:
+					w[i] = cubic_weight(x);
+					break;
+				default:
+					w[i] = lanczos_weight(x);
+			}
+			sum += w[i];
+		}
+		for (i = 0; i < k->taps; i++)
+			k->weights[t][i] = (float) (w[i] / sum);
+	}
+}
+
+/* interpolates all layers of the input at (u, v), samples out of the input
+ * image are 0 */
+static void interpolate(const struct warp_input *in, const struct warp_kernel *k,
+		double u, double v, float *out) {
+	double fu = floor(u + k->bias), fv = floor(v + k->bias);
+	int x0 = (int) fu + k->offset, y0 = (int) fv + k->offset;
+	const float *wx = k->weights[(int) ((u + k->bias - fu) * WARP_TAB_SIZE + 0.5)];
+	const float *wy = k->weights[(int) ((v + k->bias - fv) * WARP_TAB_SIZE + 0.5)];
+	/* the samples of the kernel that are in the image */
+	int i0 = max(0, -x0), i1 = min(k->taps, in->rx - x0);
+	int j0 = max(0, -y0), j1 = min(k->taps, in->ry - y0);
+	int i, j, layer;
+
+	for (layer = 0; layer < in->nb_layers; layer++)
+		out[layer] = 0.f;
+	for (j = j0; j < j1; j++) {
+		size_t line = (size_t) (y0 + j) * in->rx + x0;
+		for (layer = 0; layer < in->nb_layers; layer++) {
+			float row = 0.f;
+			if (in->fdata[0]) {
+				const float *p = in->fdata[layer] + line;
+				for (i = i0; i < i1; i++)
+					row += wx[i] * p[i];
+			} else {
+				const WORD *p = in->data[layer] + line;
+				for (i = i0; i < i1; i++)
+					row += wx[i] * (float) p[i];
+			}
+			out[layer] += wy[j] * row;
+		}
+	}
+}
+
+/* Fills the out_rx x out_ry output images, one per layer of the input, pixel
+ * (x, y) being interpolated at (m[0] x + m[1] y + m[2], m[3] x + m[4] y + m[5])
+ * in the input. Values are clipped to the 16-bit range. */
+static void warp_layers(const struct warp_input *in, opencv_interpolation interpolation,
+		const double m[6], int out_rx, int out_ry, WORD **out, float **fout) {
+	struct warp_kernel kernel;
+	int nb_tiles_x, nb_tiles, tile;
+
+	init_kernel(&kernel, interpolation);
+	nb_tiles_x = (out_rx + WARP_TILE_SIZE - 1) / WARP_TILE_SIZE;
+	nb_tiles = nb_tiles_x * ((out_ry + WARP_TILE_SIZE - 1) / WARP_TILE_SIZE);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) schedule(dynamic)
+#endif
+	for (tile = 0; tile < nb_tiles; tile++) {
+		int tx = (tile % nb_tiles_x) * WARP_TILE_SIZE;
+		int ty = (tile / nb_tiles_x) * WARP_TILE_SIZE;
+		int xend = min(tx + WARP_TILE_SIZE, out_rx);
+		int yend = min(ty + WARP_TILE_SIZE, out_ry);
+		int x, y, l;
+		float val[3];
+
+		for (y = ty; y < yend; y++) {
+			for (x = tx; x < xend; x++) {
+				double u = m[0] * x + m[1] * y + m[2];
+				double v = m[3] * x + m[4] * y + m[5];
+				size_t i = (size_t) y * out_rx + x;
+				interpolate(in, &kernel, u, v, val);
+				for (l = 0; l < in->nb_layers; l++) {
+					if (fout) {
+						float f = val[l];
+						fout[l][i] = f < 0.f ? 0.f :
+							(f > USHRT_MAX_SINGLE ? USHRT_MAX_SINGLE : f);
+					}
+					else out[l][i] = round_to_WORD(val[l]);
+				}
+			}
+		}
+	}
+}
+
+/* Computes the affine transform m from the pixel coordinates of the reference
+ * image to those of an image of height ry, for the transform trans found by
+ * star_match(). trans is the similarity given by its a, b, c and d terms, as
+ * applied by cvTransformImage() to images flipped top to bottom: the flip is
+ * done in the coordinates instead.
+ * Returns 0 on success, 1 if trans cannot be inverted. */
+int warp_get_transform(const TRANS *trans, int ry, double m[6]) {
+	double det = trans->b * trans->b + trans->c * trans->c;
+	double h1 = (double) (ry - 1);
+
+	if (det <= 0.0)
+		return 1;
+	/* The transform maps a point q of the image to p = L.q + (a, d) in the
+	 * reference, with L = [b c; -c b], in coordinates where y goes down.
+	 * For a pixel (x, y) of the reference, the image position is
+	 * q = L^-1.((x, h1 - y) - (a, d)) and (u, v) = (q.x, h1 - q.y) */
+	m[0] = trans->b / det;
+	m[1] = trans->c / det;
+	m[2] = (-trans->b * trans->a - trans->c * (h1 - trans->d)) / det;
+	m[3] = -trans->c / det;
+	m[4] = trans->b / det;
+	m[5] = h1 + (trans->c * trans->a - trans->b * (h1 - trans->d)) / det;
+	return 0;
+}
+
+/* Replaces the image by its resampling in the frame of the reference image,
+ * m being given by warp_get_transform(), with the interpolation kernel given.
+ * Returns 0 on success. */
+int warp_image(fits *fit, const double m[6], opencv_interpolation interpolation) {
+	struct warp_input in;
+	size_t npixels, elem_size;
+	int layer;
+	WORD *out_data = NULL, *out[3];
+	float *out_fdata = NULL, *fout[3];
+
+	if (fit->rx <= 0 || fit->ry <= 0)
+		return 1;
+
+	in.rx = fit->rx;
+	in.ry = fit->ry;
+	in.nb_layers = fit->naxes[2] > 3 ? 3 : (int) fit->naxes[2];
+	npixels = (size_t) fit->rx * fit->ry;
+	elem_size = fit->type == DATA_FLOAT ? sizeof(float) : sizeof(WORD);
+	for (layer = 0; layer < 3; layer++) {
+		in.data[layer] = fit->type == DATA_FLOAT ? NULL : fit->pdata[layer];
+		in.fdata[layer] = fit->type == DATA_FLOAT ? fit->fpdata[layer] : NULL;
+	}
+	if (fit->type == DATA_FLOAT)
+		out_fdata = image_buffer_get(npixels * in.nb_layers * elem_size);
+	else out_data = image_buffer_get(npixels * in.nb_layers * elem_size);
+	if (!out_data && !out_fdata) {
+		printf("Not enough memory for the transformation\n");
+		return 1;
+	}
+	for (layer = 0; layer < 3; layer++) {
+		int l = layer < in.nb_layers ? layer : 0;
+		out[layer] = out_data ? out_data + l * npixels : NULL;
+		fout[layer] = out_fdata ? out_fdata + l * npixels : NULL;
+	}
+
+	warp_layers(&in, interpolation, m, fit->rx, fit->ry,
+			out, out_fdata ? fout : NULL);
+
+	/* the input buffer is kept for the next frame */
+	if (out_fdata) {
+		image_buffer_release(fit->fdata, npixels * in.nb_layers * elem_size);
+		fit->fdata = out_fdata;
+		memcpy(fit->fpdata, fout, sizeof(fout));
+	} else {
+		image_buffer_release(fit->data, npixels * in.nb_layers * elem_size);
+		fit->data = out_data;
+		memcpy(fit->pdata, out, sizeof(out));
+	}
+	return 0;
+}
+
+/* Same as warp_image() for a single channel buffer of in_rx x in_ry pixels,
+ * the out_rx x out_ry result being stored in out. */
+void warp_buffer(WORD *in, int in_rx, int in_ry, WORD *out, int out_rx, int out_ry,
+		const double m[6], opencv_interpolation interpolation) {
+	struct warp_input input = { .rx = in_rx, .ry = in_ry, .nb_layers = 1 };
+	WORD *outs[3] = { out, NULL, NULL };
+
+	input.data[0] = in;
+	warp_layers(&input, interpolation, m, out_rx, out_ry, outs, NULL);
+}
+
+/* Number of input pixels used around the interpolation position, on each side */
+int warp_kernel_radius(opencv_interpolation interpolation) {
+	switch (interpolation) {
+		case OPENCV_NEAREST:
+			return 1;
+		case OPENCV_CUBIC:
+			return 2;
+		case OPENCV_LANCZOS4:
+			return LANCZOS_A;
+		default:
+			return 1;
+	}
+}
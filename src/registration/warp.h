@@ -0,0 +1,28 @@
+#ifndef WARP_H_
+#define WARP_H_
+
+#include "core/siril.h"
+#include "registration/matching/misc.h"
+
+/* Resampling of an image in the frame of the reference image, by the
+ * similarity found by star matching, in a single pass from the input image to
+ * a new buffer. The transform is kept as an affine transform of the pixel
+ * coordinates, that can also be stored in the registration data and applied
+ * to parts of the image at stacking time. Each output pixel is
+ * interpolated at its position in the input image, computed by the inverse
+ * transform, with separable kernels which weights are tabulated for
+ * WARP_TAB_SIZE subpixel positions. Pixels outside the input image are 0.
+ * The output is computed by tiles, in parallel. */
+
+#define WARP_TAB_SIZE 256
+#define WARP_TILE_SIZE 64
+/* taps of the largest kernel, Lanczos-4 */
+#define WARP_MAX_TAPS 8
+
+int warp_get_transform(const TRANS *trans, int ry, double m[6]);
+int warp_image(fits *fit, const double m[6], opencv_interpolation interpolation);
+void warp_buffer(WORD *in, int in_rx, int in_ry, WORD *out, int out_rx, int out_ry,
+		const double m[6], opencv_interpolation interpolation);
+int warp_kernel_radius(opencv_interpolation interpolation);
+
+#endif
@@ -0,0 +1,593 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Pixel rejection engine of the average stacking with rejection.
+ *
+ * The rejection algorithms are the ones that were applied pixel by pixel in
+ * stack_mean_with_rejection(), with the same tests, the same iterations and
+ * the same counting of rejected pixels. Instead of removing rejected values
+ * from the stack with a memmove, they are marked in a mask and kept values are
+ * compacted once per iteration.
+ *
+ * The first iteration, which is the only one for most pixels, is computed on
+ * groups of pixels stored as a structure of arrays, with loops over the
+ * pixels of the group that the compiler vectorizes. Standard deviations are
+ * computed from exact integer sums, and tests are still done in double
+ * precision to keep the decisions of the per-pixel code.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_fit.h>
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "algos/sorting.h"
+#include "stacking/rejection.h"
+
+struct rejection_workspace *rejection_workspace_new(int nb_frames) {
+	struct rejection_workspace *ws;
+	int i;
+
+	ws = calloc(1, sizeof(struct rejection_workspace));
+	if (!ws)
+		return NULL;
+	ws->nb_frames = nb_frames;
+	if (nb_frames <= SORTNET_MAX) {
+		ws->net = sortnet_new(nb_frames);
+		if (!ws->net) {
+			rejection_workspace_free(ws);
+			return NULL;
+		}
+	}
+	ws->soa = malloc(nb_frames * REJECTION_LANES * sizeof(WORD));
+	ws->wsoa = malloc(nb_frames * REJECTION_LANES * sizeof(WORD));
+	ws->rows = malloc(nb_frames * sizeof(WORD *));
+	ws->wrows = malloc(nb_frames * sizeof(WORD *));
+	ws->rej = malloc(nb_frames * REJECTION_LANES * sizeof(signed char));
+	ws->stack = malloc(nb_frames * sizeof(WORD));
+	ws->w_stack = malloc(nb_frames * sizeof(WORD));
+	ws->rejected = malloc(nb_frames * sizeof(signed char));
+	ws->xf = malloc(nb_frames * sizeof(double));
+	ws->yf = malloc(nb_frames * sizeof(double));
+	if (!ws->soa || !ws->wsoa || !ws->rows || !ws->wrows || !ws->rej ||
+			!ws->stack || !ws->w_stack || !ws->rejected || !ws->xf || !ws->yf) {
+		rejection_workspace_free(ws);
+		return NULL;
+	}
+	for (i = 0; i < nb_frames; i++) {
+		ws->rows[i] = ws->soa + i * REJECTION_LANES;
+		ws->wrows[i] = ws->wsoa + i * REJECTION_LANES;
+		ws->xf[i] = (double) i;
+	}
+	return ws;
+}
+
+void rejection_workspace_free(struct rejection_workspace *ws) {
+	if (!ws) return;
+	sortnet_free(ws->net);
+	if (ws->soa) free(ws->soa);
+	if (ws->wsoa) free(ws->wsoa);
+	if (ws->rows) free(ws->rows);
+	if (ws->wrows) free(ws->wrows);
+	if (ws->rej) free(ws->rej);
+	if (ws->stack) free(ws->stack);
+	if (ws->w_stack) free(ws->w_stack);
+	if (ws->rejected) free(ws->rejected);
+	if (ws->xf) free(ws->xf);
+	if (ws->yf) free(ws->yf);
+	free(ws);
+}
+
+/* Rejection of pixels, following sigma_(high/low) * sigma.
+ * The function returns 0 if no rejections are required, 1 if it's a high
+ * rejection and -1 for a low-rejection */
+static int sigma_clipping(WORD pixel, const double sig[], double sigma, double median, uint64_t rej[]) {
+	double sigmalow = sig[0];
+	double sigmahigh = sig[1];
+
+	if (median - (double)pixel > sigmalow * sigma) {
+		rej[0]++;
+		return -1;
+	}
+	else if ((double)pixel - median > sigmahigh * sigma) {
+		rej[1]++;
+		return 1;
+	}
+	else return 0;
+}
+
+static int Winsorized(WORD *pixel, double m0, double m1) {
+	if (*pixel < m0) *pixel = round_to_WORD(m0);
+	else if (*pixel > m1) *pixel = round_to_WORD(m1);
+
+	return 0;
+}
+
+static int line_clipping(WORD pixel, const double sig[], double sigma, int i, double a, double b, uint64_t rej[]) {
+	double sigmalow = sig[0];
+	double sigmahigh = sig[1];
+
+	if (((a * (double)i + b - (double)pixel) / sigma) > sigmalow) {
+		rej[0]++;
+		return -1;
+	}
+	else if ((((double)pixel - a * (double)i - b) / sigma) > sigmahigh) {
+		rej[1]++;
+		return 1;
+	}
+	else return 0;
+}
+
+/* Sample standard deviation of n values from their sums. The numerator
+ * n.sum(x^2) - sum(x)^2 is exact in 64 bits for up to 65536 frames. */
+static double sd_from_sums(guint64 sum, guint64 sumsq, int n) {
+	if (n < 2)
+		return 0.0;
+	return sqrt((double)((guint64)n * sumsq - sum * sum) / ((double)n * (double)(n - 1)));
+}
+
+static double stack_sd(const WORD *stack, int n) {
+	guint64 sum = 0, sumsq = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		sum += stack[i];
+		sumsq += (guint64)stack[i] * stack[i];
+	}
+	return sd_from_sums(sum, sumsq, n);
+}
+
+/* same as gsl_stats_ushort_median_from_sorted_data() */
+static double median_sorted(const WORD *stack, int n) {
+	int lhs = (n - 1) / 2, rhs = n / 2;
+	if (lhs == rhs)
+		return stack[lhs];
+	return (stack[lhs] + stack[rhs]) / 2.0;
+}
+
+/* removes the values marked in rejected from stack, keeping their order, and
+ * returns the number of removed values */
+static int compact_stack(WORD *stack, const signed char *rejected, int n) {
+	int i, kept = 0;
+	for (i = 0; i < n; i++) {
+		if (!rejected[i])
+			stack[kept++] = stack[i];
+	}
+	return n - kept;
+}
+
+/* Sigma clipping of the N sorted values of stack. Tests stop when at most 4
+ * values would be kept, r counting the rejections of all iterations; values
+ * that have not been tested are kept. Returns the number of removed values. */
+static int sigma_clip_stack(struct rejection_workspace *ws, WORD *stack, int N,
+		const double sig[2], double sigma, double median, int *r, uint64_t prej[2]) {
+	int frame;
+
+	memset(ws->rejected, 0, N * sizeof(signed char));
+	for (frame = 0; frame < N; frame++) {
+		ws->rejected[frame] = sigma_clipping(stack[frame], sig, sigma, median, prej);
+		if (ws->rejected[frame])
+			(*r)++;
+		if (N - *r <= 4) break;
+	}
+	return compact_stack(stack, ws->rejected, N);
+}
+
+/* Winsorized sigma and median of the N sorted values of stack, starting from
+ * their sigma and median. Clamping values keeps them sorted. */
+static void winsorize_stack(struct rejection_workspace *ws, const WORD *stack, int N,
+		double *sigma, double *median) {
+	double sigma0;
+	int i;
+
+	memcpy(ws->w_stack, stack, N * sizeof(WORD));
+	do {
+		double m0 = *median - 1.5 * *sigma;
+		double m1 = *median + 1.5 * *sigma;
+		for (i = 0; i < N; i++)
+			Winsorized(&ws->w_stack[i], m0, m1);
+		*median = median_sorted(ws->w_stack, N);
+		sigma0 = *sigma;
+		*sigma = 1.134 * stack_sd(ws->w_stack, N);
+	} while ((fabs(*sigma - sigma0) / sigma0) > 0.0005);
+}
+
+/* Rejection for one pixel, from the N values of stack, which are sorted for
+ * all methods but SIGMEDIAN. For SIGMA and WINSORIZED, r is the number of
+ * rejections of the previous iterations. Returns the mean of kept values. */
+static double reject_stack(struct rejection_workspace *ws, rejection type,
+		const double sig[2], WORD *stack, int N, int r, uint64_t prej[2]) {
+	double sigma, median;
+	guint64 sum = 0;
+	int frame, n;
+
+	switch (type) {
+	case SIGMA:
+	case WINSORIZED:
+		do {
+			sigma = stack_sd(stack, N);
+			median = median_sorted(stack, N);
+			if (type == WINSORIZED)
+				winsorize_stack(ws, stack, N, &sigma, &median);
+			n = sigma_clip_stack(ws, stack, N, sig, sigma, median, &r, prej);
+			N = N - n;
+		} while (n > 0 && N > 3);
+		break;
+	case SIGMEDIAN:
+		do {
+			sigma = stack_sd(stack, N);
+			quicksort_s(stack, N);
+			median = median_sorted(stack, N);
+			n = 0;
+			for (frame = 0; frame < N; frame++) {
+				if (sigma_clipping(stack[frame], sig, sigma, median, prej)) {
+					stack[frame] = round_to_WORD(median);
+					n++;
+				}
+			}
+		} while (n > 0 && N > 3);
+		break;
+	case LINEARFIT:
+		do {
+			double a, b, cov00, cov01, cov11, sumsq;
+			for (frame = 0; frame < N; frame++)
+				ws->yf[frame] = (double) stack[frame];
+			gsl_fit_linear(ws->xf, 1, ws->yf, 1, N, &b, &a, &cov00, &cov01, &cov11, &sumsq);
+			sigma = 0.0;
+			for (frame = 0; frame < N; frame++)
+				sigma += (fabs((double)stack[frame] - (a*(double)frame + b)));
+			sigma /= (double)N;
+			memset(ws->rejected, 0, N * sizeof(signed char));
+			for (frame = 0; frame < N; frame++) {
+				ws->rejected[frame] = line_clipping(stack[frame], sig, sigma, frame, a, b, prej);
+				if (ws->rejected[frame])
+					r++;
+				if (N - r <= 4) break;
+			}
+			n = compact_stack(stack, ws->rejected, N);
+			N = N - n;
+		} while (n > 0 && N > 3);
+		break;
+	default:
+		break;
+	}
+
+	for (frame = 0; frame < N; frame++)
+		sum += stack[frame];
+	return (double)sum / (double)N;
+}
+
+/* copies the pixels [x0, x0 + len) of a row of all frames in the rows of the
+ * workspace, shifted by shiftx. Pixels coming from outside the image are black. */
+static void fill_lanes(struct rejection_workspace *ws, WORD **rows,
+		const int *shiftx, long width, long x0, int len) {
+	int frame;
+
+	for (frame = 0; frame < ws->nb_frames; frame++) {
+		WORD *dst = ws->rows[frame];
+		long s = shiftx ? shiftx[frame] : 0;
+		/* pixel x comes from x - s, valid for x in [start, end) */
+		long start = x0 > s ? x0 : s;
+		long end = x0 + len < width + s ? x0 + len : width + s;
+		if (start >= end) {
+			memset(dst, 0, len * sizeof(WORD));
+			continue;
+		}
+		if (start > x0)
+			memset(dst, 0, (start - x0) * sizeof(WORD));
+		memcpy(dst + start - x0, rows[frame] + start - s, (end - start) * sizeof(WORD));
+		if (end < x0 + len)
+			memset(dst + end - x0, 0, (x0 + len - end) * sizeof(WORD));
+	}
+}
+
+/* sorts the values of each pixel of the group along the frame axis */
+static void sort_lanes(struct rejection_workspace *ws, int len) {
+	int frame, x, N = ws->nb_frames;
+
+	if (ws->net) {
+		sortnet_sort_rows(ws->net, ws->rows, 0, len);
+		return;
+	}
+	for (x = 0; x < len; x++) {
+		for (frame = 0; frame < N; frame++)
+			ws->stack[frame] = ws->rows[frame][x];
+		quicksort_s(ws->stack, N);
+		for (frame = 0; frame < N; frame++)
+			ws->rows[frame][x] = ws->stack[frame];
+	}
+}
+
+/* sums of the values of each pixel of the group, in rows */
+static void sum_lanes(struct rejection_workspace *ws, WORD **rows, int len) {
+	int frame, x;
+
+	for (x = 0; x < len; x++)
+		ws->sum[x] = ws->sumsq[x] = 0;
+	for (frame = 0; frame < ws->nb_frames; frame++) {
+		const WORD *v = rows[frame];
+		for (x = 0; x < len; x++) {
+			ws->sum[x] += v[x];
+			ws->sumsq[x] += (guint64)v[x] * v[x];
+		}
+	}
+}
+
+/* median and sigma of the sorted values of each pixel of the group */
+static void stats_lanes(struct rejection_workspace *ws, WORD **rows, int len) {
+	int N = ws->nb_frames, x;
+	const WORD *lhs = rows[(N - 1) / 2], *rhs = rows[N / 2];
+
+	sum_lanes(ws, rows, len);
+	for (x = 0; x < len; x++) {
+		ws->median[x] = (lhs[x] + rhs[x]) / 2.0;
+		ws->sigma[x] = sd_from_sums(ws->sum[x], ws->sumsq[x], N);
+	}
+}
+
+/* winsorized sigma and median of each pixel of the group, iterated until
+ * convergence of all pixels, see winsorize_stack() */
+static void winsorize_lanes(struct rejection_workspace *ws, int len) {
+	int N = ws->nb_frames, frame, x, nb_active = len;
+
+	memcpy(ws->wsoa, ws->soa, N * REJECTION_LANES * sizeof(WORD));
+	for (x = 0; x < len; x++)
+		ws->active[x] = 1;
+
+	while (nb_active > 0) {
+		const WORD *lhs = ws->wrows[(N - 1) / 2], *rhs = ws->wrows[N / 2];
+		for (x = 0; x < len; x++) {
+			if (ws->active[x]) {
+				ws->m0[x] = ws->median[x] - 1.5 * ws->sigma[x];
+				ws->m1[x] = ws->median[x] + 1.5 * ws->sigma[x];
+				ws->lo[x] = round_to_WORD(ws->m0[x]);
+				ws->hi[x] = round_to_WORD(ws->m1[x]);
+			} else {
+				/* converged pixels are not modified anymore */
+				ws->m0[x] = -HUGE_VAL;
+				ws->m1[x] = HUGE_VAL;
+			}
+		}
+		for (frame = 0; frame < N; frame++) {
+			WORD *w = ws->wrows[frame];
+			for (x = 0; x < len; x++) {
+				if (w[x] < ws->m0[x]) w[x] = ws->lo[x];
+				else if (w[x] > ws->m1[x]) w[x] = ws->hi[x];
+			}
+		}
+		sum_lanes(ws, ws->wrows, len);
+		nb_active = 0;
+		for (x = 0; x < len; x++) {
+			double sigma0;
+			if (!ws->active[x]) continue;
+			ws->median[x] = (lhs[x] + rhs[x]) / 2.0;
+			sigma0 = ws->sigma[x];
+			ws->sigma[x] = 1.134 * sd_from_sums(ws->sum[x], ws->sumsq[x], N);
+			ws->active[x] = (fabs(ws->sigma[x] - sigma0) / sigma0) > 0.0005;
+			nb_active += ws->active[x];
+		}
+	}
+}
+
+/* first sigma clipping iteration for each pixel of the group, tests stop as
+ * in sigma_clip_stack() */
+static void sigma_clip_lanes(struct rejection_workspace *ws, const double sig[2], int len) {
+	int N = ws->nb_frames, frame, x;
+
+	for (x = 0; x < len; x++)
+		ws->nb_rej[x] = 0;
+	for (frame = 0; frame < N; frame++) {
+		const WORD *v = ws->rows[frame];
+		signed char *rej = ws->rej + frame * REJECTION_LANES;
+		for (x = 0; x < len; x++) {
+			double pixel = (double) v[x];
+			int t = 0;
+			if (frame == 0 || N - ws->nb_rej[x] > 4) {
+				if (ws->median[x] - pixel > sig[0] * ws->sigma[x])
+					t = -1;
+				else if (pixel - ws->median[x] > sig[1] * ws->sigma[x])
+					t = 1;
+			}
+			rej[x] = t;
+			ws->nb_rej[x] += t != 0;
+			ws->nb_low[x] += t < 0;
+			ws->nb_high[x] += t > 0;
+		}
+	}
+}
+
+/* first sigma median iteration: rejected values are replaced by the median */
+static void sigma_median_lanes(struct rejection_workspace *ws, const double sig[2], int len) {
+	int N = ws->nb_frames, frame, x;
+
+	for (x = 0; x < len; x++) {
+		ws->nb_rej[x] = 0;
+		ws->lo[x] = round_to_WORD(ws->median[x]);
+	}
+	for (frame = 0; frame < N; frame++) {
+		WORD *v = ws->rows[frame];
+		for (x = 0; x < len; x++) {
+			double pixel = (double) v[x];
+			int low = ws->median[x] - pixel > sig[0] * ws->sigma[x];
+			int high = !low && pixel - ws->median[x] > sig[1] * ws->sigma[x];
+			if (low || high)
+				v[x] = ws->lo[x];
+			ws->nb_rej[x] += low + high;
+			ws->nb_low[x] += low;
+			ws->nb_high[x] += high;
+		}
+	}
+}
+
+/* percentile clipping for each pixel of the group, a rejected value being
+ * removed only if it's not the last one */
+static void percentile_lanes(struct rejection_workspace *ws, const double sig[2], int len) {
+	int N = ws->nb_frames, frame, x;
+
+	for (x = 0; x < len; x++)
+		ws->nb_kept[x] = N;
+	for (frame = 0; frame < N; frame++) {
+		const WORD *v = ws->rows[frame];
+		signed char *rej = ws->rej + frame * REJECTION_LANES;
+		for (x = 0; x < len; x++) {
+			double pixel = (double) v[x];
+			int t = 0, removed;
+			if ((ws->median[x] - pixel) / ws->median[x] > sig[0])
+				t = -1;
+			else if ((pixel - ws->median[x]) / ws->median[x] > sig[1])
+				t = 1;
+			ws->nb_low[x] += t < 0;
+			ws->nb_high[x] += t > 0;
+			removed = t != 0 && ws->nb_kept[x] > 1;
+			ws->nb_kept[x] -= removed;
+			rej[x] = removed ? t : 0;
+		}
+	}
+}
+
+/* sum and number of the values of each pixel that are not rejected */
+static void kept_sum_lanes(struct rejection_workspace *ws, int len) {
+	int frame, x;
+
+	for (x = 0; x < len; x++) {
+		ws->sum[x] = 0;
+		ws->nb_kept[x] = 0;
+	}
+	for (frame = 0; frame < ws->nb_frames; frame++) {
+		const WORD *v = ws->rows[frame];
+		const signed char *rej = ws->rej + frame * REJECTION_LANES;
+		for (x = 0; x < len; x++) {
+			ws->sum[x] += rej[x] ? 0 : v[x];
+			ws->nb_kept[x] += !rej[x];
+		}
+	}
+}
+
+/* writes the mean of a pixel to the float row or, rounded, to the 16-bit row */
+static inline void store_mean(float *out, WORD *wout, int x, double mean) {
+	if (out)
+		out[x] = (float) mean;
+	else wout[x] = round_to_WORD(mean);
+}
+
+static void reject_lanes(struct rejection_workspace *ws, rejection type,
+		const double sig[2], int len, float *out, WORD *wout, WORD *low_map,
+		WORD *high_map, uint64_t crej[2]) {
+	int N = ws->nb_frames, frame, x;
+
+	if (type == NO_REJEC) {
+		sum_lanes(ws, ws->rows, len);
+		for (x = 0; x < len; x++)
+			store_mean(out, wout, x, (double)ws->sum[x] / (double)N);
+		if (low_map)
+			memset(low_map, 0, len * sizeof(WORD));
+		if (high_map)
+			memset(high_map, 0, len * sizeof(WORD));
+		return;
+	}
+
+	sort_lanes(ws, len);
+	memset(ws->rej, 0, N * REJECTION_LANES * sizeof(signed char));
+	for (x = 0; x < len; x++)
+		ws->nb_low[x] = ws->nb_high[x] = ws->nb_rej[x] = 0;
+
+	switch (type) {
+	case PERCENTILE:
+		stats_lanes(ws, ws->rows, len);
+		percentile_lanes(ws, sig, len);
+		break;
+	case SIGMA:
+	case WINSORIZED:
+		stats_lanes(ws, ws->rows, len);
+		if (type == WINSORIZED)
+			winsorize_lanes(ws, len);
+		sigma_clip_lanes(ws, sig, len);
+		break;
+	case SIGMEDIAN:
+		stats_lanes(ws, ws->rows, len);
+		sigma_median_lanes(ws, sig, len);
+		break;
+	default:
+		break;
+	}
+	kept_sum_lanes(ws, len);
+
+	for (x = 0; x < len; x++) {
+		gboolean finished;
+		double mean;
+
+		switch (type) {
+		case SIGMA:
+		case WINSORIZED:
+			finished = ws->nb_rej[x] == 0 || N - ws->nb_rej[x] <= 3;
+			break;
+		case SIGMEDIAN:
+			finished = ws->nb_rej[x] == 0 || N <= 3;
+			break;
+		case LINEARFIT:
+			finished = FALSE;
+			break;
+		default:
+			finished = TRUE;
+		}
+
+		if (finished) {
+			mean = (double)ws->sum[x] / (double)ws->nb_kept[x];
+		} else {
+			uint64_t prej[2] = { 0, 0 };
+			int n = 0;
+			for (frame = 0; frame < N; frame++) {
+				if (!ws->rej[frame * REJECTION_LANES + x])
+					ws->stack[n++] = ws->rows[frame][x];
+			}
+			mean = reject_stack(ws, type, sig, ws->stack, n, ws->nb_rej[x], prej);
+			ws->nb_low[x] += prej[0];
+			ws->nb_high[x] += prej[1];
+		}
+		store_mean(out, wout, x, mean);
+		crej[0] += ws->nb_low[x];
+		crej[1] += ws->nb_high[x];
+		if (low_map)
+			low_map[x] = ws->nb_low[x] > USHRT_MAX ? USHRT_MAX : ws->nb_low[x];
+		if (high_map)
+			high_map[x] = ws->nb_high[x] > USHRT_MAX ? USHRT_MAX : ws->nb_high[x];
+	}
+}
+
+/* Stacks a row of `width' pixels: rows[frame] is the row of each frame, already
+ * normalized, shifted by shiftx[frame] pixels if shiftx is not NULL. The mean
+ * of the values kept by the rejection is written to out, unrounded, or if out
+ * is NULL to wout, rounded from its double value. The number of low and high
+ * rejections of each pixel is written in the maps if they are not NULL, and
+ * the total numbers of rejections are added to crej. */
+void rejection_row(struct rejection_workspace *ws, rejection type, const double sig[2],
+		WORD **rows, const int *shiftx, long width, float *out, WORD *wout,
+		WORD *low_map, WORD *high_map, uint64_t crej[2]) {
+	long x0;
+
+	for (x0 = 0; x0 < width; x0 += REJECTION_LANES) {
+		int len = width - x0 < REJECTION_LANES ? width - x0 : REJECTION_LANES;
+		fill_lanes(ws, rows, shiftx, width, x0, len);
+		reject_lanes(ws, type, sig, len, out ? out + x0 : NULL,
+				wout ? wout + x0 : NULL, low_map ? low_map + x0 : NULL,
+				high_map ? high_map + x0 : NULL, crej);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef REJECTION_H_
+#define REJECTION_H_
+
+#include <stdint.h>
+#include "core/siril.h"
+#include "algos/sorting.h"
+#include "stacking/stacking.h"
+
+/* number of pixels of a row processed together by the rejection engine */
+#define REJECTION_LANES SORTNET_CHUNK
+
+/* Per-thread memory of the rejection engine. Pixels of a row are processed by
+ * groups of REJECTION_LANES: the values of all frames for these pixels are
+ * stored as nb_frames rows of REJECTION_LANES values (structure of arrays), so
+ * that statistics and clipping tests of the first iteration are computed for
+ * all pixels of the group at once. Pixels that need more iterations are then
+ * finished one by one, in the stack/rejected arrays. */
+struct rejection_workspace {
+	int nb_frames;
+	sortnet *net;		// sorting network, NULL for large numbers of frames
+	WORD *soa;		// nb_frames * REJECTION_LANES values
+	WORD **rows;		// the rows of soa, one per frame
+	WORD *wsoa;		// winsorized copy of soa
+	WORD **wrows;
+	signed char *rej;	// state of each value of soa: -1 low, 1 high rejection
+	WORD *stack;		// all values of one pixel
+	WORD *w_stack;		// winsorized copy of stack
+	signed char *rejected;	// state of each value of stack
+	double *xf, *yf;	// linear fit data
+	/* statistics of each pixel of the group */
+	guint64 sum[REJECTION_LANES], sumsq[REJECTION_LANES];
+	double median[REJECTION_LANES], sigma[REJECTION_LANES];
+	double m0[REJECTION_LANES], m1[REJECTION_LANES];
+	WORD lo[REJECTION_LANES], hi[REJECTION_LANES];
+	int nb_kept[REJECTION_LANES], nb_rej[REJECTION_LANES];
+	int active[REJECTION_LANES];
+	guint64 nb_low[REJECTION_LANES], nb_high[REJECTION_LANES];
+};
+
+struct rejection_workspace *rejection_workspace_new(int nb_frames);
+void rejection_workspace_free(struct rejection_workspace *ws);
+
+void rejection_row(struct rejection_workspace *ws, rejection type, const double sig[2],
+		WORD **rows, const int *shiftx, long width, float *out, WORD *wout,
+		WORD *low_map, WORD *high_map, uint64_t crej[2]);
+
+#endif
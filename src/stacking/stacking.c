@@ -24,8 +24,6 @@
 #include <sys/stat.h>
 #include <assert.h>
 #include <math.h>
-#include <gsl/gsl_fit.h>
-#include <gsl/gsl_statistics_ushort.h>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
@@ -36,12 +34,20 @@
 #include "core/siril.h"
 #include "core/proto.h"
 #include "core/initfile.h"
+#include "core/scheduler.h"
 #include "gui/callbacks.h"
 #include "io/sequence.h"
 #include "io/single_image.h"
+#include "io/stats_cache.h"
+#include "io/prefetch.h"
+#include "core/image_pool.h"
 #include "registration/registration.h"
+#include "registration/warp.h"
 #include "stacking/stacking.h"
+#include "stacking/stream_cache.h"
+#include "stacking/rejection.h"
 #include "algos/PSF.h"
+#include "algos/sorting.h"
 #include "gui/PSF_list.h"
 #include "gui/histogram.h"	// update_gfit_histogram_if_needed();
 #include "io/ser.h"
@@ -49,7 +55,7 @@
 #undef STACK_DEBUG
 
 static struct stacking_args stackparam = {	// parameters passed to stacking
-		NULL, NULL, NULL, -1.0, 0, NULL, { '\0' }, NULL, FALSE, { 0, 0 }, -1, 0, { 0, 0 }, NO_REJEC, NO_NORM, FALSE
+		NULL, NULL, NULL, -1.0, 0, NULL, { '\0' }, NULL, FALSE, { 0, 0 }, -1, 0, { 0, 0 }, NO_REJEC, NO_NORM, FALSE, FALSE, FALSE
 };
 
 static stack_method stacking_methods[] = {
@@ -64,7 +70,8 @@ struct _data_block {
 	WORD **pix;	// buffer for a block on all images
 	WORD *tmp;	// the actual single buffer for pix
 	WORD *stack;	// the reordered stack for one pixel in all images
-	int *rejected;  // 0 if pixel ok, 1 or -1 if rejected
+	WORD **rows;	// the current row of each image in pix
+	struct rejection_workspace *rejection;	// for rejection stacking
 };
 
 void initialize_stacking_methods() {
@@ -76,8 +83,18 @@ void initialize_stacking_methods() {
 	gtk_combo_box_set_active(GTK_COMBO_BOX(rejectioncombo), com.stack.rej_method);
 }
 
+/* the statistics of the image i to stack are neither computed nor in the
+ * persistent cache, it has to be read */
+static gboolean _needs_reading_for_normalization(struct stacking_args *args, int i) {
+	imstats stat;
+	int index = args->image_indices[i];
+	return !args->seq->imgparam[index].stats &&
+		!stats_cache_get(args->seq->stats_cache, index, 0, STATS_EXTRA, &stat);
+}
+
 /* scale0, mul0 and offset0 are output arguments when i = ref_image, input arguments otherwise */
-static int _compute_normalization_for_image(struct stacking_args *args, int i, int ref_image,
+static int _compute_normalization_for_image(struct stacking_args *args,
+		struct frame_prefetcher *prefetcher, int i, int ref_image,
 		double *offset, double *mul, double *scale, normalization mode, double *scale0,
 		double *mul0, double *offset0) {
 	imstats *stat = NULL;
@@ -85,12 +102,12 @@ static int _compute_normalization_for_image(struct stacking_args *args, int i, i
 	if (!(stat = seq_get_imstats(args->seq, args->image_indices[i], NULL, STATS_EXTRA))) {
 		fits fit;
 		memset(&fit, 0, sizeof(fits));
-		if (seq_read_frame(args->seq, args->image_indices[i], &fit)) {
+		if (prefetcher_get(prefetcher, args->image_indices[i], NULL, &fit)) {
 			return 1;
 		}
 		stat = seq_get_imstats(args->seq, args->image_indices[i], &fit, STATS_EXTRA);
 		if (args->seq->type != SEQ_INTERNAL)
-			clearfits(&fit);
+			fits_recycle(&fit);
 	}
 
 	switch (mode) {
@@ -123,9 +140,24 @@ static int _compute_normalization_for_image(struct stacking_args *args, int i, i
 	return 0;
 }
 
+/* empties the statistics cache of the sequence, including the persistent
+ * cache, they will be recomputed. */
+static void clear_stats_for_normalization(sequence *seq) {
+	int i;
+	for (i = 0; i < seq->number; i++) {
+		if (seq->imgparam && seq->imgparam[i].stats) {
+			free(seq->imgparam[i].stats);
+			seq->imgparam[i].stats = NULL;
+		}
+	}
+	stats_cache_clear(seq->stats_cache);
+}
+
 int compute_normalization(struct stacking_args *args, norm_coeff *coeff, normalization mode) {
 	int i, ref_image, retval = 0, cur_nb = 1;
 	double scale0, mul0, offset0;	// for reference frame
+	struct frame_prefetcher *prefetcher;
+	GMutex io_lock;
 	char *tmpmsg;
 
 	for (i = 0; i < args->nb_images_to_stack; i++) {
@@ -146,19 +178,21 @@ int compute_normalization(struct stacking_args *args, norm_coeff *coeff, normali
 	else ref_image = args->seq->reference_image;
 
 	/* We empty the cache if needed (force to recompute) */
-	if (args->force_norm) {
-		for (i = 0; i < args->seq->number; i++) {
-			if (args->seq->imgparam && args->seq->imgparam[i].stats) {
-				free(args->seq->imgparam[i].stats);
-				args->seq->imgparam[i].stats = NULL;
-			}
-		}
-	}
+	if (args->force_norm)
+		clear_stats_for_normalization(args->seq);
+
+	/* frames without statistics are read in advance, one at a time if
+	 * cfitsio is not reentrant */
+	g_mutex_init(&io_lock);
+	prefetcher = prefetcher_new(args->seq, com.max_thread, 0, FALSE,
+			args->seq->type == SEQ_REGULAR && !fits_is_reentrant() ? &io_lock : NULL);
 
 	// compute for the first image to have scale0 mul0 and offset0
-	if (_compute_normalization_for_image(args, ref_image, ref_image, coeff->offset, coeff->mul, coeff->scale, mode,
-			&scale0, &mul0, &offset0)) {
+	if (!prefetcher || _compute_normalization_for_image(args, prefetcher, ref_image, ref_image,
+				coeff->offset, coeff->mul, coeff->scale, mode, &scale0, &mul0, &offset0)) {
 		set_progress_bar_data(_("Normalization failed."), PROGRESS_NONE);
+		prefetcher_free(prefetcher);
+		g_mutex_clear(&io_lock);
 		return 1;
 	}
 
@@ -173,7 +207,12 @@ int compute_normalization(struct stacking_args *args, norm_coeff *coeff, normali
 				retval = 1;
 				continue;
 			}
-			if (_compute_normalization_for_image(args, i, ref_image, coeff->offset, coeff->mul, coeff->scale,
+			/* with the static schedule, the next image of this thread */
+			if (i + 1 < args->nb_images_to_stack && i + 1 != ref_image &&
+					_needs_reading_for_normalization(args, i + 1))
+				prefetcher_request(prefetcher, args->image_indices[i + 1], NULL);
+			if (_compute_normalization_for_image(args, prefetcher, i, ref_image,
+					coeff->offset, coeff->mul, coeff->scale,
 					mode, &scale0, &mul0, &offset0)) {
 				retval = 1;
 				continue;
@@ -186,165 +225,487 @@ int compute_normalization(struct stacking_args *args, norm_coeff *coeff, normali
 					(double)cur_nb / ((double)args->nb_images_to_stack));
 		}
 	}
+	prefetcher_free(prefetcher);
+	g_mutex_clear(&io_lock);
+	image_pool_flush();
 	set_progress_bar_data(NULL, PROGRESS_DONE);
 	return retval;
 }
 
-/** STACK method **
- * This method takes several images and create a new being the sum of all
- * others (normalized to the maximum value of unsigned SHORT).
- */
-int stack_summing(struct stacking_args *args) {
-	int x, y, nx, ny, i, ii, j, shiftx, shifty, layer, reglayer;
-	unsigned long *somme[3], *from, maxim = 0;
-	WORD *to;
-	double ratio;
-	double exposure=0.0;
-	unsigned int nbdata = 0;
-	char filename[256];
-	int retval = 0;
-	int nb_frames, cur_nb = 0;
+/* Applies the normalization coefficients of one frame to a block of its pixels,
+ * in place. The coefficients being constant for a frame, the normalization
+ * mode is tested once per block instead of once per pixel. */
+static void normalize_block(WORD *buf, long nbpix, normalization mode,
+		double scale, double offset, double mul) {
+	long i;
+	switch (mode) {
+	default:
+	case NO_NORM:		// no normalization (scale = 1, offset = 0, mul = 1)
+		break;
+	case ADDITIVE:		// additive (scale = 1, mul = 1)
+	case ADDITIVE_SCALING:		// additive + scale (mul = 1)
+		for (i = 0; i < nbpix; i++)
+			buf[i] = round_to_WORD((double)buf[i] * scale - offset);
+		break;
+	case MULTIPLICATIVE:		// multiplicative  (scale = 1, offset = 0)
+	case MULTIPLICATIVE_SCALING:		// multiplicative + scale (offset = 0)
+		for (i = 0; i < nbpix; i++)
+			buf[i] = round_to_WORD((double)buf[i] * scale * mul);
+		break;
+	}
+}
+
+/* The registration transform of a frame, NULL if it is registered by its
+ * shifts only. Frames with a transform are resampled in the frame of the
+ * reference image at stacking time, their shifts are ignored. */
+const double *stacking_get_transform(struct stacking_args *args, int image_index) {
+	regdata *reg;
+	if (args->reglayer == -1 || !args->seq->regparam || !args->seq->regparam[args->reglayer])
+		return NULL;
+	reg = &args->seq->regparam[args->reglayer][image_index];
+	return reg->has_transform ? reg->transform : NULL;
+}
+
+/* Reads the area of a channel of a frame registered by the transform t,
+ * resampled in the frame of the reference image, in buffer. The area, of
+ * whole rows of an image of rx x ry pixels, is in the coordinates of
+ * seq_opened_read_region(), rows being counted from the top. Only the rows of
+ * the frame that the transformed area covers are read, more than the area for
+ * a rotated frame. Returns 0 on success. */
+static int read_transformed_area(sequence *seq, int channel, int image_index,
+		const double t[6], WORD *buffer, const rectangle *area, int rx, int ry) {
+	int radius = warp_kernel_radius(STACK_INTERPOLATION);
+	/* FITS row of the first row of the area */
+	double k = (double) (ry - 1 - area->y);
+	double vmin = 0.0, vmax = 0.0, m[6];
+	rectangle in_area;
+	WORD *in;
+	int c, first, last, retval;
+
+	/* extreme rows of the frame for the corners of the area */
+	for (c = 0; c < 4; c++) {
+		double x = (c & 1) ? (double) (area->w - 1) : 0.0;
+		double y = (c & 2) ? k - (double) (area->h - 1) : k;
+		double v = t[3] * x + t[4] * y + t[5];
+		if (c == 0 || v < vmin) vmin = v;
+		if (c == 0 || v > vmax) vmax = v;
+	}
+	first = max(0, (int) floor(ry - 1 - vmax) - radius);
+	last = min(ry - 1, (int) ceil(ry - 1 - vmin) + radius);
+	if (first > last) {
+		/* the area comes from outside the frame */
+		memset(buffer, 0, (size_t) area->w * area->h * sizeof(WORD));
+		return 0;
+	}
+
+	in_area.x = 0;
+	in_area.y = first;
+	in_area.w = rx;
+	in_area.h = last - first + 1;
+	in = image_buffer_get((size_t) rx * in_area.h * sizeof(WORD));
+	if (!in)
+		return -1;
+	retval = seq_opened_read_region(seq, channel, image_index, in, &in_area);
+	if (retval == 0) {
+		/* t in the coordinates of the buffers, rows counted from the top */
+		m[0] = t[0];
+		m[1] = -t[1];
+		m[2] = t[1] * k + t[2];
+		m[3] = -t[3];
+		m[4] = t[4];
+		m[5] = (double) (ry - 1 - first) - t[4] * k - t[5];
+		warp_buffer(in, rx, in_area.h, buffer, area->w, area->h, m, STACK_INTERPOLATION);
+	}
+	image_buffer_release(in, (size_t) rx * in_area.h * sizeof(WORD));
+	return retval;
+}
+
+/* The sum, maximum and minimum stacking combine the frames pixel by pixel,
+ * without needing all of them at the same time. Frames are read in parallel,
+ * each thread combining its frames in its own accumulator, and accumulators
+ * are merged at the end. Integer shifts only move whole rows, so each row of
+ * a frame is combined in one pass over the part that stays in the image. */
+typedef enum {
+	ADD_SUM,	// in double
+	ADD_MAX,	// in WORD
+	ADD_MIN		// in WORD
+} addition_op;
+
+/* part of the available memory that the accumulators of the threads may use */
+#define ADDITION_MEMORY_RATIO 0.5
+
+static size_t accumulator_size(addition_op op, size_t nbdata) {
+	return nbdata * (op == ADD_SUM ? sizeof(double) : sizeof(WORD));
+}
+
+static void *new_accumulator(addition_op op, size_t nbdata) {
+	void *acc;
+	if (op == ADD_SUM)
+		return calloc(nbdata, sizeof(double));
+	acc = malloc(nbdata * sizeof(WORD));
+	if (acc)
+		memset(acc, op == ADD_MAX ? 0 : 0xff, nbdata * sizeof(WORD));
+	return acc;
+}
+
+static void sum_row(double *acc, const WORD *src, int len) {
+	int x;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (x = 0; x < len; x++)
+		acc[x] += (double) src[x];
+}
+
+static void sum_row_float(double *acc, const float *src, int len) {
+	int x;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (x = 0; x < len; x++)
+		acc[x] += (double) src[x];
+}
+
+static void sum_row_double(double *acc, const double *src, size_t len) {
+	size_t x;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (x = 0; x < len; x++)
+		acc[x] += src[x];
+}
+
+static void max_row(WORD *acc, const WORD *src, size_t len) {
+	size_t x;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (x = 0; x < len; x++)
+		acc[x] = src[x] > acc[x] ? src[x] : acc[x];
+}
+
+static void min_row(WORD *acc, const WORD *src, size_t len) {
+	size_t x;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (x = 0; x < len; x++)
+		acc[x] = src[x] < acc[x] ? src[x] : acc[x];
+}
+
+/* Combines the frame image_index, read in fit, in the accumulator acc, after
+ * its registration. Returns 0 on success. */
+static int add_frame(struct stacking_args *args, addition_op op, int image_index,
+		fits *fit, void *acc) {
+	const double *transform;
+	int shiftx = 0, shifty = 0, x0, x1, y0, y1, y, layer;
+	size_t npixels = (size_t) fit->rx * fit->ry;
+
+	transform = stacking_get_transform(args, image_index);
+	if (transform) {
+		/* resampled in the frame of the reference image */
+		if (warp_image(fit, transform, STACK_INTERPOLATION)) {
+			siril_log_message(_("Stacking: could not transform frame %d, aborting\n"), image_index);
+			return -2;
+		}
+	} else if (args->reglayer != -1 && args->seq->regparam[args->reglayer]) {
+		shiftx = args->seq->regparam[args->reglayer][image_index].shiftx;
+		shifty = args->seq->regparam[args->reglayer][image_index].shifty;
+	}
+#ifdef STACK_DEBUG
+	printf("Stack image %d with shift x=%d y=%d\n", image_index, shiftx, shifty);
+#endif
+
+	/* pixel (x, y) of the stack is pixel (x - shiftx, y - shifty) of the
+	 * frame, the stack rows and columns covered by the frame are: */
+	x0 = max(0, shiftx);
+	x1 = min(fit->rx, fit->rx + shiftx);
+	y0 = max(0, shifty);
+	y1 = min(fit->ry, fit->ry + shifty);
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	for (layer = 0; layer < fit->naxes[2]; layer++) {
+		for (y = y0; y < y1; y++) {
+			size_t i = layer * npixels + (size_t) y * fit->rx + x0;	// in acc
+			size_t ii = (size_t) (y - shifty) * fit->rx + x0 - shiftx;	// in the layer
+			switch (op) {
+				case ADD_SUM:
+					if (fit->type == DATA_FLOAT)
+						sum_row_float((double *) acc + i, fit->fpdata[layer] + ii, x1 - x0);
+					else sum_row((double *) acc + i, fit->pdata[layer] + ii, x1 - x0);
+					break;
+				case ADD_MAX:
+					max_row((WORD *) acc + i, fit->pdata[layer] + ii, x1 - x0);
+					break;
+				case ADD_MIN:
+					min_row((WORD *) acc + i, fit->pdata[layer] + ii, x1 - x0);
+					break;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Merges the accumulator src in dst, nbdata values each. */
+static void merge_accumulators(addition_op op, void *dst, void *src, size_t nbdata) {
+	long chunk, nb_chunks = (long) ((nbdata + 65535) / 65536);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(com.max_thread) schedule(static)
+#endif
+	for (chunk = 0; chunk < nb_chunks; chunk++) {
+		size_t start = (size_t) chunk * 65536;
+		size_t len = min(nbdata - start, 65536);
+		switch (op) {
+			case ADD_SUM:
+				sum_row_double((double *) dst + start, (double *) src + start, len);
+				break;
+			case ADD_MAX:
+				max_row((WORD *) dst + start, (WORD *) src + start, len);
+				break;
+			case ADD_MIN:
+				min_row((WORD *) dst + start, (WORD *) src + start, len);
+				break;
+		}
+	}
+}
+
+static int stack_addition(struct stacking_args *args, addition_op op) {
+	int *frames = NULL, nb_frames = 0, nb_threads = 0, max_threads, chunk, i, j, layer;
+	int retval = 0, cur_nb = 1;
+	size_t npixels = 0, nbdata = 0, k;
+	void **acc = NULL;
+	double exposure = 0.0;
+	struct frame_prefetcher *prefetcher = NULL;
+	gboolean parallel, serialize_io;
+	GMutex io_lock;
 	fits *fit = &wfit[0];
-	char *tmpmsg;
+	char filename[256], *tmpmsg;
+
 	memset(fit, 0, sizeof(fits));
+	g_mutex_init(&io_lock);
 
 	/* should be pre-computed to display it in the stacking tab */
-	nb_frames = args->nb_images_to_stack;
-	reglayer = get_registration_layer();
-
-	if (nb_frames <= 1) {
+	if (args->nb_images_to_stack <= 1) {
 		siril_log_message(_("No frame selected for stacking (select at least 2). Aborting.\n"));
+		g_mutex_clear(&io_lock);
 		return -1;
 	}
-
-	somme[0] = NULL;
-	assert(nb_frames <= args->seq->number);
+	assert(args->nb_images_to_stack <= args->seq->number);
 	set_progress_bar_data(NULL, PROGRESS_RESET);
 
-	for (j=0; j<args->seq->number; ++j){
+	frames = malloc(args->seq->number * sizeof(int));
+	if (!frames) {
+		printf("Stacking: memory allocation failure\n");
+		retval = -2;
+		goto free_and_reset_progress_bar;
+	}
+	for (j = 0; j < args->seq->number; j++) {
+		if (args->filtering_criterion(args->seq, j, args->filtering_parameter))
+			frames[nb_frames++] = j;
+		else fprintf(stdout, "image %d is excluded from stacking\n", j);
+	}
+	if (nb_frames == 0) {
+		retval = -1;
+		goto free_and_reset_progress_bar;
+	}
+
+	/* the first frame gives the size of the images and the format of the
+	 * result. FITS frames, possibly calibrated in float, are summed without
+	 * rounding */
+	if (op == ADD_SUM && args->use_float && args->seq->type == SEQ_REGULAR)
+		fit->type = DATA_FLOAT;
+	if (!seq_get_image_filename(args->seq, frames[0], filename)) {
+		retval = -1;
+		goto free_and_reset_progress_bar;
+	}
+	tmpmsg = strdup(_("Processing image "));
+	tmpmsg = str_append(&tmpmsg, filename);
+	set_progress_bar_data(tmpmsg, 0.0);
+	free(tmpmsg);
+	if (seq_read_frame(args->seq, frames[0], fit)) {
+		siril_log_message(_("Stacking: could not read frame, aborting\n"));
+		retval = -3;
+		goto free_and_reset_progress_bar;
+	}
+	if (args->seq->nb_layers == -1) {
+		/* sequence has not been opened before, this is set in set_seq.
+		 * It happens with the stackall command that stacks a
+		 * sequence right after readseqfile.
+		 */
+		args->seq->rx = fit->rx; args->seq->ry = fit->ry;
+		args->seq->nb_layers = fit->naxes[2];
+	}
+	assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
+	assert(fit->naxes[2] == args->seq->nb_layers);
+	npixels = (size_t) fit->rx * fit->ry;
+	nbdata = npixels * fit->naxes[2];
+
+	/* one accumulator per thread, as many as the memory allows */
+	parallel = args->seq->type == SEQ_SER ||
+		(args->seq->type == SEQ_REGULAR && fits_is_reentrant());
+	nb_threads = parallel ? com.max_thread : 1;
+	max_threads = (int) (ADDITION_MEMORY_RATIO * get_available_memory_in_MB() *
+			1024.0 * 1024.0 / (double) accumulator_size(op, nbdata));
+	if (nb_threads > max_threads)
+		nb_threads = max_threads;
+	if (nb_threads > nb_frames - 1)
+		nb_threads = nb_frames - 1;
+	if (nb_threads < 1)
+		nb_threads = 1;
+	acc = calloc(nb_threads, sizeof(void *));
+	if (acc)
+		acc[0] = new_accumulator(op, nbdata);
+	if (!acc || !acc[0]) {
+		printf("Stacking: memory allocation failure\n");
+		retval = -2;
+		goto free_and_reset_progress_bar;
+	}
+	update_used_memory();
+
+	exposure = fit->exposure;
+	retval = add_frame(args, op, frames[0], fit, acc[0]);
+	if (retval)
+		goto free_and_reset_progress_bar;
+
+	/* frames are read in advance, one at a time if cfitsio is not
+	 * reentrant. Frames read in float are not, the prefetcher reads in
+	 * 16 bits. */
+	serialize_io = args->seq->type == SEQ_REGULAR && !fits_is_reentrant();
+	prefetcher = prefetcher_new(args->seq, fit->type == DATA_FLOAT ? 0 : com.max_thread,
+			0, FALSE, serialize_io ? &io_lock : NULL);
+	if (!prefetcher) {
+		retval = -2;
+		goto free_and_reset_progress_bar;
+	}
+	set_progress_bar_data(_("Stacking in progress..."), 1.0 / (nb_frames + 1.0));
+
+	/* each thread adds a contiguous chunk of the frames */
+	chunk = (nb_frames - 1 + nb_threads - 1) / nb_threads;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nb_threads) private(i) schedule(static, chunk) if (parallel)
+#endif
+	for (i = 1; i < nb_frames; i++) {
+		int thread = 0;
+		fits frame_fit;
+
+		if (retval)
+			continue;
 		if (!get_thread_run()) {
 			retval = -1;
-			goto free_and_reset_progress_bar;
-		}
-		if (!args->filtering_criterion(args->seq, j, args->filtering_parameter)) {
-			fprintf(stdout, "image %d is excluded from stacking\n", j);
 			continue;
 		}
-		if (!seq_get_image_filename(args->seq, j, filename)) {
-			retval = -1;
-			goto free_and_reset_progress_bar;
+#ifdef _OPENMP
+		thread = omp_get_thread_num();
+#endif
+		if (!acc[thread] && !(acc[thread] = new_accumulator(op, nbdata))) {
+			printf("Stacking: memory allocation failure\n");
+			retval = -2;
+			continue;
 		}
-		tmpmsg = strdup(_("Processing image "));
-		tmpmsg = str_append(&tmpmsg, filename);
-		set_progress_bar_data(tmpmsg, (double)cur_nb/((double)nb_frames+1.));
-		free(tmpmsg);
-
-		cur_nb++;	// only used for progress bar
-
-		if (seq_read_frame(args->seq, j, fit)) {
+		/* the next frame of this thread, unless it starts the chunk of
+		 * another thread that reads it itself */
+		if (i + 1 < nb_frames && i % chunk != 0)
+			prefetcher_request(prefetcher, frames[i + 1], NULL);
+
+		memset(&frame_fit, 0, sizeof(fits));
+		frame_fit.type = fit->type;
+		if (prefetcher_get(prefetcher, frames[i], NULL, &frame_fit)) {
 			siril_log_message(_("Stacking: could not read frame, aborting\n"));
 			retval = -3;
-			goto free_and_reset_progress_bar;
-		}
-
-		if (args->seq->nb_layers == -1) {
-			/* sequence has not been opened before, this is set in set_seq.
-			 * It happens with the stackall command that stacks a
-			 * sequence right after readseqfile.
-			 */
-			args->seq->rx = fit->rx; args->seq->ry = fit->ry;
-			args->seq->nb_layers = fit->naxes[2];
+			continue;
 		}
-		assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-		assert(fit->naxes[2] == args->seq->nb_layers);
-
-		/* first loaded image: init data structures for stacking */
-		if (!nbdata) {
-			nbdata = fit->ry * fit->rx;
-			somme[0] = calloc(nbdata, sizeof(unsigned long)*fit->naxes[2]);
-			if (somme[0] == NULL){
-				printf("Stacking: memory allocation failure\n");
-				retval = -2;
-				goto free_and_reset_progress_bar;
-			}
-			if(args->seq->nb_layers == 3){
-				somme[1] = somme[0] + nbdata;	// index of green layer in somme[0]
-				somme[2] = somme[0] + nbdata*2;	// index of blue layer in somme[0]
-			}
-			//~ "stacking operation\n");
-		} else if (fit->ry * fit->rx != nbdata) {
+		if (frame_fit.rx != fit->rx || frame_fit.ry != fit->ry ||
+				frame_fit.naxes[2] != fit->naxes[2]) {
 			siril_log_message(_("Stacking: image in sequence doesn't has the same dimensions\n"));
 			retval = -3;
-			goto free_and_reset_progress_bar;
-		}
-
-		update_used_memory();
-
-		/* load registration data for current image */
-		if(reglayer != -1 && args->seq->regparam[reglayer]) {
-			shiftx = args->seq->regparam[reglayer][j].shiftx;
-			shifty = args->seq->regparam[reglayer][j].shifty;
 		} else {
-			shiftx = 0;
-			shifty = 0;
-		}
-#ifdef STACK_DEBUG
-		printf("Stack image %d with shift x=%d y=%d\n", j, shiftx, shifty);
+			int status = add_frame(args, op, frames[i], &frame_fit, acc[thread]);
+			if (status)
+				retval = status;
+#ifdef _OPENMP
+#pragma omp atomic
 #endif
-
-		/* Summing the exposure */
-		exposure += fit->exposure;
-
-		/* stack current image */
-		i=0;	// index in somme[0]
-		for (y=0; y < fit->ry; ++y){
-			for (x=0; x < fit->rx; ++x){
-				nx = x - shiftx;
-				ny = y - shifty;
-				//printf("x=%d y=%d sx=%d sy=%d i=%d ii=%d\n",x,y,shiftx,shifty,i,ii);
-				if (nx >= 0 && nx < fit->rx && ny >= 0 && ny < fit->ry) {
-					ii = ny * fit->rx + nx;		// index in somme[0] too
-					//printf("shiftx=%d shifty=%d i=%d ii=%d\n",shiftx,shifty,i,ii);
-					if (ii > 0 && ii < fit->rx * fit->ry){
-						for(layer=0; layer<args->seq->nb_layers; ++layer){
-							WORD current_pixel = fit->pdata[layer][ii];
-							somme[layer][i] += current_pixel;
-							if (somme[layer][i] > maxim){
-								maxim = somme[layer][i];
-							}
-						}
-					}
-				}
-				++i;
-			}
+			exposure += frame_fit.exposure;
 		}
+		fits_recycle(&frame_fit);
+
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+		cur_nb++;	// only used for progress bar
+		set_progress_bar_data(NULL, (double)cur_nb / ((double)nb_frames + 1.));
 	}
+	prefetcher_free(prefetcher);
+	if (!retval && !get_thread_run())
+		retval = -1;
+	if (retval)
+		goto free_and_reset_progress_bar;
+
 	set_progress_bar_data(_("Finalizing stacking..."), (double)nb_frames/((double)nb_frames + 1.));
+	for (i = 1; i < nb_threads; i++) {
+		if (acc[i])
+			merge_accumulators(op, acc[0], acc[i], nbdata);
+	}
 
 	copyfits(fit, &gfit, CP_ALLOC|CP_FORMAT, 0);
-	gfit.hi = round_to_WORD(maxim);
-	gfit.bitpix = USHORT_IMG;
 	gfit.exposure = exposure;
-
-	if (maxim > USHRT_MAX)
-		ratio = USHRT_MAX_DOUBLE / (double)maxim;
-	else	ratio = 1.0;
-
-	if (somme[0]) {
-		assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-		for(layer=0; layer<args->seq->nb_layers; ++layer){
-			from = somme[layer];
-			to = gfit.pdata[layer];
-			for (y=0; y < fit->ry * fit->rx; ++y) {
-				if (ratio == 1.0)
-					*to++ = round_to_WORD(*from++);
-				else	*to++ = round_to_WORD((double)(*from++) * ratio);
+	if (op == ADD_SUM) {
+		double *somme = (double *) acc[0], maxim = 0.0, ratio;
+
+		/* the result is in the type asked, whatever the type of the frames */
+		if (args->use_float)
+			retval = convert_fit_to_float(&gfit);
+		else retval = convert_fit_to_ushort(&gfit);
+		if (retval) {
+			retval = -2;
+			goto free_and_reset_progress_bar;
+		}
+		for (k = 0; k < nbdata; k++)
+			if (somme[k] > maxim)
+				maxim = somme[k];
+		gfit.hi = round_to_WORD(maxim);
+
+		if (maxim > USHRT_MAX)
+			ratio = USHRT_MAX_DOUBLE / maxim;
+		else	ratio = 1.0;
+
+		for (layer = 0; layer < gfit.naxes[2]; layer++) {
+			double *from = somme + layer * npixels;
+			if (args->use_float) {
+				float *to = gfit.fpdata[layer];
+				for (k = 0; k < npixels; k++)
+					to[k] = (float) (from[k] * ratio);
+			} else {
+				WORD *to = gfit.pdata[layer];
+				for (k = 0; k < npixels; k++)
+					to[k] = round_to_WORD(from[k] * ratio);
 			}
 		}
+	} else {
+		WORD *final_pixel = (WORD *) acc[0], hi = op == ADD_MAX ? 0 : USHRT_MAX;
+
+		/* the brightest pixel for addmax, the darkest for addmin */
+		for (k = 0; k < nbdata; k++) {
+			if (op == ADD_MAX ? final_pixel[k] > hi : final_pixel[k] < hi)
+				hi = final_pixel[k];
+		}
+		gfit.hi = hi;
+		gfit.bitpix = USHORT_IMG;
+		// TODO : think if exposure has a sense here
+		for (layer = 0; layer < gfit.naxes[2]; layer++)
+			memcpy(gfit.pdata[layer], final_pixel + layer * npixels, npixels * sizeof(WORD));
 	}
 
 free_and_reset_progress_bar:
-	if (somme[0]) free(somme[0]);
+	if (acc) {
+		for (i = 0; i < nb_threads; i++)
+			free(acc[i]);
+		free(acc);
+	}
+	free(frames);
+	g_mutex_clear(&io_lock);
+	image_pool_flush();
 	if (retval) {
 		set_progress_bar_data(_("Stacking failed. Check the log."), PROGRESS_RESET);
 		siril_log_message(_("Stacking failed.\n"));
@@ -355,10 +716,113 @@ free_and_reset_progress_bar:
 	return retval;
 }
 
+/** STACK method **
+ * This method takes several images and create a new being the sum of all
+ * others (normalized to the maximum value of unsigned SHORT).
+ */
+int stack_summing(struct stacking_args *args) {
+	return stack_addition(args, ADD_SUM);
+}
+
+/* Splits the channels of the images in blocks of rows that are stacked
+ * independently, possibly in parallel, for the median and rejection stacking.
+ * Returns the number of blocks, stored in *blocksptr, or -1 on error. */
+static long compute_parallel_blocks(struct image_block **blocksptr, long max_number_of_rows,
+		long naxes[3], int nb_threads, int nb_channels, long *largest_block_height) {
+	struct image_block *blocks;
+
+	int size_of_stacks = max_number_of_rows / nb_threads; 
+	if (size_of_stacks == 0)
+		size_of_stacks = 1;
+	/* Note: this size of stacks based on the max memory configured doesn't take into
+	 * account memory for demosaicing if it applies.
+	 * Now we compute the total number of "stacks" which are the independent areas where
+	 * the stacking will occur. This will then be used to create the image areas. */
+	long nb_parallel_stacks;
+	int remainder;
+	if (naxes[1] / size_of_stacks < 4) {
+		/* We have enough RAM to process each channel with 4 threads.
+		 * We should cut images at least in 4 on one channel to use enough threads,
+		 * and if only one is available, it will use much less RAM for a small time overhead.
+		 * Also, for slow data access like rotating drives or on-the-fly debayer,
+		 * it feels more responsive this way.
+		 */
+		nb_parallel_stacks = 4 * nb_channels;
+		size_of_stacks = naxes[1] / 4;
+		remainder = naxes[1] % 4;
+	} else {
+		/* We don't have enough RAM to process a channel with all available threads */
+		nb_parallel_stacks = naxes[1] * nb_channels / size_of_stacks;
+		if (nb_parallel_stacks % nb_channels != 0
+				|| (naxes[1] * nb_channels) % size_of_stacks != 0) {
+			/* we need to take into account the fact that the stacks are computed for
+			 * each channel, not for the total number of pixels. So it needs to be
+			 * a factor of the number of channels.
+			 */
+			nb_parallel_stacks += nb_channels - (nb_parallel_stacks % nb_channels);
+			size_of_stacks = naxes[1] * nb_channels / nb_parallel_stacks;
+		}
+		remainder = naxes[1] - (nb_parallel_stacks / nb_channels * size_of_stacks);
+	}
+	siril_log_message(_("We have %d parallel blocks of size %d (+%d) for stacking.\n"),
+			nb_parallel_stacks, size_of_stacks, remainder);
+	*largest_block_height = 0;
+	blocks = malloc(nb_parallel_stacks * sizeof(struct image_block));
+	if (!blocks) {
+		fprintf(stderr, "Memory allocation error for image blocks\n");
+		return -1;
+	}
+	{
+		long channel = 0, row = 0, end, j = 0;
+		do {
+			if (j >= nb_parallel_stacks) {
+				siril_log_message(_("A bug has been found. "
+						"Unable to split the image area into the correct processing blocks.\n"));
+				free(blocks);
+				return -1;
+			}
+
+			blocks[j].channel = channel;
+			blocks[j].start_row = row;
+			end = row + size_of_stacks - 1; 
+			if (remainder > 0) {
+				// just add one pixel from the remainder to the first blocks to
+				// avoid having all of them in the last block
+				end++;
+				remainder--;
+			}
+			if (end >= naxes[1] - 1 ||	// end of the line
+					(naxes[1] - end < size_of_stacks / 10)) { // not far from it
+				end = naxes[1] - 1;
+				row = 0;
+				channel++;
+				remainder = naxes[1] - (nb_parallel_stacks / nb_channels * size_of_stacks);
+			} else {
+				row = end + 1;
+			}
+			blocks[j].end_row = end;
+			blocks[j].height = blocks[j].end_row - blocks[j].start_row + 1;
+			if (*largest_block_height < blocks[j].height) {
+				*largest_block_height = blocks[j].height;
+			}
+			fprintf(stdout, "Block %ld: channel %lu, from %lu to %lu (h = %lu)\n",
+					j, blocks[j].channel, blocks[j].start_row,
+					blocks[j].end_row, blocks[j].height);
+			j++;
+	
+		} while (channel < nb_channels) ;
+	}
+	*blocksptr = blocks;
+	return nb_parallel_stacks;
+}
+
 /******************************* MEDIAN STACKING ******************************
  * This is a bit special as median stacking requires all images to be in memory
  * So we dont use the generic readfits but directly the cfitsio routines, and
  * allocates as many pix tables as needed.
+ * Frames are normalized block by block after reading. The median is then
+ * computed with a sorting network applied to whole rows of the block for
+ * small numbers of frames, or with a selection algorithm pixel by pixel.
  * ****************************************************************************/
 int stack_median(struct stacking_args *args) {
 	int nb_frames;		/* number of frames actually used */
@@ -375,10 +839,11 @@ int stack_median(struct stacking_args *args) {
 	int pool_size = 1;
 	fits *fit = &wfit[0];
 	norm_coeff coeff;
-	struct image_block {
-		unsigned long channel, start_row, end_row, height;
-	};
 	struct image_block *blocks = NULL;
+	struct stream_cache *cache = NULL;
+	gboolean use_cache;
+	struct task_scheduler *sched = NULL;
+	sortnet *net = NULL;
 
 	nb_frames = args->nb_images_to_stack;
 
@@ -394,13 +859,21 @@ int stack_median(struct stacking_args *args) {
 
 	assert(nb_frames <= args->seq->number);
 	set_progress_bar_data(NULL, PROGRESS_RESET);
+	use_cache = stream_cache_is_needed(args);
 
 	/* allocate data structures */
 	oldnaxes[0] = oldnaxes[1] = oldnaxes[2] = 0;	// fix compiler warning
 	naxes[0] = naxes[1] = 0; naxes[2] = 1;
 
-	/* first loop: open all fits files and check they are of same size */
-	if (args->seq->type == SEQ_REGULAR) {
+	/* first loop: open all fits files and check they are of same size,
+	 * this is done while building the cache if it is used */
+	if (args->seq->type == SEQ_REGULAR && use_cache) {
+		naxes[0] = args->seq->rx;
+		naxes[1] = args->seq->ry;
+		naxes[2] = args->seq->nb_layers;
+		naxis = naxes[2] == 3 ? 3 : 2;
+	}
+	else if (args->seq->type == SEQ_REGULAR) {
 		for (i=0; i<nb_frames; ++i) {
 			int image_index = args->image_indices[i];	// image index in sequence
 			if (!get_thread_run()) {
@@ -505,15 +978,6 @@ int stack_median(struct stacking_args *args) {
 	}
 	fprintf(stdout, "image size: %ldx%ld, %ld layers\n", naxes[0], naxes[1], naxes[2]);
 
-	/* normalization: reading all images and making stats on their background level.
-	 * That's very long if not cached. */
-	if (compute_normalization(args, &coeff, args->normalize)) {
-		retval = -1;
-		goto free_and_close;
-	}
-	if (args->seq->needs_saving)	// if we had to compute new stats
-		writeseqfile(args->seq);
-
 	/* initialize result image */
 	nbdata = naxes[0] * naxes[1];
 	memset(fit, 0, sizeof(fits));
@@ -548,11 +1012,15 @@ int stack_median(struct stacking_args *args) {
 	int nb_threads;
 #ifdef _OPENMP
 	nb_threads = com.max_thread;
-	if (args->seq->type == SEQ_REGULAR && fits_is_reentrant()) {
+	if (use_cache) {
+		fprintf(stdout, "frames are read from the stacking cache,"
+				" stacking will be executed by several cores\n");
+	}
+	else if (args->seq->type == SEQ_REGULAR && fits_is_reentrant()) {
 		fprintf(stdout, "cfitsio was compiled with multi-thread support,"
 				" stacking will be executed by several cores\n");
 	}
-	if (args->seq->type == SEQ_REGULAR && !fits_is_reentrant()) {
+	else if (args->seq->type == SEQ_REGULAR && !fits_is_reentrant()) {
 		nb_threads = 1;
 		fprintf(stdout, "cfitsio was compiled without multi-thread support,"
 				" stacking will be executed on only one core\n");
@@ -568,83 +1036,38 @@ int stack_median(struct stacking_args *args) {
 		nb_channels = 3;
 	}
 
-	int size_of_stacks = args->max_number_of_rows / nb_threads; 
-	if (size_of_stacks == 0)
-		size_of_stacks = 1;
-	/* Note: this size of stacks based on the max memory configured doesn't take into
-	 * account memory for demosaicing if it applies.
-	 * Now we compute the total number of "stacks" which are the independent areas where
-	 * the stacking will occur. This will then be used to create the image areas. */
-	long nb_parallel_stacks;
-	int remainder;
-	if (naxes[1] / size_of_stacks < 4) {
-		/* We have enough RAM to process each channel with 4 threads.
-		 * We should cut images at least in 4 on one channel to use enough threads,
-		 * and if only one is available, it will use much less RAM for a small time overhead.
-		 * Also, for slow data access like rotating drives or on-the-fly debayer,
-		 * it feels more responsive this way.
-		 */
-		nb_parallel_stacks = 4 * nb_channels;
-		size_of_stacks = naxes[1] / 4;
-		remainder = naxes[1] % 4;
-	} else {
-		/* We don't have enough RAM to process a channel with all available threads */
-		nb_parallel_stacks = naxes[1] * nb_channels / size_of_stacks;
-		if (nb_parallel_stacks % nb_channels != 0
-				|| (naxes[1] * nb_channels) % size_of_stacks != 0) {
-			/* we need to take into account the fact that the stacks are computed for
-			 * each channel, not for the total number of pixels. So it needs to be
-			 * a factor of the number of channels.
-			 */
-			nb_parallel_stacks += nb_channels - (nb_parallel_stacks % nb_channels);
-			size_of_stacks = naxes[1] * nb_channels / nb_parallel_stacks;
-		}
-		remainder = naxes[1] - (nb_parallel_stacks / nb_channels * size_of_stacks);
+	long largest_block_height;
+	long nb_parallel_stacks = compute_parallel_blocks(&blocks, args->max_number_of_rows,
+			naxes, nb_threads, nb_channels, &largest_block_height);
+	if (nb_parallel_stacks < 0) {
+		retval = -1;
+		goto free_and_close;
 	}
-	siril_log_message(_("We have %d parallel blocks of size %d (+%d) for stacking.\n"),
-			nb_parallel_stacks, size_of_stacks, remainder);
-	long largest_block_height = 0;
-	blocks = malloc(nb_parallel_stacks * sizeof(struct image_block));
-	{
-		long channel = 0, row = 0, end, j = 0;
-		do {
-			if (j >= nb_parallel_stacks) {
-				siril_log_message(_("A bug has been found. "
-						"Unable to split the image area into the correct processing blocks.\n"));
-				retval = -1;
-				goto free_and_close;
-			}
 
-			blocks[j].channel = channel;
-			blocks[j].start_row = row;
-			end = row + size_of_stacks - 1; 
-			if (remainder > 0) {
-				// just add one pixel from the remainder to the first blocks to
-				// avoid having all of them in the last block
-				end++;
-				remainder--;
-			}
-			if (end >= naxes[1] - 1 ||	// end of the line
-					(naxes[1] - end < size_of_stacks / 10)) { // not far from it
-				end = naxes[1] - 1;
-				row = 0;
-				channel++;
-				remainder = naxes[1] - (nb_parallel_stacks / nb_channels * size_of_stacks);
-			} else {
-				row = end + 1;
-			}
-			blocks[j].end_row = end;
-			blocks[j].height = blocks[j].end_row - blocks[j].start_row + 1;
-			if (largest_block_height < blocks[j].height) {
-				largest_block_height = blocks[j].height;
-			}
-			fprintf(stdout, "Block %ld: channel %lu, from %lu to %lu (h = %lu)\n",
-					j, blocks[j].channel, blocks[j].start_row,
-					blocks[j].end_row, blocks[j].height);
-			j++;
-	
-		} while (channel < nb_channels) ;
+	/* normalization: reading all images and making stats on their background level.
+	 * That's very long if not cached. With the stream cache, frames are read
+	 * once and their statistics computed on the way, so it is built first. */
+	if (use_cache) {
+		gboolean force_norm = args->force_norm;
+		if (force_norm && args->normalize)
+			clear_stats_for_normalization(args->seq);
+		cache = stream_cache_build(args, blocks, nb_parallel_stacks, naxes,
+				FALSE, args->normalize != NO_NORM, &exposure);
+		if (!cache) {
+			retval = -1;
+			goto free_and_close;
+		}
+		args->force_norm = FALSE;
+		retval = compute_normalization(args, &coeff, args->normalize);
+		args->force_norm = force_norm;
 	}
+	else retval = compute_normalization(args, &coeff, args->normalize);
+	if (retval) {
+		retval = -1;
+		goto free_and_close;
+	}
+	if (args->seq->needs_saving)	// if we had to compute new stats
+		writeseqfile(args->seq);
 
 	/* Allocate the buffers.
 	 * We allocate as many as the number of threads, each thread will pick one of the buffers.
@@ -657,7 +1080,7 @@ int stack_median(struct stacking_args *args) {
 	npixels_in_block = largest_block_height * naxes[0];
 	fprintf(stdout, "allocating data for %d threads (each %'lu MB)\n", pool_size,
 			(unsigned long) (nb_frames * npixels_in_block * sizeof(WORD)) / 1048576UL);
-	data_pool = malloc(pool_size * sizeof(struct _data_block));
+	data_pool = calloc(pool_size, sizeof(struct _data_block));
 	for (i = 0; i < pool_size; i++) {
 		int j;
 		data_pool[i].pix = calloc(nb_frames, sizeof(WORD *));
@@ -675,13 +1098,35 @@ int stack_median(struct stacking_args *args) {
 	}
 	update_used_memory();
 
+	if (nb_frames <= SORTNET_MAX) {
+		net = sortnet_new(nb_frames);
+		if (!net) {
+			fprintf(stderr, "Memory allocation error for the sorting network.\n");
+			retval = -1;
+			goto free_and_close;
+		}
+	}
+
+	sched = scheduler_new(nb_parallel_stacks, com.max_thread);
+	if (!sched) {
+		retval = -1;
+		goto free_and_close;
+	}
+
 	siril_log_message(_("Starting stacking...\n"));
 	set_progress_bar_data(_("Median stacking in progress..."), PROGRESS_RESET);
 
 #ifdef _OPENMP
-#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if (args->seq->type == SEQ_SER || fits_is_reentrant())
+#pragma omp parallel num_threads(com.max_thread) private(i) if (args->seq->type == SEQ_SER || fits_is_reentrant() || use_cache)
 #endif
-	for (i = 0; i < nb_parallel_stacks; i++)
+	{
+	/* blocks are distributed by the scheduler, which balances the load
+	 * when reading is slower for some frames or some threads */
+	int thread = 0;
+#ifdef _OPENMP
+	thread = omp_get_thread_num();
+#endif
+	while ((i = scheduler_next(sched, thread)) >= 0)
 	{
 		/**** Step 1: get allocated memory for the current thread ****/
 		struct image_block *my_block = blocks+i;
@@ -691,9 +1136,7 @@ int stack_median(struct stacking_args *args) {
 
 		if (!get_thread_run()) retval = -1;
 		if (retval) continue;
-#ifdef _OPENMP
-		data_idx = omp_get_thread_num();
-#endif
+		data_idx = thread;
 		assert(data_idx < pool_size);
 		//fprintf(stdout, "thread %d working on block %d gets data\n", data_idx, i);
 		data = &data_pool[data_idx];
@@ -701,6 +1144,14 @@ int stack_median(struct stacking_args *args) {
 		/**** Step 2: load image data for the corresponding image block ****/
 		/* area in C coordinates, starting with 0, not cfitsio coordinates. */
 		rectangle area = {0, my_block->start_row, naxes[0], my_block->height};
+		if (cache) {
+			/* the block of all frames is contiguous in the cache */
+			if (stream_cache_read_block(cache, i, data->tmp)) {
+				retval = -1;
+				continue;
+			}
+			stream_cache_prefetch_block(cache, scheduler_peek(sched, thread));
+		}
 		/* Read the block from all images, store them in pix[image] */
 		for (frame = 0; frame < nb_frames; ++frame){
 			if (!get_thread_run()) {
@@ -708,17 +1159,32 @@ int stack_median(struct stacking_args *args) {
 				break;
 			}
 
-			// reading pixels from current frame
-			int success = seq_opened_read_region(args->seq, my_block->channel,
-					args->image_indices[frame], data->pix[frame], &area);
-
-			if (success < 0)
-				retval = -1;
+			if (cache) {
+				data->pix[frame] = data->tmp + frame * naxes[0] * my_block->height;
+			} else {
+				/* the shifts are not used by the median, the transforms are */
+				const double *transform = stacking_get_transform(args,
+						args->image_indices[frame]);
+				// reading pixels from current frame
+				int success = transform ?
+					read_transformed_area(args->seq, my_block->channel,
+							args->image_indices[frame], transform,
+							data->pix[frame], &area, naxes[0], naxes[1]) :
+					seq_opened_read_region(args->seq, my_block->channel,
+							args->image_indices[frame], data->pix[frame], &area);
+
+				if (success)
+					retval = -1;
 
-			if (retval) {
-				siril_log_message(_("Error reading one of the image areas\n"));
-				break;
+				if (retval) {
+					siril_log_message(_("Error reading one of the image areas\n"));
+					break;
+				}
 			}
+
+			normalize_block(data->pix[frame], naxes[0] * my_block->height,
+					args->normalize, coeff.scale[frame],
+					coeff.offset[frame], coeff.mul[frame]);
 		}
 		if (retval) continue;
 
@@ -743,32 +1209,27 @@ int stack_median(struct stacking_args *args) {
 			}
 			set_progress_bar_data(NULL, (double)cur_nb/total);
 
+			if (net) {
+				/* the whole row is sorted in place in pix, it is not used afterwards */
+				sortnet_median_rows(net, data->pix, y * naxes[0], naxes[0],
+						fit->pdata[my_block->channel] + pixel_idx);
+				continue;
+			}
+
 			for (x = 0; x < naxes[0]; ++x){
 				int ii;
 				/* copy all images pixel values in the same row array `stack'
 				 * to optimize caching and improve readability */
-				for (ii=0; ii<nb_frames; ++ii) {
-					double tmp = (double)data->pix[ii][y*naxes[0]+x] * coeff.scale[ii];
-					switch (args->normalize) {
-						default:
-						case NO_NORM:		// no normalization (scale[ii] = 1, offset[ii] = 0, mul[ii] = 1)
-						case ADDITIVE:		// additive (scale[ii] = 1, mul[ii] = 1)
-						case ADDITIVE_SCALING:		// additive + scale (mul[ii] = 1)
-							data->stack[ii] = round_to_WORD(tmp - coeff.offset[ii]);
-							break;
-						case MULTIPLICATIVE:		// multiplicative  (scale[ii] = 1, offset[ii] = 0)
-						case MULTIPLICATIVE_SCALING:		// multiplicative + scale (offset[ii] = 0)
-							data->stack[ii] = round_to_WORD(tmp * coeff.mul[ii]);
-							break;
-					}
-				}
-				quicksort_s(data->stack, nb_frames);
+				for (ii=0; ii<nb_frames; ++ii)
+					data->stack[ii] = data->pix[ii][y*naxes[0]+x];
 				fit->pdata[my_block->channel][pixel_idx] =
-						gsl_stats_ushort_median_from_sorted_data(data->stack, 1, nb_frames);
+						quickmedian(data->stack, nb_frames);
 				pixel_idx++;
 			}
 		}
 	} /* end of loop over parallel stacks */
+	}
+	scheduler_log_stats(sched, _("Stacking"));
 
 	if (retval)
 		goto free_and_close;
@@ -777,12 +1238,18 @@ int stack_median(struct stacking_args *args) {
 	/* copy result to gfit if success */
 	copyfits(fit, &gfit, CP_FORMAT, 0);
 	if (gfit.data) free(gfit.data);
+	if (gfit.fdata) free(gfit.fdata);
+	gfit.type = fit->type;
 	gfit.data = fit->data;
+	gfit.fdata = fit->fdata;
 	gfit.exposure = exposure;
 	memcpy(gfit.pdata, fit->pdata, 3*sizeof(WORD *));
+	memcpy(gfit.fpdata, fit->fpdata, 3*sizeof(float *));
 
 	fit->data = NULL;
+	fit->fdata = NULL;
 	memset(fit->pdata, 0, 3*sizeof(WORD *));
+	memset(fit->fpdata, 0, 3*sizeof(float *));
 
 free_and_close:
 	fprintf(stdout, "free and close (%d)\n", retval);
@@ -796,394 +1263,78 @@ free_and_close:
 			if (data_pool[i].pix) free(data_pool[i].pix);
 			if (data_pool[i].tmp) free(data_pool[i].tmp);
 		}
-		free(data_pool);
-	}
-	if (blocks) free(blocks);
-	free(coeff.offset);
-	free(coeff.mul);
-	free(coeff.scale);
-	if (retval) {
-		/* if retval is set, gfit has not been modified */
-		if (fit->data) free(fit->data);
-		set_progress_bar_data(_("Median stacking failed. Check the log."), PROGRESS_RESET);
-		siril_log_message(_("Stacking failed.\n"));
-	} else {
-		set_progress_bar_data(_("Median stacking complete."), PROGRESS_DONE);
-		siril_log_message(_("Median stacking complete. %d have been stacked.\n"), nb_frames);
-	}
-	update_used_memory();
-	return retval;
-}
-
-
-/** Addmax STACK method **
- * This method is very close to the summing one instead that the result
- * takes only the pixel if it is brighter than the previous one at the
- * same coordinates.
- */
-int stack_addmax(struct stacking_args *args) {
-	int x, y, nx, ny, i, ii, j, shiftx, shifty, layer, reglayer;
-	WORD *final_pixel[3], *from, maxim = 0;
-	WORD *to;
-	double exposure=0.0;
-	unsigned int nbdata = 0;
-	char filename[256];
-	int retval = 0;
-	int nb_frames, cur_nb = 0;
-	fits *fit = &wfit[0];
-	char *tmpmsg;
-	memset(fit, 0, sizeof(fits));
-
-	/* should be pre-computed to display it in the stacking tab */
-	nb_frames = args->nb_images_to_stack;
-	reglayer = get_registration_layer();
-
-	if (nb_frames <= 1) {
-		siril_log_message(_("No frame selected for stacking (select at least 2). Aborting.\n"));
-		return -1;
-	}
-
-	final_pixel[0] = NULL;
-	assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-	assert(nb_frames <= args->seq->number);
-
-	for (j=0; j<args->seq->number; ++j){
-		if (!get_thread_run()) {
-			retval = -1;
-			goto free_and_reset_progress_bar;
-		}
-		if (!args->filtering_criterion(args->seq, j, args->filtering_parameter)) {
-			fprintf(stdout, "image %d is excluded from stacking\n", j);
-			continue;
-		}
-		if (!seq_get_image_filename(args->seq, j, filename)) {
-			retval = -1;
-			goto free_and_reset_progress_bar;
-		}
-		tmpmsg = strdup(_("Processing image "));
-		tmpmsg = str_append(&tmpmsg, filename);
-		set_progress_bar_data(tmpmsg, (double)cur_nb/((double)nb_frames+1.));
-		free(tmpmsg);
-
-		cur_nb++;	// only used for progress bar
-
-		if (seq_read_frame(args->seq, j, fit)) {
-			siril_log_message(_("Stacking: could not read frame, aborting\n"));
-			retval = -3;
-			goto free_and_reset_progress_bar;
-		}
-
-		assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-		assert(fit->naxes[2] == args->seq->nb_layers);
-
-		/* first loaded image: init data structures for stacking */
-		if (!nbdata) {
-			nbdata = fit->ry * fit->rx;
-			final_pixel[0] = calloc(nbdata, sizeof(WORD)*fit->naxes[2]);
-			if (final_pixel[0] == NULL){
-				printf("Stacking: memory allocation failure\n");
-				retval = -2;
-				goto free_and_reset_progress_bar;
-			}
-			if(args->seq->nb_layers == 3){
-				final_pixel[1] = final_pixel[0] + nbdata;	// index of green layer in final_pixel[0]
-				final_pixel[2] = final_pixel[0] + nbdata*2;	// index of blue layer in final_pixel[0]
-			}
-		} else if (fit->ry * fit->rx != nbdata) {
-			siril_log_message(_("Stacking: image in sequence doesn't has the same dimensions\n"));
-			retval = -3;
-			goto free_and_reset_progress_bar;
-		}
-
-		update_used_memory();
-
-		/* load registration data for current image */
-		if(reglayer != -1 && args->seq->regparam[reglayer]) {
-			shiftx = args->seq->regparam[reglayer][j].shiftx;
-			shifty = args->seq->regparam[reglayer][j].shifty;
-		} else {
-			shiftx = 0;
-			shifty = 0;
-		}
-#ifdef STACK_DEBUG
-		printf("stack image %d with shift x=%d y=%d\n", j, shiftx, shifty);
-#endif
-
-		/* Summing the exposure */
-		exposure += fit->exposure;
-
-		/* stack current image */
-		i=0;	// index in final_pixel[0]
-		for (y=0; y < fit->ry; ++y){
-			for (x=0; x < fit->rx; ++x){
-				nx = x - shiftx;
-				ny = y - shifty;
-				//printf("x=%d y=%d sx=%d sy=%d i=%d ii=%d\n",x,y,shiftx,shifty,i,ii);
-				if (nx >= 0 && nx < fit->rx && ny >= 0 && ny < fit->ry) {
-					ii = ny * fit->rx + nx;		// index in final_pixel[0] too
-					//printf("shiftx=%d shifty=%d i=%d ii=%d\n",shiftx,shifty,i,ii);
-					if (ii > 0 && ii < fit->rx * fit->ry){
-						for(layer=0; layer<args->seq->nb_layers; ++layer){
-							WORD current_pixel = fit->pdata[layer][ii];
-							if (current_pixel > final_pixel[layer][i])	// we take the brighter pixel
-								final_pixel[layer][i] = current_pixel;
-							if (final_pixel[layer][i] > maxim){
-								maxim = final_pixel[layer][i];
-							}
-						}
-					}
-				}
-				++i;
-			}
-		}
-	}
-	if (!get_thread_run()) {
-		retval = -1;
-		goto free_and_reset_progress_bar;
-	}
-	set_progress_bar_data(_("Finalizing stacking..."), (double)nb_frames/((double)nb_frames+1.));
-
-	copyfits(fit, &gfit, CP_ALLOC|CP_FORMAT, 0);
-	gfit.hi = round_to_WORD(maxim);
-	gfit.bitpix = USHORT_IMG;
-	gfit.exposure = exposure;						// TODO : think if exposure has a sense here
-
-	if (final_pixel[0]) {
-		assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-		for (layer=0; layer<args->seq->nb_layers; ++layer){
-			from = final_pixel[layer];
-			to = gfit.pdata[layer];
-			for (y=0; y < fit->ry * fit->rx; ++y) {
-				*to++ = *from++;
-			}
-		}
-	}
-
-free_and_reset_progress_bar:
-	if (final_pixel[0]) free(final_pixel[0]);
-	if (retval) {
-		set_progress_bar_data(_("Stacking failed. Check the log."), PROGRESS_RESET);
-		siril_log_message(_("Stacking failed.\n"));
-	} else {
-		set_progress_bar_data(_("Stacking complete."), PROGRESS_DONE);
-	}
-	update_used_memory();
-	return retval;
-}
-
-/** Addmax STACK method **
- * This method is very close to the summing one instead that the result
- * takes only the pixel if it is brighter than the previous one at the
- * same coordinates.
- */
-int stack_addmin(struct stacking_args *args) {
-	int x, y, nx, ny, i, ii, j, shiftx, shifty, layer, reglayer;
-	WORD *final_pixel[3], *from;
-	WORD *to, minim = USHRT_MAX;
-	double exposure=0.0;
-	unsigned int nbdata = 0;
-	char filename[256];
-	int retval = 0;
-	int nb_frames, cur_nb = 0;
-	fits *fit = &wfit[0];
-	char *tmpmsg;
-	memset(fit, 0, sizeof(fits));
-
-	/* should be pre-computed to display it in the stacking tab */
-	nb_frames = args->nb_images_to_stack;
-	reglayer = get_registration_layer();
-
-	if (nb_frames <= 1) {
-		siril_log_message(_("No frame selected for stacking (select at least 2). Aborting.\n"));
-		return -1;
-	}
-
-	final_pixel[0] = NULL;
-	assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-	assert(nb_frames <= args->seq->number);
-
-	for (j=0; j<args->seq->number; ++j){
-		if (!get_thread_run()) {
-			retval = -1;
-			goto free_and_reset_progress_bar;
-		}
-		if (!args->filtering_criterion(args->seq, j, args->filtering_parameter)) {
-			fprintf(stdout, "image %d is excluded from stacking\n", j);
-			continue;
-		}
-		if (!seq_get_image_filename(args->seq, j, filename)) {
-			retval = -1;
-			goto free_and_reset_progress_bar;
-		}
-		tmpmsg = strdup(_("Processing image "));
-		tmpmsg = str_append(&tmpmsg, filename);
-		set_progress_bar_data(tmpmsg, (double)cur_nb/((double)nb_frames+1.));
-		free(tmpmsg);
-
-		cur_nb++;	// only used for progress bar
-
-		if (seq_read_frame(args->seq, j, fit)) {
-			siril_log_message(_("Stacking: could not read frame, aborting\n"));
-			retval = -3;
-			goto free_and_reset_progress_bar;
-		}
-
-		assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-		assert(fit->naxes[2] == args->seq->nb_layers);
-
-		/* first loaded image: init data structures for stacking */
-		if (!nbdata) {
-			nbdata = fit->ry * fit->rx;
-			final_pixel[0] = malloc(nbdata * fit->naxes[2] * sizeof(WORD));
-			memset(final_pixel[0], USHRT_MAX, nbdata * fit->naxes[2] * sizeof(WORD));
-			if (final_pixel[0] == NULL){
-				printf("Stacking: memory allocation failure\n");
-				retval = -2;
-				goto free_and_reset_progress_bar;
-			}
-			if(args->seq->nb_layers == 3){
-				final_pixel[1] = final_pixel[0] + nbdata;	// index of green layer in final_pixel[0]
-				final_pixel[2] = final_pixel[0] + nbdata*2;	// index of blue layer in final_pixel[0]
-			}
-		} else if (fit->ry * fit->rx != nbdata) {
-			siril_log_message(_("Stacking: image in sequence doesn't has the same dimensions\n"));
-			retval = -3;
-			goto free_and_reset_progress_bar;
-		}
-
-		update_used_memory();
-
-		/* load registration data for current image */
-		if(reglayer != -1 && args->seq->regparam[reglayer]) {
-			shiftx = args->seq->regparam[reglayer][j].shiftx;
-			shifty = args->seq->regparam[reglayer][j].shifty;
-		} else {
-			shiftx = 0;
-			shifty = 0;
-		}
-#ifdef STACK_DEBUG
-		printf("stack image %d with shift x=%d y=%d\n", j, shiftx, shifty);
-#endif
-
-		/* Summing the exposure */
-		exposure += fit->exposure;
-
-		/* stack current image */
-		i=0;	// index in final_pixel[0]
-		for (y=0; y < fit->ry; ++y){
-			for (x=0; x < fit->rx; ++x){
-				nx = x - shiftx;
-				ny = y - shifty;
-				//printf("x=%d y=%d sx=%d sy=%d i=%d ii=%d\n",x,y,shiftx,shifty,i,ii);
-				if (nx >= 0 && nx < fit->rx && ny >= 0 && ny < fit->ry) {
-					ii = ny * fit->rx + nx;		// index in final_pixel[0] too
-					//printf("shiftx=%d shifty=%d i=%d ii=%d\n",shiftx,shifty,i,ii);
-					if (ii > 0 && ii < fit->rx * fit->ry){
-						for(layer=0; layer<args->seq->nb_layers; ++layer){
-							WORD current_pixel = fit->pdata[layer][ii];
-							if (current_pixel < final_pixel[layer][i])	// we take the darker pixel
-								final_pixel[layer][i] = current_pixel;
-							if (final_pixel[layer][i] < minim){
-								minim = final_pixel[layer][i];
-							}
-						}
-					}
-				}
-				++i;
-			}
-		}
-	}
-	if (!get_thread_run()) {
-		retval = -1;
-		goto free_and_reset_progress_bar;
-	}
-	set_progress_bar_data(_("Finalizing stacking..."), (double)nb_frames/((double)nb_frames+1.));
-
-	copyfits(fit, &gfit, CP_ALLOC|CP_FORMAT, 0);
-	gfit.hi = round_to_WORD(minim);
-	gfit.bitpix = USHORT_IMG;
-	gfit.exposure = exposure;						// TODO : think if exposure has a sense here
-
-	if (final_pixel[0]) {
-		assert(args->seq->nb_layers == 1 || args->seq->nb_layers == 3);
-		for (layer=0; layer<args->seq->nb_layers; ++layer){
-			from = final_pixel[layer];
-			to = gfit.pdata[layer];
-			for (y=0; y < fit->ry * fit->rx; ++y) {
-				*to++ = *from++;
-			}
-		}
+		free(data_pool);
 	}
-
-free_and_reset_progress_bar:
-	if (final_pixel[0]) free(final_pixel[0]);
+	stream_cache_free(cache);
+	scheduler_free(sched);
+	if (blocks) free(blocks);
+	sortnet_free(net);
+	free(coeff.offset);
+	free(coeff.mul);
+	free(coeff.scale);
 	if (retval) {
-		set_progress_bar_data(_("Stacking failed. Check the log."), PROGRESS_RESET);
+		/* if retval is set, gfit has not been modified */
+		if (fit->data) free(fit->data);
+		set_progress_bar_data(_("Median stacking failed. Check the log."), PROGRESS_RESET);
 		siril_log_message(_("Stacking failed.\n"));
 	} else {
-		set_progress_bar_data(_("Stacking complete."), PROGRESS_DONE);
+		set_progress_bar_data(_("Median stacking complete."), PROGRESS_DONE);
+		siril_log_message(_("Median stacking complete. %d have been stacked.\n"), nb_frames);
 	}
 	update_used_memory();
 	return retval;
 }
 
-static int percentile_clipping(WORD pixel, double sig[], double median, uint64_t rej[]) {
-	double plow = sig[0];
-	double phigh = sig[1];
 
-	if ((median - (double)pixel) / median > plow) {
-		rej[0]++;
-		return -1;
-	}
-	else if (((double)pixel - median) / median > phigh) {
-		rej[1]++;
-		return 1;
-	}
-	else return 0;
+/** Addmax STACK method **
+ * This method is very close to the summing one instead that the result
+ * takes only the pixel if it is brighter than the previous one at the
+ * same coordinates.
+ */
+int stack_addmax(struct stacking_args *args) {
+	return stack_addition(args, ADD_MAX);
 }
 
-/* Rejection of pixels, following sigma_(high/low) * sigma.
- * The function returns 0 if no rejections are required, 1 if it's a high
- * rejection and -1 for a low-rejection */
-static int sigma_clipping(WORD pixel, double sig[], double sigma, double median, uint64_t rej[]) {
-	double sigmalow = sig[0];
-	double sigmahigh = sig[1];
-
-	if (median - (double)pixel > sigmalow * sigma) {
-		rej[0]++;
-		return -1;
-	}
-	else if ((double)pixel - median > sigmahigh * sigma) {
-		rej[1]++;
-		return 1;
-	}
-	else return 0;
+/** Addmax STACK method **
+ * This method is very close to the summing one instead that the result
+ * takes only the pixel if it is brighter than the previous one at the
+ * same coordinates.
+ */
+int stack_addmin(struct stacking_args *args) {
+	return stack_addition(args, ADD_MIN);
 }
 
-static int Winsorized(WORD *pixel, double m0, double m1) {
-	if (*pixel < m0) *pixel = round_to_WORD(m0);
-	else if (*pixel > m1) *pixel = round_to_WORD(m1);
-
-	return 0;
+/* Only the sum and the mean with rejection give a float result. Frames are
+ * read in 16 bits by the median and the rejection, the median of such frames
+ * is a 16-bit value as are the maximum and the minimum. */
+gboolean stacking_supports_float(stack_method method) {
+	return method == stack_summing || method == stack_mean_with_rejection;
 }
 
-static int line_clipping(WORD pixel, double sig[], double sigma, int i, double a, double b, uint64_t rej[]) {
-	double sigmalow = sig[0];
-	double sigmahigh = sig[1];
+/* Saves the low and high rejection maps next to the stacking result, their
+ * pixels being the number of rejected frames */
+static void save_rejection_maps(struct stacking_args *args, fits *rejmap[2]) {
+	const char *suffix[2] = { "_low_rejmap", "_high_rejmap" };
+	char *basename;
+	int i;
 
-	if (((a * (double)i + b - (double)pixel) / sigma) > sigmalow) {
-		rej[0]++;
-		return -1;
+	if (!args->output_filename || args->output_filename[0] == '\0') {
+		siril_log_message(_("No output file name, rejection maps are not saved\n"));
+		return;
 	}
-	else if ((((double)pixel - a * (double)i - b) / sigma) > sigmahigh) {
-		rej[1]++;
-		return 1;
+	basename = remove_ext_from_filename(args->output_filename);
+	if (basename[0] == '\0') {
+		free(basename);
+		basename = strdup(args->output_filename);
 	}
-	else return 0;
-}
-
-static void remove_pixel(WORD *arr, int i, int N) {
-	memmove(&arr[i], &arr[i + 1], (N - i - 1) * sizeof(*arr));
+	for (i = 0; i < 2; i++) {
+		char *filename = g_strdup_printf("%s%s%s", basename, suffix[i], com.ext);
+		if (savefits(filename, rejmap[i]))
+			siril_log_message(_("Could not save the rejection map %s\n"), filename);
+		else siril_log_message(_("Rejection map saved in %s\n"), filename);
+		g_free(filename);
+	}
+	free(basename);
 }
 
 int stack_mean_with_rejection(struct stacking_args *args) {
@@ -1193,7 +1344,7 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 	uint64_t irej[3][2] = {{0,0}, {0,0}, {0,0}};
 	int bitpix;
 	int naxis, oldnaxis = -1, cur_nb = 0;
-	long npixels_in_block, nbdata;
+	long npixels_in_block;
 	long naxes[3], oldnaxes[3];
 	int i;
 	double exposure = 0.0;
@@ -1204,9 +1355,14 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 	fits *fit = &wfit[0];
 	norm_coeff coeff;
 	struct image_block *blocks = NULL;
+	struct stream_cache *cache = NULL;
+	gboolean use_cache;
+	struct task_scheduler *sched = NULL;
+	int *shiftx = NULL;
+	fits *rejmap[2] = { NULL, NULL };
 
 	nb_frames = args->nb_images_to_stack;
-	reglayer = get_registration_layer();
+	reglayer = args->reglayer;
 
 	if (args->seq->type != SEQ_REGULAR && args->seq->type != SEQ_SER) {
 		char *msg = siril_log_message(_("Rejection stacking is only supported for FITS images and SER sequences.\nUse \"Sum Stacking\" instead.\n"));
@@ -1220,13 +1376,21 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 
 	assert(nb_frames <= args->seq->number);
 	set_progress_bar_data(NULL, PROGRESS_RESET);
+	use_cache = stream_cache_is_needed(args);
 
 	/* allocate data structures */
 	oldnaxes[0] = oldnaxes[1] = oldnaxes[2] = 0;	// fix compiler warning
 	naxes[0] = naxes[1] = 0; naxes[2] = 1;
 
-	/* first loop: open all fits files and check they are of same size */
-	if (args->seq->type == SEQ_REGULAR) {
+	/* first loop: open all fits files and check they are of same size,
+	 * this is done while building the cache if it is used */
+	if (args->seq->type == SEQ_REGULAR && use_cache) {
+		naxes[0] = args->seq->rx;
+		naxes[1] = args->seq->ry;
+		naxes[2] = args->seq->nb_layers;
+		naxis = naxes[2] == 3 ? 3 : 2;
+	}
+	else if (args->seq->type == SEQ_REGULAR) {
 		for (i=0; i<nb_frames; ++i) {
 			int image_index = args->image_indices[i];	// image index in sequence
 			if (!get_thread_run()) {
@@ -1331,40 +1495,24 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 	}
 	fprintf(stdout, "image size: %ldx%ld, %ld layers\n", naxes[0], naxes[1], naxes[2]);
 
-	/* normalization: reading all images and making stats on their background level.
-	 * That's very long if not cached. */
-	if (compute_normalization(args, &coeff, args->normalize)) {
-		retval = -1;
-		goto free_and_close;
-	}
-	if (args->seq->needs_saving)	// if we had to compute new stats
-		writeseqfile(args->seq);
-
-	/* initialize result image */
-	nbdata = naxes[0] * naxes[1];
+	/* initialize result image, 16-bit or float */
 	memset(fit, 0, sizeof(fits));
-	fit->data = malloc(nbdata * naxes[2] * sizeof(WORD));
-	if (!fit->data) {
+	if (new_fit_image(fit, naxes[0], naxes[1], naxes[2]) ||
+			(args->use_float && convert_fit_to_float(fit))) {
 		fprintf(stderr, "Memory allocation error for result\n");
 		retval = -1;
 		goto free_and_close;
 	}
-	fit->bitpix = USHORT_IMG;
-	fit->naxes[0] = naxes[0];
-	fit->naxes[1] = naxes[1];
-	fit->naxes[2] = naxes[2];
-	fit->rx = naxes[0];
-	fit->ry = naxes[1];
 	fit->naxis = naxis;
-	fit->maxi = 0;
-	if(fit->naxis == 3) {
-		fit->pdata[RLAYER]=fit->data;
-		fit->pdata[GLAYER]=fit->data + nbdata;
-		fit->pdata[BLAYER]=fit->data + nbdata * 2;
-	} else {
-		fit->pdata[RLAYER]=fit->data;
-		fit->pdata[GLAYER]=fit->data;
-		fit->pdata[BLAYER]=fit->data;
+	if (args->create_rejmaps) {
+		for (i = 0; i < 2; i++) {
+			rejmap[i] = calloc(1, sizeof(fits));
+			if (!rejmap[i] || new_fit_image(rejmap[i], naxes[0], naxes[1], naxes[2])) {
+				fprintf(stderr, "Memory allocation error for rejection maps\n");
+				retval = -1;
+				goto free_and_close;
+			}
+		}
 	}
 	update_used_memory();
 
@@ -1374,11 +1522,15 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 	int nb_threads;
 #ifdef _OPENMP
 	nb_threads = com.max_thread;
-	if (args->seq->type == SEQ_REGULAR && fits_is_reentrant()) {
+	if (use_cache) {
+		fprintf(stdout, "frames are read from the stacking cache,"
+				" stacking will be executed by several cores\n");
+	}
+	else if (args->seq->type == SEQ_REGULAR && fits_is_reentrant()) {
 		fprintf(stdout, "cfitsio was compiled with multi-thread support,"
 				" stacking will be executed by several cores\n");
 	}
-	if (args->seq->type == SEQ_REGULAR && !fits_is_reentrant()) {
+	else if (args->seq->type == SEQ_REGULAR && !fits_is_reentrant()) {
 		nb_threads = 1;
 		fprintf(stdout, "cfitsio was compiled without multi-thread support,"
 				" stacking will be executed on only one core\n");
@@ -1394,86 +1546,38 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 		nb_channels = 3;
 	}
 
-	int size_of_stacks = args->max_number_of_rows / nb_threads; 
-	if (size_of_stacks == 0)
-		size_of_stacks = 1;
-	/* Note: this size of stacks based on the max memory configured doesn't take into
-	 * account memory for demosaicing if it applies.
-	 * Now we compute the total number of "stacks" which are the independent areas where
-	 * the stacking will occur. This will then be used to create the image areas. */
-	long nb_parallel_stacks;
-	int remainder;
-	if (naxes[1] / size_of_stacks < 4) {
-		/* We have enough RAM to process each channel with 4 threads.
-		 * We should cut images at least in 4 on one channel to use enough threads,
-		 * and if only one is available, it will use much less RAM for a small time overhead.
-		 * Also, for slow data access like rotating drives or on-the-fly debayer,
-		 * it feels more responsive this way.
-		 */
-		nb_parallel_stacks = 4 * nb_channels;
-		size_of_stacks = naxes[1] / 4;
-		remainder = naxes[1] % 4;
-	} else {
-		/* We don't have enough RAM to process a channel with all available threads */
-		nb_parallel_stacks = naxes[1] * nb_channels / size_of_stacks;
-		if (nb_parallel_stacks % nb_channels != 0
-				|| (naxes[1] * nb_channels) % size_of_stacks != 0) {
-			/* we need to take into account the fact that the stacks are computed for
-			 * each channel, not for the total number of pixels. So it needs to be
-			 * a factor of the number of channels.
-			 */
-			nb_parallel_stacks += nb_channels - (nb_parallel_stacks % nb_channels);
-			size_of_stacks = naxes[1] * nb_channels / nb_parallel_stacks;
-		}
-		remainder = naxes[1] - (nb_parallel_stacks / nb_channels * size_of_stacks);
+	long largest_block_height;
+	long nb_parallel_stacks = compute_parallel_blocks(&blocks, args->max_number_of_rows,
+			naxes, nb_threads, nb_channels, &largest_block_height);
+	if (nb_parallel_stacks < 0) {
+		retval = -1;
+		goto free_and_close;
 	}
-	siril_log_message(_("We have %d parallel blocks of size %d (+%d) for stacking.\n"),
-			nb_parallel_stacks, size_of_stacks, remainder);
-	struct image_block {
-		unsigned long channel, start_row, end_row, height;
-	};
-	long largest_block_height = 0;
-	blocks = malloc(nb_parallel_stacks * sizeof(struct image_block));
-	{
-		long channel = 0, row = 0, end, j = 0;
-		do {
-			if (j >= nb_parallel_stacks) {
-				siril_log_message(_("A bug has been found. "
-						"Unable to split the image area into the correct processing blocks.\n"));
-				retval = -1;
-				goto free_and_close;
-			}
 
-			blocks[j].channel = channel;
-			blocks[j].start_row = row;
-			end = row + size_of_stacks - 1; 
-			if (remainder > 0) {
-				// just add one pixel from the remainder to the first blocks to
-				// avoid having all of them in the last block
-				end++;
-				remainder--;
-			}
-			if (end >= naxes[1] - 1 ||	// end of the line
-					(naxes[1] - end < size_of_stacks / 10)) { // not far from it
-				end = naxes[1] - 1;
-				row = 0;
-				channel++;
-				remainder = naxes[1] - (nb_parallel_stacks / nb_channels * size_of_stacks);
-			} else {
-				row = end + 1;
-			}
-			blocks[j].end_row = end;
-			blocks[j].height = blocks[j].end_row - blocks[j].start_row + 1;
-			if (largest_block_height < blocks[j].height) {
-				largest_block_height = blocks[j].height;
-			}
-			fprintf(stdout, "Block %ld: channel %lu, from %lu to %lu (h = %lu)\n",
-					j, blocks[j].channel, blocks[j].start_row,
-					blocks[j].end_row, blocks[j].height);
-			j++;
-	
-		} while (channel < nb_channels) ;
+	/* normalization: reading all images and making stats on their background level.
+	 * That's very long if not cached. With the stream cache, frames are read
+	 * once and their statistics computed on the way, so it is built first. */
+	if (use_cache) {
+		gboolean force_norm = args->force_norm;
+		if (force_norm && args->normalize)
+			clear_stats_for_normalization(args->seq);
+		cache = stream_cache_build(args, blocks, nb_parallel_stacks, naxes,
+				TRUE, args->normalize != NO_NORM, &exposure);
+		if (!cache) {
+			retval = -1;
+			goto free_and_close;
+		}
+		args->force_norm = FALSE;
+		retval = compute_normalization(args, &coeff, args->normalize);
+		args->force_norm = force_norm;
+	}
+	else retval = compute_normalization(args, &coeff, args->normalize);
+	if (retval) {
+		retval = -1;
+		goto free_and_close;
 	}
+	if (args->seq->needs_saving)	// if we had to compute new stats
+		writeseqfile(args->seq);
 
 	/* Allocate the buffers.
 	 * We allocate as many as the number of threads, each thread will pick one of the buffers.
@@ -1486,14 +1590,15 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 	npixels_in_block = largest_block_height * naxes[0];
 	fprintf(stdout, "allocating data for %d threads (each %'lu MB)\n", pool_size,
 			(unsigned long) (nb_frames * npixels_in_block * sizeof(WORD)) / 1048576UL);
-	data_pool = malloc(pool_size * sizeof(struct _data_block));
+	data_pool = calloc(pool_size, sizeof(struct _data_block));
 	for (i = 0; i < pool_size; i++) {
 		int j;
 		data_pool[i].pix = malloc(nb_frames * sizeof(WORD *));
 		data_pool[i].tmp = malloc(nb_frames * npixels_in_block * sizeof(WORD));
-		data_pool[i].stack = malloc(nb_frames * sizeof(WORD));
-		data_pool[i].rejected = calloc(nb_frames, sizeof(int));
-		if (!data_pool[i].pix || !data_pool[i].tmp || !data_pool[i].stack || !data_pool[i].rejected) {
+		data_pool[i].rows = malloc(nb_frames * sizeof(WORD *));
+		data_pool[i].rejection = rejection_workspace_new(nb_frames);
+		if (!data_pool[i].pix || !data_pool[i].tmp || !data_pool[i].rows ||
+				!data_pool[i].rejection) {
 			fprintf(stderr, "Memory allocation error on pix.\n");
 			fprintf(stderr, "CHANGE MEMORY SETTINGS if stacking takes too much.\n");
 			retval = -1;
@@ -1505,32 +1610,70 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 	}
 	update_used_memory();
 
+	/* the x shift is managed by the rejection engine, the y shift at read
+	 * time, frames registered by a transform are resampled at read time */
+	if (reglayer != -1 && args->seq->regparam[reglayer]) {
+		shiftx = malloc(nb_frames * sizeof(int));
+		if (!shiftx) {
+			fprintf(stderr, "Memory allocation error for shifts\n");
+			retval = -1;
+			goto free_and_close;
+		}
+		for (i = 0; i < nb_frames; i++) {
+			int image_index = args->image_indices[i];
+			shiftx[i] = stacking_get_transform(args, image_index) ? 0 :
+				args->seq->regparam[reglayer][image_index].shiftx;
+		}
+	}
+
+	sched = scheduler_new(nb_parallel_stacks, com.max_thread);
+	if (!sched) {
+		retval = -1;
+		goto free_and_close;
+	}
+
 	siril_log_message(_("Starting stacking...\n"));
 	set_progress_bar_data(_("Rejection stacking in progress..."), PROGRESS_RESET);
 
 #ifdef _OPENMP
-#pragma omp parallel for num_threads(com.max_thread) private(i) schedule(static) if (args->seq->type == SEQ_SER || fits_is_reentrant())
+#pragma omp parallel num_threads(com.max_thread) private(i) if (args->seq->type == SEQ_SER || fits_is_reentrant() || use_cache)
+#endif
+	{
+	/* blocks are distributed by the scheduler, which balances the load
+	 * when reading is slower for some frames or some threads */
+	int thread = 0;
+#ifdef _OPENMP
+	thread = omp_get_thread_num();
 #endif
-	for (i = 0; i < nb_parallel_stacks; i++)
+	while ((i = scheduler_next(sched, thread)) >= 0)
 	{
 		/**** Step 1: get allocated memory for the current thread ****/
 		struct image_block *my_block = blocks+i;
 		struct _data_block *data;
 		int data_idx = 0, frame;
-		long x, y;
+		long y;
 
 		if (!get_thread_run()) retval = -1;
 		if (retval) continue;
-#ifdef _OPENMP
-		data_idx = omp_get_thread_num();
-#endif
+		data_idx = thread;
 		assert(data_idx < pool_size);
 		//fprintf(stdout, "thread %d working on block %d gets data\n", data_idx, i);
 		data = &data_pool[data_idx];
 
 		/**** Step 2: load image data for the corresponding image block ****/
+		if (cache) {
+			/* the block of all frames is contiguous in the cache, rows
+			 * already being shifted with the registration data */
+			if (stream_cache_read_block(cache, i, data->tmp)) {
+				retval = -1;
+				continue;
+			}
+			stream_cache_prefetch_block(cache, scheduler_peek(sched, thread));
+			for (frame = 0; frame < nb_frames; ++frame)
+				data->pix[frame] = data->tmp + frame * naxes[0] * my_block->height;
+		}
 		/* Read the block from all images, store them in pix[image] */
-		for (frame = 0; frame < nb_frames; ++frame){
+		for (frame = 0; frame < nb_frames && !cache; ++frame){
 			int shifty = 0;
 			gboolean clear = FALSE, readdata = TRUE;
 			long offset = 0;
@@ -1540,6 +1683,18 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 			}
 			/* area in C coordinates, starting with 0, not cfitsio coordinates. */
 			rectangle area = {0, my_block->start_row, naxes[0], my_block->height};
+			const double *transform = stacking_get_transform(args, args->image_indices[frame]);
+
+			if (transform) {
+				if (read_transformed_area(args->seq, my_block->channel,
+							args->image_indices[frame], transform,
+							data->pix[frame], &area, naxes[0], naxes[1])) {
+					siril_log_message(_("Error reading one of the image areas\n"));
+					retval = -1;
+					break;
+				}
+				continue;
+			}
 
 			/* Load registration data for current image and modify area.
 			 * Here, only the y shift is managed. If possible, the remaining part
@@ -1578,7 +1733,7 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 				int success = seq_opened_read_region(args->seq, my_block->channel,
 						args->image_indices[frame], data->pix[frame]+offset, &area);
 
-				if (success < 0)
+				if (success)
 					retval = -1;
 
 				if (retval) {
@@ -1589,7 +1744,15 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 		}
 		if (retval) continue;
 
-		/**** Step 3: iterate over the y and x of the image block and stack ****/
+		/* normalization is applied to the whole block once, pixels coming
+		 * from outside the images with the x shift stay black */
+		for (frame = 0; frame < nb_frames; ++frame) {
+			normalize_block(data->pix[frame], naxes[0] * my_block->height,
+					args->normalize, coeff.scale[frame],
+					coeff.offset[frame], coeff.mul[frame]);
+		}
+
+		/**** Step 3: iterate over the y of the image block and stack ****/
 		for (y = 0; y < my_block->height; y++)
 		{
 			/* index of the pixel in the result image
@@ -1612,185 +1775,17 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 			}
 			set_progress_bar_data(NULL, (double)cur_nb/total);
 
-			double sigma = -1.0;
 			uint64_t crej[2] = {0, 0};
-	
-			for (x = 0; x < naxes[0]; ++x){
-				/* copy all images pixel values in the same row array `stack'
-				 * to optimize caching and improve readability */
-				for (frame = 0; frame < nb_frames; ++frame) {
-					int shiftx = 0;
-					if (reglayer != -1 && args->seq->regparam[reglayer]) {
-						shiftx = args->seq->regparam[reglayer][args->image_indices[frame]].shiftx;
-					}
-					if (shiftx && (x - shiftx >= naxes[0] || x - shiftx < 0)) {
-						/* outside bounds, images are black. We could
-						 * also set the background value instead, if available */
-						data->stack[frame] = 0;
-					}
-					else {
-						double tmp;
-						switch (args->normalize) {
-						default:
-						case NO_NORM:		// no normalization (scale[frame] = 1, offset[frame] = 0, mul[frame] = 1)
-							data->stack[frame] = data->pix[frame][pix_idx+x-shiftx];
-							/* it's faster if we don't convert it to double
-							 * to make identity operations */
-							break;
-						case ADDITIVE:		// additive (scale[frame] = 1, mul[frame] = 1)
-						case ADDITIVE_SCALING:		// additive + scale (mul[frame] = 1)
-							tmp = (double)data->pix[frame][pix_idx+x-shiftx] * coeff.scale[frame];
-							data->stack[frame] = round_to_WORD(tmp - coeff.offset[frame]);
-							break;
-						case MULTIPLICATIVE:		// multiplicative  (scale[frame] = 1, offset[frame] = 0)
-						case MULTIPLICATIVE_SCALING:		// multiplicative + scale (offset[frame] = 0)
-							tmp = (double)data->pix[frame][pix_idx+x-shiftx] * coeff.scale[frame];
-							data->stack[frame] = round_to_WORD(tmp * coeff.mul[frame]);
-							break;
-						}
-					}
-				}
-
-				int N = nb_frames;// N is the number of pixels kept from the current stack
-				double median;
-				int n, j, r = 0;
-				switch (args->type_of_rejection) {
-				case PERCENTILE:
-					quicksort_s(data->stack, N);
-					median = gsl_stats_ushort_median_from_sorted_data(data->stack, 1, N);
-					for (frame = 0; frame < N; frame++) {
-						data->rejected[frame] =	percentile_clipping(data->stack[frame], args->sig, median, crej);
-					}
-					for (frame = 0, j = 0; frame < N; frame++, j++) {
-						if (data->rejected[j] != 0 && N > 1) {
-							remove_pixel(data->stack, frame, N);
-							frame--;
-							N--;
-						}
-					}
-					break;
-				case SIGMA:
-					do {
-						sigma = gsl_stats_ushort_sd(data->stack, 1, N);
-						quicksort_s(data->stack, N);
-						median = gsl_stats_ushort_median_from_sorted_data(data->stack, 1, N);
-						n = 0;
-						for (frame = 0; frame < N; frame++) {
-							data->rejected[frame] =	sigma_clipping(data->stack[frame], args->sig, sigma, median, crej);
-							if (data->rejected[frame])
-								r++;
-							if (N - r <= 4) break;
-						}
-						for (frame = 0, j = 0; frame < N - n; frame++, j++) {
-							if (data->rejected[j] != 0) {
-								remove_pixel(data->stack, frame, N - n);
-								n++;
-								frame--;
-							}
-						}
-						N = N - n;
-					} while (n > 0 && N > 3);
-					break;
-				case SIGMEDIAN:
-					do {
-						sigma = gsl_stats_ushort_sd(data->stack, 1, N);
-						quicksort_s(data->stack, N);
-						median = gsl_stats_ushort_median_from_sorted_data(data->stack, 1, N);
-						n = 0;
-						for (frame = 0; frame < N; frame++) {
-							if (sigma_clipping(data->stack[frame], args->sig, sigma, median, crej)) {
-								data->stack[frame] = round_to_WORD(median);
-								n++;
-							}
-						}
-					} while (n > 0 && N > 3);
-					break;
-				case WINSORIZED:
-					do {
-						double sigma0;
-						sigma = gsl_stats_ushort_sd(data->stack, 1, N);
-						quicksort_s(data->stack, N);
-						median = gsl_stats_ushort_median_from_sorted_data(data->stack, 1, N);
-						WORD *w_stack = malloc(N * sizeof(WORD));
-						memcpy(w_stack, data->stack, N * sizeof(WORD));
-						do {
-							int jj;
-							double m0 = median - 1.5 * sigma;
-							double m1 = median + 1.5 * sigma;
-							for (jj = 0; jj < N; jj++)
-								Winsorized(&w_stack[jj], m0, m1);
-							quicksort_s(w_stack, N);
-							median = gsl_stats_ushort_median_from_sorted_data(w_stack, 1, N);
-							sigma0 = sigma;
-							sigma = 1.134 * gsl_stats_ushort_sd(w_stack, 1, N);
-						} while ((fabs(sigma - sigma0) / sigma0) > 0.0005);
-						free(w_stack);
-						n = 0;
-						for (frame = 0; frame < N; frame++) {
-							data->rejected[frame] = sigma_clipping(
-									data->stack[frame], args->sig, sigma,
-									median, crej);
-							if (data->rejected[frame] != 0)
-								r++;
-							if (N - r <= 4) break;
-
-						}
-						for (frame = 0, j = 0; frame < N - n; frame++, j++) {
-							if (data->rejected[j] != 0) {
-								remove_pixel(data->stack, frame, N - n);
-								frame--;
-								n++;
-							}
-						}
-						N = N - n;
-					} while (n > 0 && N > 3);
-					break;
-				case LINEARFIT:
-					do {
-						double *xf = malloc(N * sizeof(double));
-						double *yf = malloc(N * sizeof(double));
-						double a, b, cov00, cov01, cov11, sumsq;
-						quicksort_s(data->stack, N);
-						for (frame = 0; frame < N; frame++) {
-							xf[frame] = (double) frame;
-							yf[frame] = (double) data->stack[frame];
-						}
-						gsl_fit_linear(xf, 1, yf, 1, N, &b, &a, &cov00, &cov01, &cov11, &sumsq);
-						sigma = 0.0;
-						for (frame=0; frame < N; frame++)
-							sigma += (fabs((double)data->stack[frame] - (a*(double)frame + b)));
-						sigma /= (double)N;
-						n = 0;
-						for (frame = 0; frame < N; frame++) {
-							data->rejected[frame] =
-									line_clipping(data->stack[frame], args->sig, sigma, frame, a, b, crej);
-							if (data->rejected[frame] != 0)
-								r++;
-							if (N - r <= 4) break;
-						}
-						for (frame = 0, j = 0; frame < N - n; frame++, j++) {
-							if (data->rejected[j] != 0) {
-								remove_pixel(data->stack, frame, N - n);
-								frame--;
-								n++;
-							}
-						}
-						N = N - n;
-						free(xf);
-						free(yf);
-					} while (n > 0 && N > 3);
-					break;
-				default:
-				case NO_REJEC:
-					;		// Nothing to do, no rejection
-				}
-
-				double sum = 0.0;
-				for (frame = 0; frame < N; ++frame) {
-					sum += data->stack[frame];
-				}
-				fit->pdata[my_block->channel][pdata_idx++] = round_to_WORD(sum/(double)N);
-			} // end of for x
+			for (frame = 0; frame < nb_frames; ++frame)
+				data->rows[frame] = data->pix[frame] + pix_idx;
+
+			rejection_row(data->rejection, args->type_of_rejection, args->sig,
+					data->rows, shiftx, naxes[0],
+					args->use_float ? fit->fpdata[my_block->channel] + pdata_idx : NULL,
+					args->use_float ? NULL : fit->pdata[my_block->channel] + pdata_idx,
+					rejmap[0] ? rejmap[0]->pdata[my_block->channel] + pdata_idx : NULL,
+					rejmap[1] ? rejmap[1]->pdata[my_block->channel] + pdata_idx : NULL,
+					crej);
 #ifdef _OPENMP
 #pragma omp critical
 #endif
@@ -1801,6 +1796,8 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 
 		} // end of for y
 	} /* end of loop over parallel stacks */
+	}
+	scheduler_log_stats(sched, _("Stacking"));
 
 	if (retval)
 		goto free_and_close;
@@ -1814,15 +1811,24 @@ int stack_mean_with_rejection(struct stacking_args *args) {
 				irej[channel][1] / (nb_tot) * 100.0);
 	}
 
+	if (rejmap[0])
+		save_rejection_maps(args, rejmap);
+
 	/* copy result to gfit if success */
 	copyfits(fit, &gfit, CP_FORMAT, 0);
 	if (gfit.data) free(gfit.data);
+	if (gfit.fdata) free(gfit.fdata);
+	gfit.type = fit->type;
 	gfit.data = fit->data;
+	gfit.fdata = fit->fdata;
 	gfit.exposure = exposure;
 	memcpy(gfit.pdata, fit->pdata, 3*sizeof(WORD *));
+	memcpy(gfit.fpdata, fit->fpdata, 3*sizeof(float *));
 
 	fit->data = NULL;
+	fit->fdata = NULL;
 	memset(fit->pdata, 0, 3*sizeof(WORD *));
+	memset(fit->fpdata, 0, 3*sizeof(float *));
 
 free_and_close:
 	fprintf(stdout, "free and close (%d)\n", retval);
@@ -1832,20 +1838,30 @@ free_and_close:
 
 	if (data_pool) {
 		for (i=0; i<pool_size; i++) {
-			if (data_pool[i].stack) free(data_pool[i].stack);
 			if (data_pool[i].pix) free(data_pool[i].pix);
 			if (data_pool[i].tmp) free(data_pool[i].tmp);
-			if (data_pool[i].rejected) free(data_pool[i].rejected);
+			if (data_pool[i].rows) free(data_pool[i].rows);
+			rejection_workspace_free(data_pool[i].rejection);
 		}
 		free(data_pool);
 	}
+	stream_cache_free(cache);
+	scheduler_free(sched);
 	if (blocks) free(blocks);
+	if (shiftx) free(shiftx);
+	for (i = 0; i < 2; i++) {
+		if (rejmap[i]) {
+			clearfits(rejmap[i]);
+			free(rejmap[i]);
+		}
+	}
 	free(coeff.offset);
 	free(coeff.mul);
 	free(coeff.scale);
 	if (retval) {
 		/* if retval is set, gfit has not been modified */
 		if (fit->data) free(fit->data);
+		if (fit->fdata) free(fit->fdata);
 		set_progress_bar_data(_("Rejection stacking failed. Check the log."), PROGRESS_RESET);
 		siril_log_message(_("Stacking failed.\n"));
 	} else {
@@ -1860,10 +1876,97 @@ free_and_close:
 gpointer stack_function_handler(gpointer p) {
 	struct stacking_args *args = (struct stacking_args *)p;
 	args->retval = args->method(p);
+	image_pool_flush();
 	gdk_threads_add_idle(end_stacking, args);
 	return GINT_TO_POINTER(args->retval);	// not used anyway
 }
 
+/* sets the number of rows of the images that are loaded at the same time,
+ * from the memory limit of the configuration */
+static void set_max_number_of_rows(struct stacking_args *args) {
+	int max_memory;		// maximum memory to use in MB
+
+	max_memory = (int) (com.stack.memory_percent
+			* (double) get_available_memory_in_MB());
+	siril_log_message(_("Using %d MB memory maximum for stacking\n"), max_memory);
+	uint64_t number_of_rows = (uint64_t)max_memory * 1048576L /
+		((uint64_t)args->seq->rx * args->nb_images_to_stack * sizeof(WORD) * com.max_thread);
+	// this is how many rows we can load in parallel from all images of the
+	// sequence and be under the limit defined in config in megabytes.
+	// We want to avoid having blocks larger than the half or they will decrease parallelism
+	if (number_of_rows > args->seq->ry)
+		args->max_number_of_rows = args->seq->ry;
+	else if (number_of_rows * 2 > args->seq->ry)
+		args->max_number_of_rows = args->seq->ry / 2;
+	else args->max_number_of_rows = number_of_rows;
+}
+
+/* the layer that has registration data, the green one if several have, or
+ * -1. Used when no registration layer is selected in the interface. */
+int get_default_reglayer(sequence *seq) {
+	int layer;
+	if (!seq->regparam)
+		return -1;
+	if (seq->nb_layers == 3 && seq->regparam[GLAYER])
+		return GLAYER;
+	for (layer = 0; layer < seq->nb_layers; layer++)
+		if (seq->regparam[layer])
+			return layer;
+	return -1;
+}
+
+/* Stacking started from a command, on a sequence that is not displayed. The
+ * included images of args->seq are stacked, the result is saved in
+ * args->output_filename from the processing thread, then the sequence, the
+ * file name and args are freed. */
+gpointer stack_sequence_worker(gpointer p) {
+	struct stacking_args *args = (struct stacking_args *) p;
+	struct timeval t_end;
+	int i, retval;
+
+	args->filtering_criterion = stack_filter_included;
+	args->nb_images_to_stack = 0;
+	for (i = 0; i < args->seq->number; i++)
+		if (args->filtering_criterion(args->seq, i, args->filtering_parameter))
+			args->nb_images_to_stack++;
+	args->image_indices = malloc(args->nb_images_to_stack * sizeof(int));
+	if (!args->image_indices) {
+		siril_log_message(_("Out of memory - aborting\n"));
+		retval = 1;
+		goto the_end;
+	}
+	fill_list_of_unfiltered_images(args);
+	args->reglayer = get_default_reglayer(args->seq);
+	set_max_number_of_rows(args);
+
+	siril_log_color_message(_("Stacking: processing...\n"), "red");
+	gettimeofday(&args->t_start, NULL);
+	retval = args->method(args);
+	image_pool_flush();
+	if (!retval) {
+		if (args->output_overwrite)
+			unlink(args->output_filename);
+		if (savefits(args->output_filename, &gfit)) {
+			siril_log_message(_("Could not save the stacking result %s\n"),
+					args->output_filename);
+			retval = 1;
+		}
+		else siril_log_message(_("Stacking result saved in %s\n"), args->output_filename);
+		convert_fit_to_ushort(&gfit);
+		gettimeofday(&t_end, NULL);
+		show_time(args->t_start, t_end);
+	}
+
+the_end:
+	free_sequence(args->seq, TRUE);
+	if (args->image_indices)
+		free(args->image_indices);
+	g_free((gchar *) args->output_filename);
+	free(args);
+	gdk_threads_add_idle(end_generic, NULL);
+	return GINT_TO_POINTER(retval);
+}
+
 /* starts a summing operation using data stored in the stackparam structure
  * function is not reentrant but can be called again after it has returned and the thread is running */
 void start_stacking() {
@@ -1871,7 +1974,6 @@ void start_stacking() {
 	static GtkEntry *output_file = NULL;
 	static GtkToggleButton *overwrite = NULL, *force_norm = NULL;
 	static GtkSpinButton *sigSpin[2] = {NULL, NULL};
-	int max_memory;		// maximum memory to use in MB
 
 	if (method_combo == NULL) {
 		method_combo = GTK_COMBO_BOX(gtk_builder_get_object(builder, "comboboxstack_methods"));
@@ -1894,23 +1996,16 @@ void start_stacking() {
 	stackparam.type_of_rejection = gtk_combo_box_get_active(rejec_combo);
 	stackparam.normalize = gtk_combo_box_get_active(norm_combo);
 	stackparam.force_norm = gtk_toggle_button_get_active(force_norm);
+	stackparam.streaming = com.stack.streaming;
+	stackparam.create_rejmaps = com.stack.rejmaps;
 
 	stackparam.method =
 			stacking_methods[gtk_combo_box_get_active(method_combo)];
 	stackparam.seq = &com.seq;
-	max_memory = (int) (com.stack.memory_percent
-			* (double) get_available_memory_in_MB());
-	siril_log_message(_("Using %d MB memory maximum for stacking\n"), max_memory);
-	uint64_t number_of_rows = (uint64_t)max_memory * 1048576L /
-		((uint64_t)com.seq.rx * stackparam.nb_images_to_stack * sizeof(WORD) * com.max_thread);
-	// this is how many rows we can load in parallel from all images of the
-	// sequence and be under the limit defined in config in megabytes.
-	// We want to avoid having blocks larger than the half or they will decrease parallelism
-	if (number_of_rows > com.seq.ry)
-		stackparam.max_number_of_rows = com.seq.ry;
-	else if (number_of_rows * 2 > com.seq.ry)
-		stackparam.max_number_of_rows = com.seq.ry / 2;
-	else stackparam.max_number_of_rows = number_of_rows;
+	stackparam.reglayer = get_registration_layer();
+	stackparam.use_float = com.float_pipeline &&
+		stacking_supports_float(stackparam.method);
+	set_max_number_of_rows(&stackparam);
 
 	siril_log_color_message(_("Stacking: processing...\n"), "red");
 	gettimeofday(&stackparam.t_start, NULL);
@@ -2043,12 +2138,6 @@ static gboolean end_stacking(gpointer p) {
 		com.uniq->layers = calloc(com.uniq->nb_layers, sizeof(layer_info));
 		com.uniq->fit = &gfit;
 		com.uniq->fit->maxi = 0;	// force to recompute min/max
-		/* Giving summary if average rejection stacking */
-		_show_summary(args);
-		/* Giving noise estimation */
-		_show_bgnoise(com.uniq->fit);
-		stop_processing_thread();
-
 		/* save result */
 		if (args->output_filename != NULL && args->output_filename[0] != '\0') {
 			struct stat st;
@@ -2072,6 +2161,14 @@ static gboolean end_stacking(gpointer p) {
 			}
 			display_filename();
 		}
+		/* saved in float, the result is displayed in 16 bits */
+		convert_fit_to_ushort(&gfit);
+		/* Giving summary if average rejection stacking */
+		_show_summary(args);
+		/* Giving noise estimation */
+		_show_bgnoise(com.uniq->fit);
+		stop_processing_thread();
+
 		initialize_display_mode();
 
 		adjust_cutoff_from_updated_gfit();
@@ -2229,7 +2326,7 @@ void fill_list_of_unfiltered_images(struct stacking_args *args) {
 	int i, j;
 	for (i=0, j=0; i<args->seq->number; i++) {
 		if (args->filtering_criterion(
-					&com.seq, i,
+					args->seq, i,
 					args->filtering_parameter)) {
 			args->image_indices[j] = i;
 			j++;
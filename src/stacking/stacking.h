@@ -10,6 +10,10 @@ typedef int (*stack_method)(struct stacking_args *args);
 typedef struct normalization_coeff norm_coeff;
 
 
+/* interpolation of the frames registered by a transform, see
+ * register_star_alignment() */
+#define STACK_INTERPOLATION OPENCV_LANCZOS4
+
 /* TYPE OF SIGMA CLIPPING */
 typedef enum {
 	NO_REJEC,
@@ -53,6 +57,15 @@ struct stacking_args {
 	rejection type_of_rejection;		/* Type of rejection */
 	normalization normalize;		/* Normalization */
 	gboolean force_norm;		/* TRUE = force normalization */
+	gboolean streaming;		/* TRUE = read frames once, through a stream cache */
+	gboolean create_rejmaps;	/* TRUE = save low and high rejection maps */
+	int reglayer;		/* layer of the registration data to use, -1 for none */
+	gboolean use_float;	/* TRUE = the result is a 32-bit float image, see stacking_supports_float() */
+};
+
+/* rows of a channel of the images, stacked independently of the other blocks */
+struct image_block {
+	unsigned long channel, start_row, end_row, height;
 };
 
 void initialize_stacking_methods();
@@ -66,8 +79,12 @@ int stack_median(struct stacking_args *args);
 int stack_mean_with_rejection(struct stacking_args *args);
 int stack_addmax(struct stacking_args *args);
 int stack_addmin(struct stacking_args *args);
+gboolean stacking_supports_float(stack_method method);
 
 void start_stacking();
+gpointer stack_sequence_worker(gpointer p);
+int get_default_reglayer(sequence *seq);
+const double *stacking_get_transform(struct stacking_args *args, int image_index);
 void update_stack_interface();
 
 int stack_filter_all(sequence *seq, int nb_img, double any);
@@ -0,0 +1,367 @@
+/*
+ * This file is part of Siril, an astronomy image processor.
+ * Copyright (C) 2005-2011 Francois Meyer (dulle at free.fr)
+ * Copyright (C) 2012-2017 team free-astro (see more in AUTHORS file)
+ * Reference site is https://free-astro.org/index.php/Siril
+ *
+ * Siril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Siril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Siril. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Streaming stacking: instead of keeping one opened file per frame and reading
+ * a region of each of them for every stacking block, which needs a reentrant
+ * cfitsio and as many file descriptors as frames, the sequence is read once,
+ * frame after frame, and written transposed in a temporary file. Each block of
+ * rows used by the stacking methods is then a contiguous area of this file. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+#include "core/siril.h"
+#include "core/proto.h"
+#include "core/processing.h"
+#include "gui/callbacks.h"
+#include "io/sequence.h"
+#include "registration/registration.h"
+#include "registration/warp.h"
+#include "stacking/stacking.h"
+#include "stacking/stream_cache.h"
+
+/* file descriptors kept available for other uses when opening all frames */
+#define STREAM_CACHE_FD_MARGIN 32
+
+/* Returns TRUE if the stacking of args should use the stream cache: if it has
+ * been requested, or if opening all frames at the same time would exceed the
+ * limit of file descriptors or would force the stacking on one thread. */
+gboolean stream_cache_is_needed(struct stacking_args *args) {
+	sequence *seq = args->seq;
+#ifndef WIN32
+	struct rlimit rlim;
+#endif
+
+	if (seq->type != SEQ_REGULAR && seq->type != SEQ_SER)
+		return FALSE;
+	/* the geometry of FITS sequences is required before reading frames */
+	if (seq->type == SEQ_REGULAR && (seq->rx == 0 || seq->ry == 0 || seq->nb_layers < 1))
+		return FALSE;
+	if (args->streaming)
+		return TRUE;
+	if (seq->type != SEQ_REGULAR)
+		return FALSE;
+#ifdef _OPENMP
+	if (!fits_is_reentrant() && com.max_thread > 1)
+		return TRUE;
+#endif
+#ifndef WIN32
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur != RLIM_INFINITY &&
+			(rlim_t)args->nb_images_to_stack + STREAM_CACHE_FD_MARGIN > rlim.rlim_cur)
+		return TRUE;
+#endif
+	return FALSE;
+}
+
+/* bounded ring of frames read in advance by a reader thread */
+struct read_ahead {
+	struct stacking_args *args;
+	fits frames[STREAM_CACHE_READ_AHEAD];
+	int status[STREAM_CACHE_READ_AHEAD];	// return value of the read
+	int nb_read;		// number of frames read by the reader thread
+	int nb_consumed;	// number of frames consumed by the cache builder
+	gboolean stop;		// set by the builder to abort the reader
+	GMutex mutex;
+	GCond cond;
+};
+
+static gpointer read_ahead_worker(gpointer p) {
+	struct read_ahead *ra = (struct read_ahead *)p;
+	int i;
+
+	for (i = 0; i < ra->args->nb_images_to_stack; i++) {
+		int slot = i % STREAM_CACHE_READ_AHEAD, status;
+
+		g_mutex_lock(&ra->mutex);
+		while (!ra->stop && i - ra->nb_consumed >= STREAM_CACHE_READ_AHEAD)
+			g_cond_wait(&ra->cond, &ra->mutex);
+		g_mutex_unlock(&ra->mutex);
+		if (ra->stop)
+			break;
+
+		/* the slot is not accessed by the builder until nb_read changes */
+		memset(&ra->frames[slot], 0, sizeof(fits));
+		status = seq_read_frame(ra->args->seq, ra->args->image_indices[i],
+				&ra->frames[slot]);
+
+		g_mutex_lock(&ra->mutex);
+		ra->status[slot] = status;
+		ra->nb_read++;
+		g_cond_broadcast(&ra->cond);
+		g_mutex_unlock(&ra->mutex);
+		if (status)
+			break;
+	}
+	return NULL;
+}
+
+/* writes the rows of the frame at position frame_pos in the cache, for each
+ * block. apply_shifty moves the rows following the registration data, rows
+ * coming from outside the image are black. */
+static int write_frame_blocks(struct stream_cache *cache, fits *fit,
+		int frame_pos, int shifty, WORD *band) {
+	int b;
+	long y;
+
+	for (b = 0; b < cache->nb_blocks; b++) {
+		const struct image_block *block = &cache->blocks[b];
+		size_t band_size = block->height * cache->width * sizeof(WORD);
+		off_t offset = cache->block_offset[b] + (off_t)frame_pos * band_size;
+		char *ptr = (char *)band;
+		size_t remaining = band_size;
+
+		if (block->channel >= fit->naxes[2]) {
+			siril_log_message(_("Stacking cache: a frame has less channels than the sequence\n"));
+			return 1;
+		}
+		/* stacking rows are top-down, data in fits is stored bottom-up */
+		for (y = 0; y < block->height; y++) {
+			long row = (long)block->start_row + y + shifty;
+			if (row < 0 || row >= fit->ry)
+				memset(band + y * cache->width, 0, cache->width * sizeof(WORD));
+			else memcpy(band + y * cache->width,
+					fit->pdata[block->channel] + (fit->ry - row - 1) * fit->rx,
+					cache->width * sizeof(WORD));
+		}
+
+		while (remaining > 0) {
+			ssize_t written = pwrite(cache->fd, ptr, remaining, offset);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				siril_log_message(_("Stacking cache: could not write to %s (%s)\n"),
+						cache->filename, strerror(errno));
+				return 1;
+			}
+			ptr += written;
+			offset += written;
+			remaining -= written;
+		}
+	}
+	return 0;
+}
+
+static struct stream_cache *stream_cache_new(int nb_frames, long width,
+		const struct image_block *blocks, int nb_blocks) {
+	struct stream_cache *cache;
+	const gchar *dir;
+	off_t offset = 0;
+	int b;
+
+	cache = calloc(1, sizeof(struct stream_cache));
+	if (!cache)
+		return NULL;
+	cache->fd = -1;
+	cache->nb_frames = nb_frames;
+	cache->width = width;
+	cache->blocks = blocks;
+	cache->nb_blocks = nb_blocks;
+	cache->block_offset = malloc(nb_blocks * sizeof(off_t));
+	if (!cache->block_offset) {
+		free(cache);
+		return NULL;
+	}
+	for (b = 0; b < nb_blocks; b++) {
+		cache->block_offset[b] = offset;
+		offset += (off_t)nb_frames * blocks[b].height * width * sizeof(WORD);
+	}
+
+	dir = com.swap_dir ? com.swap_dir : g_get_tmp_dir();
+	cache->filename = g_build_filename(dir, "siril_stack_XXXXXX", NULL);
+	cache->fd = g_mkstemp(cache->filename);
+	if (cache->fd < 0) {
+		siril_log_message(_("Stacking cache: could not create a temporary file in %s (%s)\n"),
+				dir, strerror(errno));
+		stream_cache_free(cache);
+		return NULL;
+	}
+#ifndef WIN32
+	/* the file is removed from the directory now so that it does not
+	 * survive a crash, the space is reclaimed when it's closed */
+	unlink(cache->filename);
+#endif
+	return cache;
+}
+
+/* Builds the cache for the images to stack in args, for the given blocks.
+ * Frames registered by a transform are always resampled, apply_shifty moves
+ * the rows of the others following their shift. Statistics used by the normalization are computed on the way if
+ * compute_stats is set, so that normalization does not read the frames again,
+ * and the exposure of frames is summed in exposure. */
+struct stream_cache *stream_cache_build(struct stacking_args *args,
+		const struct image_block *blocks, int nb_blocks, long naxes[3],
+		gboolean apply_shifty, gboolean compute_stats, double *exposure) {
+	struct stream_cache *cache;
+	struct read_ahead ra;
+	GThread *reader;
+	WORD *band;
+	long largest_height = 0;
+	int i, b, reglayer, retval = 0;
+	char msg[256];
+
+	for (b = 0; b < nb_blocks; b++)
+		if (blocks[b].height > largest_height)
+			largest_height = blocks[b].height;
+	band = malloc(largest_height * naxes[0] * sizeof(WORD));
+	if (!band)
+		return NULL;
+	cache = stream_cache_new(args->nb_images_to_stack, naxes[0], blocks, nb_blocks);
+	if (!cache) {
+		free(band);
+		return NULL;
+	}
+	siril_log_message(_("Stacking cache: transposing the sequence in %s\n"),
+			com.swap_dir ? com.swap_dir : g_get_tmp_dir());
+	reglayer = args->reglayer;
+
+	memset(&ra, 0, sizeof(struct read_ahead));
+	ra.args = args;
+	g_mutex_init(&ra.mutex);
+	g_cond_init(&ra.cond);
+	reader = g_thread_new("stack read-ahead", read_ahead_worker, &ra);
+
+	for (i = 0; i < args->nb_images_to_stack && !retval; i++) {
+		int slot = i % STREAM_CACHE_READ_AHEAD, shifty = 0;
+		int image_index = args->image_indices[i];
+		const double *transform;
+		fits *fit = &ra.frames[slot];
+
+		g_mutex_lock(&ra.mutex);
+		while (ra.nb_read <= i)
+			g_cond_wait(&ra.cond, &ra.mutex);
+		g_mutex_unlock(&ra.mutex);
+
+		if (ra.status[slot]) {
+			siril_log_message(_("Stacking cache: could not read frame %d\n"), image_index);
+			retval = 1;
+		} else if (!get_thread_run()) {
+			retval = 1;
+		} else if (fit->rx != naxes[0] || fit->ry != naxes[1]) {
+			siril_log_message(_("Stacking cache: input images have different sizes\n"));
+			retval = 1;
+		}
+
+		if (!retval) {
+			snprintf(msg, 255, _("Stacking cache: transposing image %d"), image_index);
+			msg[255] = '\0';
+			set_progress_bar_data(msg, (double)i / (double)args->nb_images_to_stack);
+
+			if (compute_stats && !seq_get_imstats(args->seq, image_index, fit, STATS_EXTRA))
+				retval = 1;
+			transform = stacking_get_transform(args, image_index);
+			if (transform) {
+				/* resampled in the frame of the reference image, after
+				 * the statistics of the frame were computed */
+				if (!retval && warp_image(fit, transform, STACK_INTERPOLATION)) {
+					siril_log_message(_("Stacking cache: could not transform frame %d\n"), image_index);
+					retval = 1;
+				}
+			} else if (apply_shifty && reglayer != -1 && args->seq->regparam[reglayer])
+				shifty = args->seq->regparam[reglayer][image_index].shifty;
+			if (!retval)
+				retval = write_frame_blocks(cache, fit, i, shifty, band);
+			*exposure += fit->exposure;
+		}
+		clearfits(fit);
+
+		g_mutex_lock(&ra.mutex);
+		ra.nb_consumed++;
+		if (retval)
+			ra.stop = TRUE;
+		g_cond_broadcast(&ra.cond);
+		g_mutex_unlock(&ra.mutex);
+	}
+
+	g_thread_join(reader);
+	/* frames read ahead and not consumed after an error */
+	for (; i < ra.nb_read; i++)
+		clearfits(&ra.frames[i % STREAM_CACHE_READ_AHEAD]);
+	g_mutex_clear(&ra.mutex);
+	g_cond_clear(&ra.cond);
+	free(band);
+
+	if (retval) {
+		stream_cache_free(cache);
+		return NULL;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(cache->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	set_progress_bar_data(NULL, PROGRESS_DONE);
+	return cache;
+}
+
+/* reads a block for all frames in buffer, which must have room for
+ * nb_frames * height * width pixels. Data of frame i starts at
+ * buffer + i * height * width. Can be called from several threads. */
+int stream_cache_read_block(struct stream_cache *cache, int block, WORD *buffer) {
+	size_t remaining = (size_t)cache->nb_frames * cache->blocks[block].height *
+		cache->width * sizeof(WORD);
+	off_t offset = cache->block_offset[block];
+	char *ptr = (char *)buffer;
+
+	while (remaining > 0) {
+		ssize_t nb = pread(cache->fd, ptr, remaining, offset);
+		if (nb < 0 && errno == EINTR)
+			continue;
+		if (nb <= 0) {
+			siril_log_message(_("Stacking cache: could not read from %s\n"),
+					cache->filename);
+			return 1;
+		}
+		ptr += nb;
+		offset += nb;
+		remaining -= nb;
+	}
+	return 0;
+}
+
+/* hints the system that a block will be read soon, so that it's read from the
+ * disk while the current block is stacked. Memory used is bounded by the size
+ * of one block and managed by the system cache. */
+void stream_cache_prefetch_block(struct stream_cache *cache, int block) {
+	if (block < 0 || block >= cache->nb_blocks)
+		return;
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(cache->fd, cache->block_offset[block],
+			(off_t)cache->nb_frames * cache->blocks[block].height *
+			cache->width * sizeof(WORD), POSIX_FADV_WILLNEED);
+#endif
+}
+
+void stream_cache_free(struct stream_cache *cache) {
+	if (!cache) return;
+	if (cache->fd >= 0) {
+		close(cache->fd);
+#ifdef WIN32
+		g_unlink(cache->filename);
+#endif
+	}
+	if (cache->filename) g_free(cache->filename);
+	if (cache->block_offset) free(cache->block_offset);
+	free(cache);
+}
@@ -0,0 +1,33 @@
+#ifndef STREAM_CACHE_H_
+#define STREAM_CACHE_H_
+
+#include <sys/types.h>
+#include "stacking/stacking.h"
+
+/* number of frames read in advance while the cache is being built */
+#define STREAM_CACHE_READ_AHEAD 2
+
+/* Temporary file containing all the frames to stack, transposed so that the
+ * data of one stacking block for all frames is contiguous: for each block,
+ * the rows of the first frame, then the rows of the second frame and so on.
+ * Frames are read only once, sequentially, to build it, then stacking threads
+ * read whole blocks with positional reads on a single descriptor. */
+struct stream_cache {
+	int fd;			// file descriptor of the cache file
+	char *filename;		// path of the cache file
+	int nb_frames;		// number of frames in the cache
+	long width;		// width of the frames
+	int nb_blocks;		// number of blocks, see image_block
+	const struct image_block *blocks;	// not owned
+	off_t *block_offset;	// offset of each block in the file, in bytes
+};
+
+gboolean stream_cache_is_needed(struct stacking_args *args);
+struct stream_cache *stream_cache_build(struct stacking_args *args,
+		const struct image_block *blocks, int nb_blocks, long naxes[3],
+		gboolean apply_shifty, gboolean compute_stats, double *exposure);
+int stream_cache_read_block(struct stream_cache *cache, int block, WORD *buffer);
+void stream_cache_prefetch_block(struct stream_cache *cache, int block);
+void stream_cache_free(struct stream_cache *cache);
+
+#endif